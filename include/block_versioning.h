@@ -0,0 +1,76 @@
+/******************************************************************************
+ *
+ * file   : block_versioning.h
+ *
+ * author : Tim van Deurzen
+ * date   : 18/10/2026
+ *
+ * Prototypes, macros and on-disk structures for block-level (copy-on-write)
+ * versioning.
+ *
+ *****************************************************************************/
+
+#ifndef __HIERONYMUS_BLOCK_VERSIONING_H
+#define __HIERONYMUS_BLOCK_VERSIONING_H
+
+#include <limits.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#define BLOCK_SIZE 4096
+#define BLOCK_MAP_MAGIC "HBLKMAP1"
+
+/*
+ * Suffixes of the per-file block bitmap and undo-block store inside a snapshot
+ * directory (i.e. a version epoch).
+ */
+#define BLOCK_MAP_SUFFIX ".bitmap"
+#define BLOCK_STORE_SUFFIX ".blocks"
+
+/*
+ * Header of a block bitmap file, the bitmap itself (one bit per block) follows
+ * directly after it. The original size is the size of the file at the start of
+ * the epoch, which is needed to undo writes that extended the file.
+ */
+typedef struct BLOCK_MAP_HEADER {
+    char magic[8];
+    unsigned int block_size;
+    unsigned int reserved;
+    unsigned long long original_size;
+} block_map_header;
+
+/*
+ * Header of a record in the undo-block store, followed by 'length' bytes
+ * containing the old contents of the block.
+ */
+typedef struct BLOCK_RECORD {
+    unsigned long long block;
+    unsigned int length;
+    unsigned int reserved;
+} block_record;
+
+/*
+ * The version epoch a handle last wrote in: the snapshot directory, the root
+ * path of the file at the time and the descriptors of its bitmap, undo-block
+ * store and contents, kept open until the epoch or the path changes.
+ * 'written' is set once the file was written through the handle in the epoch.
+ * Descriptors that are not open are -1.
+ */
+typedef struct BLOCK_EPOCH {
+    char snapshot[PATH_MAX];
+    char path[PATH_MAX];
+    int map_fd;
+    int store_fd;
+    int data_fd;
+    int written;
+    block_map_header header;
+    pthread_mutex_t lock;
+} block_epoch;
+
+void block_epoch_init(block_epoch *);
+void block_epoch_close(block_epoch *);
+void block_epoch_destroy(block_epoch *);
+int h_versioned_block_write(block_epoch *, const char *, size_t, off_t);
+int h_versioned_block_release(block_epoch *);
+
+#endif
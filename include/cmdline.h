@@ -19,4 +19,6 @@ void parse_commandline(int, char **, char *);
 
 int add_commandline_arg(int, char ***, char *);
 
+int extract_commandline_option(int, char **, const char *, char *, int);
+
 #endif
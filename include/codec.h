@@ -0,0 +1,101 @@
+/******************************************************************************
+ *
+ * file   : codec.h
+ *
+ * author : Tim van Deurzen
+ * date   : 18/10/2026
+ *
+ * Prototypes, macros and on-disk structures of the compression codecs.
+ *
+ *****************************************************************************/
+
+#ifndef __HIERONYMUS_CODEC_H
+#define __HIERONYMUS_CODEC_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define CODEC_MAGIC "HCODEC01"
+
+/*
+ * Files are compressed in independent frames of CODEC_FRAME_SIZE bytes, at most
+ * CODEC_FRAMES_PER_THREAD frames per pool thread are in memory at a time.
+ */
+#define CODEC_FRAME_SIZE (1024 * 1024)
+#define CODEC_FRAMES_PER_THREAD 2
+
+#define MAX_CODEC_RULES 32
+#define MAX_CODEC_PATTERN 64
+#define MAX_CODEC_DICTIONARIES 32
+#define MAX_DICTIONARY_NAME 16
+
+/*
+ * Codecs other than 'none' are only available if compiled in: -D_ZLIB,
+ * -D_LZ4 and -D_ZSTD (link with -lz, -llz4 and -lzstd respectively).
+ */
+enum codec_types {
+    codec_none = 0,
+    codec_zlib,
+    codec_lz4,
+    codec_zstd,
+    num_codecs
+};
+
+/*
+ * A codec and its level (the acceleration factor for lz4).
+ */
+typedef struct CODEC_CHOICE {
+    int codec;
+    int level;
+} codec_choice;
+
+/*
+ * A compressed file starts with a header, followed by the frames. Each frame
+ * has a header of its own, so a file can be decompressed as a stream. The
+ * dictionary is the file type (extension) of the zstd dictionary used, if any.
+ */
+typedef struct CODEC_HEADER {
+    char magic[8];
+    uint32_t codec;
+    int32_t level;
+    uint64_t original_size;
+    uint32_t frame_size;
+    uint32_t num_frames;
+    char dictionary[MAX_DICTIONARY_NAME];
+} codec_header;
+
+/*
+ * A frame that does not compress is stored as is. The checksum is the CRC32C
+ * of the original data.
+ */
+typedef struct CODEC_FRAME {
+    uint32_t length;
+    uint32_t original_length;
+    uint32_t checksum;
+    uint32_t stored;
+} codec_frame;
+
+typedef struct CODEC_STATISTICS {
+    unsigned long long files;
+    unsigned long long bytes_in;
+    unsigned long long bytes_out;
+    unsigned long long compress_ns;
+    unsigned long long decompress_ns;
+} codec_statistics;
+
+int codec_configure(const char *, const char *);
+int codec_enabled(void);
+void codec_enable(void);
+int codec_parse(const char *, codec_choice *);
+void codec_select(const char *, codec_choice *);
+const char *codec_name(int);
+int codec_is_compressed(const char *);
+int codec_compress_file(const char *, const codec_choice *);
+int codec_decompress_file(const char *, const char *);
+int codec_sealable(const char *);
+void codec_compress_async(const char *);
+void codec_seal_snapshot(const char *);
+void codec_drain(void);
+void codec_print_statistics(FILE *);
+
+#endif
@@ -0,0 +1,55 @@
+/******************************************************************************
+ *
+ * file   : config.h
+ *
+ * author : Tim van Deurzen
+ * date   : 18/10/2026
+ *
+ * Prototypes, macros and structures of the runtime configuration.
+ *
+ *****************************************************************************/
+
+#ifndef __HIERONYMUS_CONFIG_H
+#define __HIERONYMUS_CONFIG_H
+
+#include <stdio.h>
+
+/*
+ * Longest value of a single assignment to the configuration.
+ */
+#define CONFIG_MAX_VALUE 64
+
+/*
+ * What is printed: nothing, unexpected errors, or errors and the operation log
+ * (the latter only with -D_LOGGING).
+ */
+enum log_levels {
+    log_quiet,
+    log_errors,
+    log_operations
+};
+
+/*
+ * A configuration is never changed once published, an update publishes a new
+ * one. 'threads' is the number of workers of the shared pool, 0 is one per
+ * processor.
+ */
+typedef struct HIERONYMUS_CONFIG {
+    unsigned long generation;
+    int versioning;
+    int max_num_versions;
+    int log_level;
+    double negative_ttl;
+    unsigned long negative_cache_size;
+    unsigned long long pack_threshold;
+    int threads;
+    unsigned int journal_sync_interval;
+    unsigned long vstate_max_files;
+} hieronymus_config;
+
+const hieronymus_config *config_get(void);
+int config_update(const char *);
+int config_print(const hieronymus_config *, FILE *);
+void config_destroy(void);
+
+#endif
@@ -0,0 +1,66 @@
+/******************************************************************************
+ *
+ * file   : control.h
+ *
+ * author : Tim van Deurzen
+ * date   : 18/10/2026
+ *
+ * Prototypes, macros and structures of the control files of a mount.
+ *
+ *****************************************************************************/
+
+#ifndef __HIERONYMUS_CONTROL_H
+#define __HIERONYMUS_CONTROL_H
+
+#include <stdio.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/*
+ * The control files are in a virtual directory of the mount point, it hides a
+ * directory of the same name in the root directory.
+ */
+#define CONTROL_DIRECTORY "/.hieronymus"
+
+/*
+ * At most this many bytes are written to a control file before it is read.
+ */
+#define CONTROL_MAX_REQUEST (64 * 1024)
+
+/*
+ * A control file answers the request written to it (all that was written
+ * since it was opened or last read) with what is read from it.
+ */
+typedef struct CONTROL_FILE {
+    const char *name;
+    mode_t mode;
+    int (*answer)(const char *, FILE *);
+} control_file;
+
+/*
+ * State of an open control file, kept in its handle. 'positioned' is set once
+ * the offset of the current response is known (at the first read of it).
+ */
+typedef struct CONTROL_STATE {
+    const control_file *file;
+    char *request;
+    size_t request_length;
+    char *response;
+    size_t response_length;
+    off_t response_offset;
+    int answered;
+    int positioned;
+    pthread_mutex_t lock;
+} control_state;
+
+int control_path(const char *);
+const char *control_name(int);
+int control_getattr(const char *, struct stat *);
+control_state *control_open(const char *);
+int control_read(control_state *, char *, size_t, off_t);
+int control_write(control_state *, const char *, size_t, off_t);
+int control_flush(control_state *);
+void control_release(control_state *);
+
+#endif
@@ -0,0 +1,51 @@
+/******************************************************************************
+ *
+ * file   : dedup.h
+ *
+ * author : Tim van Deurzen
+ * date   : 18/10/2026
+ *
+ * Prototypes, macros and structures of the deduplication of stored versions.
+ *
+ *****************************************************************************/
+
+#ifndef __HIERONYMUS_DEDUP_H
+#define __HIERONYMUS_DEDUP_H
+
+#include <stdio.h>
+
+#include "util.h"
+
+/*
+ * The extended attribute of a file in the root directory that holds the
+ * digest of its latest version. It is hidden from the mount point.
+ */
+#define DEDUP_ATTRIBUTE "user.hieronymus.digest"
+
+/*
+ * Blobs are stored as <root>/.version/.blobs/<2 hex digits>/<38 hex digits>.
+ */
+#define DEDUP_BLOB_DIRECTORY "/.version/.blobs"
+
+/*
+ * Size of the buffer files are read through when they are hashed.
+ */
+#define DEDUP_BUFFER_SIZE (64 * 1024)
+
+typedef struct DEDUP_STATISTICS {
+    unsigned long long unchanged;
+    unsigned long long shared;
+    unsigned long long stored;
+    unsigned long long bytes_saved;
+} dedup_statistics;
+
+int dedup_digest_file(const char *, unsigned char *);
+int dedup_unchanged(const char *, const unsigned char *);
+int dedup_remember(const char *, const unsigned char *);
+int dedup_store_copy(const char *, const char *, const unsigned char *);
+int dedup_prune(const char *);
+int dedup_hidden_attribute(const char *);
+int dedup_filter_attributes(char *, int);
+void dedup_print_statistics(FILE *);
+
+#endif
@@ -0,0 +1,83 @@
+/******************************************************************************
+ *
+ * file   : delta.h
+ *
+ * author : Tim van Deurzen
+ * date   : 18/10/2026
+ *
+ * Prototypes, macros and on-disk structures of the native delta engine.
+ *
+ *****************************************************************************/
+
+#ifndef __HIERONYMUS_DELTA_H
+#define __HIERONYMUS_DELTA_H
+
+#include <stdint.h>
+
+#define DELTA_MAGIC "HDELTA02"
+
+/*
+ * Files are split in segments of DELTA_SEGMENT_SIZE bytes, each segment is
+ * encoded (and decoded) independently. Within a segment matches are searched
+ * for in the same range of the old file, widened by DELTA_WINDOW_SLACK bytes
+ * on either side (so data shifted by small insertions is still found), at a
+ * granularity of DELTA_BLOCK_SIZE bytes.
+ */
+#define DELTA_SEGMENT_SIZE (4 * 1024 * 1024)
+#define DELTA_WINDOW_SLACK (64 * 1024)
+#define DELTA_BLOCK_SIZE 64
+
+/*
+ * Number of segments kept in memory per pool thread while encoding.
+ */
+#define DELTA_SEGMENTS_PER_THREAD 2
+
+/*
+ * How a segment of the new file is stored.
+ */
+enum delta_segment_types {
+    segment_same = 0,
+    segment_literal,
+    segment_delta
+};
+
+/*
+ * Instructions of a delta segment. An insert is followed by 'length' bytes of
+ * data, a copy takes 'length' bytes from 'offset' in the old file.
+ */
+enum delta_instructions {
+    delta_copy = 1,
+    delta_insert
+};
+
+/*
+ * A patch starts with a header, followed by a table with an entry per segment
+ * and the payloads of the segments. The checksum of a segment is the CRC32C of
+ * its data in the new file, checked after decoding.
+ */
+typedef struct DELTA_HEADER {
+    char magic[8];
+    uint32_t segment_size;
+    uint32_t num_segments;
+    uint64_t old_size;
+    uint64_t new_size;
+} delta_header;
+
+typedef struct DELTA_SEGMENT {
+    uint64_t offset;
+    uint32_t length;
+    uint32_t type;
+    uint32_t checksum;
+    uint32_t reserved;
+} delta_segment;
+
+typedef struct DELTA_INSTRUCTION {
+    uint32_t type;
+    uint32_t length;
+    uint64_t offset;
+} delta_instruction;
+
+int delta_encode(const char *, const char *, const char *);
+int delta_decode(const char *, const char *, const char *);
+
+#endif
@@ -13,15 +13,38 @@
 #define __HIERONYMUS_ERROR_H
 
 #include <stdio.h>
+#include <errno.h>
 
+/*
+ * At most this many error records are printed per error per second, the rest
+ * are counted and reported with the next record that is printed.
+ */
+#define ERROR_RATE_LIMIT 10
 
-#ifndef _SUPPRESS_ERRORS
-#define HIERONYMUS_ERROR(error, origin) \
-    print_error(error, origin)
-#else
+/*
+ * Record an unexpected error and return -errno. The error is counted and,
+ * unless compiled with _SUPPRESS_ERRORS, printed (rate-limited). errno is
+ * passed along before anything can clobber it.
+ */
 #define HIERONYMUS_ERROR(error, origin) \
-    -errno
-#endif
+    record_error(error, origin, errno)
+
+/*
+ * Like HIERONYMUS_ERROR, but if the condition 'expected' holds (e.g. errno ==
+ * ENOENT for a lookup) the error is part of normal operation and is only
+ * counted, without any output.
+ */
+#define HIERONYMUS_EXPECTED_ERROR(error, origin, expected) \
+    ((expected) ? count_error(error, errno) : record_error(error, origin, errno))
+
+/*
+ * Like HIERONYMUS_EXPECTED_ERROR, for a failure that was returned as -errno
+ * ('value') by a function that does not record its errors itself. errno is
+ * not looked at, it may have been clobbered since.
+ */
+#define HIERONYMUS_RETURNED_ERROR(error, origin, value, expected) \
+    ((expected) ? count_error(error, -(value)) \
+        : record_error(error, origin, -(value)))
 
 /*
  * Define the actual errors and messages for pretty printing.
@@ -64,18 +87,35 @@
     X(err_removexattr,      "Could not remove extended attribute!") \
     X(err_snapshot,         "Could not find latest snapshot directory!") \
     X(err_system,           "Could not execute system-command!") \
-    X(err_vs_write,         "Could not create versioning information!")
+    X(err_vs_write,         "Could not create versioning information!") \
+    X(err_block_write,      "Could not save copy-on-write blocks!") \
+    X(err_journal,          "Could not write to the journal!") \
+    X(err_recovery,         "Could not recover from the journal!") \
+    X(err_synchronize,      "Could not synchronize the root directory!") \
+    X(err_index,            "Could not update the version index!") \
+    X(err_trace,            "Could not write to the trace file!") \
+    X(err_delta,            "Could not compute or apply delta!") \
+    X(err_codec,            "Could not compress or decompress version!") \
+    X(err_pack,             "Could not pack or unpack version!") \
+    X(err_control,          "Could not answer control file request!") \
+    X(err_policy,           "Could not load the versioning policy!") \
+    X(err_restore,          "Could not restore version!") \
+    X(err_scheduler,        "Could not start the scheduler!")
 
 
 /*
  * Define an enumeration of all errors.
  */
 #define X(a, b) a,
-enum errors { ERRORS };
+enum errors { ERRORS num_errors };
 #undef X
 
 
-int print_error(int, char *);
+int record_error(int, const char *, int);
+
+int count_error(int, int);
+
+void print_error_statistics(FILE *);
 
 char *get_error_message(int);
 
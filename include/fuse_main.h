@@ -16,14 +16,19 @@
 
 typedef struct HIERONYMUS_DATA {
     char *root_directory;
-    int max_num_versions;
     FILE *log_file;
 } hieronymus_data;
 
 /*
  * Access the private data field of the FUSE context.
+ *
+ * The private data is set up once in main, so a global pointer to it is used
+ * instead of the FUSE context. That way the versioning code does not depend on
+ * FUSE and can be driven directly (e.g. by the micro-benchmarks).
  */
-#define ADMIN ((hieronymus_data *) fuse_get_context()->private_data)
+extern hieronymus_data *hieronymus_admin;
+
+#define ADMIN hieronymus_admin
 
 /*
  * Access the process information in the the FUSE context.
@@ -35,7 +40,4 @@ typedef struct HIERONYMUS_DATA {
 
 #define MAX_NUM_VERSIONS 16
 
-
-void resolve_root_path(const char *, char *);
-
 #endif
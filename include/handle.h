@@ -0,0 +1,148 @@
+/******************************************************************************
+ *
+ * file   : handle.h
+ *
+ * author : Tim van Deurzen
+ * date   : 18/10/2026
+ *
+ * Prototypes, macros and structures for the state kept per open file and
+ * directory.
+ *
+ *****************************************************************************/
+
+#ifndef __HIERONYMUS_HANDLE_H
+#define __HIERONYMUS_HANDLE_H
+
+#include <limits.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "block_versioning.h"
+#include "control.h"
+#include "policy.h"
+#include "sha1.h"
+#include "scheduler.h"
+
+/*
+ * Handles are allocated HANDLE_SLAB_SIZE at a time and recycled through a free
+ * list. A handle starts with room for HANDLE_EXTENTS dirty extents.
+ */
+#define HANDLE_SLAB_SIZE 64
+#define HANDLE_EXTENTS 16
+
+/*
+ * Number of buckets of the table of files open for writing.
+ */
+#define HANDLE_FILE_BUCKETS 256
+
+/*
+ * Access the handle stored in the fuse_file_info of an open file or directory.
+ */
+#define HANDLE(file_info) \
+    ((hieronymus_handle *) (uintptr_t) (file_info)->fh)
+
+/*
+ * A range [start, end) of a file written through a handle since the range was
+ * last cleared.
+ */
+typedef struct HANDLE_EXTENT {
+    off_t start;
+    off_t end;
+} handle_extent;
+
+/*
+ * Operations performed through a handle.
+ */
+typedef struct HANDLE_STATISTICS {
+    unsigned long reads;
+    unsigned long writes;
+    unsigned long long bytes_read;
+    unsigned long long bytes_written;
+} handle_statistics;
+
+/*
+ * A file open for writing through one or more handles. Every change of its
+ * contents through the mount point advances 'generation' before it is made,
+ * 'changing' counts the changes in progress.
+ */
+typedef struct HANDLE_FILE {
+    dev_t device;
+    ino_t inode;
+    unsigned long generation;
+    int changing;
+    int references;
+    struct HANDLE_FILE *next;
+} handle_file;
+
+/*
+ * State of an open file or directory.
+ *
+ * 'path' is the path in the mount point the root path was resolved for. FUSE
+ * passes the current path of a file to every operation, if it differs (the file
+ * was renamed while open) the root path is resolved again. The dirty extents
+ * are sorted and do not overlap. 'versions' counts the versions created through
+ * this handle. An open control file (see control.h) has no descriptor but
+ * 'control' instead.
+ *
+ * 'policy' is the rule of the versioning policy that applies to the file (NULL
+ * if none does), matched again when the file is renamed. 'last_version' is
+ * when the last version was created through the handle (monotonic clock, in
+ * nanoseconds), 'coalesced' is set when a write was not versioned because of
+ * the coalescing interval of the rule. 'timer' versions those writes once the
+ * file has not been written for an interval (see h_write).
+ *
+ * While a file opened for writing is written from its start in order, and
+ * only through this handle, 'digest' is the running SHA-1 of its first
+ * 'hashed' bytes ('hashing' is set). 'generation' is the generation of 'file'
+ * after the last change made through the handle.
+ *
+ * 'epoch' is the version epoch the handle writes in with block-level
+ * versioning (see block_versioning.c).
+ */
+typedef struct HIERONYMUS_HANDLE {
+    int fd;
+    int flags;
+    DIR *directory;
+    control_state *control;
+    char path[PATH_MAX];
+    char root_path[PATH_MAX];
+    size_t root_length;
+    handle_extent *extents;
+    size_t num_extents;
+    size_t max_extents;
+    unsigned long versions;
+    const policy_rule *policy;
+    unsigned long long last_version;
+    int coalesced;
+    scheduler_timer timer;
+    handle_file *file;
+    unsigned long generation;
+    sha1_context digest;
+    off_t hashed;
+    int hashing;
+    block_epoch epoch;
+    handle_statistics statistics;
+    pthread_mutex_t lock;
+    struct HIERONYMUS_HANDLE *next_free;
+} hieronymus_handle;
+
+hieronymus_handle *handle_acquire(const char *, const char *, int);
+void handle_release(hieronymus_handle *);
+void handle_pool_destroy(void);
+char *handle_root_path(hieronymus_handle *, const char *);
+void handle_add_extent(hieronymus_handle *, off_t, size_t);
+size_t handle_clear_extents(hieronymus_handle *);
+int handle_versioned(hieronymus_handle *);
+int handle_version_due(hieronymus_handle *);
+int handle_take_coalesced(hieronymus_handle *);
+void handle_track(hieronymus_handle *);
+void handle_change_begin(hieronymus_handle *);
+void handle_hash_write(hieronymus_handle *, const char *, off_t, ssize_t);
+void handle_hash_truncate(hieronymus_handle *, off_t, int);
+handle_file *handle_file_change_begin(const char *);
+void handle_file_change_end(handle_file *);
+const unsigned char *handle_digest(hieronymus_handle *, unsigned char *);
+
+#endif
@@ -0,0 +1,67 @@
+/******************************************************************************
+ *
+ * file   : journal.h
+ *
+ * author : Tim van Deurzen
+ * date   : 18/10/2026
+ *
+ * Prototypes, macros and on-disk structures for the write-ahead intent journal.
+ *
+ *****************************************************************************/
+
+#ifndef __HIERONYMUS_JOURNAL_H
+#define __HIERONYMUS_JOURNAL_H
+
+/*
+ * The journal lives in the '.version' directory of the root directory, the
+ * leading dot keeps it out of the snapshot listing.
+ */
+#define JOURNAL_NAME ".version/.journal"
+#define JOURNAL_MAGIC 0x4c4e524a
+
+/*
+ * Size of the in-memory append buffer, the interval (in milliseconds) at which
+ * the journal is synced to stable storage and the size at which a journal
+ * without outstanding intents is truncated.
+ */
+#define JOURNAL_BUFFER_SIZE 65536
+#define JOURNAL_SYNC_INTERVAL 100
+#define JOURNAL_CHECKPOINT_SIZE (4 * 1024 * 1024)
+
+/*
+ * Record types. An intent is logged before an operation that changes both the
+ * live file and its history, and a matching completion record is logged after
+ * both are done. intent_replace covers the link that keeps a file replaced by
+ * a rename; it comes last so the numbers of the other types do not change.
+ */
+enum journal_record_types {
+    intent_write = 1,
+    intent_rmdir,
+    intent_unlink,
+    intent_rename,
+    intent_done,
+    intent_replace
+};
+
+/*
+ * Header of a journal record, followed by 'length' bytes of payload. For
+ * intents the payload holds one or two null-terminated paths, for completion
+ * records it is empty and 'sequence' refers to the completed intent.
+ */
+typedef struct JOURNAL_RECORD {
+    unsigned int magic;
+    unsigned short type;
+    unsigned short length;
+    unsigned int checksum;
+    unsigned int reserved;
+    unsigned long long sequence;
+} journal_record;
+
+int journal_open(const char *);
+void journal_close(void);
+unsigned long long journal_intent(int, const char *, const char *);
+int journal_commit(unsigned long long);
+void journal_done(unsigned long long);
+int journal_sync(void);
+
+#endif
@@ -9,12 +9,31 @@
  *
  *****************************************************************************/
 
+#include <stdio.h>
+
+#include "config.h"
+
+/*
+ * The log file is fully buffered and flushed every LOG_FLUSH_INTERVAL
+ * milliseconds by the scheduler (once it runs, see log_flush_periodically).
+ */
+#define LOG_FLUSH_INTERVAL 1000
+
+/*
+ * Operations are only logged while the log level of the runtime configuration
+ * asks for it.
+ */
 #ifdef _LOGGING
 #define HIERONYMUS_LOG(fh, format, ...) \
-    fprintf(fh, format, __VA_ARGS__)
+    do { \
+        if (config_get()->log_level >= log_operations) { \
+            fprintf(fh, format, __VA_ARGS__); \
+        } \
+    } while (0)
 #else
 #define HIERONYMUS_LOG(...)
 #endif
 
 
 FILE *open_log_file (void);
+int log_flush_periodically (FILE *);
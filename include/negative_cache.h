@@ -0,0 +1,36 @@
+/******************************************************************************
+ *
+ * file   : negative_cache.h
+ *
+ * author : Tim van Deurzen
+ * date   : 18/10/2026
+ *
+ * Prototypes and macros for the cache of paths that do not exist.
+ *
+ *****************************************************************************/
+
+#ifndef __HIERONYMUS_NEGATIVE_CACHE_H
+#define __HIERONYMUS_NEGATIVE_CACHE_H
+
+/*
+ * The cache is a set-associative table: a path hashes to a set of
+ * NEGATIVE_CACHE_WAYS entries, the entry that expires first is replaced. Sets
+ * are protected by NEGATIVE_CACHE_STRIPES locks. The table has
+ * NEGATIVE_CACHE_SIZE entries unless the configuration says otherwise, always
+ * a power of two of at least NEGATIVE_CACHE_WAYS.
+ */
+#define NEGATIVE_CACHE_SIZE 16384
+#define NEGATIVE_CACHE_MAX_SIZE (1UL << 24)
+#define NEGATIVE_CACHE_WAYS 4
+#define NEGATIVE_CACHE_STRIPES 64
+
+void negative_cache_init(double);
+void negative_cache_configure(double);
+void negative_cache_resize(unsigned long);
+void negative_cache_destroy(void);
+int negative_cache_lookup(const char *, unsigned long *);
+void negative_cache_insert(const char *, int, unsigned long);
+void negative_cache_invalidate(const char *);
+void negative_cache_invalidate_all(void);
+
+#endif
@@ -0,0 +1,96 @@
+/******************************************************************************
+ *
+ * file   : pack.h
+ *
+ * author : Tim van Deurzen
+ * date   : 18/10/2026
+ *
+ * Prototypes, macros and on-disk structures of the pack files small stored
+ * versions are appended to.
+ *
+ *****************************************************************************/
+
+#ifndef __HIERONYMUS_PACK_H
+#define __HIERONYMUS_PACK_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "util.h"
+
+/*
+ * Every '.version' directory has at most one pack and its index.
+ */
+#define PACK_NAME ".pack"
+#define PACK_INDEX_NAME ".pack.idx"
+#define PACK_TEMPORARY_SUFFIX ".repack"
+
+#define PACK_MAGIC "HPACK001"
+#define PACK_INDEX_MAGIC "HPIDX001"
+#define PACK_RECORD_MAGIC "HPRC"
+
+/*
+ * Stored versions of at most this many bytes (after compression) are packed,
+ * unless configured otherwise with --pack_threshold.
+ */
+#define PACK_THRESHOLD (64 * 1024)
+
+/*
+ * Entries are named '<snapshot>/<stored version>', relative to the '.version'
+ * directory.
+ */
+#define MAX_PACK_NAME (MAX_SNAPSHOT_LENGTH + 256)
+
+/*
+ * The pack and its index both start with a header. They belong together if
+ * the generations are equal, a repack gives both a new generation.
+ */
+typedef struct PACK_HEADER {
+    char magic[8];
+    uint64_t generation;
+} pack_header;
+
+/*
+ * A record of the pack is followed by the name of the entry and its data. The
+ * records describe themselves, so the index can be rebuilt from the pack.
+ */
+typedef struct PACK_RECORD {
+    char magic[4];
+    uint32_t checksum;
+    uint64_t length;
+    uint16_t name_length;
+    uint16_t reserved;
+    uint32_t padding;
+} pack_record;
+
+/*
+ * An entry of the index is followed by the name of the entry. The offset is
+ * that of the data in the pack, the checksum is the CRC32C of the data.
+ */
+typedef struct PACK_ENTRY {
+    uint64_t offset;
+    uint64_t length;
+    uint32_t checksum;
+    uint16_t name_length;
+    uint16_t reserved;
+} pack_entry;
+
+typedef struct PACK_STATISTICS {
+    unsigned long long entries;
+    unsigned long long bytes;
+    unsigned long long absorbed;
+    unsigned long long dropped;
+    unsigned long long bytes_before;
+} pack_statistics;
+
+void pack_configure(unsigned long long);
+int pack_store(const char *);
+void pack_store_async(const char *);
+void pack_seal_snapshot(const char *);
+void pack_drain(void);
+int pack_count(const char *, const char *);
+int pack_extract(const char *, const char *, const char *);
+int pack_list(const char *, FILE *);
+int pack_repack(const char *, pack_statistics *);
+
+#endif
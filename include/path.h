@@ -0,0 +1,63 @@
+/******************************************************************************
+ *
+ * file   : path.h
+ *
+ * author : Tim van Deurzen
+ * date   : 18/10/2026
+ *
+ * Prototypes, macros and structures for building paths without fixed-size
+ * buffers.
+ *
+ *****************************************************************************/
+
+#ifndef __HIERONYMUS_PATH_H
+#define __HIERONYMUS_PATH_H
+
+#include <stddef.h>
+#include <string.h>
+
+/*
+ * Size of a block of the per-thread arena paths are allocated from. Larger
+ * allocations get a block of their own.
+ */
+#define PATH_ARENA_BLOCK_SIZE 65536
+
+/*
+ * A part of a path: a pointer and a length, not necessarily null-terminated.
+ */
+typedef struct PATH_SLICE {
+    const char *data;
+    size_t length;
+} path_slice;
+
+/*
+ * Position in the arena, everything allocated after a mark is released by
+ * path_release.
+ */
+typedef struct PATH_MARK {
+    void *block;
+    size_t used;
+} path_mark;
+
+/*
+ * Make slices of null-terminated strings and of string literals (the length of
+ * a literal is known at compile time).
+ */
+#define PATH_SLICE(string) \
+    ((path_slice) { (string), strlen(string) })
+#define PATH_LITERAL(literal) \
+    ((path_slice) { (literal), sizeof(literal) - 1 })
+#define PATH_END \
+    ((path_slice) { NULL, 0 })
+
+void path_init(const char *);
+char *path_alloc(size_t);
+path_mark path_get_mark(void);
+void path_release(path_mark);
+void path_reset(void);
+char *path_resolve(const char *);
+char *path_build(path_slice, ...);
+path_slice path_parent(path_slice);
+path_slice path_name(path_slice);
+
+#endif
@@ -0,0 +1,49 @@
+/******************************************************************************
+ *
+ * file   : policy.h
+ *
+ * author : Tim van Deurzen
+ * date   : 18/10/2026
+ *
+ * Prototypes, macros and structures of the per-path versioning policy.
+ *
+ *****************************************************************************/
+
+#ifndef __HIERONYMUS_POLICY_H
+#define __HIERONYMUS_POLICY_H
+
+#include "codec.h"
+
+/*
+ * Limits of a policy file: the number of rules, the length of a pattern (and
+ * of a line) and the number of states of the compiled matcher.
+ */
+#define POLICY_MAX_RULES 256
+#define POLICY_MAX_PATTERN 256
+#define POLICY_MAX_LINE 1024
+#define POLICY_MAX_STATES 65536
+
+/*
+ * A rule of the policy. 'max_versions' overrides max_num_versions of the
+ * runtime configuration (0 keeps it), 'coalesce' is the minimum number of
+ * milliseconds between versions created through one open file (0 versions
+ * every write), writes in between are versioned once the file is quiet for as
+ * long.
+ */
+typedef struct POLICY_RULE {
+    char pattern[POLICY_MAX_PATTERN];
+    int versioned;
+    int directory_only;
+    int max_versions;
+    int has_codec;
+    codec_choice codec;
+    unsigned int coalesce;
+} policy_rule;
+
+int policy_load(const char *);
+int policy_enabled(void);
+const policy_rule *policy_match(const char *);
+const policy_rule *policy_match_root(const char *);
+void policy_destroy(void);
+
+#endif
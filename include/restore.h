@@ -0,0 +1,74 @@
+/******************************************************************************
+ *
+ * file   : restore.h
+ *
+ * author : Tim van Deurzen
+ * date   : 18/10/2026
+ *
+ * Prototypes, macros and structures of the reconstruction of old versions.
+ *
+ *****************************************************************************/
+
+#ifndef __HIERONYMUS_RESTORE_H
+#define __HIERONYMUS_RESTORE_H
+
+#include <limits.h>
+
+#include "thread_pool.h"
+
+/*
+ * Inputs are read ahead in chunks of this size, so a prefetch task does not
+ * tie up a worker for a whole file in one call.
+ */
+#define RESTORE_READAHEAD_CHUNK (8 * 1024 * 1024)
+
+/*
+ * Number of undo-block stores loaded into memory ahead of the one that is
+ * being applied, the others are only read ahead.
+ */
+#define RESTORE_WINDOW 4
+
+/*
+ * How the patch of a whole-file version is applied, matching the way it was
+ * made (-D_NATIVE_DELTA, -D_XDELTA or neither).
+ */
+enum restore_methods {
+    restore_native,
+    restore_xdelta,
+    restore_diff
+};
+
+/*
+ * A stored version that is an input of a reconstruction. It is made readable
+ * (unpacked and decompressed to a temporary file next to the output if need
+ * be) and read ahead by a task of the shared pool, 'group' is waited for
+ * before 'readable' is used.
+ */
+typedef struct RESTORE_INPUT {
+    char path[PATH_MAX];
+    char readable[PATH_MAX];
+    const char *output;
+    int temporary;
+    int failed;
+    pool_group group;
+} restore_input;
+
+/*
+ * The undo-block store of a file in one epoch, loaded into memory.
+ */
+typedef struct RESTORE_EPOCH {
+    char prefix[PATH_MAX];
+    unsigned char *blocks;
+    size_t length;
+    unsigned int block_size;
+    unsigned long long original_size;
+    int has_map;
+    int failed;
+    pool_group group;
+} restore_epoch;
+
+int restore_parse_method(const char *);
+int restore_version(const char *, const char *, const char *, int);
+int restore_blocks(const char *, const char *, char **, int);
+
+#endif
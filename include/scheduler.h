@@ -0,0 +1,56 @@
+/******************************************************************************
+ *
+ * file   : scheduler.h
+ *
+ * author : Tim van Deurzen
+ * date   : 18/10/2026
+ *
+ * Prototypes, macros and structures of the scheduler of deferred work.
+ *
+ *****************************************************************************/
+
+#ifndef __HIERONYMUS_SCHEDULER_H
+#define __HIERONYMUS_SCHEDULER_H
+
+#include <pthread.h>
+
+/*
+ * Timers expire on ticks of SCHEDULER_TICK milliseconds. The wheel has
+ * SCHEDULER_LEVELS levels of SCHEDULER_SLOTS slots, a slot of level n spans
+ * SCHEDULER_SLOTS^n ticks, so the wheel covers 2^32 ticks (over a year);
+ * later deadlines are cut off at that.
+ */
+#define SCHEDULER_TICK 10
+#define SCHEDULER_LEVEL_BITS 8
+#define SCHEDULER_SLOTS (1 << SCHEDULER_LEVEL_BITS)
+#define SCHEDULER_LEVELS 4
+
+/*
+ * Number of workers that run expired timers.
+ */
+#define SCHEDULER_WORKERS 2
+
+typedef void (*scheduler_function)(void *);
+
+/*
+ * A timer, embedded in the structure it works on. 'link' points to the
+ * pointer to the timer in its slot while it is pending, so it is removed in
+ * constant time. 'running' counts the runs of its function in progress.
+ */
+typedef struct SCHEDULER_TIMER {
+    scheduler_function function;
+    void *argument;
+    unsigned long long expires;
+    int pending;
+    int running;
+    struct SCHEDULER_TIMER *next;
+    struct SCHEDULER_TIMER **link;
+} scheduler_timer;
+
+int scheduler_start(int);
+void scheduler_stop(void);
+void scheduler_timer_init(scheduler_timer *, scheduler_function, void *);
+int scheduler_arm(scheduler_timer *, unsigned long);
+int scheduler_cancel(scheduler_timer *);
+
+#endif
@@ -0,0 +1,63 @@
+/******************************************************************************
+ *
+ * file   : simd.h
+ *
+ * author : Tim van Deurzen
+ * date   : 18/10/2026
+ *
+ * Prototypes and macros for the vectorised comparison and hashing kernels.
+ *
+ *****************************************************************************/
+
+#ifndef __HIERONYMUS_SIMD_H
+#define __HIERONYMUS_SIMD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Instruction set levels, in increasing order. The best level the processor
+ * supports is selected on first use (or by simd_set_level).
+ */
+enum simd_levels {
+    simd_scalar = 0,
+    simd_sse42,
+    simd_avx2,
+    simd_avx512,
+    num_simd_levels
+};
+
+/*
+ * Average distance between chunk boundaries found by simd_gear_boundary is
+ * mask + 1, for a mask with the low n bits set.
+ */
+#define SIMD_GEAR_MASK(bits) ((1ULL << (bits)) - 1)
+
+/*
+ * The gear hash of a position depends on the 64 bytes up to and including it.
+ */
+#define SIMD_GEAR_WINDOW 64
+
+/*
+ * The vector versions of the gear hash give each lane a part of this many
+ * bytes (plus the window before it) at a time.
+ */
+#define SIMD_GEAR_PART 1024
+
+/*
+ * Two ranges of bytes are equal if they do not mismatch.
+ */
+#define simd_block_equal(a, b, length) \
+    (simd_mismatch((a), (b), (length)) == (length))
+
+size_t simd_mismatch(const void *, const void *, size_t);
+uint32_t simd_crc32c(uint32_t, const void *, size_t);
+size_t simd_gear_boundary(const void *, size_t, uint64_t);
+
+int simd_level(void);
+int simd_supported(int);
+int simd_set_level(int);
+const char *simd_level_name(int);
+int simd_self_test(void);
+
+#endif
@@ -0,0 +1,28 @@
+/******************************************************************************
+ *
+ * file   : synchronize.h
+ *
+ * author : Tim van Deurzen
+ * date   : 18/10/2026
+ *
+ * Prototypes and macros for synchronizing the root directory with the
+ * versioning information at mount-time.
+ *
+ *****************************************************************************/
+
+#ifndef __HIERONYMUS_SYNCHRONIZE_H
+#define __HIERONYMUS_SYNCHRONIZE_H
+
+/*
+ * Marker in the '.version' directory of the root directory, indicating that a
+ * baseline was built for the whole tree.
+ */
+#define SYNCHRONIZED_MARKER ".version/.synchronized"
+
+#define MAX_SYNC_THREADS 64
+#define SYNC_BUFFER_SIZE 65536
+#define SYNC_PROGRESS_INTERVAL 1
+
+int synchronize_roots(const char *);
+
+#endif
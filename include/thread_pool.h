@@ -0,0 +1,77 @@
+/******************************************************************************
+ *
+ * file   : thread_pool.h
+ *
+ * author : Tim van Deurzen
+ * date   : 18/10/2026
+ *
+ * Prototypes and structures for the pool of worker threads.
+ *
+ *****************************************************************************/
+
+#ifndef __HIERONYMUS_THREAD_POOL_H
+#define __HIERONYMUS_THREAD_POOL_H
+
+#include <pthread.h>
+
+/*
+ * Upper bound on the number of workers of the shared pool, the actual number
+ * is the number of online processors unless it is resized.
+ */
+#define MAX_POOL_THREADS 64
+
+typedef void (*pool_function)(void *);
+
+/*
+ * A set of tasks that is waited for as a whole. Tasks of a group may run in any
+ * order and on any worker.
+ */
+typedef struct POOL_GROUP {
+    unsigned long pending;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+} pool_group;
+
+/*
+ * A task in the queue of the pool.
+ */
+typedef struct POOL_TASK {
+    pool_function function;
+    void *argument;
+    pool_group *group;
+    struct POOL_TASK *next;
+} pool_task;
+
+struct THREAD_POOL;
+
+/*
+ * A worker knows its place in the pool, workers from 'limit' on are parked.
+ */
+typedef struct POOL_WORKER {
+    struct THREAD_POOL *pool;
+    int index;
+} pool_worker;
+
+typedef struct THREAD_POOL {
+    pthread_t threads[MAX_POOL_THREADS];
+    pool_worker workers[MAX_POOL_THREADS];
+    int num_threads;
+    int limit;
+    int running;
+    pool_task *head;
+    pool_task *tail;
+    pthread_mutex_t lock;
+    pthread_cond_t available;
+    pthread_cond_t parked;
+} thread_pool;
+
+thread_pool *thread_pool_create(int);
+void thread_pool_destroy(thread_pool *);
+int thread_pool_resize(thread_pool *, int);
+thread_pool *thread_pool_shared(void);
+void pool_group_init(pool_group *);
+void pool_group_destroy(pool_group *);
+void thread_pool_submit(thread_pool *, pool_group *, pool_function, void *);
+void pool_group_wait(thread_pool *, pool_group *);
+
+#endif
@@ -0,0 +1,129 @@
+/******************************************************************************
+ *
+ * file   : trace.h
+ *
+ * author : Tim van Deurzen
+ * date   : 18/10/2026
+ *
+ * Prototypes, macros and on-disk structures for capturing binary traces of
+ * all FUSE operations.
+ *
+ *****************************************************************************/
+
+#ifndef __HIERONYMUS_TRACE_H
+#define __HIERONYMUS_TRACE_H
+
+#define TRACE_MAGIC "HTRACE01"
+#define TRACE_BUFFER_SIZE (1024 * 1024)
+#define TRACE_TABLE_SIZE 4096
+
+/*
+ * All traced operations.
+ */
+#define TRACE_OPERATIONS \
+    X(op_getattr,       "getattr") \
+    X(op_readlink,      "readlink") \
+    X(op_mknod,         "mknod") \
+    X(op_mkdir,         "mkdir") \
+    X(op_unlink,        "unlink") \
+    X(op_rmdir,         "rmdir") \
+    X(op_symlink,       "symlink") \
+    X(op_rename,        "rename") \
+    X(op_link,          "link") \
+    X(op_chmod,         "chmod") \
+    X(op_chown,         "chown") \
+    X(op_truncate,      "truncate") \
+    X(op_utime,         "utime") \
+    X(op_utimens,       "utimens") \
+    X(op_open,          "open") \
+    X(op_read,          "read") \
+    X(op_write,         "write") \
+    X(op_statfs,        "statfs") \
+    X(op_flush,         "flush") \
+    X(op_release,       "release") \
+    X(op_fsync,         "fsync") \
+    X(op_setxattr,      "setxattr") \
+    X(op_getxattr,      "getxattr") \
+    X(op_listxattr,     "listxattr") \
+    X(op_removexattr,   "removexattr") \
+    X(op_opendir,       "opendir") \
+    X(op_readdir,       "readdir") \
+    X(op_releasedir,    "releasedir") \
+    X(op_fsyncdir,      "fsyncdir") \
+    X(op_access,        "access") \
+    X(op_create,        "create") \
+    X(op_ftruncate,     "ftruncate") \
+    X(op_fgetattr,      "fgetattr")
+
+#define X(a, b) a,
+enum trace_operations { TRACE_OPERATIONS num_trace_operations };
+#undef X
+
+/*
+ * Kinds of records in a trace.
+ */
+enum trace_record_kinds {
+    trace_path = 1,
+    trace_operation_record
+};
+
+/*
+ * Header at the start of a trace file. The start of every operation is
+ * relative to 'start' (nanoseconds since the epoch).
+ */
+typedef struct TRACE_HEADER {
+    char magic[8];
+    unsigned long long start;
+} trace_header;
+
+/*
+ * Record defining a path, followed by 'length' bytes of path (not null
+ * terminated). Every path is defined once, before the first operation using
+ * its identifier.
+ */
+typedef struct TRACE_PATH_RECORD {
+    unsigned char kind;
+    unsigned char reserved;
+    unsigned short length;
+    unsigned int path_id;
+} trace_path_record;
+
+/*
+ * Record describing a single operation. 'argument' and 'size' hold the
+ * operation-specific arguments (offset and size for read and write, the mode
+ * for chmod, flags for open, etc.). 'process' is the process on whose behalf
+ * the operation was served, 'duration' is in nanoseconds.
+ */
+typedef struct TRACE_RECORD {
+    unsigned char kind;
+    unsigned char operation;
+    unsigned short reserved;
+    unsigned int path_id;
+    unsigned int second_path_id;
+    unsigned int process;
+    int result;
+    unsigned int duration;
+    unsigned long long argument;
+    unsigned long long size;
+    unsigned long long start;
+} trace_record;
+
+#ifdef _TRACING
+#define TRACE_START() \
+    unsigned long long trace_start = trace_clock()
+#define HIERONYMUS_TRACE(operation, path, second_path, argument, size, result) \
+    trace_operation(operation, path, second_path, argument, size, result, \
+            trace_start, OP_PID)
+#else
+#define TRACE_START()
+#define HIERONYMUS_TRACE(...)
+#endif
+
+int trace_open(const char *);
+void trace_close(void);
+unsigned long long trace_clock(void);
+void trace_operation(int, const char *, const char *, unsigned long long, 
+        unsigned long long, int, unsigned long long, int);
+const char *trace_operation_name(int);
+
+#endif
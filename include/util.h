@@ -19,6 +19,13 @@
 #define MAX_ID_LENGTH 128
 #define MAX_SNAPSHOT_LENGTH 128
 #define MAX_COMMAND_LENGTH 512
+#define COPY_BUFFER_SIZE 65536
+
+/*
+ * Version identifiers are formatted as 20 zero-padded digits (the width of the
+ * largest unsigned 64-bit number) plus the terminating null character.
+ */
+#define MAX_VERSION_ID_LENGTH 21
 
 #ifdef _DEBUG
 #define HIERONYMUS_DEBUG(format, ...) \
@@ -58,10 +65,12 @@ void parent_directory(const char *, char *);
 
 void bottom_directory(const char *, char *);
 
-char *timestamp(void);
+unsigned long long next_version_id(void);
+char *format_version_id(unsigned long long, char *);
+char *timestamp(char *);
 
 int copy(const char *, const char *);
 
-int diff(const char *, const char *);
+int diff(const char *, const char *, const char *);
 
 #endif
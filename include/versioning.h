@@ -12,6 +12,18 @@
 
 #define MAX_FILENAME 256
 
+/*
+ * Every '.version' directory has an index logging the events that are not
+ * visible in the snapshots themselves: creation, removal and renames.
+ */
+#define VERSION_INDEX ".index"
+
+/*
+ * Copies the SHA-1 of a file to its second argument and returns it if the
+ * writer given as first argument knows it (see handle_digest), NULL if not.
+ */
+typedef const unsigned char *(*version_digest_function)(void *, 
+        unsigned char *);
 
 int h_versioned_mkdir(const char *);
 
@@ -21,4 +33,12 @@ int h_versioned_create(const char *, mode_t);
 
 int h_versioned_unlink(const char *);
 
+int h_versioned_rename(const char *, const char *);
+
+int h_versioned_rename_index(const char *, const char *);
+
+int h_versioned_replace_index(const char *, const char *);
+
+int h_versioned_write(const char *, version_digest_function, void *);
+
 #endif
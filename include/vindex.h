@@ -0,0 +1,164 @@
+/******************************************************************************
+ *
+ * file   : vindex.h
+ *
+ * author : Tim van Deurzen
+ * date   : 18/10/2026
+ *
+ * Prototypes, macros and on-disk structures of the version index of a mount.
+ *
+ *****************************************************************************/
+
+#ifndef __HIERONYMUS_VINDEX_H
+#define __HIERONYMUS_VINDEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "thread_pool.h"
+
+/*
+ * The index lives in the '.version' directory of the root directory: the
+ * merged base, the log of the in-memory delta and, while a merge runs, the log
+ * of the delta being merged.
+ */
+#define VINDEX_NAME ".version/.vindex"
+#define VINDEX_LOG_NAME ".version/.vindex.log"
+#define VINDEX_MERGING_NAME ".version/.vindex.log.merging"
+#define VINDEX_TEMPORARY_NAME ".version/.vindex.tmp"
+
+#define VINDEX_MAGIC "HVINDEX1"
+#define VINDEX_LOG_MAGIC 0x474c4956
+
+/*
+ * Number of versions in the delta at which it is merged into the base.
+ */
+#define VINDEX_MERGE_THRESHOLD 4096
+
+/*
+ * Sections of the base start on a cache line, file records fill one.
+ */
+#define VINDEX_ALIGNMENT 64
+
+enum vindex_kinds {
+    vindex_snapshot = 1,
+    vindex_patch,
+    vindex_create,
+    vindex_unlink,
+    vindex_rename_from,
+    vindex_rename_to,
+    vindex_rmdir,
+    num_vindex_kinds
+};
+
+/*
+ * The base starts with a header, followed by the files sorted by path hash
+ * (then path), the versions of each file sorted by id and the null-terminated
+ * paths. Log records with a sequence up to last_sequence are in the base.
+ */
+typedef struct VINDEX_HEADER {
+    char magic[8];
+    uint64_t generation;
+    uint64_t last_sequence;
+    uint64_t num_files;
+    uint64_t num_versions;
+    uint64_t files_offset;
+    uint64_t versions_offset;
+    uint64_t strings_offset;
+} vindex_header;
+
+typedef struct VINDEX_FILE {
+    uint64_t hash;
+    uint64_t path_offset;
+    uint64_t first_version;
+    uint32_t num_versions;
+    uint32_t path_length;
+    uint64_t first_id;
+    uint64_t last_id;
+    uint64_t total_stored;
+    uint64_t reserved;
+} vindex_file;
+
+/*
+ * A version of a file: its id (the version id of the stored version), the size
+ * of the file and the number of bytes stored for it (a copy or a patch, before
+ * compression).
+ */
+typedef struct VINDEX_VERSION {
+    uint64_t id;
+    uint64_t size;
+    uint64_t stored;
+    uint32_t kind;
+    uint32_t reserved;
+} vindex_version;
+
+/*
+ * A record of the log is followed by the path, the checksum is the CRC32C of
+ * the record (with a zero checksum) and the path.
+ */
+typedef struct VINDEX_LOG_RECORD {
+    uint32_t magic;
+    uint32_t checksum;
+    uint64_t sequence;
+    uint32_t path_length;
+    uint32_t reserved;
+    vindex_version version;
+} vindex_log_record;
+
+typedef struct VINDEX_DELTA_ENTRY {
+    uint64_t hash;
+    uint64_t sequence;
+    char *path;
+    vindex_version version;
+} vindex_delta_entry;
+
+typedef struct VINDEX_DELTA {
+    vindex_delta_entry *entries;
+    size_t num_entries;
+    size_t capacity;
+} vindex_delta;
+
+/*
+ * Lookups see the base, the delta being merged (frozen) and the delta new
+ * versions are added to (active). Only one process opens an index for
+ * writing, it holds a lock on the '.version' directory.
+ */
+typedef struct VINDEX {
+    char root[PATH_MAX];
+    int writable;
+    const unsigned char *base;
+    size_t base_size;
+    vindex_delta active;
+    vindex_delta frozen;
+    int log_fd;
+    int lock_fd;
+    uint64_t next_sequence;
+    int merging;
+    pool_group merges;
+    pthread_rwlock_t lock;
+} vindex;
+
+/*
+ * Called by vindex_walk for every file with its versions, oldest first.
+ */
+typedef int (*vindex_walk_function)(const char *, const vindex_version *, int,
+        void *);
+
+vindex *vindex_open(const char *, int);
+void vindex_close(vindex *);
+int vindex_add(vindex *, const char *, const vindex_version *);
+int vindex_lookup(vindex *, const char *, vindex_version *, int);
+int vindex_walk(vindex *, const char *, int, vindex_walk_function, void *);
+int vindex_merge(vindex *);
+uint64_t vindex_hash(const char *);
+const char *vindex_kind_name(int);
+
+int vindex_mount(const char *);
+vindex *vindex_mounted(void);
+void vindex_unmount(void);
+void vindex_record(const char *, int, unsigned long long, unsigned long long,
+        unsigned long long);
+
+#endif
@@ -0,0 +1,98 @@
+/******************************************************************************
+ *
+ * file   : vquery.h
+ *
+ * author : Tim van Deurzen
+ * date   : 18/10/2026
+ *
+ * Prototypes, macros and structures of queries on the version index.
+ *
+ *****************************************************************************/
+
+#ifndef __HIERONYMUS_VQUERY_H
+#define __HIERONYMUS_VQUERY_H
+
+#include <stdio.h>
+#include <limits.h>
+
+#include "vindex.h"
+
+/*
+ * Number of versions listed per page, unless the query asks for another.
+ */
+#define VQUERY_DEFAULT_LIMIT 100
+
+/*
+ * Times of at most this many digits are seconds since the epoch, longer ones
+ * are version ids (nanoseconds since the epoch).
+ */
+#define VQUERY_MAX_SECONDS_DIGITS 11
+
+enum vquery_formats {
+    vquery_json,
+    vquery_text
+};
+
+/*
+ * The versions of one file, or of all files below a directory (subtree), with
+ * an id in [from, to] and a kind in kinds (a bit per kind, 0 is all kinds).
+ * Of those, limit are listed from offset on.
+ */
+typedef struct VQUERY {
+    char path[PATH_MAX];
+    int subtree;
+    unsigned long long from;
+    unsigned long long to;
+    unsigned int kinds;
+    unsigned long long offset;
+    unsigned long long limit;
+    int format;
+} vquery;
+
+/*
+ * A listed version, delta is the change in size since the previous version of
+ * the file.
+ */
+typedef struct VQUERY_ENTRY {
+    char *path;
+    vindex_version version;
+    long long delta;
+} vquery_entry;
+
+/*
+ * Statistics over all versions a query matches, not only the listed ones.
+ * patch_bytes are stored for patches of files of patched_bytes in total.
+ */
+typedef struct VQUERY_STATISTICS {
+    unsigned long long files;
+    unsigned long long versions;
+    unsigned long long snapshots;
+    unsigned long long patches;
+    unsigned long long events;
+    unsigned long long first_id;
+    unsigned long long last_id;
+    unsigned long long min_size;
+    unsigned long long max_size;
+    unsigned long long total_size;
+    unsigned long long snapshot_bytes;
+    unsigned long long patch_bytes;
+    unsigned long long patched_bytes;
+    long long growth;
+} vquery_statistics;
+
+typedef struct VQUERY_RESULT {
+    vquery_entry *entries;
+    size_t num_entries;
+    size_t capacity;
+    vquery_statistics statistics;
+    double seconds;
+} vquery_result;
+
+void vquery_init(vquery *);
+int vquery_parse(vquery *, const char *);
+int vquery_parse_time(const char *, int, unsigned long long *);
+int vquery_run(vindex *, const vquery *, vquery_result *);
+int vquery_print(const vquery *, const vquery_result *, FILE *);
+void vquery_free(vquery_result *);
+
+#endif
@@ -0,0 +1,95 @@
+/******************************************************************************
+ *
+ * file   : vstate.h
+ *
+ * author : Tim van Deurzen
+ * date   : 18/10/2026
+ *
+ * Prototypes, macros and structures of the in-memory versioning state.
+ *
+ *****************************************************************************/
+
+#ifndef __HIERONYMUS_VSTATE_H
+#define __HIERONYMUS_VSTATE_H
+
+#include <pthread.h>
+
+#include "util.h"
+
+/*
+ * Both tables (of '.version' directories and of versioned files) have
+ * VSTATE_BUCKETS buckets, protected by VSTATE_STRIPES locks.
+ */
+#define VSTATE_BUCKETS 4096
+#define VSTATE_STRIPES 64
+
+/*
+ * Beyond this many files (vstate_max_files of the runtime configuration), the
+ * entry of a file is dropped as soon as no writer uses it; its number of
+ * versions is then read from disk again.
+ */
+#define VSTATE_MAX_FILES 65536
+
+typedef void (*vstate_seal_function)(const char *);
+
+/*
+ * A snapshot directory that 'users' writers are using: they found it to be the
+ * latest snapshot and may still read or add its files. 'seal' is set once a
+ * newer snapshot replaced it, it is called when the last of them is done.
+ */
+typedef struct VSTATE_SNAPSHOT {
+    char name[MAX_SNAPSHOT_LENGTH];
+    int users;
+    vstate_seal_function seal;
+    struct VSTATE_SNAPSHOT *next;
+} vstate_snapshot;
+
+/*
+ * A '.version' directory and the name of its latest snapshot directory ("" if
+ * not known yet). 'lock' is held while the latest snapshot is looked up on disk
+ * or a new one is made, and protects the list of snapshots in use.
+ */
+typedef struct VSTATE_DIRECTORY {
+    char *path;
+    unsigned int hash;
+    unsigned long generation;
+    char latest[MAX_SNAPSHOT_LENGTH];
+    vstate_snapshot *snapshots;
+    pthread_mutex_t lock;
+    struct VSTATE_DIRECTORY *next;
+} vstate_directory;
+
+/*
+ * A file in the root directory that is being versioned, or was. 'lock' is
+ * held by its writer while a version is made, 'used' is the snapshot the
+ * writer uses (in 'directory') until it unlocks the file. 'num_versions'
+ * counts the versions of the file in the snapshot with id 'snapshot', as
+ * find_snapshot_version does.
+ */
+typedef struct VSTATE_FILE {
+    char *path;
+    unsigned int hash;
+    int references;
+    unsigned long generation;
+    unsigned long locked_generation;
+    unsigned long long snapshot;
+    int num_versions;
+    vstate_directory *directory;
+    vstate_snapshot *used;
+    pthread_mutex_t lock;
+    struct VSTATE_FILE *next;
+} vstate_file;
+
+vstate_file *vstate_lock_file(const char *);
+void vstate_unlock_file(vstate_file *);
+int vstate_latest_snapshot(vstate_file *, const char *, char *);
+int vstate_next_snapshot(vstate_file *, const char *, const char *, char *,
+        vstate_seal_function);
+int vstate_current_snapshot(const char *, char *);
+int vstate_close_snapshot(const char *, const char *, char *);
+int vstate_num_versions(vstate_file *, const char *, const char *);
+void vstate_add_version(vstate_file *, const char *, int);
+void vstate_invalidate(void);
+void vstate_destroy(void);
+
+#endif
@@ -0,0 +1,417 @@
+/******************************************************************************
+ *
+ * file   : block_versioning.c
+ *
+ * author : Tim van Deurzen
+ * date   : 18/10/2026
+ *
+ * Block-level (copy-on-write) versioning.
+ *
+ * Instead of diffing the whole file after every write, the old contents of
+ * each block are saved the first time the block is overwritten within a version
+ * epoch. An epoch is a snapshot directory; for each file written during the
+ * epoch it contains a block bitmap and an undo-block store:
+ *
+ *    ``.version/<snapshot>/<file>.bitmap''
+ *    ``.version/<snapshot>/<file>.blocks''
+ *
+ * The state of a file at the start of an epoch is restored by applying the
+ * undo-block stores of that epoch and all later epochs to the live file, newest
+ * first, and truncating it to the original size of the oldest epoch.
+ *
+ * A handle keeps the epoch it writes in (see block_epoch) with its files open,
+ * the latest snapshot of a directory is looked up in the versioning state (see
+ * vstate.c), so a write only touches the disk to save blocks. Releasing a
+ * handle that wrote in the latest epoch starts the next one, once: a handle
+ * that only wrote in an older epoch finds it already closed.
+ *
+ *****************************************************************************/
+
+#include <limits.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "block_versioning.h"
+#include "versioning.h"
+#include "vstate.h"
+#include "util.h"
+#include "error.h"
+
+/**
+ * Open the block bitmap of a file in the given snapshot directory.
+ *
+ * If the file did not have a bitmap in this epoch yet, it is created and its
+ * header records the current size of the file. The header is read into the
+ * header argument.
+ */
+static int open_block_map(const char *map_path, const char *path, 
+        block_map_header *header)
+{
+    int map_fd = 0;
+    struct stat stat_buffer;
+
+    map_fd = open(map_path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+
+    if (map_fd < 0) {
+        return HIERONYMUS_ERROR(err_open, "open_block_map");
+    }
+
+    if (pread(map_fd, header, sizeof(block_map_header), 0) 
+            == sizeof(block_map_header)) {
+        return map_fd;
+    }
+
+    /*
+     * First write to this file in this epoch, record the size of the file so
+     * writes past the end of the file can be undone by truncating it.
+     */
+    if (stat(path, &stat_buffer) < 0) {
+        close(map_fd);
+        return HIERONYMUS_ERROR(err_getattr, "open_block_map");
+    }
+
+    memset(header, 0, sizeof(block_map_header));
+    memcpy(header->magic, BLOCK_MAP_MAGIC, sizeof(header->magic));
+    header->block_size = BLOCK_SIZE;
+    header->original_size = stat_buffer.st_size;
+
+    if (pwrite(map_fd, header, sizeof(block_map_header), 0) 
+            != sizeof(block_map_header)) {
+        close(map_fd);
+        return HIERONYMUS_ERROR(err_write, "open_block_map");
+    }
+
+    return map_fd;
+}
+
+/**
+ * Copy the path of the '.version' directory next to a file to directory.
+ */
+static int version_directory(const char *path, char *directory)
+{
+    parent_directory(path, directory);
+
+    if (strlen(directory) + sizeof("/.version") > PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    strcat(directory, "/.version");
+
+    return 0;
+}
+
+/**
+ * Copy the path of the bitmap or undo-block store (given by its suffix) of the
+ * file of an epoch to file_path.
+ */
+static int epoch_file(const block_epoch *epoch, const char *suffix, 
+        char *file_path)
+{
+    char filename[MAX_FILENAME];
+    int length = 0;
+
+    bottom_directory(epoch->path, filename);
+    length = snprintf(file_path, PATH_MAX, "%s/%s%s", epoch->snapshot, 
+            filename, suffix);
+
+    if (length < 0 || length >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Close the files of an epoch and forget it, called with its lock held.
+ */
+static void close_epoch_locked(block_epoch *epoch)
+{
+    if (epoch->map_fd >= 0) {
+        close(epoch->map_fd);
+    }
+
+    if (epoch->store_fd >= 0) {
+        close(epoch->store_fd);
+    }
+
+    if (epoch->data_fd >= 0) {
+        close(epoch->data_fd);
+    }
+
+    epoch->snapshot[0] = '\0';
+    epoch->path[0] = '\0';
+    epoch->map_fd = -1;
+    epoch->store_fd = -1;
+    epoch->data_fd = -1;
+    epoch->written = 0;
+}
+
+/**
+ * Make sure an epoch is the latest epoch of the file at path, with its bitmap
+ * open, called with its lock held. The files of an older epoch, or of the file
+ * under an older path, are closed first.
+ */
+static int enter_epoch_locked(block_epoch *epoch, const char *path)
+{
+    char directory[PATH_MAX];
+    char snapshot_path[PATH_MAX];
+    char map_path[PATH_MAX];
+    int map_fd = 0;
+
+    if (version_directory(path, directory) < 0 
+            || vstate_current_snapshot(directory, snapshot_path) < 0) {
+        return HIERONYMUS_ERROR(err_snapshot, "h_versioned_block_write");
+    }
+
+    if (epoch->map_fd >= 0 && strcmp(epoch->snapshot, snapshot_path) == 0
+            && strcmp(epoch->path, path) == 0) {
+        return 0;
+    }
+
+    close_epoch_locked(epoch);
+
+    strcpy(epoch->snapshot, snapshot_path);
+    strncpy(epoch->path, path, PATH_MAX - 1);
+    epoch->path[PATH_MAX - 1] = '\0';
+
+    if (epoch_file(epoch, BLOCK_MAP_SUFFIX, map_path) < 0) {
+        close_epoch_locked(epoch);
+        return HIERONYMUS_ERROR(err_open, "h_versioned_block_write");
+    }
+
+    if ((map_fd = open_block_map(map_path, path, &epoch->header)) < 0) {
+        close_epoch_locked(epoch);
+        return map_fd;
+    }
+
+    epoch->map_fd = map_fd;
+
+    return 0;
+}
+
+/**
+ * Open the undo-block store and the contents of the file of an epoch, unless
+ * they are open already. The handle given to h_write might be write-only, so
+ * the old contents are read through a separate descriptor.
+ */
+static int open_epoch_data(block_epoch *epoch)
+{
+    char store_path[PATH_MAX];
+
+    if (epoch->data_fd < 0 
+            && (epoch->data_fd = open(epoch->path, O_RDONLY)) < 0) {
+        return -1;
+    }
+
+    if (epoch->store_fd < 0) {
+        if (epoch_file(epoch, BLOCK_STORE_SUFFIX, store_path) < 0) {
+            return -1;
+        }
+
+        epoch->store_fd = open(store_path, O_WRONLY | O_CREAT | O_APPEND, 
+                S_IRUSR | S_IWUSR);
+    }
+
+    return epoch->store_fd < 0 ? -1 : 0;
+}
+
+void block_epoch_init(block_epoch *epoch)
+{
+    epoch->map_fd = -1;
+    epoch->store_fd = -1;
+    epoch->data_fd = -1;
+    close_epoch_locked(epoch);
+    pthread_mutex_init(&epoch->lock, NULL);
+}
+
+/**
+ * Close the files of an epoch, without starting the next epoch.
+ */
+void block_epoch_close(block_epoch *epoch)
+{
+    pthread_mutex_lock(&epoch->lock);
+    close_epoch_locked(epoch);
+    pthread_mutex_unlock(&epoch->lock);
+}
+
+void block_epoch_destroy(block_epoch *epoch)
+{
+    block_epoch_close(epoch);
+    pthread_mutex_destroy(&epoch->lock);
+}
+
+/**
+ * Save the blocks that are about to be overwritten.
+ *
+ * This function is called before 'size' bytes are written at 'offset' in the
+ * file at path (an absolute path in the root directory), through the handle
+ * that keeps the given epoch (NULL for a write without a handle). Every block
+ * in that range that was not yet saved in the current epoch is appended to the
+ * undo-block store and marked in the block bitmap. Blocks past the original end
+ * of the file hold no data and are only marked. The cost of versioning is thus
+ * proportional to the number of bytes changed instead of the file size.
+ */
+int h_versioned_block_write(block_epoch *epoch, const char *path, size_t size, 
+        off_t offset)
+{
+    int return_value = 0;
+    int changed = 0;
+    ssize_t length = 0;
+    unsigned long long block = 0;
+    unsigned long long first_block = 0;
+    unsigned long long last_block = 0;
+    unsigned long long original_blocks = 0;
+    size_t map_length = 0;
+    unsigned char *map = NULL;
+    char *block_buffer = NULL;
+    block_map_header *header = NULL;
+    block_record record;
+    block_epoch unowned;
+    struct iovec vector[2];
+
+    if (size == 0) {
+        return 0;
+    }
+
+    if (epoch == NULL) {
+        block_epoch_init(&unowned);
+        epoch = &unowned;
+    }
+
+    pthread_mutex_lock(&epoch->lock);
+
+    if ((return_value = enter_epoch_locked(epoch, path)) < 0) {
+        goto unlock;
+    }
+
+    epoch->written = 1;
+    header = &epoch->header;
+    first_block = offset / header->block_size;
+    last_block = (offset + size - 1) / header->block_size;
+    original_blocks = (header->original_size + header->block_size - 1) 
+        / header->block_size;
+
+    /*
+     * Only read the part of the bitmap covering the written range. Reading past
+     * the end of the bitmap file simply means those blocks were not saved yet.
+     */
+    map_length = (last_block / 8) - (first_block / 8) + 1;
+    map = (unsigned char *) checked_malloc(map_length);
+    memset(map, 0, map_length);
+
+    if (pread(epoch->map_fd, map, map_length, 
+                sizeof(block_map_header) + (first_block / 8)) < 0) {
+        return_value = HIERONYMUS_ERROR(err_read, "h_versioned_block_write");
+        goto cleanup;
+    }
+
+    for (block = first_block; block <= last_block; block++) {
+        unsigned long long bit = block - (first_block & ~7ULL);
+
+        if (map[bit / 8] & (1 << (bit % 8))) {
+            continue;
+        }
+
+        if (block < original_blocks) {
+            if (block_buffer == NULL) {
+                if (open_epoch_data(epoch) < 0) {
+                    return_value = HIERONYMUS_ERROR(err_open, 
+                            "h_versioned_block_write");
+                    goto cleanup;
+                }
+
+                block_buffer = (char *) checked_malloc(header->block_size);
+            }
+
+            length = pread(epoch->data_fd, block_buffer, header->block_size, 
+                    block * header->block_size);
+
+            if (length < 0) {
+                return_value = HIERONYMUS_ERROR(err_read, 
+                        "h_versioned_block_write");
+                goto cleanup;
+            }
+
+            record.block = block;
+            record.length = length;
+            record.reserved = 0;
+
+            vector[0].iov_base = &record;
+            vector[0].iov_len = sizeof(record);
+            vector[1].iov_base = block_buffer;
+            vector[1].iov_len = length;
+
+            if (writev(epoch->store_fd, vector, 2) 
+                    != (ssize_t) (sizeof(record) + length)) {
+                return_value = HIERONYMUS_ERROR(err_block_write, 
+                        "h_versioned_block_write");
+                goto cleanup;
+            }
+        }
+
+        map[bit / 8] |= (1 << (bit % 8));
+        changed = 1;
+    }
+
+    /*
+     * The bitmap is only updated after the old blocks are safely stored.
+     */
+    if (changed && pwrite(epoch->map_fd, map, map_length, 
+                sizeof(block_map_header) + (first_block / 8)) < 0) {
+        return_value = HIERONYMUS_ERROR(err_block_write, 
+                "h_versioned_block_write");
+    }
+
+cleanup:
+    free(block_buffer);
+    free(map);
+
+unlock:
+    pthread_mutex_unlock(&epoch->lock);
+
+    if (epoch == &unowned) {
+        block_epoch_destroy(&unowned);
+    }
+
+    return return_value;
+}
+
+/**
+ * Close the current version epoch of a handle.
+ *
+ * When a handle that wrote its file during the latest epoch is released, a new
+ * snapshot directory is created. The next write to any file in this directory
+ * then saves its blocks in the new epoch, so each release of a modified file
+ * marks a restorable version. If another release started a newer epoch since
+ * the last write through the handle, that epoch already marks the version.
+ */
+int h_versioned_block_release(block_epoch *epoch)
+{
+    int return_value = 0;
+    char directory[PATH_MAX];
+    char snapshot_path[PATH_MAX];
+
+    pthread_mutex_lock(&epoch->lock);
+
+    if (epoch->written) {
+        if (version_directory(epoch->path, directory) < 0) {
+            return_value = HIERONYMUS_ERROR(err_snapshot, 
+                    "h_versioned_block_release");
+        } else {
+            return_value = vstate_close_snapshot(directory, epoch->snapshot, 
+                    snapshot_path);
+        }
+    }
+
+    close_epoch_locked(epoch);
+    pthread_mutex_unlock(&epoch->lock);
+
+    return return_value < 0 ? return_value : 0;
+}
@@ -55,6 +55,39 @@ void parse_commandline (int argc, char **argv, char *versioning_root)
     }
 }
 
+/** 
+ * Extract an optional `--key=value' argument from the commandline arguments.
+ *
+ * If the argument is present its value is copied to value (at most length - 1
+ * characters) and the argument is removed from argv, so it is not passed on to
+ * FUSE. Returns the new number of arguments.
+ */
+int extract_commandline_option (int argc, char **argv, const char *key, 
+        char *value, int length) 
+{
+    int i = 0;
+    int key_length = strlen(key);
+
+    for (; i < argc; i++) {
+        if (strncmp(argv[i], key, key_length) == 0) {
+            strncpy(value, argv[i] + key_length, length - 1);
+            value[length - 1] = '\0';
+
+            break;
+        }
+    }
+
+    if (i == argc) {
+        return argc;
+    }
+
+    for (; i < argc; i++) {
+        argv[i] = argv[i + 1];
+    }
+
+    return argc - 1;
+}
+
 /** 
  * Add arguments to the commandline arguments.
  *
@@ -96,15 +129,17 @@ int add_commandline_arg(int argc, char ***argv, char *new_arg)
         /* 
          * Here we actually have two arguments: '-o', 'nonempty'. 
          */
-        strncpy(new_argv[argc], "-o", 2);
-        strncpy(new_argv[argc + 1], new_arg + 3, strlen(new_arg) - 3);
+        strcpy(new_argv[argc], "-o");
+        strncpy(new_argv[argc + 1], new_arg + 3, MAX_ARG_LENGTH - 1);
+        new_argv[argc + 1][MAX_ARG_LENGTH - 1] = '\0';
         argc += 2;
 
     } else {
         /*
          * Now we just have a single argument: '-f'. 
          */
-        strncpy(new_argv[argc], new_arg, strlen(new_arg));
+        strncpy(new_argv[argc], new_arg, MAX_ARG_LENGTH - 1);
+        new_argv[argc][MAX_ARG_LENGTH - 1] = '\0';
         argc += 1;
     }
     
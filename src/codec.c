@@ -0,0 +1,1130 @@
+/******************************************************************************
+ *
+ * file   : codec.c
+ *
+ * author : Tim van Deurzen
+ * date   : 18/10/2026
+ *
+ * Compression of stored versions.
+ *
+ * Patches are compressed as soon as they are written, snapshot copies once
+ * they are sealed: when a newer snapshot directory is made, the copies in the
+ * previous one no longer serve as the base of new patches. Compression runs in
+ * the background on the shared thread pool, a file is compressed in frames
+ * (in parallel for large files) to a temporary file that replaces the original,
+ * so a stored version keeps its name. Compressed files are recognised by their
+ * header; h_vtool decompresses them as a stream.
+ *
+ * The codec is chosen per mount or per file name pattern:
+ *
+ *     ``--codec=*.log=zstd:19,*.jpg=none,lz4''
+ *
+ * The first pattern that matches the name of the file (without the
+ * '-<version id>.patch' suffix of patches) wins, an entry without a pattern is
+ * the default. A codec given by the versioning policy (see policy.c) for the
+ * file a version was stored for takes precedence. With
+ * --codec_dictionaries=<directory>, zstd uses the dictionary
+ * <directory>/<extension>.dict for files with that extension, if it exists.
+ *
+ * Per codec the number of files, the bytes in and out and the CPU time spent
+ * compressing and decompressing are counted.
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#ifdef _ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef _LZ4
+#include <lz4.h>
+#endif
+
+#ifdef _ZSTD
+#include <zstd.h>
+#endif
+
+#include "codec.h"
+#include "policy.h"
+#include "thread_pool.h"
+#include "simd.h"
+#include "block_versioning.h"
+#include "error.h"
+#include "util.h"
+
+/*
+ * Prefix of the temporary file a file is compressed to, in the same directory.
+ */
+#define CODEC_TEMPORARY_PREFIX ".codec-"
+
+typedef struct CODEC_RULE {
+    char pattern[MAX_CODEC_PATTERN];
+    codec_choice choice;
+} codec_rule;
+
+/*
+ * A dictionary file, loaded on first use. Compression dictionaries are bound
+ * to a level, so there is an entry per file type and level.
+ */
+typedef struct CODEC_DICTIONARY {
+    char name[MAX_DICTIONARY_NAME];
+    int level;
+    void *data;
+    size_t size;
+#ifdef _ZSTD
+    ZSTD_CDict *compress;
+    ZSTD_DDict *decompress;
+#endif
+} codec_dictionary;
+
+/*
+ * Compression or decompression of a frame.
+ */
+typedef struct CODEC_JOB {
+    const codec_choice *choice;
+    const codec_dictionary *dictionary;
+    unsigned char *input;
+    size_t input_length;
+    unsigned char *output;
+    size_t output_size;
+    size_t output_length;
+    codec_frame frame;
+    int failed;
+} codec_job;
+
+static const char *codec_names[num_codecs] = {
+    "none", "zlib", "lz4", "zstd"
+};
+
+static struct {
+    codec_rule rules[MAX_CODEC_RULES];
+    int num_rules;
+    codec_choice fallback;
+    int enabled;
+    char dictionaries[PATH_MAX];
+    codec_dictionary loaded[MAX_CODEC_DICTIONARIES];
+    int num_loaded;
+    pool_group background;
+    codec_statistics statistics[num_codecs];
+    pthread_mutex_t lock;
+} codecs = {
+    .fallback = { codec_none, 0 },
+    .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static pthread_once_t background_once = PTHREAD_ONCE_INIT;
+
+static void init_background(void)
+{
+    pool_group_init(&codecs.background);
+}
+
+static unsigned long long cpu_time_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+
+    return (unsigned long long) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+const char *codec_name(int codec)
+{
+    if (codec < 0 || codec >= num_codecs) {
+        return "unknown";
+    }
+
+    return codec_names[codec];
+}
+
+static int codec_available(int codec)
+{
+    switch (codec) {
+        case codec_none:
+            return 1;
+#ifdef _ZLIB
+        case codec_zlib:
+            return 1;
+#endif
+#ifdef _LZ4
+        case codec_lz4:
+            return 1;
+#endif
+#ifdef _ZSTD
+        case codec_zstd:
+            return 1;
+#endif
+        default:
+            return 0;
+    }
+}
+
+/**
+ * Parse a codec specification 'name[:level]'.
+ */
+int codec_parse(const char *specification, codec_choice *choice)
+{
+    size_t length = strcspn(specification, ":");
+    int i = 0;
+
+    for (i = 0; i < num_codecs; i++) {
+        if (strlen(codec_names[i]) == length
+                && strncmp(specification, codec_names[i], length) == 0) {
+            break;
+        }
+    }
+
+    if (i == num_codecs || !codec_available(i)) {
+        errno = EINVAL;
+        return HIERONYMUS_ERROR(err_codec, "codec_parse");
+    }
+
+    choice->codec = i;
+    choice->level = specification[length] == ':' ?
+        atoi(specification + length + 1) : 0;
+
+    return 0;
+}
+
+/**
+ * Configure the codecs from the value of --codec (a comma-separated list of
+ * '[pattern=]codec[:level]') and the dictionary directory (may be empty).
+ */
+int codec_configure(const char *rules, const char *dictionaries)
+{
+    char entry[MAX_CODEC_PATTERN + 32];
+    const char *separator = NULL;
+    codec_choice choice;
+    size_t length = 0;
+    char *equals = NULL;
+
+    snprintf(codecs.dictionaries, PATH_MAX, "%s", dictionaries);
+
+    while (*rules != '\0') {
+        length = strcspn(rules, ",");
+
+        if (length >= sizeof(entry)) {
+            errno = ENAMETOOLONG;
+            return HIERONYMUS_ERROR(err_codec, "codec_configure");
+        }
+
+        memcpy(entry, rules, length);
+        entry[length] = '\0';
+        separator = rules + length;
+        rules = *separator == ',' ? separator + 1 : separator;
+
+        if ((equals = strrchr(entry, '=')) != NULL) {
+            *equals = '\0';
+
+            if (codec_parse(equals + 1, &choice) < 0) {
+                return -1;
+            }
+
+            if (codecs.num_rules == MAX_CODEC_RULES
+                    || strlen(entry) >= MAX_CODEC_PATTERN) {
+                errno = ENOSPC;
+                return HIERONYMUS_ERROR(err_codec, "codec_configure");
+            }
+
+            strcpy(codecs.rules[codecs.num_rules].pattern, entry);
+            codecs.rules[codecs.num_rules++].choice = choice;
+        } else {
+            if (codec_parse(entry, &codecs.fallback) < 0) {
+                return -1;
+            }
+
+            choice = codecs.fallback;
+        }
+
+        if (choice.codec != codec_none) {
+            codecs.enabled = 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Return whether any file is compressed at all.
+ */
+int codec_enabled(void)
+{
+    return codecs.enabled;
+}
+
+/**
+ * Compress even if --codec selects no codec, a rule of the versioning policy
+ * may select one.
+ */
+void codec_enable(void)
+{
+    codecs.enabled = 1;
+}
+
+/**
+ * Return the length of the name of a stored version without the
+ * '-<version id>.patch' suffix of patches.
+ */
+static size_t base_name_length(const char *name)
+{
+    size_t length = strlen(name);
+    size_t end = length;
+
+    if (length < 7 || strcmp(name + length - 6, ".patch") != 0) {
+        return length;
+    }
+
+    for (end = length - 6; end > 0 && name[end - 1] >= '0'
+            && name[end - 1] <= '9'; end--);
+
+    if (end == length - 6 || end == 0 || name[end - 1] != '-') {
+        return length;
+    }
+
+    return end - 1;
+}
+
+static const char *file_name(const char *path)
+{
+    const char *name = strrchr(path, '/');
+
+    return name != NULL ? name + 1 : path;
+}
+
+/**
+ * Look up the codec the versioning policy gives the file a version (in
+ * '<directory>/.version/<snapshot>/') was stored for. Returns -1 if it gives
+ * none.
+ */
+static int policy_codec(const char *path, const char *base,
+        codec_choice *choice)
+{
+    char live_path[PATH_MAX];
+    const policy_rule *rule = NULL;
+    const char *version_directory = NULL;
+    const char *next = path;
+
+    while ((next = strstr(next, "/.version/")) != NULL) {
+        version_directory = next++;
+    }
+
+    if (version_directory == NULL || snprintf(live_path, PATH_MAX, "%.*s/%s",
+                (int) (version_directory - path), path, base) >= PATH_MAX) {
+        return -1;
+    }
+
+    if ((rule = policy_match_root(live_path)) == NULL || !rule->has_codec) {
+        return -1;
+    }
+
+    *choice = rule->codec;
+
+    return 0;
+}
+
+/**
+ * Choose the codec of a stored version by its name.
+ */
+void codec_select(const char *path, codec_choice *choice)
+{
+    const char *name = file_name(path);
+    char base[NAME_MAX + 1];
+    size_t length = base_name_length(name);
+    int i = 0;
+
+    if (length > NAME_MAX) {
+        length = NAME_MAX;
+    }
+
+    memcpy(base, name, length);
+    base[length] = '\0';
+
+    if (policy_enabled() && policy_codec(path, base, choice) == 0) {
+        return;
+    }
+
+    for (i = 0; i < codecs.num_rules; i++) {
+        if (fnmatch(codecs.rules[i].pattern, base, 0) == 0) {
+            *choice = codecs.rules[i].choice;
+            return;
+        }
+    }
+
+    *choice = codecs.fallback;
+}
+
+/**
+ * Return the dictionary of the file type of path, NULL if there is none.
+ */
+static const codec_dictionary *find_dictionary(const char *name, int level)
+{
+    codec_dictionary *dictionary = NULL;
+    struct stat file_stat;
+    char path[PATH_MAX];
+    int fd = -1;
+    int i = 0;
+
+    if (codecs.dictionaries[0] == '\0' || name[0] == '\0') {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&codecs.lock);
+
+    for (i = 0; i < codecs.num_loaded; i++) {
+        if (strcmp(codecs.loaded[i].name, name) == 0
+                && codecs.loaded[i].level == level) {
+            pthread_mutex_unlock(&codecs.lock);
+            return &codecs.loaded[i];
+        }
+    }
+
+    if (snprintf(path, PATH_MAX, "%s/%s.dict", codecs.dictionaries, name)
+            >= PATH_MAX || codecs.num_loaded == MAX_CODEC_DICTIONARIES
+            || (fd = open(path, O_RDONLY)) < 0) {
+        pthread_mutex_unlock(&codecs.lock);
+        return NULL;
+    }
+
+    dictionary = &codecs.loaded[codecs.num_loaded];
+    memset(dictionary, 0, sizeof(codec_dictionary));
+
+    if (fstat(fd, &file_stat) == 0 && file_stat.st_size > 0) {
+        dictionary->size = file_stat.st_size;
+        dictionary->data = checked_malloc(dictionary->size);
+
+        if (read(fd, dictionary->data, dictionary->size)
+                != (ssize_t) dictionary->size) {
+            free(dictionary->data);
+            dictionary->data = NULL;
+        }
+    }
+
+    close(fd);
+
+    if (dictionary->data == NULL) {
+        pthread_mutex_unlock(&codecs.lock);
+        return NULL;
+    }
+
+    snprintf(dictionary->name, MAX_DICTIONARY_NAME, "%s", name);
+    dictionary->level = level;
+
+#ifdef _ZSTD
+    dictionary->compress = ZSTD_createCDict(dictionary->data,
+            dictionary->size, level);
+    dictionary->decompress = ZSTD_createDDict(dictionary->data,
+            dictionary->size);
+#endif
+
+    codecs.num_loaded++;
+
+    pthread_mutex_unlock(&codecs.lock);
+
+    return dictionary;
+}
+
+/**
+ * Return the file type of a stored version (its extension), used to name its
+ * dictionary.
+ */
+static void file_type(const char *path, char *type)
+{
+    const char *name = file_name(path);
+    size_t length = base_name_length(name);
+    size_t start = length;
+
+    while (start > 0 && name[start - 1] != '.') {
+        start--;
+    }
+
+    type[0] = '\0';
+
+    if (start > 1 && length - start < MAX_DICTIONARY_NAME) {
+        memcpy(type, name + start, length - start);
+        type[length - start] = '\0';
+    }
+}
+
+static size_t compress_bound(int codec, size_t length)
+{
+    switch (codec) {
+#ifdef _ZLIB
+        case codec_zlib:
+            return compressBound(length);
+#endif
+#ifdef _LZ4
+        case codec_lz4:
+            return LZ4_compressBound(length);
+#endif
+#ifdef _ZSTD
+        case codec_zstd:
+            return ZSTD_compressBound(length);
+#endif
+        default:
+            return length;
+    }
+}
+
+/**
+ * Compress the input of job, return the compressed length or 0 if the codec
+ * failed.
+ */
+static size_t compress_frame(codec_job *job)
+{
+#ifdef _ZLIB
+    uLongf zlib_length = job->output_size;
+#endif
+#ifdef _ZSTD
+    ZSTD_CCtx *context = NULL;
+#endif
+    size_t length = 0;
+
+    switch (job->choice->codec) {
+#ifdef _ZLIB
+        case codec_zlib:
+            if (compress2(job->output, &zlib_length, job->input,
+                        job->input_length, job->choice->level > 0 ?
+                        job->choice->level : Z_DEFAULT_COMPRESSION) == Z_OK) {
+                length = zlib_length;
+            }
+
+            break;
+#endif
+#ifdef _LZ4
+        case codec_lz4:
+            length = LZ4_compress_fast((const char *) job->input,
+                    (char *) job->output, job->input_length, job->output_size,
+                    job->choice->level > 0 ? job->choice->level : 1);
+            break;
+#endif
+#ifdef _ZSTD
+        case codec_zstd:
+            if ((context = ZSTD_createCCtx()) == NULL) {
+                break;
+            }
+
+            if (job->dictionary != NULL && job->dictionary->compress != NULL) {
+                length = ZSTD_compress_usingCDict(context, job->output,
+                        job->output_size, job->input, job->input_length,
+                        job->dictionary->compress);
+            } else {
+                length = ZSTD_compressCCtx(context, job->output,
+                        job->output_size, job->input, job->input_length,
+                        job->choice->level);
+            }
+
+            if (ZSTD_isError(length)) {
+                length = 0;
+            }
+
+            ZSTD_freeCCtx(context);
+            break;
+#endif
+        default:
+            break;
+    }
+
+    return length;
+}
+
+/**
+ * Decompress the input of job into exactly output_size bytes, return -1 if
+ * that fails.
+ */
+static int decompress_frame(codec_job *job, int codec)
+{
+#ifdef _ZLIB
+    uLongf zlib_length = job->output_size;
+#endif
+#ifdef _ZSTD
+    ZSTD_DCtx *context = NULL;
+#endif
+    size_t length = 0;
+
+    switch (codec) {
+#ifdef _ZLIB
+        case codec_zlib:
+            if (uncompress(job->output, &zlib_length, job->input,
+                        job->input_length) == Z_OK) {
+                length = zlib_length;
+            }
+
+            break;
+#endif
+#ifdef _LZ4
+        case codec_lz4:
+            if (LZ4_decompress_safe((const char *) job->input,
+                        (char *) job->output, job->input_length,
+                        job->output_size) >= 0) {
+                length = job->output_size;
+            }
+
+            break;
+#endif
+#ifdef _ZSTD
+        case codec_zstd:
+            if ((context = ZSTD_createDCtx()) == NULL) {
+                break;
+            }
+
+            if (job->dictionary != NULL
+                    && job->dictionary->decompress != NULL) {
+                length = ZSTD_decompress_usingDDict(context, job->output,
+                        job->output_size, job->input, job->input_length,
+                        job->dictionary->decompress);
+            } else {
+                length = ZSTD_decompressDCtx(context, job->output,
+                        job->output_size, job->input, job->input_length);
+            }
+
+            if (ZSTD_isError(length)) {
+                length = 0;
+            }
+
+            ZSTD_freeDCtx(context);
+            break;
+#endif
+        default:
+            break;
+    }
+
+    return length == job->output_size ? 0 : -1;
+}
+
+/**
+ * Compress a frame, keeping it as is if it does not get smaller.
+ */
+static void compress_task(void *argument)
+{
+    codec_job *job = (codec_job *) argument;
+    unsigned long long start = cpu_time_ns();
+    size_t bound = compress_bound(job->choice->codec, job->input_length);
+
+    if (job->output_size < bound) {
+        free(job->output);
+        job->output = (unsigned char *) checked_malloc(bound);
+        job->output_size = bound;
+    }
+
+    job->frame.original_length = job->input_length;
+    job->frame.checksum = simd_crc32c(0, job->input, job->input_length);
+    job->output_length = compress_frame(job);
+
+    if (job->output_length == 0 || job->output_length >= job->input_length) {
+        job->frame.stored = 1;
+        job->frame.length = job->input_length;
+    } else {
+        job->frame.stored = 0;
+        job->frame.length = job->output_length;
+    }
+
+    __sync_fetch_and_add(&codecs.statistics[job->choice->codec].compress_ns,
+            cpu_time_ns() - start);
+}
+
+static int write_all(int fd, const void *buffer, size_t length)
+{
+    const unsigned char *data = (const unsigned char *) buffer;
+    ssize_t written = 0;
+
+    while (length > 0) {
+        if ((written = write(fd, data, length)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return -1;
+        }
+
+        data += written;
+        length -= written;
+    }
+
+    return 0;
+}
+
+static int read_all(int fd, void *buffer, size_t length)
+{
+    unsigned char *data = (unsigned char *) buffer;
+    ssize_t result = 0;
+
+    while (length > 0) {
+        if ((result = read(fd, data, length)) <= 0) {
+            if (result < 0 && errno == EINTR) {
+                continue;
+            }
+
+            if (result == 0) {
+                errno = EIO;
+            }
+
+            return -1;
+        }
+
+        data += result;
+        length -= result;
+    }
+
+    return 0;
+}
+
+/**
+ * Return 1 if the file at path is compressed, 0 if not and -1 on errors.
+ */
+int codec_is_compressed(const char *path)
+{
+    char magic[sizeof(CODEC_MAGIC) - 1];
+    int fd = open(path, O_RDONLY);
+    int compressed = 0;
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    compressed = read(fd, magic, sizeof(magic)) == sizeof(magic)
+        && memcmp(magic, CODEC_MAGIC, sizeof(magic)) == 0;
+
+    close(fd);
+
+    return compressed;
+}
+
+/**
+ * Compress the file at path in place with the given codec.
+ */
+int codec_compress_file(const char *path, const codec_choice *choice)
+{
+    thread_pool *pool = thread_pool_shared();
+    pool_group group;
+    codec_header header;
+    codec_job *jobs = NULL;
+    struct stat file_stat;
+    char temporary[PATH_MAX];
+    char type[MAX_DICTIONARY_NAME];
+    const codec_dictionary *dictionary = NULL;
+    unsigned long long bytes_out = sizeof(codec_header);
+    const char *name = file_name(path);
+    uint32_t num_jobs = 0;
+    uint32_t batch_size = 0;
+    uint32_t first = 0;
+    uint32_t i = 0;
+    int source_fd = -1;
+    int dest_fd = -1;
+    int return_value = 0;
+
+    if (choice->codec == codec_none || codec_is_compressed(path) != 0) {
+        return 0;
+    }
+
+    snprintf(temporary, PATH_MAX, "%.*s%s%s", (int) (name - path), path,
+            CODEC_TEMPORARY_PREFIX, name);
+
+    if ((source_fd = open(path, O_RDONLY)) < 0
+            || fstat(source_fd, &file_stat) < 0) {
+        return_value = HIERONYMUS_ERROR(err_codec, "codec_compress_file");
+        goto out;
+    }
+
+    dest_fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC,
+            file_stat.st_mode & 07777);
+
+    if (dest_fd < 0) {
+        return_value = HIERONYMUS_ERROR(err_codec, "codec_compress_file");
+        goto out;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CODEC_MAGIC, sizeof(header.magic));
+    header.codec = choice->codec;
+    header.level = choice->level;
+    header.original_size = file_stat.st_size;
+    header.frame_size = CODEC_FRAME_SIZE;
+    header.num_frames = (file_stat.st_size + CODEC_FRAME_SIZE - 1)
+        / CODEC_FRAME_SIZE;
+
+    if (choice->codec == codec_zstd) {
+        file_type(path, type);
+
+        if ((dictionary = find_dictionary(type, choice->level)) != NULL) {
+            memcpy(header.dictionary, dictionary->name, MAX_DICTIONARY_NAME);
+        }
+    }
+
+    if (write_all(dest_fd, &header, sizeof(header)) < 0) {
+        return_value = HIERONYMUS_ERROR(err_codec, "codec_compress_file");
+        goto out;
+    }
+
+    num_jobs = (pool->limit > 0 ? pool->limit : 1)
+        * CODEC_FRAMES_PER_THREAD;
+    jobs = (codec_job *) calloc(num_jobs, sizeof(codec_job));
+
+    if (jobs == NULL) {
+        HIERONYMUS_ERROR(err_malloc, "codec_compress_file");
+        abort();
+    }
+
+    pool_group_init(&group);
+
+    for (first = 0; first < header.num_frames && return_value == 0;
+            first += batch_size) {
+        batch_size = header.num_frames - first;
+
+        if (batch_size > num_jobs) {
+            batch_size = num_jobs;
+        }
+
+        for (i = 0; i < batch_size; i++) {
+            jobs[i].choice = choice;
+            jobs[i].dictionary = dictionary;
+            jobs[i].input_length = header.original_size
+                - (unsigned long long) (first + i) * CODEC_FRAME_SIZE;
+
+            if (jobs[i].input_length > CODEC_FRAME_SIZE) {
+                jobs[i].input_length = CODEC_FRAME_SIZE;
+            }
+
+            if (jobs[i].input == NULL) {
+                jobs[i].input = (unsigned char *) checked_malloc(
+                        CODEC_FRAME_SIZE);
+            }
+
+            if (read_all(source_fd, jobs[i].input,
+                        jobs[i].input_length) < 0) {
+                return_value = HIERONYMUS_ERROR(err_codec,
+                        "codec_compress_file");
+                break;
+            }
+
+            thread_pool_submit(pool, &group, compress_task, &jobs[i]);
+        }
+
+        pool_group_wait(pool, &group);
+
+        for (i = 0; i < batch_size && return_value == 0; i++) {
+            if (write_all(dest_fd, &jobs[i].frame, sizeof(codec_frame)) < 0
+                    || write_all(dest_fd, jobs[i].frame.stored ?
+                        jobs[i].input : jobs[i].output,
+                        jobs[i].frame.length) < 0) {
+                return_value = HIERONYMUS_ERROR(err_codec,
+                        "codec_compress_file");
+            }
+
+            bytes_out += sizeof(codec_frame) + jobs[i].frame.length;
+        }
+    }
+
+    pool_group_destroy(&group);
+
+    if (return_value == 0) {
+        if (close(dest_fd) < 0 || rename(temporary, path) < 0) {
+            return_value = HIERONYMUS_ERROR(err_codec, "codec_compress_file");
+        }
+
+        dest_fd = -1;
+    }
+
+    if (return_value == 0) {
+        __sync_fetch_and_add(&codecs.statistics[choice->codec].files, 1);
+        __sync_fetch_and_add(&codecs.statistics[choice->codec].bytes_in,
+                header.original_size);
+        __sync_fetch_and_add(&codecs.statistics[choice->codec].bytes_out,
+                bytes_out);
+    }
+
+out:
+    if (dest_fd >= 0) {
+        close(dest_fd);
+    }
+
+    if (return_value != 0) {
+        unlink(temporary);
+    }
+
+    if (source_fd >= 0) {
+        close(source_fd);
+    }
+
+    for (i = 0; jobs != NULL && i < num_jobs; i++) {
+        free(jobs[i].input);
+        free(jobs[i].output);
+    }
+
+    free(jobs);
+
+    return return_value;
+}
+
+/**
+ * Decompress source to dest ('-' for the standard output), one frame at a
+ * time. An uncompressed source is copied as is.
+ */
+int codec_decompress_file(const char *source, const char *dest)
+{
+    codec_header header;
+    codec_job job;
+    unsigned long long start = 0;
+    unsigned long long written = 0;
+    uint32_t i = 0;
+    int source_fd = -1;
+    int dest_fd = -1;
+    int return_value = 0;
+
+    memset(&job, 0, sizeof(job));
+
+    if (codec_is_compressed(source) == 0 && strcmp(dest, "-") != 0) {
+        return copy(source, dest);
+    }
+
+    if ((source_fd = open(source, O_RDONLY)) < 0) {
+        return HIERONYMUS_ERROR(err_codec, "codec_decompress_file");
+    }
+
+    dest_fd = strcmp(dest, "-") == 0 ? STDOUT_FILENO :
+        open(dest, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (dest_fd < 0 || read_all(source_fd, &header, sizeof(header)) < 0) {
+        return_value = HIERONYMUS_ERROR(err_codec, "codec_decompress_file");
+        goto out;
+    }
+
+    if (memcmp(header.magic, CODEC_MAGIC, sizeof(header.magic)) != 0
+            || header.codec >= num_codecs || !codec_available(header.codec)
+            || header.frame_size == 0 || header.frame_size > CODEC_FRAME_SIZE) {
+        errno = EINVAL;
+        return_value = HIERONYMUS_ERROR(err_codec, "codec_decompress_file");
+        goto out;
+    }
+
+    header.dictionary[MAX_DICTIONARY_NAME - 1] = '\0';
+
+    if (header.dictionary[0] != '\0'
+            && (job.dictionary = find_dictionary(header.dictionary,
+                    header.level)) == NULL) {
+        errno = ENOENT;
+        return_value = HIERONYMUS_ERROR(err_codec, "codec_decompress_file");
+        goto out;
+    }
+
+    job.input = (unsigned char *) checked_malloc(
+            compress_bound(header.codec, header.frame_size));
+    job.output = (unsigned char *) checked_malloc(header.frame_size);
+
+    for (i = 0; i < header.num_frames; i++) {
+        if (read_all(source_fd, &job.frame, sizeof(codec_frame)) < 0
+                || job.frame.original_length > header.frame_size
+                || job.frame.length > compress_bound(header.codec,
+                    header.frame_size)
+                || (job.frame.stored
+                    && job.frame.length != job.frame.original_length)
+                || read_all(source_fd, job.input, job.frame.length) < 0) {
+            errno = EINVAL;
+            return_value = HIERONYMUS_ERROR(err_codec,
+                    "codec_decompress_file");
+            break;
+        }
+
+        job.input_length = job.frame.length;
+        job.output_size = job.frame.original_length;
+
+        start = cpu_time_ns();
+
+        if (job.frame.stored) {
+            memcpy(job.output, job.input, job.frame.length);
+        } else if (decompress_frame(&job, header.codec) < 0) {
+            errno = EINVAL;
+            return_value = HIERONYMUS_ERROR(err_codec,
+                    "codec_decompress_file");
+            break;
+        }
+
+        __sync_fetch_and_add(&codecs.statistics[header.codec].decompress_ns,
+                cpu_time_ns() - start);
+
+        if (simd_crc32c(0, job.output, job.output_size)
+                != job.frame.checksum) {
+            errno = EIO;
+            return_value = HIERONYMUS_ERROR(err_codec,
+                    "codec_decompress_file");
+            break;
+        }
+
+        if (write_all(dest_fd, job.output, job.output_size) < 0) {
+            return_value = HIERONYMUS_ERROR(err_codec,
+                    "codec_decompress_file");
+            break;
+        }
+
+        written += job.output_size;
+    }
+
+    if (return_value == 0 && written != header.original_size) {
+        errno = EINVAL;
+        return_value = HIERONYMUS_ERROR(err_codec, "codec_decompress_file");
+    }
+
+out:
+    if (dest_fd >= 0 && dest_fd != STDOUT_FILENO) {
+        close(dest_fd);
+    }
+
+    close(source_fd);
+    free(job.input);
+    free(job.output);
+
+    return return_value;
+}
+
+static void compress_file_task(void *argument)
+{
+    char *path = (char *) argument;
+    codec_choice choice;
+
+    codec_select(path, &choice);
+    codec_compress_file(path, &choice);
+
+    free(path);
+}
+
+/**
+ * Compress the file at path in the background, with the codec selected for
+ * its name.
+ */
+void codec_compress_async(const char *path)
+{
+    char *argument = NULL;
+
+    if (!codecs.enabled) {
+        return;
+    }
+
+    pthread_once(&background_once, init_background);
+
+    argument = (char *) checked_malloc(strlen(path) + 1);
+    strcpy(argument, path);
+
+    thread_pool_submit(thread_pool_shared(), &codecs.background,
+            compress_file_task, argument);
+}
+
+/**
+ * Return whether an entry of a snapshot directory is a stored version that can
+ * be compressed (block versioning data is read in place and left alone).
+ */
+int codec_sealable(const char *name)
+{
+    size_t length = strlen(name);
+
+    if (name[0] == '.') {
+        return 0;
+    }
+
+    if (length >= strlen(BLOCK_MAP_SUFFIX) && strcmp(name + length
+                - strlen(BLOCK_MAP_SUFFIX), BLOCK_MAP_SUFFIX) == 0) {
+        return 0;
+    }
+
+    return !(length >= strlen(BLOCK_STORE_SUFFIX) && strcmp(name + length
+                - strlen(BLOCK_STORE_SUFFIX), BLOCK_STORE_SUFFIX) == 0);
+}
+
+static void seal_snapshot_task(void *argument)
+{
+    char *directory = (char *) argument;
+    struct dirent *entry = NULL;
+    codec_choice choice;
+    char path[PATH_MAX];
+    DIR *snapshot = opendir(directory);
+
+    if (snapshot == NULL) {
+        HIERONYMUS_ERROR(err_codec, "seal_snapshot_task");
+        free(directory);
+        return;
+    }
+
+    while ((entry = readdir(snapshot)) != NULL) {
+        if (!codec_sealable(entry->d_name)) {
+            continue;
+        }
+
+        snprintf(path, PATH_MAX, "%s/%s", directory, entry->d_name);
+        codec_select(path, &choice);
+        codec_compress_file(path, &choice);
+    }
+
+    closedir(snapshot);
+    free(directory);
+}
+
+/**
+ * Compress the snapshot copies in a snapshot directory that was superseded by
+ * a newer one, in the background.
+ */
+void codec_seal_snapshot(const char *directory)
+{
+    char *argument = NULL;
+
+    if (!codecs.enabled) {
+        return;
+    }
+
+    pthread_once(&background_once, init_background);
+
+    argument = (char *) checked_malloc(strlen(directory) + 1);
+    strcpy(argument, directory);
+
+    thread_pool_submit(thread_pool_shared(), &codecs.background,
+            seal_snapshot_task, argument);
+}
+
+/**
+ * Wait for all background compression to finish.
+ */
+void codec_drain(void)
+{
+    if (!codecs.enabled) {
+        return;
+    }
+
+    pthread_once(&background_once, init_background);
+    pool_group_wait(thread_pool_shared(), &codecs.background);
+}
+
+/**
+ * Print the counters of every codec that was used as JSON, one line each.
+ */
+void codec_print_statistics(FILE *stream)
+{
+    codec_statistics *statistics = NULL;
+    int i = 0;
+
+    for (i = codec_none + 1; i < num_codecs; i++) {
+        statistics = &codecs.statistics[i];
+
+        if (statistics->files == 0 && statistics->decompress_ns == 0) {
+            continue;
+        }
+
+        fprintf(stream, "{\"codec\": \"%s\", \"files\": %llu, "
+                "\"bytes_in\": %llu, \"bytes_out\": %llu, \"ratio\": %.3f, "
+                "\"compress_cpu_ms\": %.3f, \"decompress_cpu_ms\": %.3f}\n",
+                codec_names[i], statistics->files, statistics->bytes_in,
+                statistics->bytes_out, statistics->bytes_out > 0 ?
+                (double) statistics->bytes_in / statistics->bytes_out : 0.0,
+                statistics->compress_ns / 1e6,
+                statistics->decompress_ns / 1e6);
+    }
+}
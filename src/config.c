@@ -0,0 +1,344 @@
+/******************************************************************************
+ *
+ * file   : config.c
+ *
+ * author : Tim van Deurzen
+ * date   : 18/10/2026
+ *
+ * The runtime configuration of a mount, changed on a live mount through the
+ * control file '/.hieronymus/ctl' (see control.c):
+ *
+ *     ``echo max_num_versions=32 threads=4 > /mnt/.hieronymus/ctl''
+ *     ``cat /mnt/.hieronymus/ctl''
+ *
+ *     versioning=0|1           create versions of written files (only with
+ *                              -D_VERSIONING, removed and renamed files are
+ *                              always kept)
+ *     max_num_versions=<n>     patches per snapshot before a new snapshot
+ *     log_level=<n>            0 quiet, 1 errors, 2 errors and operations
+ *     negative_ttl=<seconds>   time failed lookups are cached, 0 disables
+ *     negative_cache_size=<n>  entries of the negative cache, a power of two
+ *     pack_threshold=<bytes>   largest stored version that is packed
+ *     threads=<n>              workers of the shared pool, 0 is one per
+ *                              processor
+ *     journal_sync_interval=<milliseconds>
+ *     vstate_max_files=<n>     versioned files kept in memory when no writer
+ *                              uses them
+ *
+ * The configuration is read on hot paths without taking a lock. It is never
+ * changed in place: an update copies the current configuration, applies all
+ * its assignments to the copy and publishes the copy with a single pointer
+ * store, so a reader sees either all of an update or none of it. A reader may
+ * still use the configuration it loaded before an update, replaced
+ * configurations are therefore only freed when the mount ends.
+ *
+ * The settings that live in other modules (the pool, the negative cache, the
+ * packer) are handed to them after the new configuration is published.
+ *
+ * The number of buckets and locks of the tables of the versioning state (see
+ * vstate.c) stay fixed: writers keep pointers to entries and locks across
+ * operations, rehashing them would mean stopping every writer. The number of
+ * files those tables keep is a setting.
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "fuse_main.h"
+#include "journal.h"
+#include "negative_cache.h"
+#include "thread_pool.h"
+#include "pack.h"
+#include "vstate.h"
+#include "error.h"
+#include "util.h"
+
+/*
+ * A configuration that was replaced, kept until the mount ends.
+ */
+typedef struct CONFIG_RETIRED {
+    hieronymus_config *config;
+    struct CONFIG_RETIRED *next;
+} config_retired;
+
+static hieronymus_config defaults = {
+    .generation = 0,
+    .versioning = 1,
+    .max_num_versions = MAX_NUM_VERSIONS,
+    .log_level = log_operations,
+    .negative_ttl = 0,
+    .negative_cache_size = NEGATIVE_CACHE_SIZE,
+    .pack_threshold = PACK_THRESHOLD,
+    .threads = 0,
+    .journal_sync_interval = JOURNAL_SYNC_INTERVAL,
+    .vstate_max_files = VSTATE_MAX_FILES
+};
+
+static struct {
+    hieronymus_config *volatile current;
+    config_retired *retired;
+    pthread_mutex_t lock;
+} configuration = {
+    .current = &defaults,
+    .retired = NULL,
+    .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+/**
+ * The current configuration. The pointer is valid until the mount ends.
+ */
+const hieronymus_config *config_get(void)
+{
+    return configuration.current;
+}
+
+static int parse_integer(const char *value, long minimum, long maximum,
+        long *number)
+{
+    char *end = NULL;
+
+    errno = 0;
+    *number = strtol(value, &end, 10);
+
+    return errno != 0 || end == value || *end != '\0' || *number < minimum
+        || *number > maximum ? -1 : 0;
+}
+
+/**
+ * Apply one assignment to a configuration that is not published yet.
+ */
+static int assign(hieronymus_config *config, const char *key, size_t length,
+        const char *value)
+{
+    unsigned long long bytes = 0;
+    double seconds = 0;
+    char *end = NULL;
+    long number = 0;
+
+#define KEY(name) (length == strlen(name) && strncmp(key, name, length) == 0)
+
+    if (KEY("versioning")) {
+        if (parse_integer(value, 0, 1, &number) < 0) {
+            return -1;
+        }
+
+        config->versioning = number;
+    } else if (KEY("max_num_versions")) {
+        if (parse_integer(value, 1, 1L << 20, &number) < 0) {
+            return -1;
+        }
+
+        config->max_num_versions = number;
+    } else if (KEY("log_level")) {
+        if (parse_integer(value, log_quiet, log_operations, &number) < 0) {
+            return -1;
+        }
+
+        config->log_level = number;
+    } else if (KEY("negative_ttl")) {
+        seconds = strtod(value, &end);
+
+        if (end == value || *end != '\0' || seconds < 0) {
+            return -1;
+        }
+
+        config->negative_ttl = seconds;
+    } else if (KEY("negative_cache_size")) {
+        if (parse_integer(value, NEGATIVE_CACHE_WAYS, NEGATIVE_CACHE_MAX_SIZE,
+                    &number) < 0 || (number & (number - 1)) != 0) {
+            return -1;
+        }
+
+        config->negative_cache_size = number;
+    } else if (KEY("pack_threshold")) {
+        errno = 0;
+        bytes = strtoull(value, &end, 10);
+
+        if (errno != 0 || end == value || *end != '\0' || bytes == 0) {
+            return -1;
+        }
+
+        config->pack_threshold = bytes;
+    } else if (KEY("threads")) {
+        if (parse_integer(value, 0, MAX_POOL_THREADS, &number) < 0) {
+            return -1;
+        }
+
+        config->threads = number;
+    } else if (KEY("journal_sync_interval")) {
+        if (parse_integer(value, 1, 60 * 60 * 1000, &number) < 0) {
+            return -1;
+        }
+
+        config->journal_sync_interval = number;
+    } else if (KEY("vstate_max_files")) {
+        if (parse_integer(value, 0, LONG_MAX, &number) < 0) {
+            return -1;
+        }
+
+        config->vstate_max_files = number;
+    } else {
+        return -1;
+    }
+
+#undef KEY
+
+    return 0;
+}
+
+/**
+ * Hand the settings of a new configuration that live elsewhere to their
+ * modules. Called with the configuration lock held.
+ */
+static void apply_locked(const hieronymus_config *old,
+        const hieronymus_config *new)
+{
+    if (new->negative_ttl != old->negative_ttl) {
+        negative_cache_configure(new->negative_ttl);
+    }
+
+    if (new->negative_cache_size != old->negative_cache_size) {
+        negative_cache_resize(new->negative_cache_size);
+    }
+
+    if (new->pack_threshold != old->pack_threshold) {
+        pack_configure(new->pack_threshold);
+    }
+
+    if (new->threads != old->threads) {
+        thread_pool_resize(thread_pool_shared(), new->threads > 0
+                ? new->threads : sysconf(_SC_NPROCESSORS_ONLN));
+    }
+}
+
+/**
+ * Apply 'key=value' assignments, separated by blanks or newlines, as a whole:
+ * if any assignment is not understood nothing changes (and errno is EINVAL).
+ * Lines starting with '#' are ignored, so what config_print printed can be
+ * written back.
+ */
+int config_update(const char *assignments)
+{
+    hieronymus_config *config = NULL;
+    hieronymus_config *old = NULL;
+    config_retired *retired = NULL;
+    char value[CONFIG_MAX_VALUE];
+    const char *term = assignments;
+    const char *equals = NULL;
+    size_t length = 0;
+    int return_value = 0;
+
+    config = (hieronymus_config *) checked_malloc(sizeof(hieronymus_config));
+
+    pthread_mutex_lock(&configuration.lock);
+
+    old = configuration.current;
+    *config = *old;
+
+    while (return_value == 0 && *term != '\0') {
+        term += strspn(term, " \t\r\n");
+
+        if (*term == '#') {
+            term += strcspn(term, "\r\n");
+            continue;
+        }
+
+        if (*term == '\0') {
+            break;
+        }
+
+        length = strcspn(term, " \t\r\n");
+        equals = memchr(term, '=', length);
+
+        if (equals == NULL || (size_t) (term + length - equals)
+                > sizeof(value)) {
+            return_value = -1;
+            break;
+        }
+
+        memcpy(value, equals + 1, term + length - equals - 1);
+        value[term + length - equals - 1] = '\0';
+        return_value = assign(config, term, equals - term, value);
+        term += length;
+    }
+
+    if (return_value < 0) {
+        pthread_mutex_unlock(&configuration.lock);
+        free(config);
+        errno = EINVAL;
+
+        return -1;
+    }
+
+    config->generation = old->generation + 1;
+
+    /*
+     * The configuration is complete before it is published.
+     */
+    __sync_synchronize();
+    configuration.current = config;
+
+    apply_locked(old, config);
+
+    if (old != &defaults) {
+        retired = (config_retired *) checked_malloc(sizeof(config_retired));
+        retired->config = old;
+        retired->next = configuration.retired;
+        configuration.retired = retired;
+    }
+
+    pthread_mutex_unlock(&configuration.lock);
+
+    return 0;
+}
+
+/**
+ * Print a configuration as assignments config_update understands.
+ */
+int config_print(const hieronymus_config *config, FILE *output)
+{
+    fprintf(output, "# generation %lu\n", config->generation);
+    fprintf(output, "versioning=%d\n", config->versioning);
+    fprintf(output, "max_num_versions=%d\n", config->max_num_versions);
+    fprintf(output, "log_level=%d\n", config->log_level);
+    fprintf(output, "negative_ttl=%g\n", config->negative_ttl);
+    fprintf(output, "negative_cache_size=%lu\n", config->negative_cache_size);
+    fprintf(output, "pack_threshold=%llu\n", config->pack_threshold);
+    fprintf(output, "threads=%d\n", config->threads);
+    fprintf(output, "journal_sync_interval=%u\n",
+            config->journal_sync_interval);
+    fprintf(output, "vstate_max_files=%lu\n", config->vstate_max_files);
+
+    return ferror(output) ? -1 : 0;
+}
+
+/**
+ * Free all configurations but the defaults, called when the mount ends.
+ */
+void config_destroy(void)
+{
+    config_retired *retired = NULL;
+
+    pthread_mutex_lock(&configuration.lock);
+
+    while (configuration.retired != NULL) {
+        retired = configuration.retired;
+        configuration.retired = retired->next;
+        free(retired->config);
+        free(retired);
+    }
+
+    if (configuration.current != &defaults) {
+        free(configuration.current);
+        configuration.current = &defaults;
+    }
+
+    pthread_mutex_unlock(&configuration.lock);
+}
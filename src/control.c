@@ -0,0 +1,316 @@
+/******************************************************************************
+ *
+ * file   : control.c
+ *
+ * author : Tim van Deurzen
+ * date   : 18/10/2026
+ *
+ * The control files of a mount, in the virtual directory '/.hieronymus'.
+ *
+ * A control file is opened, a request is written to it and the response is
+ * read back through the same descriptor, e.g.
+ *
+ *     ``exec 3<> /mnt/.hieronymus/versions; echo path=/a >&3; cat <&3''
+ *
+ * The response is read from the offset of the first read after the request
+ * on, so it does not matter where the request left the file offset. Reading
+ * a control file without writing a request answers the empty request. A
+ * request that is not read back is answered when the file is closed, so
+ * ``echo threads=4 > /mnt/.hieronymus/ctl'' takes effect (and a bad request
+ * fails the close). The files are opened with direct I/O, so their (unknown)
+ * size does not matter.
+ *
+ *     ctl          the runtime configuration, see config.c
+ *     versions     queries on the version index, see vquery.c
+ *                  (with -D_VERSION_INDEX)
+ *
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "config.h"
+#include "control.h"
+#include "error.h"
+#include "util.h"
+#include "vindex.h"
+#include "vquery.h"
+
+/**
+ * Apply the assignments of the request to the runtime configuration and print
+ * the resulting configuration. The empty request only prints it.
+ */
+static int answer_ctl(const char *request, FILE *output)
+{
+    if (request[strspn(request, " \t\r\n")] != '\0'
+            && config_update(request) < 0) {
+        return -1;
+    }
+
+    return config_print(config_get(), output);
+}
+
+#ifdef _VERSION_INDEX
+/**
+ * Answer a query on the version index of the mount. The empty request lists
+ * the first page of versions of all files.
+ */
+static int answer_versions(const char *request, FILE *output)
+{
+    vindex *index = vindex_mounted();
+    vquery query;
+    vquery_result result;
+
+    if (index == NULL) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    vquery_init(&query);
+
+    if (vquery_parse(&query, request) < 0
+            || vquery_run(index, &query, &result) < 0) {
+        return -1;
+    }
+
+    vquery_print(&query, &result, output);
+    vquery_free(&result);
+
+    return 0;
+}
+#endif
+
+static const control_file control_files[] = {
+    { "ctl", S_IFREG | 0666, answer_ctl },
+#ifdef _VERSION_INDEX
+    { "versions", S_IFREG | 0666, answer_versions },
+#endif
+    { NULL, 0, NULL }
+};
+
+/**
+ * Check whether a path in the mount point is a control file. Returns the
+ * number of the file plus one, 0 for the control directory itself and -1 for
+ * any other path.
+ */
+int control_path(const char *path)
+{
+    size_t length = sizeof(CONTROL_DIRECTORY) - 1;
+    int i = 0;
+
+    if (strncmp(path, CONTROL_DIRECTORY, length) != 0) {
+        return -1;
+    }
+
+    if (path[length] == '\0') {
+        return 0;
+    }
+
+    if (path[length] != '/') {
+        return -1;
+    }
+
+    for (i = 0; control_files[i].name != NULL; i++) {
+        if (strcmp(path + length + 1, control_files[i].name) == 0) {
+            return i + 1;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * The name of control file i (counting from 0), NULL past the last one.
+ */
+const char *control_name(int i)
+{
+    return control_files[i].name;
+}
+
+int control_getattr(const char *path, struct stat *stat_buffer)
+{
+    int file = control_path(path);
+
+    if (file < 0) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    memset(stat_buffer, 0, sizeof(struct stat));
+    stat_buffer->st_uid = getuid();
+    stat_buffer->st_gid = getgid();
+    stat_buffer->st_mtime = time(NULL);
+    stat_buffer->st_atime = stat_buffer->st_mtime;
+    stat_buffer->st_ctime = stat_buffer->st_mtime;
+
+    if (file == 0) {
+        stat_buffer->st_mode = S_IFDIR | 0555;
+        stat_buffer->st_nlink = 2;
+    } else {
+        stat_buffer->st_mode = control_files[file - 1].mode;
+        stat_buffer->st_nlink = 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Open a control file, NULL (with errno set) if path is not one.
+ */
+control_state *control_open(const char *path)
+{
+    control_state *state = NULL;
+    int file = control_path(path);
+
+    if (file <= 0) {
+        errno = file == 0 ? EISDIR : ENOENT;
+        return NULL;
+    }
+
+    state = (control_state *) checked_malloc(sizeof(control_state));
+    memset(state, 0, sizeof(control_state));
+    state->file = &control_files[file - 1];
+    pthread_mutex_init(&state->lock, NULL);
+
+    return state;
+}
+
+/**
+ * Answer the request written so far, called with the state locked.
+ */
+static int answer_locked(control_state *state)
+{
+    FILE *output = NULL;
+    int return_value = 0;
+
+    free(state->response);
+    state->response = NULL;
+    state->response_length = 0;
+
+    if ((output = open_memstream(&state->response,
+                    &state->response_length)) == NULL) {
+        return -1;
+    }
+
+    return_value = state->file->answer(state->request != NULL
+            ? state->request : "", output);
+
+    if (fclose(output) != 0) {
+        return_value = -1;
+    }
+
+    state->request_length = 0;
+    state->answered = 1;
+    state->positioned = 0;
+
+    return return_value;
+}
+
+/**
+ * Read the response to the request written before. The first read after a
+ * request answers it, its offset is where the response starts.
+ */
+int control_read(control_state *state, char *buffer, size_t size,
+        off_t offset)
+{
+    int return_value = 0;
+
+    pthread_mutex_lock(&state->lock);
+
+    if (!state->answered && answer_locked(state) < 0) {
+        return_value = HIERONYMUS_ERROR(err_control, "control_read");
+    }
+
+    if (!state->positioned) {
+        state->response_offset = offset;
+        state->positioned = 1;
+    }
+
+    offset -= state->response_offset;
+
+    if (return_value == 0 && offset >= 0
+            && (size_t) offset < state->response_length) {
+        if (size > state->response_length - offset) {
+            size = state->response_length - offset;
+        }
+
+        memcpy(buffer, state->response + offset, size);
+        return_value = size;
+    }
+
+    pthread_mutex_unlock(&state->lock);
+
+    return return_value;
+}
+
+/**
+ * Append to the request. A write after the response was read starts a new
+ * request. The offset is ignored, requests are written in one go.
+ */
+int control_write(control_state *state, const char *buffer, size_t size,
+        off_t offset)
+{
+    char *grown = NULL;
+    int return_value = size;
+
+    (void) offset;
+
+    pthread_mutex_lock(&state->lock);
+
+    state->answered = 0;
+
+    if (state->request_length + size >= CONTROL_MAX_REQUEST) {
+        errno = EFBIG;
+        return_value = HIERONYMUS_ERROR(err_control, "control_write");
+    } else if ((grown = (char *) realloc(state->request,
+                    state->request_length + size + 1)) == NULL) {
+        return_value = HIERONYMUS_ERROR(err_malloc, "control_write");
+    } else {
+        state->request = grown;
+        memcpy(state->request + state->request_length, buffer, size);
+        state->request_length += size;
+        state->request[state->request_length] = '\0';
+    }
+
+    pthread_mutex_unlock(&state->lock);
+
+    return return_value;
+}
+
+/**
+ * Answer a request that was written but not read back, called when a
+ * descriptor of the file is closed.
+ */
+int control_flush(control_state *state)
+{
+    int return_value = 0;
+
+    pthread_mutex_lock(&state->lock);
+
+    if (!state->answered && state->request_length > 0
+            && answer_locked(state) < 0) {
+        return_value = HIERONYMUS_ERROR(err_control, "control_flush");
+    }
+
+    pthread_mutex_unlock(&state->lock);
+
+    return return_value;
+}
+
+void control_release(control_state *state)
+{
+    if (state == NULL) {
+        return;
+    }
+
+    pthread_mutex_destroy(&state->lock);
+    free(state->request);
+    free(state->response);
+    free(state);
+}
@@ -0,0 +1,303 @@
+/******************************************************************************
+ *
+ * file   : dedup.c
+ *
+ * author : Tim van Deurzen
+ * date   : 18/10/2026
+ *
+ * Deduplication of whole-file versions (with -D_DEDUP).
+ *
+ * Before a version of a written file is created, the SHA-1 digest of its
+ * contents is compared with the digest of its latest version, kept in the
+ * extended attribute DEDUP_ATTRIBUTE of the file in the root directory. A
+ * file that was rewritten with the same contents gets no new version. The
+ * attribute moves along when the file is renamed; a file system without
+ * extended attributes only loses this check.
+ *
+ * Snapshot copies with the same contents, of the same file or of different
+ * files, share one blob: the copy is a hard link to
+ *
+ *     ``<root>/.version/.blobs/<first two hex digits>/<rest of the digest>''
+ *
+ * so the link count of a blob is its reference count. A blob only linked
+ * from the blob store is no longer referenced (its versions were compressed,
+ * packed or removed) and is removed by dedup_prune ('h_vtool prune-blobs').
+ * Patches depend on their snapshot copy and are not shared.
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+
+#include "dedup.h"
+#include "sha1.h"
+#include "fuse_main.h"
+#include "error.h"
+#include "util.h"
+
+static dedup_statistics statistics;
+
+/**
+ * Compute the SHA-1 digest of the contents of a file.
+ */
+int dedup_digest_file(const char *path, unsigned char *digest)
+{
+    unsigned char *buffer = NULL;
+    sha1_context context;
+    ssize_t length = 0;
+    int fd = -1;
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        return HIERONYMUS_ERROR(err_open, "dedup_digest_file");
+    }
+
+    buffer = (unsigned char *) checked_malloc(DEDUP_BUFFER_SIZE);
+    sha1_starts(&context);
+
+    while ((length = read(fd, buffer, DEDUP_BUFFER_SIZE)) > 0) {
+        sha1_update(&context, buffer, length);
+    }
+
+    sha1_finish(&context, digest);
+    free(buffer);
+    close(fd);
+
+    if (length < 0) {
+        return HIERONYMUS_ERROR(err_read, "dedup_digest_file");
+    }
+
+    return 0;
+}
+
+/**
+ * Return whether the latest version of a file has the given digest.
+ */
+int dedup_unchanged(const char *path, const unsigned char *digest)
+{
+    unsigned char latest[SHA1_LENGTH];
+
+    if (lgetxattr(path, DEDUP_ATTRIBUTE, latest, SHA1_LENGTH) != SHA1_LENGTH
+            || memcmp(latest, digest, SHA1_LENGTH) != 0) {
+        return 0;
+    }
+
+    __sync_fetch_and_add(&statistics.unchanged, 1);
+
+    return 1;
+}
+
+/**
+ * Remember the digest of the version of a file that was just created.
+ */
+int dedup_remember(const char *path, const unsigned char *digest)
+{
+    if (lsetxattr(path, DEDUP_ATTRIBUTE, digest, SHA1_LENGTH, 0) < 0) {
+        return HIERONYMUS_EXPECTED_ERROR(err_setxattr, "dedup_remember",
+                errno == ENOTSUP);
+    }
+
+    return 0;
+}
+
+/**
+ * Copy the path of the blob with the given digest to path, fails with
+ * ENAMETOOLONG if it does not fit.
+ */
+static int blob_path(const char *root, const unsigned char *digest,
+        char *path)
+{
+    char hex[2 * SHA1_LENGTH + 1];
+    int length = 0;
+    int i = 0;
+
+    for (i = 0; i < SHA1_LENGTH; i++) {
+        sprintf(hex + 2 * i, "%02x", digest[i]);
+    }
+
+    length = snprintf(path, PATH_MAX, "%s%s/%.2s/%s", root,
+            DEDUP_BLOB_DIRECTORY, hex, hex + 2);
+
+    if (length < 0 || length >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Store a copy of a file with the given digest at stored_path: a link to the
+ * blob with that digest if there is one, otherwise a copy that becomes the
+ * blob.
+ */
+int dedup_store_copy(const char *path, const char *stored_path,
+        const unsigned char *digest)
+{
+    char blob[PATH_MAX];
+    char *slash = NULL;
+    struct stat stat_buffer;
+
+    if (blob_path(ADMIN->root_directory, digest, blob) < 0) {
+        return copy(path, stored_path);
+    }
+
+    if (link(blob, stored_path) == 0) {
+        __sync_fetch_and_add(&statistics.shared, 1);
+
+        if (stat(stored_path, &stat_buffer) == 0) {
+            __sync_fetch_and_add(&statistics.bytes_saved, stat_buffer.st_size);
+        }
+
+        return 0;
+    }
+
+    /*
+     * Never copy into an existing stored version, it may share a blob.
+     */
+    unlink(stored_path);
+
+    if (copy(path, stored_path) < 0) {
+        return -1;
+    }
+
+    /*
+     * Failing to add the blob only costs sharing, the copy is stored. The
+     * directories of the blob store are made on demand (by whichever thread
+     * gets there first).
+     */
+    slash = strrchr(blob, '/');
+    *slash = '\0';
+
+    if (mkdir(blob, S_IRWXU) < 0 && errno == ENOENT) {
+        *strrchr(blob, '/') = '\0';
+        mkdir(blob, S_IRWXU);
+        blob[strlen(blob)] = '/';
+        mkdir(blob, S_IRWXU);
+    }
+
+    *slash = '/';
+
+    if (link(stored_path, blob) == 0) {
+        __sync_fetch_and_add(&statistics.stored, 1);
+    } else if (errno != EEXIST) {
+        HIERONYMUS_EXPECTED_ERROR(err_create, "dedup_store_copy",
+                errno == EMLINK || errno == EXDEV);
+    }
+
+    return 0;
+}
+
+/**
+ * Remove the blobs of a root directory that no version links to any more.
+ * Returns the number of blobs removed.
+ */
+int dedup_prune(const char *root)
+{
+    char directory[PATH_MAX];
+    char path[PATH_MAX];
+    struct dirent *prefix = NULL;
+    struct dirent *entry = NULL;
+    struct stat stat_buffer;
+    DIR *blobs = NULL;
+    DIR *bucket = NULL;
+    int removed = 0;
+    int length = 0;
+
+    length = snprintf(directory, PATH_MAX, "%s%s", root,
+            DEDUP_BLOB_DIRECTORY);
+
+    if (length < 0 || length >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return HIERONYMUS_ERROR(err_opendir, "dedup_prune");
+    }
+
+    if ((blobs = opendir(directory)) == NULL) {
+        return errno == ENOENT ? 0
+            : HIERONYMUS_ERROR(err_opendir, "dedup_prune");
+    }
+
+    while ((prefix = readdir(blobs)) != NULL) {
+        if (prefix->d_name[0] == '.') {
+            continue;
+        }
+
+        length = snprintf(path, PATH_MAX, "%s/%s", directory, prefix->d_name);
+
+        if (length < 0 || length >= PATH_MAX
+                || (bucket = opendir(path)) == NULL) {
+            continue;
+        }
+
+        while ((entry = readdir(bucket)) != NULL) {
+            if (entry->d_name[0] == '.') {
+                continue;
+            }
+
+            length = snprintf(path, PATH_MAX, "%s/%s/%s", directory,
+                    prefix->d_name, entry->d_name);
+
+            if (length < 0 || length >= PATH_MAX) {
+                continue;
+            }
+
+            if (lstat(path, &stat_buffer) == 0 && stat_buffer.st_nlink == 1
+                    && unlink(path) == 0) {
+                removed++;
+            }
+        }
+
+        closedir(bucket);
+    }
+
+    closedir(blobs);
+
+    return removed;
+}
+
+/**
+ * Return whether an extended attribute is kept by Hieronymus itself.
+ */
+int dedup_hidden_attribute(const char *name)
+{
+    return strcmp(name, DEDUP_ATTRIBUTE) == 0;
+}
+
+/**
+ * Remove the hidden attributes from a list of attribute names, returns the
+ * new length of the list.
+ */
+int dedup_filter_attributes(char *list, int length)
+{
+    char *name = list;
+    size_t size = 0;
+
+    while (name < list + length) {
+        size = strlen(name) + 1;
+
+        if (dedup_hidden_attribute(name)) {
+            memmove(name, name + size, list + length - name - size);
+            length -= size;
+        } else {
+            name += size;
+        }
+    }
+
+    return length;
+}
+
+void dedup_print_statistics(FILE *stream)
+{
+    fprintf(stream, "{\"dedup\": {\"unchanged\": %llu, \"shared\": %llu, "
+            "\"stored\": %llu, \"bytes_saved\": %llu}}\n",
+            statistics.unchanged, statistics.shared, statistics.stored,
+            statistics.bytes_saved);
+}
@@ -0,0 +1,760 @@
+/******************************************************************************
+ *
+ * file   : delta.c
+ *
+ * author : Tim van Deurzen
+ * date   : 18/10/2026
+ *
+ * Native delta engine for large files.
+ *
+ * The new file is split in segments of DELTA_SEGMENT_SIZE bytes that are
+ * encoded independently on the shared thread pool. A segment that is identical
+ * to the same range of the old file is only recorded in the segment table. The
+ * other segments are encoded as copy / insert instructions against a window of
+ * the old file around the same range, found with a rolling hash over blocks of
+ * DELTA_BLOCK_SIZE bytes. If that does not pay off the segment is stored as is.
+ *
+ * Encoding keeps at most DELTA_SEGMENTS_PER_THREAD segments per pool thread in
+ * memory, the segment table is written after all payloads. Decoding maps the
+ * output file and fills every segment in parallel, checking each against the
+ * CRC32C recorded in the segment table.
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "delta.h"
+#include "thread_pool.h"
+#include "simd.h"
+#include "error.h"
+#include "util.h"
+
+/*
+ * A file mapped for reading.
+ */
+typedef struct DELTA_MAP {
+    int fd;
+    unsigned char *data;
+    uint64_t size;
+} delta_map;
+
+/*
+ * Encoding state of a segment of the new file.
+ */
+typedef struct DELTA_ENCODE_JOB {
+    const delta_map *old_file;
+    const delta_map *new_file;
+    uint64_t start;
+    uint64_t length;
+    uint32_t type;
+    uint32_t checksum;
+    unsigned char *payload;
+    uint64_t payload_length;
+    uint64_t payload_size;
+} delta_encode_job;
+
+/*
+ * Decoding state of a segment of the new file.
+ */
+typedef struct DELTA_DECODE_JOB {
+    const delta_map *old_file;
+    const delta_map *patch;
+    const delta_segment *segment;
+    unsigned char *output;
+    uint64_t start;
+    uint64_t length;
+    int failed;
+} delta_decode_job;
+
+/*
+ * Entry of the hash table over the blocks of the old window.
+ */
+typedef struct DELTA_BLOCK {
+    uint32_t hash;
+    uint64_t offset;
+} delta_block;
+
+static int map_file(const char *path, delta_map *map)
+{
+    struct stat file_stat;
+
+    map->data = NULL;
+    map->size = 0;
+
+    if ((map->fd = open(path, O_RDONLY)) < 0) {
+        return -1;
+    }
+
+    if (fstat(map->fd, &file_stat) < 0) {
+        close(map->fd);
+        return -1;
+    }
+
+    map->size = file_stat.st_size;
+
+    if (map->size == 0) {
+        return 0;
+    }
+
+    map->data = mmap(NULL, map->size, PROT_READ, MAP_PRIVATE, map->fd, 0);
+
+    if (map->data == MAP_FAILED) {
+        map->data = NULL;
+        close(map->fd);
+        return -1;
+    }
+
+    madvise(map->data, map->size, MADV_SEQUENTIAL);
+
+    return 0;
+}
+
+static void unmap_file(delta_map *map)
+{
+    if (map->data != NULL) {
+        munmap(map->data, map->size);
+    }
+
+    close(map->fd);
+}
+
+/**
+ * Weak rolling checksum (as used by rsync) of a block.
+ */
+static uint32_t block_hash(const unsigned char *data, uint32_t *a, uint32_t *b)
+{
+    int i = 0;
+
+    *a = 0;
+    *b = 0;
+
+    for (i = 0; i < DELTA_BLOCK_SIZE; i++) {
+        *a += data[i];
+        *b += (DELTA_BLOCK_SIZE - i) * data[i];
+    }
+
+    return (*a & 0xffff) | (*b << 16);
+}
+
+/**
+ * Slide the checksum one byte: drop 'out', add 'in'.
+ */
+static uint32_t roll_hash(unsigned char out, unsigned char in,
+        uint32_t *a, uint32_t *b)
+{
+    *a += in - out;
+    *b += *a - DELTA_BLOCK_SIZE * out;
+
+    return (*a & 0xffff) | (*b << 16);
+}
+
+/**
+ * Slot of a checksum in the block table. The low half of the checksum is a sum
+ * of bytes and takes few distinct values, so it is mixed before masking.
+ */
+static uint64_t block_slot(uint32_t hash, uint64_t mask)
+{
+    return ((hash * 0x9e3779b97f4a7c15ULL) >> 32) & mask;
+}
+
+/**
+ * Make sure the payload of job has room for another size bytes.
+ */
+static void reserve_payload(delta_encode_job *job, uint64_t size)
+{
+    if (job->payload_length + size <= job->payload_size) {
+        return;
+    }
+
+    while (job->payload_length + size > job->payload_size) {
+        job->payload_size = job->payload_size ? job->payload_size * 2 : 4096;
+    }
+
+    job->payload = realloc(job->payload, job->payload_size);
+
+    if (job->payload == NULL) {
+        HIERONYMUS_ERROR(err_malloc, "reserve_payload");
+        abort();
+    }
+}
+
+static void add_instruction(delta_encode_job *job, uint32_t type,
+        uint64_t offset, uint32_t length, const unsigned char *data)
+{
+    delta_instruction instruction;
+
+    instruction.type = type;
+    instruction.length = length;
+    instruction.offset = offset;
+
+    reserve_payload(job, sizeof(instruction) + (data ? length : 0));
+
+    memcpy(job->payload + job->payload_length, &instruction,
+            sizeof(instruction));
+    job->payload_length += sizeof(instruction);
+
+    if (data != NULL) {
+        memcpy(job->payload + job->payload_length, data, length);
+        job->payload_length += length;
+    }
+}
+
+static void store_literal(delta_encode_job *job)
+{
+    job->type = segment_literal;
+    job->payload_length = 0;
+
+    reserve_payload(job, job->length);
+    memcpy(job->payload, job->new_file->data + job->start, job->length);
+    job->payload_length = job->length;
+}
+
+/**
+ * Encode a segment of the new file against the window of the old file around
+ * the same range.
+ */
+static void encode_segment(void *argument)
+{
+    delta_encode_job *job = (delta_encode_job *) argument;
+    const unsigned char *old = job->old_file->data;
+    const unsigned char *new = job->new_file->data + job->start;
+    uint64_t old_size = job->old_file->size;
+    uint64_t window_start = 0;
+    uint64_t window_end = 0;
+    uint64_t num_blocks = 0;
+    uint64_t table_size = 0;
+    uint64_t mask = 0;
+    uint64_t position = 0;
+    uint64_t literal = 0;
+    uint64_t offset = 0;
+    uint64_t slot = 0;
+    uint64_t match = 0;
+    uint64_t match_length = 0;
+    uint64_t extent = 0;
+    uint32_t hash = 0;
+    uint32_t a = 0;
+    uint32_t b = 0;
+    delta_block *table = NULL;
+
+    job->checksum = simd_crc32c(0, new, job->length);
+
+    if (job->start + job->length <= old_size
+            && simd_block_equal(old + job->start, new, job->length)) {
+        job->type = segment_same;
+        return;
+    }
+
+    window_start = job->start > DELTA_WINDOW_SLACK ?
+        job->start - DELTA_WINDOW_SLACK : 0;
+    window_end = job->start + job->length + DELTA_WINDOW_SLACK;
+
+    if (window_end > old_size) {
+        window_end = old_size;
+    }
+
+    if (window_start + DELTA_BLOCK_SIZE > window_end
+            || job->length < DELTA_BLOCK_SIZE) {
+        store_literal(job);
+        return;
+    }
+
+    num_blocks = (window_end - window_start) / DELTA_BLOCK_SIZE;
+
+    for (table_size = 1; table_size < 2 * num_blocks; table_size <<= 1);
+
+    mask = table_size - 1;
+    table = calloc(table_size, sizeof(delta_block));
+
+    if (table == NULL) {
+        HIERONYMUS_ERROR(err_malloc, "encode_segment");
+        abort();
+    }
+
+    /*
+     * Offsets are stored plus one, so zero marks an empty slot. Blocks with an
+     * equal checksum are kept once, the first one wins.
+     */
+    for (offset = window_start; offset + DELTA_BLOCK_SIZE <= window_end;
+            offset += DELTA_BLOCK_SIZE) {
+        hash = block_hash(old + offset, &a, &b);
+
+        for (slot = block_slot(hash, mask); table[slot].offset != 0
+                && table[slot].hash != hash; slot = (slot + 1) & mask);
+
+        if (table[slot].offset == 0) {
+            table[slot].hash = hash;
+            table[slot].offset = offset + 1;
+        }
+    }
+
+    hash = block_hash(new, &a, &b);
+
+    while (position + DELTA_BLOCK_SIZE <= job->length) {
+        match_length = 0;
+
+        for (slot = block_slot(hash, mask); table[slot].offset != 0;
+                slot = (slot + 1) & mask) {
+            if (table[slot].hash == hash) {
+                match = table[slot].offset - 1;
+
+                if (simd_block_equal(old + match, new + position,
+                            DELTA_BLOCK_SIZE)) {
+                    match_length = DELTA_BLOCK_SIZE;
+                }
+
+                break;
+            }
+        }
+
+        if (match_length == 0) {
+            if (position + DELTA_BLOCK_SIZE < job->length) {
+                hash = roll_hash(new[position],
+                        new[position + DELTA_BLOCK_SIZE], &a, &b);
+            }
+
+            position++;
+            continue;
+        }
+
+        /*
+         * Extend the match in both directions (backwards only into the
+         * pending literal data).
+         */
+        extent = job->length - position;
+
+        if (extent > old_size - match) {
+            extent = old_size - match;
+        }
+
+        if (extent > UINT32_MAX) {
+            extent = UINT32_MAX;
+        }
+
+        match_length = simd_mismatch(old + match, new + position, extent);
+
+        while (position > literal && match > 0 && match_length < UINT32_MAX
+                && new[position - 1] == old[match - 1]) {
+            position--;
+            match--;
+            match_length++;
+        }
+
+        if (position > literal) {
+            add_instruction(job, delta_insert, 0, position - literal,
+                    new + literal);
+        }
+
+        add_instruction(job, delta_copy, match, match_length, NULL);
+
+        position += match_length;
+        literal = position;
+
+        if (position + DELTA_BLOCK_SIZE <= job->length) {
+            hash = block_hash(new + position, &a, &b);
+        }
+    }
+
+    if (literal < job->length) {
+        add_instruction(job, delta_insert, 0, job->length - literal,
+                new + literal);
+    }
+
+    free(table);
+
+    if (job->payload_length >= job->length) {
+        store_literal(job);
+    } else {
+        job->type = segment_delta;
+    }
+}
+
+static int write_all(int fd, const void *buffer, uint64_t length)
+{
+    const unsigned char *data = (const unsigned char *) buffer;
+    ssize_t written = 0;
+
+    while (length > 0) {
+        if ((written = write(fd, data, length)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return -1;
+        }
+
+        data += written;
+        length -= written;
+    }
+
+    return 0;
+}
+
+/**
+ * Write a patch to patch_file that turns old_file into new_file.
+ */
+int delta_encode(const char *old_file, const char *new_file,
+        const char *patch_file)
+{
+    thread_pool *pool = thread_pool_shared();
+    pool_group group;
+    delta_map old_map;
+    delta_map new_map;
+    delta_header header;
+    delta_segment *segments = NULL;
+    delta_encode_job *jobs = NULL;
+    uint64_t payload_offset = 0;
+    uint32_t num_jobs = 0;
+    uint32_t batch_size = 0;
+    uint32_t first = 0;
+    uint32_t i = 0;
+    int patch_fd = -1;
+    int return_value = 0;
+
+    if (map_file(old_file, &old_map) < 0) {
+        return HIERONYMUS_ERROR(err_delta, "delta_encode");
+    }
+
+    if (map_file(new_file, &new_map) < 0) {
+        return_value = HIERONYMUS_ERROR(err_delta, "delta_encode");
+        unmap_file(&old_map);
+        return return_value;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DELTA_MAGIC, sizeof(header.magic));
+    header.segment_size = DELTA_SEGMENT_SIZE;
+    header.num_segments = (new_map.size + DELTA_SEGMENT_SIZE - 1)
+        / DELTA_SEGMENT_SIZE;
+    header.old_size = old_map.size;
+    header.new_size = new_map.size;
+
+    segments = calloc(header.num_segments + 1, sizeof(delta_segment));
+    num_jobs = (pool->limit > 0 ? pool->limit : 1)
+        * DELTA_SEGMENTS_PER_THREAD;
+    batch_size = num_jobs;
+    jobs = calloc(num_jobs, sizeof(delta_encode_job));
+
+    if (segments == NULL || jobs == NULL) {
+        HIERONYMUS_ERROR(err_malloc, "delta_encode");
+        abort();
+    }
+
+    patch_fd = open(patch_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (patch_fd < 0) {
+        return_value = HIERONYMUS_ERROR(err_delta, "delta_encode");
+        goto out;
+    }
+
+    payload_offset = sizeof(header)
+        + (uint64_t) header.num_segments * sizeof(delta_segment);
+
+    if (lseek(patch_fd, payload_offset, SEEK_SET) < 0) {
+        return_value = HIERONYMUS_ERROR(err_delta, "delta_encode");
+        goto out;
+    }
+
+    pool_group_init(&group);
+
+    for (first = 0; first < header.num_segments; first += batch_size) {
+        if (first + batch_size > header.num_segments) {
+            batch_size = header.num_segments - first;
+        }
+
+        for (i = 0; i < batch_size; i++) {
+            jobs[i].old_file = &old_map;
+            jobs[i].new_file = &new_map;
+            jobs[i].start = (uint64_t) (first + i) * DELTA_SEGMENT_SIZE;
+            jobs[i].length = new_map.size - jobs[i].start;
+            jobs[i].payload_length = 0;
+
+            if (jobs[i].length > DELTA_SEGMENT_SIZE) {
+                jobs[i].length = DELTA_SEGMENT_SIZE;
+            }
+
+            thread_pool_submit(pool, &group, encode_segment, &jobs[i]);
+        }
+
+        pool_group_wait(pool, &group);
+
+        /*
+         * Payloads are written in segment order, so the patch does not depend
+         * on which thread finished first.
+         */
+        for (i = 0; i < batch_size && return_value == 0; i++) {
+            segments[first + i].offset = payload_offset;
+            segments[first + i].length = jobs[i].payload_length;
+            segments[first + i].type = jobs[i].type;
+            segments[first + i].checksum = jobs[i].checksum;
+
+            if (jobs[i].type != segment_same && write_all(patch_fd,
+                        jobs[i].payload, jobs[i].payload_length) < 0) {
+                return_value = HIERONYMUS_ERROR(err_delta, "delta_encode");
+            }
+
+            payload_offset += jobs[i].payload_length;
+        }
+
+        if (return_value != 0) {
+            break;
+        }
+    }
+
+    pool_group_destroy(&group);
+
+    if (return_value == 0 && (pwrite(patch_fd, &header, sizeof(header), 0) < 0
+                || pwrite(patch_fd, segments, (uint64_t) header.num_segments
+                    * sizeof(delta_segment), sizeof(header)) < 0)) {
+        return_value = HIERONYMUS_ERROR(err_delta, "delta_encode");
+    }
+
+out:
+    if (patch_fd >= 0) {
+        close(patch_fd);
+    }
+
+    for (i = 0; i < num_jobs; i++) {
+        free(jobs[i].payload);
+    }
+
+    free(jobs);
+    free(segments);
+    unmap_file(&new_map);
+    unmap_file(&old_map);
+
+    return return_value;
+}
+
+/**
+ * Execute the instructions of a delta segment, return -1 if they do not
+ * rebuild exactly the segment.
+ */
+static int decode_instructions(delta_decode_job *job,
+        const unsigned char *payload, const unsigned char *end,
+        unsigned char *output)
+{
+    delta_instruction instruction;
+    uint64_t written = 0;
+
+    while (payload + sizeof(instruction) <= end) {
+        memcpy(&instruction, payload, sizeof(instruction));
+        payload += sizeof(instruction);
+
+        if (written + instruction.length > job->length) {
+            break;
+        }
+
+        if (instruction.type == delta_copy) {
+            if (instruction.offset > job->old_file->size
+                    || instruction.length > job->old_file->size
+                        - instruction.offset) {
+                break;
+            }
+
+            memcpy(output + written, job->old_file->data + instruction.offset,
+                    instruction.length);
+        } else if (instruction.type == delta_insert) {
+            if (instruction.length > (uint64_t) (end - payload)) {
+                break;
+            }
+
+            memcpy(output + written, payload, instruction.length);
+            payload += instruction.length;
+        } else {
+            break;
+        }
+
+        written += instruction.length;
+    }
+
+    if (payload != end || written != job->length) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Rebuild a segment of the new file in the mapped output.
+ */
+static void decode_segment(void *argument)
+{
+    delta_decode_job *job = (delta_decode_job *) argument;
+    const unsigned char *payload = job->patch->data + job->segment->offset;
+    const unsigned char *end = payload + job->segment->length;
+    unsigned char *output = job->output + job->start;
+
+    switch (job->segment->type) {
+        case segment_same:
+            if (job->start + job->length > job->old_file->size) {
+                job->failed = 1;
+                return;
+            }
+
+            memcpy(output, job->old_file->data + job->start, job->length);
+            break;
+
+        case segment_literal:
+            if (job->segment->length != job->length) {
+                job->failed = 1;
+                return;
+            }
+
+            memcpy(output, payload, job->length);
+            break;
+
+        case segment_delta:
+            if (decode_instructions(job, payload, end, output) < 0) {
+                job->failed = 1;
+                return;
+            }
+
+            break;
+
+        default:
+            job->failed = 1;
+            return;
+    }
+
+    if (simd_crc32c(0, output, job->length) != job->segment->checksum) {
+        job->failed = 1;
+    }
+}
+
+/**
+ * Apply patch_file to old_file, writing the result to new_file.
+ */
+int delta_decode(const char *old_file, const char *patch_file,
+        const char *new_file)
+{
+    thread_pool *pool = thread_pool_shared();
+    pool_group group;
+    delta_map old_map;
+    delta_map patch_map;
+    delta_header header;
+    const delta_segment *segments = NULL;
+    delta_decode_job *jobs = NULL;
+    unsigned char *output = NULL;
+    uint64_t table_end = 0;
+    uint32_t i = 0;
+    int new_fd = -1;
+    int return_value = 0;
+
+    if (map_file(old_file, &old_map) < 0) {
+        return HIERONYMUS_ERROR(err_delta, "delta_decode");
+    }
+
+    if (map_file(patch_file, &patch_map) < 0) {
+        return_value = HIERONYMUS_ERROR(err_delta, "delta_decode");
+        unmap_file(&old_map);
+        return return_value;
+    }
+
+    errno = EINVAL;
+
+    if (patch_map.size < sizeof(header)) {
+        return_value = HIERONYMUS_ERROR(err_delta, "delta_decode");
+        goto out;
+    }
+
+    memcpy(&header, patch_map.data, sizeof(header));
+    segments = (const delta_segment *) (patch_map.data + sizeof(header));
+    table_end = sizeof(header)
+        + (uint64_t) header.num_segments * sizeof(delta_segment);
+
+    if (memcmp(header.magic, DELTA_MAGIC, sizeof(header.magic)) != 0
+            || header.segment_size == 0 || header.old_size != old_map.size
+            || table_end > patch_map.size
+            || header.num_segments != (header.new_size + header.segment_size
+                - 1) / header.segment_size) {
+        return_value = HIERONYMUS_ERROR(err_delta, "delta_decode");
+        goto out;
+    }
+
+    for (i = 0; i < header.num_segments; i++) {
+        if (segments[i].offset < table_end
+                || segments[i].offset > patch_map.size
+                || segments[i].length > patch_map.size - segments[i].offset) {
+            return_value = HIERONYMUS_ERROR(err_delta, "delta_decode");
+            goto out;
+        }
+    }
+
+    new_fd = open(new_file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    if (new_fd < 0 || ftruncate(new_fd, header.new_size) < 0) {
+        return_value = HIERONYMUS_ERROR(err_delta, "delta_decode");
+        goto out;
+    }
+
+    if (header.new_size == 0) {
+        goto out;
+    }
+
+    output = mmap(NULL, header.new_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+            new_fd, 0);
+
+    if (output == MAP_FAILED) {
+        output = NULL;
+        return_value = HIERONYMUS_ERROR(err_delta, "delta_decode");
+        goto out;
+    }
+
+    jobs = calloc(header.num_segments, sizeof(delta_decode_job));
+
+    if (jobs == NULL) {
+        HIERONYMUS_ERROR(err_malloc, "delta_decode");
+        abort();
+    }
+
+    pool_group_init(&group);
+
+    for (i = 0; i < header.num_segments; i++) {
+        jobs[i].old_file = &old_map;
+        jobs[i].patch = &patch_map;
+        jobs[i].segment = &segments[i];
+        jobs[i].output = output;
+        jobs[i].start = (uint64_t) i * header.segment_size;
+        jobs[i].length = header.new_size - jobs[i].start;
+
+        if (jobs[i].length > header.segment_size) {
+            jobs[i].length = header.segment_size;
+        }
+
+        thread_pool_submit(pool, &group, decode_segment, &jobs[i]);
+    }
+
+    pool_group_wait(pool, &group);
+    pool_group_destroy(&group);
+
+    for (i = 0; i < header.num_segments; i++) {
+        if (jobs[i].failed) {
+            errno = EINVAL;
+            return_value = HIERONYMUS_ERROR(err_delta, "delta_decode");
+            break;
+        }
+    }
+
+out:
+    if (output != NULL) {
+        munmap(output, header.new_size);
+    }
+
+    if (new_fd >= 0) {
+        close(new_fd);
+    }
+
+    free(jobs);
+    unmap_file(&patch_map);
+    unmap_file(&old_map);
+
+    return return_value;
+}
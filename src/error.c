@@ -5,15 +5,24 @@
  * author : Tim van Deurzen
  * date   : 06/01/2011
  *
- * Functions for pretty printing errors.
+ * Functions for accounting and pretty printing errors.
+ *
+ * Every error is counted, split into errors that are expected during normal
+ * operation (a failed lookup, a missing extended attribute) and unexpected
+ * ones. Expected errors only increment a counter. Unexpected errors are
+ * printed as a single structured line, at most ERROR_RATE_LIMIT times per
+ * second per error.
  *
  *****************************************************************************/
 
+#define _GNU_SOURCE
 #include <errno.h>
 #include <string.h>
+#include <time.h>
 
 #include "print_color.h"
 #include "error.h"
+#include "config.h"
 
 /*
  * Define a string-array for pretty-printing errors.
@@ -22,27 +31,122 @@
 static char *error_messages[] = { ERRORS };
 #undef X
 
+#define X(a, b) #a,
+static char *error_names[] = { ERRORS };
+#undef X
+
+/*
+ * Counters for a single error. All fields are updated with atomic operations,
+ * no lock is taken on the error path.
+ */
+typedef struct ERROR_COUNTER {
+    unsigned long expected;
+    unsigned long unexpected;
+    unsigned long suppressed;
+    int last_errno;
+    long window;
+    unsigned int window_count;
+} error_counter;
+
+static error_counter error_counters[num_errors];
+
 /**
- * Print an error message.
+ * Count an expected error and return -errno_value.
+ */
+int count_error(int error, int errno_value)
+{
+    __sync_fetch_and_add(&error_counters[error].expected, 1);
+    error_counters[error].last_errno = errno_value;
+
+    return -errno_value;
+}
+
+/**
+ * Count an unexpected error and print it, unless more than ERROR_RATE_LIMIT
+ * records were printed for this error in the current second. Returns
+ * -errno_value.
  *
  * Errors are printed in red to make them stand out in the debug output.
  */
-int print_error(int error, char *origin)
+int record_error(int error, const char *origin, int errno_value)
 {
+    error_counter *counter = &error_counters[error];
+#ifndef _SUPPRESS_ERRORS
+    char buffer[128];
+    long now = time(NULL);
+    long window = counter->window;
+    unsigned long suppressed = 0;
+#endif
+
+    __sync_fetch_and_add(&counter->unexpected, 1);
+    counter->last_errno = errno_value;
+
+#ifndef _SUPPRESS_ERRORS
+    /*
+     * Start a new window once per second. The thread that wins the swap
+     * resets the count, a few records more or less in a racing second are
+     * harmless.
+     */
+    if (config_get()->log_level < log_errors) {
+        return -errno_value;
+    }
+
+    if (window != now
+            && __sync_bool_compare_and_swap(&counter->window, window, now)) {
+        counter->window_count = 0;
+    }
+
+    if (__sync_add_and_fetch(&counter->window_count, 1) > ERROR_RATE_LIMIT) {
+        __sync_fetch_and_add(&counter->suppressed, 1);
+
+        return -errno_value;
+    }
+
+    suppressed = __sync_lock_test_and_set(&counter->suppressed, 0);
+
     START_PRINT_RED();
 
-    fprintf(stderr, "*** ERROR | %s\n", get_error_message(error));
-    fprintf(stderr, "%9s | %s: %s\n", "", origin, strerror(errno));
+    fprintf(stderr, "*** ERROR | %s | %s | errno %d (%s) | %s",
+            error_names[error], origin, errno_value,
+            strerror_r(errno_value, buffer, sizeof(buffer)),
+            error_messages[error]);
+
+    if (suppressed > 0) {
+        fprintf(stderr, " | %lu suppressed", suppressed);
+    }
+
+    fprintf(stderr, "\n");
 
     END_PRINT_COLOR();
+#endif
+
+    return -errno_value;
+}
+
+/**
+ * Print the counters of all errors that occurred, one line of JSON per error.
+ */
+void print_error_statistics(FILE *stream)
+{
+    int i = 0;
+
+    for (i = 0; i < num_errors; i++) {
+        if (error_counters[i].expected == 0
+                && error_counters[i].unexpected == 0) {
+            continue;
+        }
 
-    return -errno;
+        fprintf(stream, "{\"error\": \"%s\", \"expected\": %lu, "
+                "\"unexpected\": %lu, \"last_errno\": %d}\n",
+                error_names[i], error_counters[i].expected,
+                error_counters[i].unexpected, error_counters[i].last_errno);
+    }
 }
 
 /**
  * Return the error message belonging to the given error number.
  */
-char *get_error_message(int error_number) 
+char *get_error_message(int error_number)
 {
     return error_messages[error_number];
 }
@@ -39,6 +39,22 @@
 #include "error.h"
 #include "cmdline.h"
 #include "versioning.h"
+#include "block_versioning.h"
+#include "journal.h"
+#include "synchronize.h"
+#include "trace.h"
+#include "negative_cache.h"
+#include "handle.h"
+#include "path.h"
+#include "codec.h"
+#include "pack.h"
+#include "vindex.h"
+#include "control.h"
+#include "config.h"
+#include "policy.h"
+#include "dedup.h"
+#include "vstate.h"
+#include "scheduler.h"
 #include "log.h"
 
 /** 
@@ -53,22 +69,44 @@
  * Currently this function is just a pass-through function. However,
  * it could be used to display versioning information next to the standard
  * information.
+ *
+ * Paths that do not exist are remembered in the negative cache, repeated
+ * lookups of such a path do not reach the root directory. The control files
+ * (see control.c) do not exist in the root directory at all.
  */
 int h_getattr (const char *path, struct stat *stat_buffer) 
 {
+    TRACE_START();
     int return_value = 0;
-    char root_path[PATH_MAX];
+    int cached_error = 0;
+    unsigned long sequence = 0;
+    char *root_path = NULL;
 
-    resolve_root_path(path, root_path);
+    cached_error = negative_cache_lookup(path, &sequence);
 
-    return_value = lstat(root_path, stat_buffer);
+    if (control_path(path) >= 0) {
+        return_value = control_getattr(path, stat_buffer);
+    } else if (cached_error != 0) {
+        return_value = count_error(err_getattr, cached_error);
+    } else {
+        path_reset();
+        root_path = path_resolve(path);
 
-    if (return_value != 0) {
-        return_value = HIERONYMUS_ERROR(err_getattr, "h_getattr");
+        return_value = lstat(root_path, stat_buffer);
+
+        if (return_value != 0) {
+            return_value = HIERONYMUS_EXPECTED_ERROR(err_getattr, "h_getattr",
+                    errno == ENOENT || errno == ENOTDIR);
+        }
+
+        if (return_value == -ENOENT) {
+            negative_cache_insert(path, ENOENT, sequence);
+        }
     }
 
     HIERONYMUS_DEBUG("getattr: %s\n", path);
     HIERONYMUS_LOG(ADMIN->log_file, "[%d] getattr # %s\n", OP_PID, path);
+    HIERONYMUS_TRACE(op_getattr, path, NULL, 0, 0, return_value);
 
     return return_value;
 }
@@ -88,10 +126,12 @@ int h_getattr (const char *path, struct stat *stat_buffer)
  */
 int h_readlink (const char *path, char *link, size_t size)
 {
+    TRACE_START();
     int return_value = 0;
-    char root_path[PATH_MAX];
+    char *root_path = NULL;
 
-    resolve_root_path(path, root_path);
+    path_reset();
+    root_path = path_resolve(path);
     
     return_value = readlink(root_path, link, size);
 
@@ -103,7 +143,8 @@ int h_readlink (const char *path, char *link, size_t size)
 
     HIERONYMUS_DEBUG("readlink: %s\n", path);
     HIERONYMUS_LOG(ADMIN->log_file, "[%d] readlink # %s\n", OP_PID, path);
-    
+    HIERONYMUS_TRACE(op_readlink, path, NULL, 0, size, return_value);
+
     return return_value;
 }
 
@@ -123,10 +164,12 @@ int h_readlink (const char *path, char *link, size_t size)
  */
 int h_mknod (const char *path, mode_t mode, dev_t dev)
 {
+    TRACE_START();
     int return_value = 0;
-    char root_path[PATH_MAX];
+    char *root_path = NULL;
     
-    resolve_root_path(path, root_path);
+    path_reset();
+    root_path = path_resolve(path);
 
     return_value = mknod(root_path, mode, dev);
 
@@ -134,9 +177,12 @@ int h_mknod (const char *path, mode_t mode, dev_t dev)
         return_value = HIERONYMUS_ERROR(err_mknod, "h_mknod");
     }
 
+    negative_cache_invalidate(path);
+
     HIERONYMUS_DEBUG("mknod: %s\n", path);
     HIERONYMUS_LOG(ADMIN->log_file, "[%d] mknod # %s\n", OP_PID, path);
-    
+    HIERONYMUS_TRACE(op_mknod, path, NULL, mode, dev, return_value);
+
     return return_value;
 }
 
@@ -154,10 +200,12 @@ int h_mknod (const char *path, mode_t mode, dev_t dev)
  */
 int h_mkdir (const char *path, mode_t mode)
 {
+    TRACE_START();
     int return_value = 0;
-    char root_path[PATH_MAX];
+    char *root_path = NULL;
 
-    resolve_root_path(path, root_path);
+    path_reset();
+    root_path = path_resolve(path);
     
     /*
      * Make sure the mode is correct.
@@ -169,7 +217,8 @@ int h_mkdir (const char *path, mode_t mode)
     return_value = checked_mkdir(root_path);
 
     if (return_value != 0) {
-        return_value = HIERONYMUS_ERROR(err_mkdir, "h_mkdir");
+        return_value = HIERONYMUS_EXPECTED_ERROR(err_mkdir, "h_mkdir",
+                errno == EEXIST);
     }
 
 #ifdef _VERSIONING
@@ -179,8 +228,11 @@ int h_mkdir (const char *path, mode_t mode)
     return_value = h_versioned_mkdir(root_path);
 #endif
 
+    negative_cache_invalidate(path);
+
     HIERONYMUS_DEBUG("mkdir: %s\n", path);
     HIERONYMUS_LOG(ADMIN->log_file, "[%d] mkdir # %s\n", OP_PID, path);
+    HIERONYMUS_TRACE(op_mkdir, path, NULL, mode, 0, return_value);
 
     return return_value;
 }
@@ -192,24 +244,33 @@ int h_mkdir (const char *path, mode_t mode)
  * This function removes all links to a file, effectively deleting it.
  *
  * ** Hieronymus **
- * Removing a file has no direct effect for versioning. The last patch-version
- * can be used to retrieve the last version of the file.
+ * Removing a file amounts to moving it into the '.version' directory of its
+ * directory, so its last contents can still be restored. This is a rename, no
+ * data is copied.
  */
 int h_unlink (const char *path)
 {
+    TRACE_START();
     int return_value = 0;
-    char root_path[PATH_MAX];
+    char *root_path = NULL;
     
-    resolve_root_path(path, root_path);
+    path_reset();
+    root_path = path_resolve(path);
 
-    return_value = unlink(root_path);
+#ifdef _VERSIONING
+    return_value = h_versioned_unlink(root_path);
+#else
+    return_value = unlink(root_path) < 0 ? -errno : 0;
+#endif
 
     if (return_value < 0) {
-        return_value = HIERONYMUS_ERROR(err_unlink, "h_unlink");
+        return_value = HIERONYMUS_RETURNED_ERROR(err_unlink, "h_unlink",
+                return_value, return_value == -ENOENT);
     }
     
     HIERONYMUS_DEBUG("unlink: %s\n", path);
     HIERONYMUS_LOG(ADMIN->log_file, "[%d] unlink # %s\n", OP_PID, path);
+    HIERONYMUS_TRACE(op_unlink, path, NULL, 0, 0, return_value);
 
     return return_value;
 }
@@ -225,23 +286,27 @@ int h_unlink (const char *path)
  */
 int h_rmdir (const char *path)
 {
+    TRACE_START();
     int return_value = 0;
-    char root_path[PATH_MAX];
+    char *root_path = NULL;
+
+    path_reset();
+    root_path = path_resolve(path);
 
 #ifdef _VERSIONING
-    return_value = h_versioned_rmdir(path);
+    return_value = h_versioned_rmdir(root_path);
 #else
-    resolve_root_path(path, root_path);
-
-    return_value = rmdir(root_path);
+    return_value = rmdir(root_path) < 0 ? -errno : 0;
 #endif
 
     if (return_value < 0) {
-        return_value = HIERONYMUS_ERROR(err_rmdir, "h_rmdir");
+        return_value = HIERONYMUS_RETURNED_ERROR(err_rmdir, "h_rmdir",
+                return_value, return_value == -ENOTEMPTY);
     }
     
     HIERONYMUS_DEBUG("rmdir: %s\n", path);
     HIERONYMUS_LOG(ADMIN->log_file, "[%d] rmdir # %s\n", OP_PID, path);
+    HIERONYMUS_TRACE(op_rmdir, path, NULL, 0, 0, return_value);
 
     return return_value;
 }
@@ -257,10 +322,12 @@ int h_rmdir (const char *path)
  */
 int h_symlink (const char *path, const char *link)
 {
+    TRACE_START();
     int return_value = 0;
-    char root_link[PATH_MAX];
+    char *root_link = NULL;
     
-    resolve_root_path(link, root_link);
+    path_reset();
+    root_link = path_resolve(link);
     
     return_value = symlink(path, root_link);
 
@@ -268,8 +335,11 @@ int h_symlink (const char *path, const char *link)
         return_value = HIERONYMUS_ERROR(err_symlink, "h_symlink");
     }
     
+    negative_cache_invalidate(link);
+
     HIERONYMUS_DEBUG("symlink: %s -> %s\n", path, link);
     HIERONYMUS_LOG(ADMIN->log_file, "[%d] symlink # %s -> %s\n", OP_PID, path, link);
+    HIERONYMUS_TRACE(op_symlink, link, path, 0, 0, return_value);
 
     return return_value;
 }
@@ -281,27 +351,47 @@ int h_symlink (const char *path, const char *link)
  *
  * ** Hieronymus **
  * Renaming a file has consequences for the consistency of the versioning
- * information. Currently versioning treats a move as the removal of the
- * original file and the creation of a new file.
+ * information. The rename is logged in the version index of both directories,
+ * so the history of the file follows it to its new name. A file replaced by
+ * the rename is kept in the '.version' directory, as if it was removed.
  */
 int h_rename (const char *path, const char *new_path)
 {
+    TRACE_START();
     int return_value = 0;
-    char root_path[PATH_MAX];
-    char new_root_path[PATH_MAX];
+    struct stat stat_buffer;
+    char *root_path = NULL;
+    char *new_root_path = NULL;
     
-    resolve_root_path(path, root_path);
-    resolve_root_path(new_path, new_root_path);
+    path_reset();
+    root_path = path_resolve(path);
+    new_root_path = path_resolve(new_path);
     
-    return_value = rename(root_path, new_root_path);
+#ifdef _VERSIONING
+    return_value = h_versioned_rename(root_path, new_root_path);
+#else
+    return_value = rename(root_path, new_root_path) < 0 ? -errno : 0;
+#endif
 
     if (return_value < 0) {
-        return_value = HIERONYMUS_ERROR(err_rename, "h_rename");
+        return_value = HIERONYMUS_RETURNED_ERROR(err_rename, "h_rename",
+                return_value, 0);
+    }
+
+    /*
+     * Every name below a renamed directory may have come into existence.
+     */
+    if (lstat(new_root_path, &stat_buffer) == 0 
+            && S_ISDIR(stat_buffer.st_mode)) {
+        negative_cache_invalidate_all();
+    } else {
+        negative_cache_invalidate(new_path);
     }
     
     HIERONYMUS_DEBUG("rename: %s ==> %s\n", path, new_path);
     HIERONYMUS_LOG(ADMIN->log_file, "[%d] rename # %s -> %s\n", OP_PID, path,
             new_path);
+    HIERONYMUS_TRACE(op_rename, path, new_path, 0, 0, return_value);
 
     return return_value;
 }
@@ -316,12 +406,14 @@ int h_rename (const char *path, const char *new_path)
  */
 int h_link (const char *path, const char *link_path)
 {
+    TRACE_START();
     int return_value = 0;
-    char root_path[PATH_MAX];
-    char new_root_path[PATH_MAX];
+    char *root_path = NULL;
+    char *new_root_path = NULL;
     
-    resolve_root_path(path, root_path);
-    resolve_root_path(link_path, new_root_path);
+    path_reset();
+    root_path = path_resolve(path);
+    new_root_path = path_resolve(link_path);
     
     return_value = link(root_path, new_root_path);
 
@@ -329,9 +421,12 @@ int h_link (const char *path, const char *link_path)
         return_value = HIERONYMUS_ERROR(err_link, "h_link");
     }
     
+    negative_cache_invalidate(link_path);
+
     HIERONYMUS_DEBUG("link: %s -> %s\n", path, link_path);
     HIERONYMUS_LOG(ADMIN->log_file, "[%d] link # %s -> %s\n", OP_PID, path,
             link_path);
+    HIERONYMUS_TRACE(op_link, path, link_path, 0, 0, return_value);
 
     return return_value;
 }
@@ -346,10 +441,12 @@ int h_link (const char *path, const char *link_path)
  */
 int h_chmod (const char *path, mode_t mode)
 {
+    TRACE_START();
     int return_value = 0;
-    char root_path[PATH_MAX];
+    char *root_path = NULL;
 
-    resolve_root_path(path, root_path);
+    path_reset();
+    root_path = path_resolve(path);
 
     return_value = chmod(root_path, mode);
 
@@ -359,6 +456,7 @@ int h_chmod (const char *path, mode_t mode)
 
     HIERONYMUS_DEBUG("chmod: %s\n", path);
     HIERONYMUS_LOG(ADMIN->log_file, "[%d] chmod # %s\n", OP_PID,  path);
+    HIERONYMUS_TRACE(op_chmod, path, NULL, mode, 0, return_value);
 
     return return_value;
 }
@@ -376,10 +474,12 @@ int h_chmod (const char *path, mode_t mode)
  */
 int h_chown (const char *path, uid_t uid, gid_t gid)
 {
+    TRACE_START();
     int return_value = 0;
-    char root_path[PATH_MAX];
+    char *root_path = NULL;
 
-    resolve_root_path(path, root_path);
+    path_reset();
+    root_path = path_resolve(path);
 
     return_value = lchown(root_path, uid, gid);
 
@@ -389,6 +489,7 @@ int h_chown (const char *path, uid_t uid, gid_t gid)
 
     HIERONYMUS_DEBUG("chown: %s\n", path);
     HIERONYMUS_LOG(ADMIN->log_file, "[%d] chown # %s\n", OP_PID,  path);
+    HIERONYMUS_TRACE(op_chown, path, NULL, uid, gid, return_value);
 
     return return_value;
 }
@@ -400,14 +501,40 @@ int h_chown (const char *path, uid_t uid, gid_t gid)
  *
  * ** Hieronymus **
  * Truncating a file means a new version is stored and a patch from 
- * the previous version to this version is created.
+ * the previous version to this version is created. With block-level versioning
+ * the blocks cut off by shrinking the file are saved first.
  */
 int h_truncate (const char *path, off_t new_size)
 {
+    TRACE_START();
     int return_value = 0;
-    char root_path[PATH_MAX];
+    char *root_path = NULL;
+
+    /*
+     * Opening a control file with O_TRUNC truncates it first, it has no
+     * contents to lose.
+     */
+    if (control_path(path) > 0) {
+        return 0;
+    }
 
-    resolve_root_path(path, root_path);
+    path_reset();
+    root_path = path_resolve(path);
+
+#if defined(_VERSIONING) && defined(_BLOCK_VERSIONING)
+    struct stat stat_buffer;
+
+    if (stat(root_path, &stat_buffer) == 0 && stat_buffer.st_size > new_size) {
+        if (h_versioned_block_write(NULL, root_path, 
+                    stat_buffer.st_size - new_size, new_size) < 0) {
+            HIERONYMUS_ERROR(err_vs_write, "h_truncate");
+        }
+    }
+#endif
+
+#if defined(_DEDUP) && !defined(_BLOCK_VERSIONING)
+    handle_file *file = handle_file_change_begin(root_path);
+#endif
 
     return_value = truncate(root_path, new_size);
 
@@ -415,8 +542,13 @@ int h_truncate (const char *path, off_t new_size)
         return_value = HIERONYMUS_ERROR(err_truncate, "h_truncate");
     }
 
+#if defined(_DEDUP) && !defined(_BLOCK_VERSIONING)
+    handle_file_change_end(file);
+#endif
+
     HIERONYMUS_DEBUG("truncate: %s\n", path);
     HIERONYMUS_LOG(ADMIN->log_file, "[%d] truncate # %s\n", OP_PID, path);
+    HIERONYMUS_TRACE(op_truncate, path, NULL, new_size, 0, return_value);
 
     return return_value;
 }
@@ -431,10 +563,12 @@ int h_truncate (const char *path, off_t new_size)
  */
 int h_utime (const char *path, struct utimbuf *ubuffer)
 {
+    TRACE_START();
     int return_value = 0;
-    char root_path[PATH_MAX];
+    char *root_path = NULL;
     
-    resolve_root_path(path, root_path);
+    path_reset();
+    root_path = path_resolve(path);
     
     return_value = utime(root_path, ubuffer);
 
@@ -444,7 +578,8 @@ int h_utime (const char *path, struct utimbuf *ubuffer)
 
     HIERONYMUS_DEBUG("utime: %s\n", path);
     HIERONYMUS_LOG(ADMIN->log_file, "[%d] utime # %s\n", OP_PID, path);
-    
+    HIERONYMUS_TRACE(op_utime, path, NULL, 0, 0, return_value);
+
     return return_value;
 }
 
@@ -460,16 +595,18 @@ int h_utime (const char *path, struct utimbuf *ubuffer)
  */
 static int h_utimens (const char *path, const struct timespec ts[2])
 {
+    TRACE_START();
     int return_value = 0;
 	struct timeval tv[2];
-    char root_path[PATH_MAX];
+    char *root_path = NULL;
     
 	tv[0].tv_sec = ts[0].tv_sec;
 	tv[0].tv_usec = ts[0].tv_nsec / 1000;
 	tv[1].tv_sec = ts[1].tv_sec;
 	tv[1].tv_usec = ts[1].tv_nsec / 1000;
 
-    resolve_root_path(path, root_path);
+    path_reset();
+    root_path = path_resolve(path);
 
 	return_value = utimes(root_path, tv);
 	if (return_value == -1) {
@@ -478,11 +615,72 @@ static int h_utimens (const char *path, const struct timespec ts[2])
 
     HIERONYMUS_DEBUG("utimens: %s\n", path);
     HIERONYMUS_LOG(ADMIN->log_file, "[%d] utimens # %s\n", OP_PID, path);
+    HIERONYMUS_TRACE(op_utimens, path, NULL, 0, 0, return_value);
 
 	return return_value;
 }
 
-/** 
+#if defined(_VERSIONING) && !defined(_BLOCK_VERSIONING)
+/**
+ * Return the SHA-1 of the file of a handle if the handle knows it (see
+ * h_versioned_write).
+ */
+static const unsigned char *known_digest (void *handle, unsigned char *digest)
+{
+    return handle_digest((hieronymus_handle *) handle, digest);
+}
+
+/**
+ * Version a file with writes that were coalesced (see h_write) and not
+ * versioned yet. 'path' is its path in the mount point, the path arena is
+ * used.
+ */
+static void version_coalesced (hieronymus_handle *handle, const char *path)
+{
+    char *root_path = NULL;
+
+    if (!handle_take_coalesced(handle)) {
+        return;
+    }
+
+    root_path = handle_root_path(handle, path);
+
+#ifdef _JOURNALING
+    unsigned long long sequence = journal_intent(intent_write, root_path,
+            NULL);
+
+    if (journal_commit(sequence) < 0) {
+        HIERONYMUS_ERROR(err_journal, "version_coalesced");
+    }
+#endif
+
+    if (h_versioned_write(root_path, known_digest, handle) < 0) {
+        HIERONYMUS_ERROR(err_vs_write, "version_coalesced");
+    } else {
+        __sync_fetch_and_add(&handle->versions, 1);
+    }
+
+#ifdef _JOURNALING
+    journal_done(sequence);
+#endif
+}
+
+/**
+ * The timer of a handle expired: the file has not been written for the
+ * coalescing interval of its policy. Runs on a worker of the scheduler, the
+ * handle is not released before this is done (h_release cancels the timer).
+ */
+static void version_coalesced_later (void *argument)
+{
+    hieronymus_handle *handle = (hieronymus_handle *) argument;
+    path_mark mark = path_get_mark();
+
+    version_coalesced(handle, handle->path);
+    path_release(mark);
+}
+#endif
+
+/**
  * File open operation
  *
  * ** FUSE **
@@ -504,25 +702,51 @@ static int h_utimens (const char *path, const struct timespec ts[2])
  * ** Hieronymus **
  * Upon opening a file Hieronymus calculate the SHA1 hash of its 
  * contents and stores it until the file is closed again.
+ *
+ * The file handle is a hieronymus_handle (see handle.h) holding the file
+ * descriptor and the state of this open file. A control file gets a handle
+ * without a descriptor and is read with direct I/O.
  */
 int h_open (const char *path, struct fuse_file_info *file_info)
 {
+    TRACE_START();
     int return_value = 0;
     int file_descriptor = 0;
-    char root_path[PATH_MAX];
+    hieronymus_handle *handle = NULL;
+    control_state *control = NULL;
+    char *root_path = NULL;
     
-    resolve_root_path(path, root_path);
+    path_reset();
+    root_path = path_resolve(path);
+
+    if (control_path(path) >= 0) {
+        if ((control = control_open(path)) == NULL) {
+            return_value = HIERONYMUS_ERROR(err_open, "h_open");
+        } else {
+            handle = handle_acquire(path, root_path, file_info->flags);
+            handle->control = control;
+            file_info->direct_io = 1;
+        }
+    } else if ((file_descriptor = open(root_path, file_info->flags)) < 0) {
+        return_value = HIERONYMUS_ERROR(err_open, "h_open");
+    } else {
+        handle = handle_acquire(path, root_path, file_info->flags);
+        handle->fd = file_descriptor;
 
-    file_descriptor = open(root_path, file_info->flags);
+#if defined(_VERSIONING) && !defined(_BLOCK_VERSIONING)
+        scheduler_timer_init(&handle->timer, version_coalesced_later, handle);
+#endif
 
-    if (file_descriptor < 0) {
-        return_value = HIERONYMUS_ERROR(err_open, "h_open");
+#if defined(_DEDUP) && !defined(_BLOCK_VERSIONING)
+        handle_track(handle);
+#endif
     }
     
-    file_info->fh = file_descriptor;
+    file_info->fh = (uintptr_t) handle;
     
     HIERONYMUS_DEBUG("open: %s\n", path);
     HIERONYMUS_LOG(ADMIN->log_file, "[%d] open # %s\n", OP_PID, path);
+    HIERONYMUS_TRACE(op_open, path, NULL, file_info->flags, 0, return_value);
 
     return return_value;
 }
@@ -541,26 +765,34 @@ int h_open (const char *path, struct fuse_file_info *file_info)
  * Changed in version 2.2
  *
  * ** Hieronymus **
- * Pass through function.
+ * Pass through function, except for control files.
  */
 int h_read (const char *path, char *buffer, size_t size, off_t offset, 
         struct fuse_file_info *file_info)
 {
+    TRACE_START();
     int return_value = 0;
+    hieronymus_handle *handle = HANDLE(file_info);
     
     /*
      * We don't need to use the path here as the file handle is passed
      * directly through the fuse_file_info struct.
      */
-    return_value = pread(file_info->fh, buffer, size, offset);
-
-    if (return_value < 0) {
+    if (handle->control != NULL) {
+        return_value = control_read(handle->control, buffer, size, offset);
+    } else if ((return_value = pread(handle->fd, buffer, size, offset)) < 0) {
         return_value = HIERONYMUS_ERROR(err_read, "h_read");
     }
+
+    if (return_value >= 0) {
+        __sync_fetch_and_add(&handle->statistics.reads, 1);
+        __sync_fetch_and_add(&handle->statistics.bytes_read, return_value);
+    }
     
     HIERONYMUS_DEBUG("read: %s\n", path);
     HIERONYMUS_LOG(ADMIN->log_file, "[%d] read %d # %s\n", OP_PID,
             return_value, path);
+    HIERONYMUS_TRACE(op_read, path, NULL, offset, size, return_value);
 
     return return_value;
 }
@@ -581,31 +813,110 @@ int h_read (const char *path, char *buffer, size_t size, off_t offset,
  * snapshot folder is opened and either a patch or snapshot version of the file
  * is created. A snapshot version is created if the snapshot folder does not yet
  * contain a reference to the file being written.
+ *
+ * With block-level versioning (-D_BLOCK_VERSIONING) the blocks in the written
+ * range are saved before they are overwritten instead, so the cost of
+ * versioning only depends on the size of the write.
+ *
+ * The written range is recorded in the dirty extents of the handle. Writing
+ * to a control file makes a request, which is not versioned. Writes are not
+ * versioned either while versioning is off in the runtime configuration, or
+ * if the versioning policy excludes the file. Within the coalescing interval
+ * of its policy, a file is versioned once it has not been written for an
+ * interval (by the scheduler), or when it is released, instead.
  */
 int h_write (const char *path, const char *buffer, size_t size, off_t offset,
           struct fuse_file_info *file_info)
 {
+    TRACE_START();
     int return_value = 0;
-    
-    return_value = pwrite(file_info->fh, buffer, size, offset);
+    hieronymus_handle *handle = HANDLE(file_info);
+
+    if (handle->control != NULL) {
+        return control_write(handle->control, buffer, size, offset);
+    }
 
 #ifdef _VERSIONING
-    char root_path[PATH_MAX];
+    char *root_path = NULL;
+    int versioned = 0;
+
+    path_reset();
+    root_path = handle_root_path(handle, path);
+    versioned = config_get()->versioning && handle_versioned(handle);
+#endif
+
+#if defined(_VERSIONING) && !defined(_BLOCK_VERSIONING)
+    if (versioned && !handle_version_due(handle)) {
+        scheduler_arm(&handle->timer, handle->policy->coalesce);
+        versioned = 0;
+    }
+#endif
+
+#if defined(_VERSIONING) && defined(_JOURNALING)
+    /*
+     * The intent has to be in the journal before the live file changes, so a
+     * crash before the version is created is detected at the next mount.
+     */
+    unsigned long long sequence = 0;
+
+    if (versioned) {
+        sequence = journal_intent(intent_write, root_path, NULL);
+
+        if (journal_commit(sequence) < 0) {
+            HIERONYMUS_ERROR(err_journal, "h_write");
+        }
+    }
+#endif
+
+#if defined(_VERSIONING) && defined(_BLOCK_VERSIONING)
+    /*
+     * The write is still performed if saving the old blocks failed, the error
+     * only affects the versioning information.
+     */
+    if (versioned && h_versioned_block_write(&handle->epoch, root_path, size, 
+                offset) < 0) {
+        HIERONYMUS_ERROR(err_vs_write, "h_write");
+    }
+#endif
+    
+#if defined(_DEDUP) && !defined(_BLOCK_VERSIONING)
+    handle_change_begin(handle);
+#endif
+
+    return_value = pwrite(handle->fd, buffer, size, offset);
+
+#if defined(_DEDUP) && !defined(_BLOCK_VERSIONING)
+    handle_hash_write(handle, buffer, offset, return_value);
+#endif
 
     if (return_value > 0) {
-        resolve_root_path(path, root_path);
+        handle_add_extent(handle, offset, return_value);
+        __sync_fetch_and_add(&handle->statistics.writes, 1);
+        __sync_fetch_and_add(&handle->statistics.bytes_written, return_value);
+    }
 
+#if defined(_VERSIONING) && !defined(_BLOCK_VERSIONING)
+    if (versioned && return_value > 0) {
         /*
          * We cannot overwrite return_value here as we would lose the amount of
          * bytes written to disk. That value is needed by FUSE to check if the
-         * write succeeded.
+         * write succeeded. The digest of the file is known if it was written
+         * sequentially through this handle.
          */
-        if (h_versioned_write(root_path) < 0) {
+        if (h_versioned_write(root_path, known_digest, handle) < 0) {
             HIERONYMUS_ERROR(err_vs_write, "h_write");
+        } else {
+            __sync_fetch_and_add(&handle->versions, 1);
         }
     }
 #endif
 
+#if defined(_VERSIONING) && defined(_JOURNALING)
+    if (versioned) {
+        journal_done(sequence);
+    }
+#endif
+
     if (return_value < 0) {
         return_value = HIERONYMUS_ERROR(err_write, "h_write");
     }
@@ -613,7 +924,8 @@ int h_write (const char *path, const char *buffer, size_t size, off_t offset,
     HIERONYMUS_DEBUG("write: %s\n %8s | buffer: %s\n", path, "", buffer);
     HIERONYMUS_LOG(ADMIN->log_file, "[%d] write %d bytes # %s\n", OP_PID,
             return_value, path);
-    
+    HIERONYMUS_TRACE(op_write, path, NULL, offset, size, return_value);
+
     return return_value;
 }
 
@@ -631,10 +943,12 @@ int h_write (const char *path, const char *buffer, size_t size, off_t offset,
  */
 int h_statfs (const char *path, struct statvfs *stat_info)
 {
+    TRACE_START();
     int return_value = 0;
-    char root_path[PATH_MAX];
+    char *root_path = NULL;
     
-    resolve_root_path(path, root_path);
+    path_reset();
+    root_path = path_resolve(path);
     
     return_value = statvfs(root_path, stat_info);
 
@@ -644,7 +958,8 @@ int h_statfs (const char *path, struct statvfs *stat_info)
 
     HIERONYMUS_DEBUG("statfs: %s\n", path);
     HIERONYMUS_LOG(ADMIN->log_file, "[%d] statfs # %s\n", OP_PID, path);
-    
+    HIERONYMUS_TRACE(op_statfs, path, NULL, 0, 0, return_value);
+
     return return_value;
 }
 
@@ -674,16 +989,24 @@ int h_statfs (const char *path, struct statvfs *stat_info)
  * Changed in version 2.2
  *
  * ** Hieronymus **
- * Stub function.
+ * Stub function for ordinary files. A request written to a control file that
+ * was not read back is answered here.
  */
 int h_flush (const char *path, struct fuse_file_info *file_info)
 {
-    (void) file_info;
+    TRACE_START();
+    hieronymus_handle *handle = HANDLE(file_info);
+    int return_value = 0;
+
+    if (handle->control != NULL) {
+        return_value = control_flush(handle->control);
+    }
 
     HIERONYMUS_DEBUG("flush: %s\n", path);
     HIERONYMUS_LOG(ADMIN->log_file, "[%d] flush # %s\n", OP_PID, path);
+    HIERONYMUS_TRACE(op_flush, path, NULL, 0, 0, return_value);
 
-    return 0;
+    return return_value;
 }
 
 /** 
@@ -703,20 +1026,51 @@ int h_flush (const char *path, struct fuse_file_info *file_info)
  * Changed in version 2.2
  *
  * ** Hieronymus **
- * Pass through function.
+ * Pass through function. With block-level versioning releasing a file that was
+ * opened for writing closes its current version epoch. Otherwise a file with
+ * writes that were coalesced (see h_write) and not versioned by its timer yet
+ * is versioned now. The handle is returned to the pool.
  */
 int h_release (const char *path, struct fuse_file_info *file_info)
 {
+    TRACE_START();
     int return_value = 0;
+    hieronymus_handle *handle = HANDLE(file_info);
 
-    return_value = close(file_info->fh);
+    if (handle->control != NULL) {
+        control_release(handle->control);
+    } else {
+        return_value = close(handle->fd);
+    }
+
+#if defined(_VERSIONING) && defined(_BLOCK_VERSIONING)
+    if (handle->control == NULL && (handle->flags & O_ACCMODE) != O_RDONLY) {
+        if (h_versioned_block_release(&handle->epoch) < 0) {
+            HIERONYMUS_ERROR(err_vs_write, "h_release");
+        }
+    }
+#endif
+
+#if defined(_VERSIONING) && !defined(_BLOCK_VERSIONING)
+    if (handle->control == NULL) {
+        scheduler_cancel(&handle->timer);
+        path_reset();
+        version_coalesced(handle, path);
+    }
+#endif
 
     if (return_value < 0) {
         return_value = HIERONYMUS_ERROR(err_release, "h_release");
     }
 
-    HIERONYMUS_DEBUG("release: %s\n", path);
+    HIERONYMUS_DEBUG("release: %s (%lu reads, %lu writes, %lu versions)\n", 
+            path, handle->statistics.reads, handle->statistics.writes, 
+            handle->versions);
+
+    handle_release(handle);
+
     HIERONYMUS_LOG(ADMIN->log_file, "[%d] release # %s\n", OP_PID, path);
+    HIERONYMUS_TRACE(op_release, path, NULL, 0, 0, return_value);
 
     return return_value;
 }
@@ -731,16 +1085,26 @@ int h_release (const char *path, struct fuse_file_info *file_info)
  * Changed in version 2.2
  *
  * ** Hieronymus **
- * Unused.
+ * Unused, unless journaling is enabled. In that case the journal is synced to
+ * stable storage, so the versioning information of the file is as durable as
+ * its contents.
  *
  */
 int h_fsync (const char *path, int data_sync, struct fuse_file_info *file_info)
 {
+    TRACE_START();
     (void) data_sync;
     (void) file_info;
 
+#if defined(_VERSIONING) && defined(_JOURNALING)
+    if (journal_sync() < 0) {
+        HIERONYMUS_ERROR(err_journal, "h_fsync");
+    }
+#endif
+
     HIERONYMUS_DEBUG("fsync: %s\n", path);
     HIERONYMUS_LOG(ADMIN->log_file, "[%d] fsync # %s\n", OP_PID, path);
+    HIERONYMUS_TRACE(op_fsync, path, NULL, data_sync, 0, 0);
 
     return 0;
 }
@@ -751,26 +1115,32 @@ int h_fsync (const char *path, int data_sync, struct fuse_file_info *file_info)
  * ** FUSE **
  * 
  * ** Hieronymus **
- * Pass through function.
+ * Pass through function, except for the attributes kept by Hieronymus itself
+ * (see dedup.c), which are hidden.
  */
 int h_setxattr (const char *path, const char *name, const char *value, 
             size_t size, int flags)
 {
+    TRACE_START();
     int return_value = 0;
-    char root_path[PATH_MAX];
+    char *root_path = NULL;
     
-    resolve_root_path(path, root_path);
+    path_reset();
+    root_path = path_resolve(path);
     
-    return_value = lsetxattr(root_path, name, value, size, flags);
-
-    if (return_value < 0) {
-        return_value = HIERONYMUS_ERROR(err_setxattr, "h_setxattr");
+    if (dedup_hidden_attribute(name)) {
+        return_value = -EPERM;
+    } else if ((return_value = lsetxattr(root_path, name, value, size, 
+                    flags)) < 0) {
+        return_value = HIERONYMUS_EXPECTED_ERROR(err_setxattr, "h_setxattr",
+                errno == ENOTSUP);
     }
 
     HIERONYMUS_DEBUG("setxattr: %s (%s: %s)\n", path, name, value);
     HIERONYMUS_LOG(ADMIN->log_file, "[%d] setxattr # %s (%s: %s)\n", OP_PID,
             path, name, value);
-    
+    HIERONYMUS_TRACE(op_setxattr, path, NULL, flags, size, return_value);
+
     return return_value;
 }
 
@@ -780,24 +1150,28 @@ int h_setxattr (const char *path, const char *name, const char *value,
  * ** FUSE **
  *
  * ** Hieronymus **
- * Pass through function.
+ * Pass through function, the attributes kept by Hieronymus are hidden.
  */
 int h_getxattr (const char *path, const char *name, char *value, size_t size)
 {
+    TRACE_START();
     int return_value = 0;
-    char root_path[PATH_MAX];
+    char *root_path = NULL;
     
-    resolve_root_path(path, root_path);
+    path_reset();
+    root_path = path_resolve(path);
     
-    return_value = lgetxattr(root_path, name, value, size);
-
-    if (return_value < 0) {
-        return_value = HIERONYMUS_ERROR(err_getxattr, "h_getxattr");
+    if (dedup_hidden_attribute(name)) {
+        return_value = -ENODATA;
+    } else if ((return_value = lgetxattr(root_path, name, value, size)) < 0) {
+        return_value = HIERONYMUS_EXPECTED_ERROR(err_getxattr, "h_getxattr",
+                errno == ENODATA || errno == ENOTSUP);
     }
     
     HIERONYMUS_DEBUG("getxattr: %s (%s: %s)\n", path, name, value);
     HIERONYMUS_LOG(ADMIN->log_file, "[%d] getxattr # %s (%s: %s)\n", OP_PID,
             path, name, value);
+    HIERONYMUS_TRACE(op_getxattr, path, NULL, 0, size, return_value);
 
     return return_value;
 }
@@ -808,20 +1182,26 @@ int h_getxattr (const char *path, const char *name, char *value, size_t size)
  * ** FUSE **
  *
  * ** Hieronymus **
- * Pass through function.
+ * Pass through function, the attributes kept by Hieronymus are left out (the
+ * size asked for with an empty buffer may be larger than needed).
  */
 int h_listxattr (const char *path, char *list, size_t size)
 {
+    TRACE_START();
     int return_value = 0;
-    char root_path[PATH_MAX];
+    char *root_path = NULL;
     char *ptr;
     
-    resolve_root_path(path, root_path);
+    path_reset();
+    root_path = path_resolve(path);
     
     return_value = llistxattr(root_path, list, size);
 
     if (return_value < 0) {
-        return_value = HIERONYMUS_ERROR(err_listxattr, "h_listxattr");
+        return_value = HIERONYMUS_EXPECTED_ERROR(err_listxattr, "h_listxattr",
+                errno == ENOTSUP);
+    } else if (size > 0) {
+        return_value = dedup_filter_attributes(list, return_value);
     }
     
     HIERONYMUS_DEBUG("listxattr: %s:", path);
@@ -830,7 +1210,8 @@ int h_listxattr (const char *path, char *list, size_t size)
     for (ptr = list; ptr < list + return_value; ptr += strlen(ptr)+1) {
         HIERONYMUS_DEBUG("\t%s\n", ptr);
     }
-    
+    HIERONYMUS_TRACE(op_listxattr, path, NULL, 0, size, return_value);
+
     return return_value;
 }
 
@@ -840,25 +1221,29 @@ int h_listxattr (const char *path, char *list, size_t size)
  * ** FUSE **
  *
  * ** Hieronymus **
- * Pass through function.
+ * Pass through function, the attributes kept by Hieronymus are hidden.
  */
 int h_removexattr (const char *path, const char *name)
 {
+    TRACE_START();
     int return_value = 0;
-    char root_path[PATH_MAX];
+    char *root_path = NULL;
     
-    resolve_root_path(path, root_path);
+    path_reset();
+    root_path = path_resolve(path);
     
-    return_value = lremovexattr(root_path, name);
-
-    if (return_value < 0) {
-        return_value = HIERONYMUS_ERROR(err_removexattr, "h_removexattr");
+    if (dedup_hidden_attribute(name)) {
+        return_value = -ENODATA;
+    } else if ((return_value = lremovexattr(root_path, name)) < 0) {
+        return_value = HIERONYMUS_EXPECTED_ERROR(err_removexattr, "h_removexattr",
+                errno == ENODATA || errno == ENOTSUP);
     }
 
     HIERONYMUS_DEBUG("removexattr: %s (%s)\n", path, name);
     HIERONYMUS_LOG(ADMIN->log_file, "[%d] removexattr # %s (%s)\n", OP_PID, path,
             name);
-    
+    HIERONYMUS_TRACE(op_removexattr, path, NULL, 0, 0, return_value);
+
     return return_value;
 }
 
@@ -875,25 +1260,34 @@ int h_removexattr (const char *path, const char *name)
  * Introduced in version 2.3
  *  
  * ** Hieronymus **
- * Pass through function.
+ * Pass through function. The control directory has a handle without a
+ * directory stream.
  */
 int h_opendir (const char *path, struct fuse_file_info *file_info)
 {
-    DIR *dir_pointer;
+    TRACE_START();
+    DIR *dir_pointer = NULL;
     int return_value = 0;
-    char root_path[PATH_MAX];
+    hieronymus_handle *handle = NULL;
+    char *root_path = NULL;
 
-    resolve_root_path(path, root_path);
-    dir_pointer = opendir(root_path);
+    path_reset();
+    root_path = path_resolve(path);
 
-    if (dir_pointer == NULL) {
+    if (control_path(path) == 0) {
+        handle = handle_acquire(path, root_path, file_info->flags);
+    } else if ((dir_pointer = opendir(root_path)) == NULL) {
         return_value = HIERONYMUS_ERROR(err_opendir, "h_opendir");
+    } else {
+        handle = handle_acquire(path, root_path, file_info->flags);
+        handle->directory = dir_pointer;
     }
 
-    file_info->fh = (intptr_t) dir_pointer;
+    file_info->fh = (uintptr_t) handle;
     
     HIERONYMUS_DEBUG("opendir: %s\n", path);
     HIERONYMUS_LOG(ADMIN->log_file, "[%d] opendir # %s\n", OP_PID, path);
+    HIERONYMUS_TRACE(op_opendir, path, NULL, 0, 0, return_value);
 
     return return_value; 
 }
@@ -923,18 +1317,35 @@ int h_opendir (const char *path, struct fuse_file_info *file_info)
  *
  * ** Hieronymus **
  * To prevent the user from exploring the versioning information the '.version'
- * directory is removed from the directory listing.
+ * directory is removed from the directory listing. The control directory lists
+ * the control files.
  */
 int h_readdir (const char *path, void *buffer, fuse_fill_dir_t filler, 
         off_t offset, struct fuse_file_info *file_info)
 {
+    TRACE_START();
     int return_value = 0;
     DIR *dir_pointer;
     struct dirent *directory_entry;
+    const char *name = NULL;
+    int i = 0;
     
     (void) offset;
 
-    dir_pointer = (DIR *) (uintptr_t) file_info->fh;
+    dir_pointer = HANDLE(file_info)->directory;
+
+    if (dir_pointer == NULL) {
+        filler(buffer, ".", NULL, 0);
+        filler(buffer, "..", NULL, 0);
+
+        while ((name = control_name(i++)) != NULL) {
+            if (filler(buffer, name, NULL, 0) != 0) {
+                return HIERONYMUS_ERROR(err_rd_filler, "h_readdir");
+            }
+        }
+
+        return 0;
+    }
 
     /*
      * As a directory always contains '.' and '..', the first call to readdir
@@ -966,6 +1377,7 @@ int h_readdir (const char *path, void *buffer, fuse_fill_dir_t filler,
     
     HIERONYMUS_DEBUG("readdir: %s\n", path);
     HIERONYMUS_LOG(ADMIN->log_file, "[%d] readdir # %s\n", OP_PID, path);
+    HIERONYMUS_TRACE(op_readdir, path, NULL, offset, 0, return_value);
 
     return return_value;
 }
@@ -981,17 +1393,23 @@ int h_readdir (const char *path, void *buffer, fuse_fill_dir_t filler,
  */
 int h_releasedir (const char *path, struct fuse_file_info *file_info)
 {
+    TRACE_START();
     int return_value = 0;
     
-    return_value = closedir((DIR *) (uintptr_t) file_info->fh);
+    if (HANDLE(file_info)->directory != NULL) {
+        return_value = closedir(HANDLE(file_info)->directory);
+    }
 
     if (return_value < 0) {
         return_value = HIERONYMUS_ERROR(err_releasedir, "h_releasedir");
     }
 
+    handle_release(HANDLE(file_info));
+
     HIERONYMUS_DEBUG("releasedir: %s\n", path);
     HIERONYMUS_LOG(ADMIN->log_file, "[%d] releasedir # %s\n", OP_PID, path);
-    
+    HIERONYMUS_TRACE(op_releasedir, path, NULL, 0, 0, return_value);
+
     return return_value;
 }
 
@@ -1009,11 +1427,13 @@ int h_releasedir (const char *path, struct fuse_file_info *file_info)
  */
 int h_fsyncdir (const char *path, int data_sync, struct fuse_file_info *file_info)
 {
+    TRACE_START();
     (void) data_sync;
     (void) file_info;
 
     HIERONYMUS_DEBUG("fsyncdir: %s\n", path);
     HIERONYMUS_LOG(ADMIN->log_file, "[%d] fsyncdir # %s\n", OP_PID, path);
+    HIERONYMUS_TRACE(op_fsyncdir, path, NULL, data_sync, 0, 0);
 
     return 0;
 }
@@ -1030,7 +1450,12 @@ int h_fsyncdir (const char *path, int data_sync, struct fuse_file_info *file_inf
  * Changed in version 2.6
  *
  * ** Hieronymus **
- * Unimplemented.
+ * With journaling enabled the journal is opened here and any intents left
+ * behind by a crash are replayed before the first operation is served. The
+ * version index is opened first, so replayed operations are indexed too.
+ *
+ * The scheduler of deferred work (coalesced versions, flushing the log) is
+ * started here.
  *
  */
 void *h_init (struct fuse_conn_info *connection)
@@ -1039,6 +1464,23 @@ void *h_init (struct fuse_conn_info *connection)
 
     HIERONYMUS_NOTE("init\n");
 
+    if (scheduler_start(SCHEDULER_WORKERS) < 0
+            || log_flush_periodically(ADMIN->log_file) < 0) {
+        HIERONYMUS_ERROR(err_scheduler, "h_init");
+    }
+
+#if defined(_VERSIONING) && defined(_VERSION_INDEX)
+    if (vindex_mount(ADMIN->root_directory) < 0) {
+        HIERONYMUS_ERROR(err_index, "h_init");
+    }
+#endif
+
+#if defined(_VERSIONING) && defined(_JOURNALING)
+    if (journal_open(ADMIN->root_directory) < 0) {
+        HIERONYMUS_ERROR(err_journal, "h_init");
+    }
+#endif
+
     return ADMIN;
 }
 
@@ -1052,10 +1494,48 @@ void *h_init (struct fuse_conn_info *connection)
  * Introduced in version 2.3
  *
  * ** Hieronymus **
- * Free up the memory used by the private-data field.
+ * Free up the memory used by the private-data field, stop the scheduler, close
+ * the journal and the version index, write the remainder of the trace and the
+ * log, finish background packing and compression and print the codec,
+ * deduplication and error counters.
  */
 void h_destroy (void *user_data)
 {
+    scheduler_stop();
+    fflush(ADMIN->log_file);
+
+#ifdef _TRACING
+    trace_close();
+#endif
+
+#ifdef _PACKING
+    pack_drain();
+#endif
+
+#ifdef _COMPRESSION
+    codec_drain();
+    codec_print_statistics(stderr);
+#endif
+
+#ifdef _DEDUP
+    dedup_print_statistics(stderr);
+#endif
+
+    print_error_statistics(stderr);
+    negative_cache_destroy();
+    handle_pool_destroy();
+    vstate_destroy();
+    policy_destroy();
+    config_destroy();
+
+#if defined(_VERSIONING) && defined(_JOURNALING)
+    journal_close();
+#endif
+
+#if defined(_VERSIONING) && defined(_VERSION_INDEX)
+    vindex_unmount();
+#endif
+
     if (user_data != NULL) {
         free(user_data);
     }
@@ -1080,20 +1560,24 @@ void h_destroy (void *user_data)
  */
 int h_access (const char *path, int mask)
 {
+    TRACE_START();
     int return_value = 0;
-    char root_path[PATH_MAX];
+    char *root_path = NULL;
 
-    resolve_root_path(path, root_path);
+    path_reset();
+    root_path = path_resolve(path);
    
-    return_value = access(root_path, mask);
-    
-    if (return_value < 0) {
-        return_value = HIERONYMUS_ERROR(err_access, "h_access");
+    if (control_path(path) >= 0) {
+        return_value = 0;
+    } else if ((return_value = access(root_path, mask)) < 0) {
+        return_value = HIERONYMUS_EXPECTED_ERROR(err_access, "h_access",
+                errno == ENOENT || errno == EACCES);
     }
 
     HIERONYMUS_DEBUG("access: %s\n", path);
     HIERONYMUS_LOG(ADMIN->log_file, "[%d] access # %s\n", OP_PID, path);
-    
+    HIERONYMUS_TRACE(op_access, path, NULL, mask, 0, return_value);
+
     return return_value;
 }
 
@@ -1111,26 +1595,52 @@ int h_access (const char *path, int mask)
  * Introduced in version 2.5
  *
  * ** Hieronymus **
- * Pass through function.
+ * The creation of the file is logged in the version index of its directory.
  */
 int h_create (const char *path, mode_t mode, struct fuse_file_info *file_info)
 {
+    TRACE_START();
     int return_value = 0;
-    char root_path[PATH_MAX];
+    hieronymus_handle *handle = NULL;
+    char *root_path = NULL;
     int file_descriptor;
     
-    resolve_root_path(path, root_path);
+    path_reset();
+    root_path = path_resolve(path);
     
+#ifdef _VERSIONING
+    file_descriptor = h_versioned_create(root_path, mode);
+#else
     file_descriptor = creat(root_path, mode);
 
     if (file_descriptor < 0) {
-        return_value = HIERONYMUS_ERROR(err_create, "h_create");
+        file_descriptor = -errno;
+    }
+#endif
+
+    if (file_descriptor < 0) {
+        return_value = HIERONYMUS_RETURNED_ERROR(err_create, "h_create",
+                file_descriptor, file_descriptor == -EEXIST);
+    } else {
+        handle = handle_acquire(path, root_path, file_info->flags);
+        handle->fd = file_descriptor;
+
+#if defined(_VERSIONING) && !defined(_BLOCK_VERSIONING)
+        scheduler_timer_init(&handle->timer, version_coalesced_later, handle);
+#endif
+
+#if defined(_DEDUP) && !defined(_BLOCK_VERSIONING)
+        handle_track(handle);
+#endif
     }
     
-    file_info->fh = file_descriptor;
+    file_info->fh = (uintptr_t) handle;
     
+    negative_cache_invalidate(path);
+
     HIERONYMUS_DEBUG("create: %s\n", path);
     HIERONYMUS_LOG(ADMIN->log_file, "[%d] create # %s\n", OP_PID, path);
+    HIERONYMUS_TRACE(op_create, path, NULL, mode, 0, return_value);
 
     return return_value;
 }
@@ -1149,14 +1659,45 @@ int h_create (const char *path, mode_t mode, struct fuse_file_info *file_info)
  * Introduced in version 2.5
  *
  * ** Hieronymus **
- * Pass through function.
+ * Pass through function. With block-level versioning the blocks cut off by
+ * shrinking the file are saved first.
  */
 int h_ftruncate (const char *path, off_t offset, 
         struct fuse_file_info *file_info)
 {
+    TRACE_START();
     int return_value = 0;
+    hieronymus_handle *handle = HANDLE(file_info);
+
+    if (handle->control != NULL) {
+        return 0;
+    }
+
+#if defined(_VERSIONING) && defined(_BLOCK_VERSIONING)
+    struct stat stat_buffer;
+    char *root_path = NULL;
+
+    if (fstat(handle->fd, &stat_buffer) == 0 
+            && stat_buffer.st_size > offset) {
+        path_reset();
+        root_path = handle_root_path(handle, path);
+
+        if (h_versioned_block_write(&handle->epoch, root_path, 
+                    stat_buffer.st_size - offset, offset) < 0) {
+            HIERONYMUS_ERROR(err_vs_write, "h_ftruncate");
+        }
+    }
+#endif
+
+#if defined(_DEDUP) && !defined(_BLOCK_VERSIONING)
+    handle_change_begin(handle);
+#endif
     
-    return_value = ftruncate(file_info->fh, offset);
+    return_value = ftruncate(handle->fd, offset);
+
+#if defined(_DEDUP) && !defined(_BLOCK_VERSIONING)
+    handle_hash_truncate(handle, offset, return_value < 0);
+#endif
 
     if (return_value < 0) {
         return_value = HIERONYMUS_ERROR(err_ftruncate, "h_ftruncate");
@@ -1164,6 +1705,7 @@ int h_ftruncate (const char *path, off_t offset,
     
     HIERONYMUS_DEBUG("ftruncate: %s\n", path);
     HIERONYMUS_LOG(ADMIN->log_file, "[%d] ftruncate # %s\n", OP_PID, path);
+    HIERONYMUS_TRACE(op_ftruncate, path, NULL, offset, 0, return_value);
 
     return return_value;
 }
@@ -1188,9 +1730,14 @@ int h_ftruncate (const char *path, off_t offset,
 int h_fgetattr (const char *path, struct stat *stat_buffer, 
         struct fuse_file_info *file_info)
 {
+    TRACE_START();
     int return_value = 0;
     
-    return_value = fstat(file_info->fh, stat_buffer);
+    if (HANDLE(file_info)->control != NULL) {
+        return_value = control_getattr(path, stat_buffer);
+    } else {
+        return_value = fstat(HANDLE(file_info)->fd, stat_buffer);
+    }
 
     if (return_value < 0) {
         return_value = HIERONYMUS_ERROR(err_fgetattr, "h_fgetattr");
@@ -1198,24 +1745,9 @@ int h_fgetattr (const char *path, struct stat *stat_buffer,
 
     HIERONYMUS_DEBUG("fgetattr: %s\n", path);
     HIERONYMUS_LOG(ADMIN->log_file, "[%d] fgetattr # %s\n", OP_PID, path);
-    
-    return return_value;
-}
+    HIERONYMUS_TRACE(op_fgetattr, path, NULL, 0, 0, return_value);
 
-/**
- * Acquire the path to the actual contents of the file system.
- *
- * ** Hieronymus **
- * The root of the file system and the mount point are two separate locations in
- * the file system. However, all paths are relative to the mount point. This
- * function translates each path to the root directory.
- */
-void resolve_root_path (const char *path, char *new_path) 
-{
-    HIERONYMUS_DEBUG("resolve_root_path: %s\n", path);
-    
-    sprintf((char *) new_path, "%s%s", ADMIN->root_directory, path);
-    new_path[strlen(ADMIN->root_directory) + strlen(path)] = '\0';
+    return return_value;
 }
 
 /**
@@ -1268,7 +1800,7 @@ struct fuse_operations hieronymus_operations = {
  *  - Parsing the commandline.
  *  - Adding optional commandline arguments.
  *  - Creating the necessary directories.
- *  - Syncing root directory and mount directory (Unimplemented).
+ *  - Building the versioning baseline of an existing root directory.
  *  - Starting the FUSE main loop.
  */
 int main (int argc, char *argv[])
@@ -1278,6 +1810,82 @@ int main (int argc, char *argv[])
     char versioning_root[PATH_MAX] = "";
     hieronymus_data *administration = NULL;
 
+    char negative_ttl[MAX_ARG_LENGTH] = "";
+    char negative_timeout[MAX_ARG_LENGTH] = "";
+    char assignment[2 * MAX_ARG_LENGTH] = "";
+    char policy_file[PATH_MAX] = "";
+
+#ifdef _TRACING
+    char trace_path[PATH_MAX] = "";
+
+    /*
+     * Record a binary trace of all operations to the given file.
+     */
+    argc = extract_commandline_option(argc, argv, "--trace=", trace_path, 
+            PATH_MAX);
+
+    if (strlen(trace_path) > 0 && trace_open(trace_path) < 0) {
+        abort();
+    }
+#endif
+
+#ifdef _COMPRESSION
+    char codec_rules[PATH_MAX] = "";
+    char codec_dictionaries[PATH_MAX] = "";
+
+    /*
+     * Compress stored versions with the codec(s) given as
+     * '[pattern=]codec[:level],...', optionally with zstd dictionaries per
+     * file type.
+     */
+    argc = extract_commandline_option(argc, argv, "--codec=", codec_rules, 
+            PATH_MAX);
+    argc = extract_commandline_option(argc, argv, "--codec_dictionaries=", 
+            codec_dictionaries, PATH_MAX);
+
+    if (codec_configure(codec_rules, codec_dictionaries) < 0) {
+        abort();
+    }
+#endif
+
+#ifdef _PACKING
+    char pack_threshold[MAX_ARG_LENGTH] = "";
+
+    /*
+     * Stored versions of at most this many bytes are moved into the pack of
+     * their '.version' directory.
+     */
+    argc = extract_commandline_option(argc, argv, "--pack_threshold=", 
+            pack_threshold, MAX_ARG_LENGTH);
+
+    if (strlen(pack_threshold) > 0) {
+        snprintf(assignment, sizeof(assignment), "pack_threshold=%s",
+                pack_threshold);
+
+        if (config_update(assignment) < 0) {
+            abort();
+        }
+    }
+#endif
+
+    /*
+     * Decide per path which files are versioned, and how, by the rules in the
+     * given file.
+     */
+    argc = extract_commandline_option(argc, argv, "--policy=", policy_file, 
+            PATH_MAX);
+
+    if (strlen(policy_file) > 0 && policy_load(policy_file) < 0) {
+        abort();
+    }
+
+    /*
+     * Remember failed lookups for the given number of seconds, in the daemon
+     * as well as in the kernel.
+     */
+    argc = extract_commandline_option(argc, argv, "--negative_ttl=", 
+            negative_ttl, MAX_ARG_LENGTH);
+
     /* Handle custom commandline parameters */
     parse_commandline(argc, argv, versioning_root);
 
@@ -1300,6 +1908,19 @@ int main (int argc, char *argv[])
      */
     argc = add_commandline_arg(argc, &argv, "-o nonempty");
 
+    if (atof(negative_ttl) > 0) {
+        snprintf(assignment, sizeof(assignment), "negative_ttl=%s",
+                negative_ttl);
+
+        if (config_update(assignment) < 0) {
+            abort();
+        }
+
+        snprintf(negative_timeout, MAX_ARG_LENGTH, "-o negative_timeout=%g",
+                atof(negative_ttl));
+        argc = add_commandline_arg(argc, &argv, negative_timeout);
+    }
+
 #ifdef _DEBUG
     argc = add_commandline_arg(argc, &argv, "-f");
  //   argc = add_commandline_arg(argc, &argv, "-d");
@@ -1319,14 +1940,22 @@ int main (int argc, char *argv[])
         abort();
     }
 
+    /*
+     * All paths in the mount point are resolved against the root directory.
+     */
+    path_init(versioning_root);
+
+#ifdef _VERSIONING
     /* 
-     * Synchronize mountpoint and versioning_root. 
+     * Synchronize the root directory and its versioning information.
      *
-     * TODO
-     * This function would be needed when mounting an existing (non-empty)
-     * directory with versioning.
+     * When an existing (non-empty) root directory is mounted with versioning,
+     * every file gets a snapshot version to serve as its baseline.
      */
-    //synchronize_roots();
+    if (synchronize_roots(versioning_root) != 0) {
+        HIERONYMUS_ERROR(err_synchronize, "main");
+    }
+#endif
 
     /*
      * Setup private data-structure. 
@@ -1338,9 +1967,10 @@ int main (int argc, char *argv[])
     }
 
     administration->root_directory = versioning_root;
-    administration->max_num_versions = MAX_NUM_VERSIONS;
     administration->log_file = open_log_file();
 
+    hieronymus_admin = administration;
+
     umask(0);
 
     /*
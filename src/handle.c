@@ -0,0 +1,690 @@
+/******************************************************************************
+ *
+ * file   : handle.c
+ *
+ * author : Tim van Deurzen
+ * date   : 18/10/2026
+ *
+ * State kept per open file and directory.
+ *
+ * Instead of a bare file descriptor (or DIR pointer) the fuse_file_info of an
+ * open file holds a handle: the descriptor, the path in the root directory it
+ * was opened under, the ranges written through it and some statistics. So the
+ * root path does not have to be resolved again for every write and state can
+ * be kept from one operation on a file to the next.
+ *
+ * Handles are allocated in slabs and recycled through a free list, opening a
+ * file normally does not call malloc.
+ *
+ * A handle also keeps the rule of the versioning policy that applies to its
+ * file (see policy.c), so writes do not match the path again.
+ *
+ * A handle of a file that is written sequentially from its start keeps the
+ * SHA-1 of what was written (with -D_DEDUP), so the digest of a new version
+ * is known without reading the file again. Files open for writing are kept in
+ * a table by inode, with a generation that every write, through any handle,
+ * and every truncation advances before it starts, and a count of the changes in
+ * progress. A handle that finds a change it did not make itself, or writes out
+ * of order, stops hashing; the digest is then computed from the file when it
+ * is needed. No digest is handed out while a change of the file is in
+ * progress, it may already be in the file without being in the generation.
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "handle.h"
+#include "fuse_main.h"
+#include "util.h"
+#include "path.h"
+
+/*
+ * A block of handles, slabs are only freed when the pool is destroyed.
+ */
+typedef struct HANDLE_SLAB {
+    hieronymus_handle handles[HANDLE_SLAB_SIZE];
+    struct HANDLE_SLAB *next;
+} handle_slab;
+
+static struct {
+    hieronymus_handle *free_list;
+    handle_slab *slabs;
+    pthread_mutex_t lock;
+} handle_pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static struct {
+    handle_file *buckets[HANDLE_FILE_BUCKETS];
+    pthread_mutex_t locks[HANDLE_FILE_BUCKETS];
+} handle_files;
+
+static pthread_once_t handle_files_once = PTHREAD_ONCE_INIT;
+
+static void init_handle_files(void)
+{
+    int i = 0;
+
+    for (i = 0; i < HANDLE_FILE_BUCKETS; i++) {
+        pthread_mutex_init(&handle_files.locks[i], NULL);
+    }
+}
+
+static int file_bucket(dev_t device, ino_t inode)
+{
+    return (inode ^ (device * 31)) % HANDLE_FILE_BUCKETS;
+}
+
+/**
+ * Find the entry of a file in its bucket, called with the bucket locked.
+ */
+static handle_file *find_file_locked(int bucket, dev_t device, ino_t inode)
+{
+    handle_file *file = handle_files.buckets[bucket];
+
+    while (file != NULL && (file->device != device || file->inode != inode)) {
+        file = file->next;
+    }
+
+    return file;
+}
+
+/**
+ * Record that a change of the file of a handle made through the handle is
+ * done. Returns whether the handle made every change since its last one,
+ * including this one.
+ */
+static int end_change(hieronymus_handle *handle)
+{
+    int bucket = file_bucket(handle->file->device, handle->file->inode);
+    int in_order = 0;
+
+    pthread_mutex_lock(&handle_files.locks[bucket]);
+
+    in_order = handle->file->generation == handle->generation;
+    handle->file->changing--;
+
+    pthread_mutex_unlock(&handle_files.locks[bucket]);
+
+    return in_order;
+}
+
+/**
+ * Drop the reference of a handle to its file.
+ */
+static void untrack(hieronymus_handle *handle)
+{
+    handle_file **link = NULL;
+    int bucket = file_bucket(handle->file->device, handle->file->inode);
+
+    pthread_mutex_lock(&handle_files.locks[bucket]);
+
+    if (--handle->file->references == 0) {
+        for (link = &handle_files.buckets[bucket]; *link != handle->file;
+                link = &(*link)->next);
+
+        *link = handle->file->next;
+        free(handle->file);
+    }
+
+    pthread_mutex_unlock(&handle_files.locks[bucket]);
+
+    handle->file = NULL;
+}
+
+/**
+ * Allocate a new slab and put all its handles on the free list. Called with
+ * the pool lock held.
+ */
+static void grow_pool_locked(void)
+{
+    handle_slab *slab = NULL;
+    int i = 0;
+
+    slab = (handle_slab *) checked_malloc(sizeof(handle_slab));
+    memset(slab, 0, sizeof(handle_slab));
+
+    for (i = 0; i < HANDLE_SLAB_SIZE; i++) {
+        pthread_mutex_init(&slab->handles[i].lock, NULL);
+        block_epoch_init(&slab->handles[i].epoch);
+        slab->handles[i].extents = (handle_extent *) checked_malloc(
+                HANDLE_EXTENTS * sizeof(handle_extent));
+        slab->handles[i].max_extents = HANDLE_EXTENTS;
+        slab->handles[i].next_free = handle_pool.free_list;
+        handle_pool.free_list = &slab->handles[i];
+    }
+
+    slab->next = handle_pool.slabs;
+    handle_pool.slabs = slab;
+}
+
+/**
+ * Take a handle from the pool for a file or directory opened with the given
+ * flags. The descriptor (or directory) is filled in by the caller.
+ */
+hieronymus_handle *handle_acquire(const char *path, const char *root_path,
+        int flags)
+{
+    hieronymus_handle *handle = NULL;
+
+    pthread_mutex_lock(&handle_pool.lock);
+
+    if (handle_pool.free_list == NULL) {
+        grow_pool_locked();
+    }
+
+    handle = handle_pool.free_list;
+    handle_pool.free_list = handle->next_free;
+
+    pthread_mutex_unlock(&handle_pool.lock);
+
+    handle->fd = -1;
+    handle->flags = flags;
+    handle->directory = NULL;
+    handle->control = NULL;
+    handle->num_extents = 0;
+    handle->versions = 0;
+    handle->policy = policy_match(path);
+    handle->last_version = 0;
+    handle->coalesced = 0;
+    scheduler_timer_init(&handle->timer, NULL, handle);
+    handle->file = NULL;
+    handle->hashed = 0;
+    handle->hashing = 0;
+    handle->next_free = NULL;
+    memset(&handle->statistics, 0, sizeof(handle_statistics));
+
+    strncpy(handle->path, path, PATH_MAX - 1);
+    handle->path[PATH_MAX - 1] = '\0';
+    strncpy(handle->root_path, root_path, PATH_MAX - 1);
+    handle->root_path[PATH_MAX - 1] = '\0';
+    handle->root_length = strlen(handle->root_path);
+
+    return handle;
+}
+
+/**
+ * Return a handle to the pool. The descriptor must have been closed.
+ */
+void handle_release(hieronymus_handle *handle)
+{
+    if (handle == NULL) {
+        return;
+    }
+
+    if (handle->file != NULL) {
+        untrack(handle);
+    }
+
+    block_epoch_close(&handle->epoch);
+
+    /*
+     * Shrink extents that grew for a heavily written file.
+     */
+    if (handle->max_extents > HANDLE_EXTENTS) {
+        free(handle->extents);
+        handle->extents = (handle_extent *) checked_malloc(
+                HANDLE_EXTENTS * sizeof(handle_extent));
+        handle->max_extents = HANDLE_EXTENTS;
+    }
+
+    pthread_mutex_lock(&handle_pool.lock);
+
+    handle->next_free = handle_pool.free_list;
+    handle_pool.free_list = handle;
+
+    pthread_mutex_unlock(&handle_pool.lock);
+}
+
+/**
+ * Free all slabs, called when the file system is unmounted.
+ */
+void handle_pool_destroy(void)
+{
+    handle_slab *slab = NULL;
+    int i = 0;
+
+    pthread_mutex_lock(&handle_pool.lock);
+
+    while (handle_pool.slabs != NULL) {
+        slab = handle_pool.slabs;
+        handle_pool.slabs = slab->next;
+
+        for (i = 0; i < HANDLE_SLAB_SIZE; i++) {
+            free(slab->handles[i].extents);
+            block_epoch_destroy(&slab->handles[i].epoch);
+            pthread_mutex_destroy(&slab->handles[i].lock);
+        }
+
+        free(slab);
+    }
+
+    handle_pool.free_list = NULL;
+
+    pthread_mutex_unlock(&handle_pool.lock);
+}
+
+/**
+ * Return the root path of an open file (allocated from the path arena), given
+ * its current path in the mount point. The root path is only resolved again if
+ * the file was renamed.
+ */
+char *handle_root_path(hieronymus_handle *handle, const char *path)
+{
+    char *root_path = NULL;
+
+    pthread_mutex_lock(&handle->lock);
+
+    if (strcmp(handle->path, path) != 0) {
+        strncpy(handle->path, path, PATH_MAX - 1);
+        handle->path[PATH_MAX - 1] = '\0';
+        handle->root_length = snprintf(handle->root_path, PATH_MAX, "%s%s", 
+                ADMIN->root_directory, path);
+        handle->policy = policy_match(path);
+    }
+
+    root_path = path_alloc(handle->root_length + 1);
+    memcpy(root_path, handle->root_path, handle->root_length + 1);
+
+    pthread_mutex_unlock(&handle->lock);
+
+    return root_path;
+}
+
+/**
+ * Mark the range [offset, offset + size) as written, merging it with the
+ * extents it overlaps or touches.
+ */
+void handle_add_extent(hieronymus_handle *handle, off_t offset, size_t size)
+{
+    off_t start = offset;
+    off_t end = offset + size;
+    size_t low = 0;
+    size_t high = 0;
+    size_t middle = 0;
+    size_t last = 0;
+
+    if (size == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&handle->lock);
+
+    /*
+     * Find the first extent that ends at or after the start of the range.
+     */
+    high = handle->num_extents;
+
+    while (low < high) {
+        middle = (low + high) / 2;
+
+        if (handle->extents[middle].end < start) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    /*
+     * Merge all extents that start at or before the end of the range.
+     */
+    for (last = low; last < handle->num_extents
+            && handle->extents[last].start <= end; last++) {
+        if (handle->extents[last].start < start) {
+            start = handle->extents[last].start;
+        }
+
+        if (handle->extents[last].end > end) {
+            end = handle->extents[last].end;
+        }
+    }
+
+    if (last == low) {
+        /* No overlap, insert a new extent at 'low'. */
+        if (handle->num_extents == handle->max_extents) {
+            handle->max_extents *= 2;
+            handle->extents = (handle_extent *) realloc(handle->extents,
+                    handle->max_extents * sizeof(handle_extent));
+
+            if (handle->extents == NULL) {
+                abort();
+            }
+        }
+
+        memmove(&handle->extents[low + 1], &handle->extents[low],
+                (handle->num_extents - low) * sizeof(handle_extent));
+        handle->num_extents++;
+    } else {
+        /* Replace extents low .. last - 1 by a single extent. */
+        memmove(&handle->extents[low + 1], &handle->extents[last],
+                (handle->num_extents - last) * sizeof(handle_extent));
+        handle->num_extents -= last - low - 1;
+    }
+
+    handle->extents[low].start = start;
+    handle->extents[low].end = end;
+
+    pthread_mutex_unlock(&handle->lock);
+}
+
+/**
+ * Forget all written ranges, returns the number of extents that were dirty.
+ */
+size_t handle_clear_extents(hieronymus_handle *handle)
+{
+    size_t num_extents = 0;
+
+    pthread_mutex_lock(&handle->lock);
+
+    num_extents = handle->num_extents;
+    handle->num_extents = 0;
+
+    pthread_mutex_unlock(&handle->lock);
+
+    return num_extents;
+}
+
+/**
+ * Return whether writes through the handle are versioned at all by the
+ * versioning policy.
+ */
+int handle_versioned(hieronymus_handle *handle)
+{
+    return handle->policy == NULL || handle->policy->versioned;
+}
+
+/**
+ * Decide whether a write through the handle creates a version now. With a
+ * coalescing interval in the rule of the file, a version is created at most
+ * once per interval, a write in between marks the handle instead.
+ */
+int handle_version_due(hieronymus_handle *handle)
+{
+    struct timespec now;
+    unsigned long long time = 0;
+    int due = 1;
+
+    if (handle->policy == NULL || handle->policy->coalesce == 0) {
+        return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    time = now.tv_sec * 1000000000ULL + now.tv_nsec;
+
+    pthread_mutex_lock(&handle->lock);
+
+    if (handle->last_version != 0 && time - handle->last_version
+            < handle->policy->coalesce * 1000000ULL) {
+        handle->coalesced = 1;
+        due = 0;
+    } else {
+        handle->last_version = time;
+        handle->coalesced = 0;
+    }
+
+    pthread_mutex_unlock(&handle->lock);
+
+    return due;
+}
+
+/**
+ * Return whether writes through the handle were not versioned because of the
+ * coalescing interval, and clear the mark. Called when the file is released,
+ * so its last state is versioned.
+ */
+int handle_take_coalesced(hieronymus_handle *handle)
+{
+    int coalesced = 0;
+
+    pthread_mutex_lock(&handle->lock);
+
+    coalesced = handle->coalesced;
+    handle->coalesced = 0;
+
+    pthread_mutex_unlock(&handle->lock);
+
+    return coalesced;
+}
+
+/**
+ * Track the file of a handle opened for writing, once its descriptor is
+ * filled in. An empty file is hashed from here on.
+ */
+void handle_track(hieronymus_handle *handle)
+{
+    handle_file *file = NULL;
+    struct stat stat_buffer;
+    int bucket = 0;
+
+    if (handle->fd < 0 || (handle->flags & O_ACCMODE) == O_RDONLY
+            || fstat(handle->fd, &stat_buffer) < 0) {
+        return;
+    }
+
+    pthread_once(&handle_files_once, init_handle_files);
+    bucket = file_bucket(stat_buffer.st_dev, stat_buffer.st_ino);
+
+    pthread_mutex_lock(&handle_files.locks[bucket]);
+
+    file = find_file_locked(bucket, stat_buffer.st_dev, stat_buffer.st_ino);
+
+    if (file == NULL) {
+        file = (handle_file *) checked_malloc(sizeof(handle_file));
+        file->device = stat_buffer.st_dev;
+        file->inode = stat_buffer.st_ino;
+        file->generation = 0;
+        file->changing = 0;
+        file->references = 0;
+        file->next = handle_files.buckets[bucket];
+        handle_files.buckets[bucket] = file;
+    }
+
+    file->references++;
+    handle->file = file;
+    handle->generation = file->generation;
+
+    pthread_mutex_unlock(&handle_files.locks[bucket]);
+
+    handle->hashed = 0;
+    handle->hashing = stat_buffer.st_size == 0;
+
+    if (handle->hashing) {
+        sha1_starts(&handle->digest);
+    }
+}
+
+/**
+ * Record that the file of a handle is about to be written or truncated through
+ * the handle, before the change is made. Must be followed by handle_hash_write
+ * or handle_hash_truncate. A handle that did not make the last change of the
+ * file stops hashing.
+ */
+void handle_change_begin(hieronymus_handle *handle)
+{
+    int bucket = 0;
+    int in_order = 0;
+
+    if (handle->file == NULL) {
+        return;
+    }
+
+    bucket = file_bucket(handle->file->device, handle->file->inode);
+
+    pthread_mutex_lock(&handle->lock);
+    pthread_mutex_lock(&handle_files.locks[bucket]);
+
+    in_order = handle->file->generation == handle->generation;
+    handle->generation = ++handle->file->generation;
+    handle->file->changing++;
+
+    pthread_mutex_unlock(&handle_files.locks[bucket]);
+
+    if (!in_order) {
+        handle->hashing = 0;
+    }
+
+    pthread_mutex_unlock(&handle->lock);
+}
+
+/**
+ * Feed bytes written through a handle at offset to its running digest, ending
+ * the change started with handle_change_begin ('length' is negative if the
+ * write failed). A write that does not continue where the digest ends, or that
+ * another change of the file overlapped, stops the hashing.
+ */
+void handle_hash_write(hieronymus_handle *handle, const char *buffer,
+        off_t offset, ssize_t length)
+{
+    if (handle->file == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&handle->lock);
+
+    if (end_change(handle) && handle->hashing && length >= 0
+            && offset == handle->hashed) {
+        sha1_update(&handle->digest, (const unsigned char *) buffer, length);
+        handle->hashed += length;
+    } else {
+        handle->hashing = 0;
+    }
+
+    pthread_mutex_unlock(&handle->lock);
+}
+
+/**
+ * Account for the truncation of the file of a handle through the handle,
+ * ending the change started with handle_change_begin ('failed' is set if the
+ * truncation failed). Truncating it to nothing starts the digest again.
+ */
+void handle_hash_truncate(hieronymus_handle *handle, off_t size, int failed)
+{
+    int in_order = 0;
+
+    if (handle->file == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&handle->lock);
+
+    in_order = end_change(handle);
+
+    if (in_order && !failed && size == 0) {
+        sha1_starts(&handle->digest);
+        handle->hashed = 0;
+        handle->hashing = 1;
+    } else if (!in_order || failed || size != handle->hashed) {
+        handle->hashing = 0;
+    }
+
+    pthread_mutex_unlock(&handle->lock);
+}
+
+/**
+ * Record that a file is about to be changed other than through a handle (e.g.
+ * truncate() by path), the digests of its handles are stale from now on.
+ * Returns the entry of the file to pass to handle_file_change_end, NULL if it
+ * is not open for writing.
+ */
+handle_file *handle_file_change_begin(const char *root_path)
+{
+    handle_file *file = NULL;
+    struct stat stat_buffer;
+    int bucket = 0;
+
+    if (stat(root_path, &stat_buffer) < 0) {
+        return NULL;
+    }
+
+    pthread_once(&handle_files_once, init_handle_files);
+    bucket = file_bucket(stat_buffer.st_dev, stat_buffer.st_ino);
+
+    pthread_mutex_lock(&handle_files.locks[bucket]);
+
+    file = find_file_locked(bucket, stat_buffer.st_dev, stat_buffer.st_ino);
+
+    if (file != NULL) {
+        file->generation++;
+        file->changing++;
+        file->references++;
+    }
+
+    pthread_mutex_unlock(&handle_files.locks[bucket]);
+
+    return file;
+}
+
+/**
+ * Record that a change started with handle_file_change_begin is done.
+ */
+void handle_file_change_end(handle_file *file)
+{
+    handle_file **link = NULL;
+    int bucket = 0;
+
+    if (file == NULL) {
+        return;
+    }
+
+    bucket = file_bucket(file->device, file->inode);
+
+    pthread_mutex_lock(&handle_files.locks[bucket]);
+
+    file->changing--;
+
+    if (--file->references == 0) {
+        for (link = &handle_files.buckets[bucket]; *link != file;
+                link = &(*link)->next);
+
+        *link = file->next;
+        free(file);
+    }
+
+    pthread_mutex_unlock(&handle_files.locks[bucket]);
+}
+
+/**
+ * Return the SHA-1 of the file of a handle, from its running digest, or NULL
+ * if that does not cover the current contents of the file or the file is being
+ * changed.
+ */
+const unsigned char *handle_digest(hieronymus_handle *handle,
+        unsigned char *digest)
+{
+    sha1_context context;
+    struct stat stat_buffer;
+    int bucket = 0;
+    int valid = 0;
+
+    if (handle->file == NULL) {
+        return NULL;
+    }
+
+    bucket = file_bucket(handle->file->device, handle->file->inode);
+
+    pthread_mutex_lock(&handle->lock);
+    pthread_mutex_lock(&handle_files.locks[bucket]);
+
+    valid = handle->hashing && handle->file->changing == 0
+        && handle->file->generation == handle->generation;
+
+    pthread_mutex_unlock(&handle_files.locks[bucket]);
+
+    if (valid && stat(handle->root_path, &stat_buffer) == 0
+            && stat_buffer.st_ino == handle->file->inode
+            && stat_buffer.st_size == handle->hashed) {
+        context = handle->digest;
+        sha1_finish(&context, digest);
+    } else {
+        valid = 0;
+    }
+
+    pthread_mutex_unlock(&handle->lock);
+
+    return valid ? digest : NULL;
+}
@@ -0,0 +1,653 @@
+/******************************************************************************
+ *
+ * file   : journal.c
+ *
+ * author : Tim van Deurzen
+ * date   : 18/10/2026
+ *
+ * Write-ahead intent journal for crash-consistent versioning.
+ *
+ * Operations that change both a live file and its history (a write followed by
+ * the creation of a version, the move of a removed directory into '.version')
+ * log an intent before they start and a completion record when they are done.
+ * After a crash every intent without a completion record is replayed at the
+ * next mount, bringing the history back in line with the live files.
+ *
+ * Records are appended to an in-memory buffer and written to the journal in
+ * batches: the first thread that needs its intent in the journal writes the
+ * records of all waiting threads with a single write (group commit). Intents
+ * reach the kernel before the operation they describe starts, which is enough
+ * to survive a crash of the daemon. A background thread syncs the journal to
+ * stable storage every journal_sync_interval milliseconds (of the runtime
+ * configuration, JOURNAL_SYNC_INTERVAL by default) and on fsync(), so no
+ * write pays for an fsync of its own.
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <limits.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "journal.h"
+#include "versioning.h"
+#include "util.h"
+#include "error.h"
+#include "config.h"
+
+/*
+ * An intent read from the journal during recovery.
+ */
+typedef struct JOURNAL_INTENT {
+    unsigned long long sequence;
+    int type;
+    int completed;
+    const char *path;
+    const char *new_path;
+} journal_intent_entry;
+
+/*
+ * State of the journal of this mount.
+ */
+static struct {
+    int fd;
+    int running;
+    int writing;
+    char *buffer;
+    char *spare;
+    size_t used;
+    off_t size;
+    unsigned long outstanding;
+    unsigned long long next_sequence;
+    unsigned long long buffered_sequence;
+    unsigned long long written_sequence;
+    pthread_mutex_t lock;
+    pthread_cond_t written;
+    pthread_cond_t stop;
+    pthread_t flusher;
+} journal = { 
+    .fd = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .written = PTHREAD_COND_INITIALIZER,
+    .stop = PTHREAD_COND_INITIALIZER
+};
+
+/**
+ * Calculate the checksum of a record (FNV-1a over header and payload).
+ *
+ * The checksum field of the header must be zero while it is calculated.
+ */
+static unsigned int record_checksum(const journal_record *record, 
+        const char *payload)
+{
+    unsigned int hash = 2166136261U;
+    const unsigned char *bytes = (const unsigned char *) record;
+    size_t i = 0;
+
+    for (i = 0; i < sizeof(journal_record); i++) {
+        hash = (hash ^ bytes[i]) * 16777619U;
+    }
+
+    bytes = (const unsigned char *) payload;
+
+    for (i = 0; i < record->length; i++) {
+        hash = (hash ^ bytes[i]) * 16777619U;
+    }
+
+    return hash;
+}
+
+/**
+ * Write the whole buffer, retrying on short writes.
+ */
+static int write_all(int fd, const char *buffer, size_t length)
+{
+    ssize_t written = 0;
+
+    while (length > 0) {
+        written = write(fd, buffer, length);
+
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return -1;
+        }
+
+        buffer += written;
+        length -= written;
+    }
+
+    return 0;
+}
+
+/**
+ * Write the buffered records to the journal.
+ *
+ * Must be called with the journal lock held. The calling thread becomes the
+ * leader of the batch: it takes the current buffer, releases the lock while
+ * writing and wakes up all threads waiting for records in the batch. Only one
+ * batch is written at a time, so records end up in the journal in order.
+ */
+static int flush_locked(void)
+{
+    int return_value = 0;
+    char *batch = NULL;
+    size_t length = 0;
+    unsigned long long last_sequence = 0;
+
+    while (journal.writing) {
+        pthread_cond_wait(&journal.written, &journal.lock);
+    }
+
+    if (journal.used == 0) {
+        return 0;
+    }
+
+    batch = journal.buffer;
+    length = journal.used;
+    last_sequence = journal.buffered_sequence;
+
+    journal.buffer = journal.spare;
+    journal.spare = NULL;
+    journal.used = 0;
+    journal.writing = 1;
+
+    pthread_mutex_unlock(&journal.lock);
+
+    if (write_all(journal.fd, batch, length) < 0) {
+        return_value = HIERONYMUS_ERROR(err_journal, "flush_locked");
+    }
+
+    pthread_mutex_lock(&journal.lock);
+
+    journal.spare = batch;
+    journal.size += length;
+    journal.writing = 0;
+
+    if (last_sequence > journal.written_sequence) {
+        journal.written_sequence = last_sequence;
+    }
+
+    pthread_cond_broadcast(&journal.written);
+
+    return return_value;
+}
+
+/**
+ * Append a record to the in-memory buffer.
+ *
+ * Must be called with the journal lock held. If the buffer is full, it is
+ * written to the journal first.
+ */
+static void append_locked(int type, unsigned long long sequence, 
+        const char *payload, size_t length)
+{
+    journal_record record;
+
+    while (journal.used + sizeof(journal_record) + length 
+            > JOURNAL_BUFFER_SIZE) {
+        flush_locked();
+    }
+
+    memset(&record, 0, sizeof(journal_record));
+    record.magic = JOURNAL_MAGIC;
+    record.type = type;
+    record.length = length;
+    record.sequence = sequence;
+    record.checksum = record_checksum(&record, payload);
+
+    memcpy(journal.buffer + journal.used, &record, sizeof(journal_record));
+
+    if (length > 0) {
+        memcpy(journal.buffer + journal.used + sizeof(journal_record), 
+                payload, length);
+    }
+
+    journal.used += sizeof(journal_record) + length;
+}
+
+/**
+ * Log an intent.
+ *
+ * Both paths are paths in the root directory. The intent is only buffered,
+ * use journal_commit to make sure it is in the journal before starting the
+ * operation. Returns the sequence number of the intent (0 if journaling is not
+ * active).
+ */
+unsigned long long journal_intent(int type, const char *path, 
+        const char *new_path)
+{
+    unsigned long long sequence = 0;
+    size_t path_length = strlen(path) + 1;
+    size_t new_path_length = (new_path != NULL) ? strlen(new_path) + 1 : 0;
+    char payload[2 * PATH_MAX];
+
+    if (journal.fd < 0 || path_length + new_path_length > sizeof(payload)) {
+        return 0;
+    }
+
+    memcpy(payload, path, path_length);
+
+    if (new_path != NULL) {
+        memcpy(payload + path_length, new_path, new_path_length);
+    }
+
+    pthread_mutex_lock(&journal.lock);
+
+    sequence = ++journal.next_sequence;
+    append_locked(type, sequence, payload, path_length + new_path_length);
+    journal.buffered_sequence = sequence;
+    journal.outstanding++;
+
+    pthread_mutex_unlock(&journal.lock);
+
+    return sequence;
+}
+
+/**
+ * Wait until the intent with the given sequence number is in the journal.
+ *
+ * Threads committing at the same time share a single write.
+ */
+int journal_commit(unsigned long long sequence)
+{
+    int return_value = 0;
+
+    if (sequence == 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&journal.lock);
+
+    while (journal.written_sequence < sequence && return_value == 0) {
+        return_value = flush_locked();
+    }
+
+    pthread_mutex_unlock(&journal.lock);
+
+    return return_value;
+}
+
+/**
+ * Log the completion of an intent.
+ *
+ * Completion records are not committed; if they are lost in a crash the intent
+ * is replayed, which is harmless.
+ */
+void journal_done(unsigned long long sequence)
+{
+    if (sequence == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&journal.lock);
+
+    append_locked(intent_done, sequence, NULL, 0);
+    journal.outstanding--;
+
+    pthread_mutex_unlock(&journal.lock);
+}
+
+/**
+ * Write all buffered records and sync the journal to stable storage.
+ *
+ * If no intents are outstanding and the journal has grown large, it is
+ * truncated (checkpointed) as nothing in it would be replayed.
+ */
+int journal_sync(void)
+{
+    int return_value = 0;
+
+    if (journal.fd < 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&journal.lock);
+
+    return_value = flush_locked();
+
+    if (journal.outstanding == 0 && journal.used == 0 
+            && journal.size > JOURNAL_CHECKPOINT_SIZE) {
+        if (ftruncate(journal.fd, 0) == 0) {
+            journal.size = 0;
+        }
+    }
+
+    pthread_mutex_unlock(&journal.lock);
+
+    if (fdatasync(journal.fd) < 0) {
+        return_value = HIERONYMUS_ERROR(err_journal, "journal_sync");
+    }
+
+    return return_value;
+}
+
+/**
+ * Periodically sync the journal until it is closed.
+ */
+static void *journal_flusher(void *argument)
+{
+    struct timeval now;
+    struct timespec deadline;
+
+    (void) argument;
+
+    pthread_mutex_lock(&journal.lock);
+
+    while (journal.running) {
+        gettimeofday(&now, NULL);
+        deadline.tv_sec = now.tv_sec;
+        deadline.tv_nsec = now.tv_usec * 1000 
+            + config_get()->journal_sync_interval * 1000000L;
+
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+            deadline.tv_nsec %= 1000000000L;
+        }
+
+        pthread_cond_timedwait(&journal.stop, &journal.lock, &deadline);
+
+        pthread_mutex_unlock(&journal.lock);
+        journal_sync();
+        pthread_mutex_lock(&journal.lock);
+    }
+
+    pthread_mutex_unlock(&journal.lock);
+
+    return NULL;
+}
+
+/**
+ * Check that a path from the journal is in the root directory.
+ */
+static int in_root_directory(const char *path, const char *root_directory)
+{
+    size_t length = strlen(root_directory);
+
+    return strncmp(path, root_directory, length) == 0 
+        && (path[length] == '/' || path[length] == '\0');
+}
+
+/**
+ * Redo an intent that was not completed before the crash.
+ *
+ * Intents hold paths in the root directory. An intent with any other path is
+ * not replayed, it would change files outside the mount.
+ */
+static void replay_intent(const journal_intent_entry *intent, 
+        const char *root_directory)
+{
+    struct stat live;
+    struct stat stored;
+
+    if (!in_root_directory(intent->path, root_directory) 
+            || (intent->type != intent_write 
+                && !in_root_directory(intent->new_path, root_directory))) {
+        errno = EINVAL;
+        HIERONYMUS_ERROR(err_recovery, "replay_intent");
+        return;
+    }
+
+    switch (intent->type) {
+    case intent_write:
+        /*
+         * The live file may have been written without a version being
+         * created, create one for its current contents. Block-level
+         * versioning saves the old blocks before the write, so there is
+         * nothing to redo.
+         */
+#ifndef _BLOCK_VERSIONING
+        if (access(intent->path, F_OK) == 0) {
+            h_versioned_write(intent->path, NULL, NULL);
+        }
+#endif
+        break;
+
+    case intent_rmdir:
+    case intent_unlink:
+        /*
+         * The rename is atomic, so either the directory (or file) was moved or
+         * it still has to be moved.
+         */
+        if (access(intent->path, F_OK) == 0 
+                && access(intent->new_path, F_OK) != 0) {
+            if (rename(intent->path, intent->new_path) != 0) {
+                HIERONYMUS_ERROR(err_recovery, "replay_intent");
+            }
+        }
+        break;
+
+    case intent_rename:
+        /*
+         * If the rename took place, make sure the indexes record it.
+         */
+        if (access(intent->path, F_OK) != 0 
+                && access(intent->new_path, F_OK) == 0) {
+            h_versioned_rename_index(intent->path, intent->new_path);
+        }
+        break;
+
+    case intent_replace:
+        /*
+         * The replaced file was linked into '.version' before the rename. If
+         * both names are still the same file, the rename did not take place
+         * and the link is undone. Otherwise the removal is logged.
+         */
+        if (lstat(intent->new_path, &stored) == 0) {
+            if (lstat(intent->path, &live) == 0 && live.st_dev == stored.st_dev
+                    && live.st_ino == stored.st_ino) {
+                unlink(intent->new_path);
+            } else {
+                h_versioned_replace_index(intent->path, intent->new_path);
+            }
+        }
+        break;
+    }
+
+    HIERONYMUS_DEBUG("journal: replayed intent %llu (%s)\n", 
+            intent->sequence, intent->path);
+}
+
+/**
+ * Find an intent by sequence number.
+ *
+ * Intents are appended in order of their sequence numbers, so the array can
+ * be searched with a binary search.
+ */
+static journal_intent_entry *find_intent(journal_intent_entry *intents, 
+        size_t count, unsigned long long sequence)
+{
+    size_t low = 0;
+    size_t high = count;
+    size_t middle = 0;
+
+    while (low < high) {
+        middle = low + (high - low) / 2;
+
+        if (intents[middle].sequence < sequence) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    if (low < count && intents[low].sequence == sequence) {
+        return &intents[low];
+    }
+
+    return NULL;
+}
+
+/**
+ * Replay all intents in the journal that were not completed.
+ *
+ * The journal is read up to the first incomplete or corrupt record, which can
+ * only be a record that was being written when the daemon crashed.
+ */
+static int journal_recover(int fd, const char *root_directory)
+{
+    int return_value = 0;
+    struct stat stat_buffer;
+    char *contents = NULL;
+    size_t offset = 0;
+    size_t count = 0;
+    size_t replayed = 0;
+    size_t i = 0;
+    journal_intent_entry *intents = NULL;
+    journal_intent_entry *intent = NULL;
+    journal_record record;
+    unsigned int checksum = 0;
+
+    if (fstat(fd, &stat_buffer) < 0) {
+        return HIERONYMUS_ERROR(err_recovery, "journal_recover");
+    }
+
+    if (stat_buffer.st_size == 0) {
+        return 0;
+    }
+
+    contents = (char *) checked_malloc(stat_buffer.st_size);
+
+    if (pread(fd, contents, stat_buffer.st_size, 0) != stat_buffer.st_size) {
+        free(contents);
+        return HIERONYMUS_ERROR(err_recovery, "journal_recover");
+    }
+
+    /*
+     * Every record is at least a header, so this bounds the number of intents.
+     */
+    intents = (journal_intent_entry *) checked_malloc(
+            (stat_buffer.st_size / sizeof(journal_record) + 1) 
+            * sizeof(journal_intent_entry));
+
+    while (offset + sizeof(journal_record) <= (size_t) stat_buffer.st_size) {
+        memcpy(&record, contents + offset, sizeof(journal_record));
+
+        if (record.magic != JOURNAL_MAGIC || offset + sizeof(journal_record) 
+                + record.length > (size_t) stat_buffer.st_size) {
+            break;
+        }
+
+        checksum = record.checksum;
+        record.checksum = 0;
+
+        if (record_checksum(&record, contents + offset 
+                    + sizeof(journal_record)) != checksum) {
+            break;
+        }
+
+        if (record.type == intent_done) {
+            if ((intent = find_intent(intents, count, record.sequence)) != NULL) {
+                intent->completed = 1;
+            }
+        } else if (record.length > 0) {
+            intent = &intents[count++];
+            intent->sequence = record.sequence;
+            intent->type = record.type;
+            intent->completed = 0;
+            intent->path = contents + offset + sizeof(journal_record);
+            intent->new_path = intent->path + strlen(intent->path) + 1;
+
+            /* Guard against a missing terminator in the last path. */
+            contents[offset + sizeof(journal_record) + record.length - 1] = '\0';
+        }
+
+        offset += sizeof(journal_record) + record.length;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (!intents[i].completed) {
+            replay_intent(&intents[i], root_directory);
+            replayed++;
+        }
+    }
+
+    HIERONYMUS_DEBUG("journal: %lu intents, %lu replayed\n", 
+            (unsigned long) count, (unsigned long) replayed);
+
+    free(intents);
+    free(contents);
+
+    return return_value;
+}
+
+/**
+ * Open the journal of the mount, replaying it if necessary.
+ *
+ * After recovery the journal is truncated and the background thread that
+ * syncs it is started. This function needs ADMIN to be set up (versions may be
+ * created while replaying), so it is called from h_init.
+ */
+int journal_open(const char *root_directory)
+{
+    char journal_path[PATH_MAX];
+
+    snprintf(journal_path, PATH_MAX, "%s/%s", root_directory, JOURNAL_NAME);
+
+    journal.fd = open(journal_path, O_RDWR | O_CREAT | O_APPEND, 
+            S_IRUSR | S_IWUSR);
+
+    if (journal.fd < 0) {
+        return HIERONYMUS_ERROR(err_journal, "journal_open");
+    }
+
+    if (journal_recover(journal.fd, root_directory) < 0 || ftruncate(journal.fd, 0) < 0 
+            || fdatasync(journal.fd) < 0) {
+        HIERONYMUS_ERROR(err_recovery, "journal_open");
+    }
+
+    journal.buffer = (char *) checked_malloc(JOURNAL_BUFFER_SIZE);
+    journal.spare = (char *) checked_malloc(JOURNAL_BUFFER_SIZE);
+    journal.running = 1;
+
+    if (pthread_create(&journal.flusher, NULL, journal_flusher, NULL) != 0) {
+        journal.running = 0;
+        return HIERONYMUS_ERROR(err_journal, "journal_open");
+    }
+
+    return 0;
+}
+
+/**
+ * Stop the background thread and sync and close the journal.
+ *
+ * All operations are complete at this point, so the journal is empty after a
+ * clean shutdown.
+ */
+void journal_close(void)
+{
+    if (journal.fd < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&journal.lock);
+
+    if (journal.running) {
+        journal.running = 0;
+        pthread_cond_signal(&journal.stop);
+        pthread_mutex_unlock(&journal.lock);
+        pthread_join(journal.flusher, NULL);
+    } else {
+        pthread_mutex_unlock(&journal.lock);
+    }
+
+    journal_sync();
+
+    if (journal.outstanding == 0 && ftruncate(journal.fd, 0) == 0) {
+        fdatasync(journal.fd);
+    }
+
+    close(journal.fd);
+    journal.fd = -1;
+
+    free(journal.buffer);
+    free(journal.spare);
+}
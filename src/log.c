@@ -13,6 +13,9 @@
 #include <stdlib.h>
 
 #include "log.h"
+#include "scheduler.h"
+
+static scheduler_timer flush_timer;
 
 /**
  * Open the log file for writing.
@@ -28,8 +31,25 @@ FILE *open_log_file (void)
         exit(EXIT_FAILURE);
     }
 
-    /* Set file to line buffering */
-    setvbuf(file_handle, NULL, _IOLBF, 0);
+    /* Set file to full buffering, it is flushed periodically */
+    setvbuf(file_handle, NULL, _IOFBF, BUFSIZ);
 
     return file_handle;
 }
+
+static void flush_log (void *argument)
+{
+    fflush((FILE *) argument);
+    scheduler_arm(&flush_timer, LOG_FLUSH_INTERVAL);
+}
+
+/**
+ * Flush the log file every LOG_FLUSH_INTERVAL milliseconds, until the
+ * scheduler is stopped.
+ */
+int log_flush_periodically (FILE *file_handle)
+{
+    scheduler_timer_init(&flush_timer, flush_log, file_handle);
+
+    return scheduler_arm(&flush_timer, LOG_FLUSH_INTERVAL);
+}
@@ -0,0 +1,409 @@
+/******************************************************************************
+ *
+ * file   : negative_cache.c
+ *
+ * author : Tim van Deurzen
+ * date   : 18/10/2026
+ *
+ * Cache of paths that were found not to exist.
+ *
+ * Build systems and language runtimes look up many paths that do not exist.
+ * A lookup that failed with ENOENT is remembered for a configurable time
+ * (--negative_ttl), repeated lookups of the same path are answered without
+ * touching the root directory. Every operation that creates a name invalidates
+ * it; renaming a directory invalidates the whole cache, as every name below
+ * the new name may now exist.
+ *
+ * A lookup that raced with the creation of its path must not be cached. Every
+ * stripe has a sequence number that is incremented by each invalidation, a
+ * failed lookup is only inserted if the sequence did not change since the
+ * lookup started.
+ *
+ * The table can be resized on a running mount, all stripes are locked while
+ * it is replaced, so entries are only used with the lock of their stripe held.
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "negative_cache.h"
+#include "util.h"
+
+/*
+ * A path that does not exist. 'generation' is the generation of the cache in
+ * which the entry was inserted, entries of older generations are stale.
+ */
+typedef struct NEGATIVE_ENTRY {
+    unsigned int hash;
+    int error;
+    unsigned long generation;
+    unsigned long long expiry;
+    char *path;
+} negative_entry;
+
+static struct {
+    int enabled;
+    unsigned long long ttl;
+    unsigned long generation;
+    negative_entry *entries;
+    unsigned long size;
+    unsigned long sequences[NEGATIVE_CACHE_STRIPES];
+    pthread_mutex_t locks[NEGATIVE_CACHE_STRIPES];
+} negative_cache;
+
+static unsigned long long negative_clock(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+
+    return (unsigned long long) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static unsigned int negative_hash(const char *path)
+{
+    unsigned int hash = 2166136261U;
+
+    while (*path) {
+        hash = (hash ^ (unsigned char) *path++) * 16777619U;
+    }
+
+    return hash;
+}
+
+/**
+ * Return the first entry of the set a hash belongs to, called with the lock of
+ * its stripe held.
+ */
+static negative_entry *negative_set(unsigned int hash)
+{
+    return negative_cache.entries
+        + (hash & (negative_cache.size / NEGATIVE_CACHE_WAYS - 1))
+        * NEGATIVE_CACHE_WAYS;
+}
+
+static void lock_all(void)
+{
+    int i = 0;
+
+    for (i = 0; i < NEGATIVE_CACHE_STRIPES; i++) {
+        pthread_mutex_lock(&negative_cache.locks[i]);
+    }
+}
+
+static void unlock_all(void)
+{
+    int i = 0;
+
+    for (i = NEGATIVE_CACHE_STRIPES - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&negative_cache.locks[i]);
+    }
+}
+
+/**
+ * Free the entries of a table of the given size.
+ */
+static void free_entries(negative_entry *entries, unsigned long size)
+{
+    unsigned long i = 0;
+
+    for (i = 0; i < size; i++) {
+        free(entries[i].path);
+    }
+
+    free(entries);
+}
+
+static pthread_mutex_t *negative_lock(unsigned int hash)
+{
+    return &negative_cache.locks[hash & (NEGATIVE_CACHE_STRIPES - 1)];
+}
+
+/**
+ * Set up the cache, entries are kept for ttl seconds. A ttl of 0 disables the
+ * cache.
+ */
+void negative_cache_init(double ttl)
+{
+    int i = 0;
+
+    if (ttl <= 0) {
+        return;
+    }
+
+    if (negative_cache.size == 0) {
+        negative_cache.size = NEGATIVE_CACHE_SIZE;
+    }
+
+    negative_cache.ttl = (unsigned long long) (ttl * 1e9);
+    negative_cache.entries = (negative_entry *) checked_malloc(
+            negative_cache.size * sizeof(negative_entry));
+    memset(negative_cache.entries, 0,
+            negative_cache.size * sizeof(negative_entry));
+
+    for (i = 0; i < NEGATIVE_CACHE_STRIPES; i++) {
+        pthread_mutex_init(&negative_cache.locks[i], NULL);
+    }
+
+    /*
+     * Lookups that see the cache enabled must see its entries.
+     */
+    __sync_synchronize();
+    negative_cache.enabled = 1;
+}
+
+/**
+ * Change the time entries are kept for on a running mount (the kernel keeps
+ * the negative_timeout it was mounted with). A ttl of 0 disables the cache,
+ * its entries stay allocated as lookups may still be using them. All entries
+ * are invalidated when the cache is enabled again, as nothing was invalidated
+ * meanwhile.
+ */
+void negative_cache_configure(double ttl)
+{
+    int i = 0;
+
+    if (ttl <= 0) {
+        negative_cache.enabled = 0;
+        return;
+    }
+
+    if (negative_cache.entries == NULL) {
+        negative_cache_init(ttl);
+        return;
+    }
+
+    negative_cache.ttl = (unsigned long long) (ttl * 1e9);
+
+    if (negative_cache.enabled) {
+        return;
+    }
+
+    lock_all();
+
+    negative_cache.generation++;
+
+    for (i = 0; i < NEGATIVE_CACHE_STRIPES; i++) {
+        negative_cache.sequences[i]++;
+    }
+
+    negative_cache.enabled = 1;
+
+    unlock_all();
+}
+
+/**
+ * Change the number of entries of the cache (a power of two of at least
+ * NEGATIVE_CACHE_WAYS). The entries of the old table are dropped, the
+ * sequences advance so no lookup that started before inserts into the new one.
+ */
+void negative_cache_resize(unsigned long size)
+{
+    negative_entry *entries = NULL;
+    negative_entry *old = NULL;
+    unsigned long old_size = 0;
+    int i = 0;
+
+    if (negative_cache.entries == NULL) {
+        negative_cache.size = size;
+        return;
+    }
+
+    entries = (negative_entry *) checked_malloc(size * sizeof(negative_entry));
+    memset(entries, 0, size * sizeof(negative_entry));
+
+    lock_all();
+
+    old = negative_cache.entries;
+    old_size = negative_cache.size;
+    negative_cache.entries = entries;
+    negative_cache.size = size;
+
+    for (i = 0; i < NEGATIVE_CACHE_STRIPES; i++) {
+        negative_cache.sequences[i]++;
+    }
+
+    unlock_all();
+
+    free_entries(old, old_size);
+}
+
+/**
+ * Free all entries.
+ */
+void negative_cache_destroy(void)
+{
+    if (negative_cache.entries == NULL) {
+        return;
+    }
+
+    negative_cache.enabled = 0;
+
+    free_entries(negative_cache.entries, negative_cache.size);
+    negative_cache.entries = NULL;
+}
+
+/**
+ * Look up a path. Returns the errno of the cached failed lookup, or 0 if the
+ * path is not in the cache. In the latter case *sequence is set for a
+ * following negative_cache_insert.
+ */
+int negative_cache_lookup(const char *path, unsigned long *sequence)
+{
+    unsigned int hash = 0;
+    negative_entry *set = NULL;
+    unsigned long long now = 0;
+    int error = 0;
+    int i = 0;
+
+    if (!negative_cache.enabled) {
+        return 0;
+    }
+
+    hash = negative_hash(path);
+    now = negative_clock();
+
+    pthread_mutex_lock(negative_lock(hash));
+    set = negative_set(hash);
+
+    for (i = 0; i < NEGATIVE_CACHE_WAYS; i++) {
+        if (set[i].path != NULL && set[i].hash == hash
+                && set[i].generation == negative_cache.generation
+                && set[i].expiry > now && strcmp(set[i].path, path) == 0) {
+            error = set[i].error;
+            break;
+        }
+    }
+
+    *sequence = negative_cache.sequences[hash & (NEGATIVE_CACHE_STRIPES - 1)];
+
+    pthread_mutex_unlock(negative_lock(hash));
+
+    return error;
+}
+
+/**
+ * Remember that a lookup of path failed with error. Nothing is inserted if
+ * the path was invalidated after sequence was taken by negative_cache_lookup.
+ */
+void negative_cache_insert(const char *path, int error, unsigned long sequence)
+{
+    unsigned int hash = 0;
+    negative_entry *set = NULL;
+    negative_entry *victim = NULL;
+    negative_entry *unused = NULL;
+    negative_entry *oldest = NULL;
+    unsigned long long now = 0;
+    int i = 0;
+
+    if (!negative_cache.enabled) {
+        return;
+    }
+
+    hash = negative_hash(path);
+    now = negative_clock();
+
+    pthread_mutex_lock(negative_lock(hash));
+    set = negative_set(hash);
+
+    if (negative_cache.sequences[hash & (NEGATIVE_CACHE_STRIPES - 1)]
+            != sequence) {
+        pthread_mutex_unlock(negative_lock(hash));
+        return;
+    }
+
+    /*
+     * Reuse the entry of the path itself, or else an empty or stale entry, or
+     * else replace the entry that expires first.
+     */
+    for (i = 0; i < NEGATIVE_CACHE_WAYS; i++) {
+        if (set[i].path != NULL && set[i].hash == hash
+                && strcmp(set[i].path, path) == 0) {
+            victim = &set[i];
+            break;
+        }
+
+        if (set[i].path == NULL 
+                || set[i].generation != negative_cache.generation) {
+            if (unused == NULL) {
+                unused = &set[i];
+            }
+        } else if (oldest == NULL || set[i].expiry < oldest->expiry) {
+            oldest = &set[i];
+        }
+    }
+
+    if (victim == NULL) {
+        victim = (unused != NULL) ? unused : oldest;
+
+        free(victim->path);
+        victim->path = strdup(path);
+    }
+
+    victim->hash = hash;
+    victim->error = error;
+    victim->generation = negative_cache.generation;
+    victim->expiry = now + negative_cache.ttl;
+
+    pthread_mutex_unlock(negative_lock(hash));
+}
+
+/**
+ * Forget a path, called after a name was created.
+ */
+void negative_cache_invalidate(const char *path)
+{
+    unsigned int hash = 0;
+    negative_entry *set = NULL;
+    int i = 0;
+
+    if (!negative_cache.enabled) {
+        return;
+    }
+
+    hash = negative_hash(path);
+
+    pthread_mutex_lock(negative_lock(hash));
+    set = negative_set(hash);
+
+    negative_cache.sequences[hash & (NEGATIVE_CACHE_STRIPES - 1)]++;
+
+    for (i = 0; i < NEGATIVE_CACHE_WAYS; i++) {
+        if (set[i].path != NULL && set[i].hash == hash
+                && strcmp(set[i].path, path) == 0) {
+            set[i].expiry = 0;
+        }
+    }
+
+    pthread_mutex_unlock(negative_lock(hash));
+}
+
+/**
+ * Forget all paths, called after a directory was renamed.
+ *
+ * Entries are not freed but made stale by starting a new generation. All
+ * stripes are locked, so no lookup that started before can insert an entry
+ * afterwards.
+ */
+void negative_cache_invalidate_all(void)
+{
+    int i = 0;
+
+    if (!negative_cache.enabled) {
+        return;
+    }
+
+    lock_all();
+
+    negative_cache.generation++;
+
+    for (i = 0; i < NEGATIVE_CACHE_STRIPES; i++) {
+        negative_cache.sequences[i]++;
+    }
+
+    unlock_all();
+}
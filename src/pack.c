@@ -0,0 +1,1254 @@
+/******************************************************************************
+ *
+ * file   : pack.c
+ *
+ * author : Tim van Deurzen
+ * date   : 18/10/2026
+ *
+ * Pack files for small stored versions (compiled in with -D_PACKING). Storing
+ * every patch and snapshot copy as a file of its own costs an inode each, and
+ * makes the snapshot directories find_snapshot_version reads ever larger.
+ * Instead, stored versions of at most --pack_threshold bytes are appended to
+ * '.version/.pack', their name, offset, length and checksum to
+ * '.version/.pack.idx', and the file itself is removed.
+ *
+ * Patches are packed in the background as soon as they are written, snapshot
+ * copies once their snapshot is sealed. With -D_COMPRESSION a version is
+ * compressed before it is packed, so an entry holds exactly what the file
+ * would have held.
+ *
+ * Appending takes an exclusive flock on the pack, so h_vtool can repack while
+ * the filesystem is mounted. Readers take no lock: they map the index and the
+ * pack and only use the entries that are complete. A repack writes the live
+ * entries, sorted by name, to a new pack and index of a new generation, and
+ * absorbs the small files left in older snapshot directories.
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "pack.h"
+#include "codec.h"
+#include "thread_pool.h"
+#include "simd.h"
+#include "error.h"
+#include "util.h"
+
+/*
+ * Number of times a reader tries to map a pack and an index of the same
+ * generation while a repack replaces them.
+ */
+#define PACK_ATTEMPTS 8
+
+/*
+ * The index and the pack of a '.version' directory, mapped for reading.
+ */
+typedef struct PACK_VIEW {
+    const unsigned char *index;
+    size_t index_size;
+    const unsigned char *pack;
+    size_t pack_size;
+} pack_view;
+
+/*
+ * An entry that a repack keeps. The data is in the old pack, or in memory if
+ * it was read from a loose file (path is then the file to remove).
+ */
+typedef struct PACK_LIVE {
+    char name[MAX_PACK_NAME];
+    const unsigned char *data;
+    uint64_t length;
+    uint32_t checksum;
+    unsigned long sequence;
+    char *path;
+} pack_live;
+
+typedef struct PACK_LIVE_SET {
+    pack_live *entries;
+    size_t num_entries;
+    size_t capacity;
+} pack_live_set;
+
+static struct {
+    unsigned long long threshold;
+    pool_group background;
+} packs = {
+    .threshold = PACK_THRESHOLD
+};
+
+static pthread_once_t background_once = PTHREAD_ONCE_INIT;
+
+static void init_background(void)
+{
+    pool_group_init(&packs.background);
+}
+
+/**
+ * Pack stored versions of at most threshold bytes (the default if 0).
+ */
+void pack_configure(unsigned long long threshold)
+{
+    if (threshold > 0) {
+        packs.threshold = threshold;
+    }
+}
+
+static int write_all(int fd, const void *buffer, size_t length)
+{
+    const unsigned char *data = (const unsigned char *) buffer;
+    ssize_t written = 0;
+
+    while (length > 0) {
+        if ((written = write(fd, data, length)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return -1;
+        }
+
+        data += written;
+        length -= written;
+    }
+
+    return 0;
+}
+
+static int read_all(int fd, void *buffer, size_t length)
+{
+    unsigned char *data = (unsigned char *) buffer;
+    ssize_t result = 0;
+
+    while (length > 0) {
+        if ((result = read(fd, data, length)) <= 0) {
+            if (result < 0 && errno == EINTR) {
+                continue;
+            }
+
+            if (result == 0) {
+                errno = EIO;
+            }
+
+            return -1;
+        }
+
+        data += result;
+        length -= result;
+    }
+
+    return 0;
+}
+
+/**
+ * Build the path of a file in a '.version' directory, it is empty if the path
+ * would be too long.
+ */
+static void pack_path(const char *version_directory, const char *name,
+        char *path)
+{
+    if (snprintf(path, PATH_MAX, "%s/%s", version_directory, name)
+            >= PATH_MAX) {
+        path[0] = '\0';
+    }
+}
+
+/**
+ * Split the path of a stored version into its '.version' directory and the
+ * name of its entry.
+ */
+static int stored_name(const char *path, char *version_directory, char *name)
+{
+    char snapshot[PATH_MAX];
+    char file[PATH_MAX];
+    char id[PATH_MAX];
+
+    if (strlen(path) >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    parent_directory(path, snapshot);
+    bottom_directory(path, file);
+    parent_directory(snapshot, version_directory);
+    bottom_directory(snapshot, id);
+
+    if (snprintf(name, MAX_PACK_NAME, "%s/%s", id, file) >= MAX_PACK_NAME) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Return the name of the record at position in a pack and move position past
+ * its data, or NULL if the rest of the pack is not a complete record.
+ */
+static const char *next_record(const unsigned char *pack, size_t size,
+        size_t *position, pack_record *record)
+{
+    const char *name = NULL;
+
+    if (*position + sizeof(pack_record) > size) {
+        return NULL;
+    }
+
+    memcpy(record, pack + *position, sizeof(pack_record));
+
+    if (memcmp(record->magic, PACK_RECORD_MAGIC, sizeof(record->magic)) != 0
+            || record->length > size || *position + sizeof(pack_record)
+            + record->name_length + record->length > size) {
+        return NULL;
+    }
+
+    name = (const char *) pack + *position + sizeof(pack_record);
+    *position += sizeof(pack_record) + record->name_length + record->length;
+
+    return name;
+}
+
+/**
+ * Return the name of the entry at position in an index and move position past
+ * it, or NULL if the rest of the index is not a complete entry.
+ */
+static const char *next_entry(const pack_view *view, size_t *position,
+        pack_entry *entry)
+{
+    const char *name = NULL;
+
+    if (*position + sizeof(pack_entry) > view->index_size) {
+        return NULL;
+    }
+
+    memcpy(entry, view->index + *position, sizeof(pack_entry));
+
+    if (*position + sizeof(pack_entry) + entry->name_length
+            > view->index_size) {
+        return NULL;
+    }
+
+    name = (const char *) view->index + *position + sizeof(pack_entry);
+    *position += sizeof(pack_entry) + entry->name_length;
+
+    return name;
+}
+
+/**
+ * Open the pack of a '.version' directory for appending and lock it, creating
+ * it if necessary. Its header is read into header.
+ */
+static int lock_pack(const char *version_directory, pack_header *header)
+{
+    char path[PATH_MAX];
+    struct stat locked;
+    struct stat current;
+    int fd = -1;
+
+    pack_path(version_directory, PACK_NAME, path);
+
+    for (;;) {
+        if ((fd = open(path, O_RDWR | O_CREAT, 0644)) < 0) {
+            return -1;
+        }
+
+        if (flock(fd, LOCK_EX) < 0) {
+            close(fd);
+            return -1;
+        }
+
+        /*
+         * A repack may have replaced the pack while waiting for the lock.
+         */
+        if (fstat(fd, &locked) == 0 && stat(path, &current) == 0
+                && locked.st_dev == current.st_dev
+                && locked.st_ino == current.st_ino) {
+            break;
+        }
+
+        close(fd);
+    }
+
+    if (locked.st_size < (off_t) sizeof(pack_header)) {
+        memcpy(header->magic, PACK_MAGIC, sizeof(header->magic));
+        header->generation = next_version_id();
+
+        if (ftruncate(fd, 0) < 0
+                || write_all(fd, header, sizeof(pack_header)) < 0) {
+            close(fd);
+            return -1;
+        }
+    } else if (read_all(fd, header, sizeof(pack_header)) < 0
+            || memcmp(header->magic, PACK_MAGIC, sizeof(header->magic)) != 0) {
+        errno = EINVAL;
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * Write a new index for the records of a locked pack.
+ */
+static int rebuild_index(int pack_fd, const pack_header *header, int index_fd)
+{
+    unsigned char *pack = NULL;
+    pack_header index_header;
+    pack_record record;
+    pack_entry entry;
+    struct stat pack_stat;
+    const char *name = NULL;
+    size_t position = sizeof(pack_header);
+    int return_value = 0;
+
+    memcpy(index_header.magic, PACK_INDEX_MAGIC, sizeof(index_header.magic));
+    index_header.generation = header->generation;
+
+    if (fstat(pack_fd, &pack_stat) < 0 || ftruncate(index_fd, 0) < 0
+            || lseek(index_fd, 0, SEEK_SET) < 0
+            || write_all(index_fd, &index_header, sizeof(pack_header)) < 0) {
+        return -1;
+    }
+
+    pack = (unsigned char *) mmap(NULL, pack_stat.st_size, PROT_READ,
+            MAP_SHARED, pack_fd, 0);
+
+    if (pack == MAP_FAILED) {
+        return -1;
+    }
+
+    while (return_value == 0 && (name = next_record(pack, pack_stat.st_size,
+                    &position, &record)) != NULL) {
+        entry.offset = position - record.length;
+        entry.length = record.length;
+        entry.checksum = record.checksum;
+        entry.name_length = record.name_length;
+        entry.reserved = 0;
+
+        if (write_all(index_fd, &entry, sizeof(entry)) < 0
+                || write_all(index_fd, name, record.name_length) < 0) {
+            return_value = -1;
+        }
+    }
+
+    munmap(pack, pack_stat.st_size);
+
+    return return_value;
+}
+
+/**
+ * Open the index of a locked pack, it is rebuilt from the pack if it is
+ * missing or does not belong to it.
+ */
+static int open_index(const char *version_directory, int pack_fd,
+        const pack_header *header)
+{
+    char path[PATH_MAX];
+    pack_header index_header;
+    int fd = -1;
+
+    pack_path(version_directory, PACK_INDEX_NAME, path);
+
+    if ((fd = open(path, O_RDWR | O_CREAT, 0644)) < 0) {
+        return -1;
+    }
+
+    if (read_all(fd, &index_header, sizeof(pack_header)) < 0
+            || memcmp(index_header.magic, PACK_INDEX_MAGIC,
+                sizeof(index_header.magic)) != 0
+            || index_header.generation != header->generation) {
+        if (rebuild_index(pack_fd, header, fd) < 0) {
+            close(fd);
+            return -1;
+        }
+    }
+
+    return fd;
+}
+
+/**
+ * Append an entry to a locked pack and its index. If either write fails, both
+ * are cut back to their previous length.
+ */
+static int append_entry(int pack_fd, int index_fd, const char *name,
+        const unsigned char *data, uint64_t length)
+{
+    uint16_t name_length = strlen(name);
+    off_t pack_end = lseek(pack_fd, 0, SEEK_END);
+    off_t index_end = lseek(index_fd, 0, SEEK_END);
+    size_t size = sizeof(pack_record) + name_length + length;
+    unsigned char *buffer = NULL;
+    pack_record record;
+    pack_entry entry;
+    int return_value = 0;
+
+    if (pack_end < 0 || index_end < 0) {
+        return -1;
+    }
+
+    memset(&record, 0, sizeof(record));
+    memcpy(record.magic, PACK_RECORD_MAGIC, sizeof(record.magic));
+    record.checksum = simd_crc32c(0, data, length);
+    record.length = length;
+    record.name_length = name_length;
+
+    entry.offset = pack_end + sizeof(pack_record) + name_length;
+    entry.length = length;
+    entry.checksum = record.checksum;
+    entry.name_length = name_length;
+    entry.reserved = 0;
+
+    buffer = (unsigned char *) checked_malloc(size);
+    memcpy(buffer, &record, sizeof(record));
+    memcpy(buffer + sizeof(record), name, name_length);
+    memcpy(buffer + sizeof(record) + name_length, data, length);
+
+    if (write_all(pack_fd, buffer, size) < 0) {
+        return_value = -1;
+    } else {
+        memcpy(buffer, &entry, sizeof(entry));
+        memcpy(buffer + sizeof(entry), name, name_length);
+
+        if (write_all(index_fd, buffer, sizeof(entry) + name_length) < 0) {
+            return_value = -1;
+        }
+    }
+
+    if (return_value < 0) {
+        if (ftruncate(pack_fd, pack_end) < 0
+                || ftruncate(index_fd, index_end) < 0) {
+            HIERONYMUS_ERROR(err_pack, "append_entry");
+        }
+    }
+
+    free(buffer);
+
+    return return_value;
+}
+
+/**
+ * Move a stored version into the pack of its '.version' directory, after
+ * compressing it if a codec is configured. Return 1 if it was packed, 0 if it
+ * is too large (or gone) and -1 on errors.
+ */
+int pack_store(const char *path)
+{
+    char version_directory[PATH_MAX];
+    char name[MAX_PACK_NAME];
+    codec_choice choice;
+    pack_header header;
+    struct stat file_stat;
+    unsigned char *data = NULL;
+    int pack_fd = -1;
+    int index_fd = -1;
+    int fd = -1;
+    int return_value = 0;
+
+    if (codec_enabled()) {
+        codec_select(path, &choice);
+
+        if (codec_compress_file(path, &choice) < 0) {
+            return -1;
+        }
+    }
+
+    if (stat(path, &file_stat) < 0) {
+        return errno == ENOENT ? 0 : HIERONYMUS_ERROR(err_pack, "pack_store");
+    }
+
+    if ((unsigned long long) file_stat.st_size > packs.threshold) {
+        return 0;
+    }
+
+    if (stored_name(path, version_directory, name) < 0
+            || (pack_fd = lock_pack(version_directory, &header)) < 0
+            || (index_fd = open_index(version_directory, pack_fd,
+                    &header)) < 0) {
+        return_value = HIERONYMUS_ERROR(err_pack, "pack_store");
+        goto out;
+    }
+
+    /*
+     * The file is read under the lock, a repack may have absorbed it already.
+     */
+    if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &file_stat) < 0) {
+        return_value = errno == ENOENT ? 0
+            : HIERONYMUS_ERROR(err_pack, "pack_store");
+        goto out;
+    }
+
+    if ((unsigned long long) file_stat.st_size > packs.threshold) {
+        goto out;
+    }
+
+    data = (unsigned char *) checked_malloc(file_stat.st_size + 1);
+
+    if (read_all(fd, data, file_stat.st_size) < 0
+            || append_entry(pack_fd, index_fd, name, data,
+                file_stat.st_size) < 0
+            || unlink(path) < 0) {
+        return_value = HIERONYMUS_ERROR(err_pack, "pack_store");
+        goto out;
+    }
+
+    return_value = 1;
+
+out:
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    if (index_fd >= 0) {
+        close(index_fd);
+    }
+
+    if (pack_fd >= 0) {
+        close(pack_fd);
+    }
+
+    free(data);
+
+    return return_value;
+}
+
+static void store_task(void *argument)
+{
+    char *path = (char *) argument;
+
+    pack_store(path);
+    free(path);
+}
+
+/**
+ * Pack (and compress) the stored version at path in the background. Versions
+ * too large to pack are only compressed.
+ */
+void pack_store_async(const char *path)
+{
+    char *argument = NULL;
+
+    pthread_once(&background_once, init_background);
+
+    argument = (char *) checked_malloc(strlen(path) + 1);
+    strcpy(argument, path);
+
+    thread_pool_submit(thread_pool_shared(), &packs.background, store_task,
+            argument);
+}
+
+static void seal_snapshot_task(void *argument)
+{
+    char *directory = (char *) argument;
+    struct dirent *entry = NULL;
+    char **names = NULL;
+    size_t num_names = 0;
+    size_t capacity = 0;
+    size_t i = 0;
+    char path[PATH_MAX];
+    DIR *snapshot = opendir(directory);
+
+    if (snapshot == NULL) {
+        HIERONYMUS_ERROR(err_pack, "seal_snapshot_task");
+        free(directory);
+        return;
+    }
+
+    /*
+     * Packing removes entries from the directory (and compressing renames
+     * them), so the names are collected first.
+     */
+    while ((entry = readdir(snapshot)) != NULL) {
+        if (!codec_sealable(entry->d_name)) {
+            continue;
+        }
+
+        if (num_names == capacity) {
+            capacity = capacity == 0 ? 64 : capacity * 2;
+            names = (char **) realloc(names, capacity * sizeof(char *));
+
+            if (names == NULL) {
+                HIERONYMUS_ERROR(err_malloc, "seal_snapshot_task");
+                closedir(snapshot);
+                free(directory);
+                return;
+            }
+        }
+
+        names[num_names] = (char *) checked_malloc(strlen(entry->d_name) + 1);
+        strcpy(names[num_names++], entry->d_name);
+    }
+
+    closedir(snapshot);
+
+    for (i = 0; i < num_names; i++) {
+        snprintf(path, PATH_MAX, "%s/%s", directory, names[i]);
+        pack_store(path);
+        free(names[i]);
+    }
+
+    free(names);
+    free(directory);
+}
+
+/**
+ * Pack (and compress) the snapshot copies in a snapshot directory that was
+ * superseded by a newer one, in the background.
+ */
+void pack_seal_snapshot(const char *directory)
+{
+    char *argument = NULL;
+
+    pthread_once(&background_once, init_background);
+
+    argument = (char *) checked_malloc(strlen(directory) + 1);
+    strcpy(argument, directory);
+
+    thread_pool_submit(thread_pool_shared(), &packs.background,
+            seal_snapshot_task, argument);
+}
+
+/**
+ * Wait for all background packing to finish.
+ */
+void pack_drain(void)
+{
+    pthread_once(&background_once, init_background);
+    pool_group_wait(thread_pool_shared(), &packs.background);
+}
+
+/**
+ * Map a pack or an index for reading. Return 0 if it does not exist (or has
+ * no header yet).
+ */
+static int map_file(const char *path, const char *magic,
+        const unsigned char **data, size_t *size)
+{
+    struct stat file_stat;
+    void *mapping = NULL;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    if (fstat(fd, &file_stat) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    if (file_stat.st_size < (off_t) sizeof(pack_header)) {
+        close(fd);
+        return 0;
+    }
+
+    mapping = mmap(NULL, file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (mapping == MAP_FAILED) {
+        return -1;
+    }
+
+    if (memcmp(mapping, magic, strlen(magic)) != 0) {
+        munmap(mapping, file_stat.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+
+    *data = (const unsigned char *) mapping;
+    *size = file_stat.st_size;
+
+    return 1;
+}
+
+static void close_view(pack_view *view)
+{
+    if (view->index != NULL) {
+        munmap((void *) view->index, view->index_size);
+    }
+
+    if (view->pack != NULL) {
+        munmap((void *) view->pack, view->pack_size);
+    }
+
+    memset(view, 0, sizeof(pack_view));
+}
+
+/**
+ * Map the index and the pack of a '.version' directory. Return 1 if they are
+ * mapped, 0 if there is no pack and -1 on errors.
+ */
+static int open_view(const char *version_directory, pack_view *view)
+{
+    char index_path[PATH_MAX];
+    char path[PATH_MAX];
+    pack_header index_header;
+    pack_header header;
+    int attempt = 0;
+    int result = 0;
+
+    pack_path(version_directory, PACK_INDEX_NAME, index_path);
+    pack_path(version_directory, PACK_NAME, path);
+
+    for (attempt = 0; attempt < PACK_ATTEMPTS; attempt++) {
+        memset(view, 0, sizeof(pack_view));
+
+        if ((result = map_file(index_path, PACK_INDEX_MAGIC, &view->index,
+                        &view->index_size)) <= 0) {
+            return result;
+        }
+
+        if ((result = map_file(path, PACK_MAGIC, &view->pack,
+                        &view->pack_size)) <= 0) {
+            close_view(view);
+            return result;
+        }
+
+        memcpy(&index_header, view->index, sizeof(pack_header));
+        memcpy(&header, view->pack, sizeof(pack_header));
+
+        if (index_header.generation == header.generation) {
+            return 1;
+        }
+
+        /*
+         * A repack is replacing the pack, or the index is being rebuilt.
+         */
+        close_view(view);
+        usleep(1000);
+    }
+
+    errno = ESTALE;
+
+    return -1;
+}
+
+/**
+ * Return the data of an entry, or NULL if it is not (yet) in the mapped pack.
+ */
+static const unsigned char *entry_data(const pack_view *view,
+        const pack_entry *entry)
+{
+    if (entry->offset < sizeof(pack_header) || entry->offset > view->pack_size
+            || entry->length > view->pack_size - entry->offset) {
+        return NULL;
+    }
+
+    return view->pack + entry->offset;
+}
+
+/**
+ * Count the packed versions of a file in a snapshot directory.
+ */
+int pack_count(const char *snapshot_directory, const char *filename)
+{
+    char version_directory[PATH_MAX];
+    char id[PATH_MAX];
+    char prefix[MAX_PACK_NAME];
+    pack_view view;
+    pack_entry entry;
+    const char *name = NULL;
+    size_t position = sizeof(pack_header);
+    size_t prefix_length = 0;
+    int count = 0;
+    int result = 0;
+
+    parent_directory(snapshot_directory, version_directory);
+    bottom_directory(snapshot_directory, id);
+    prefix_length = snprintf(prefix, MAX_PACK_NAME, "%s/%s", id, filename);
+
+    if (prefix_length >= MAX_PACK_NAME) {
+        return 0;
+    }
+
+    if ((result = open_view(version_directory, &view)) <= 0) {
+        return result < 0 ? HIERONYMUS_ERROR(err_pack, "pack_count") : 0;
+    }
+
+    while ((name = next_entry(&view, &position, &entry)) != NULL) {
+        if (entry.name_length >= prefix_length
+                && memcmp(name, prefix, prefix_length) == 0) {
+            count++;
+        }
+    }
+
+    close_view(&view);
+
+    return count;
+}
+
+/**
+ * Write the packed version with the given name to dest ("-" for standard
+ * output). The last entry with that name wins.
+ */
+int pack_extract(const char *version_directory, const char *name,
+        const char *dest)
+{
+    pack_view view;
+    pack_entry entry;
+    pack_entry found;
+    const char *entry_name = NULL;
+    const unsigned char *data = NULL;
+    size_t name_length = strlen(name);
+    size_t position = sizeof(pack_header);
+    int return_value = 0;
+    int fd = -1;
+
+    if ((return_value = open_view(version_directory, &view)) <= 0) {
+        if (return_value == 0) {
+            errno = ENOENT;
+        }
+
+        return HIERONYMUS_ERROR(err_pack, "pack_extract");
+    }
+
+    while ((entry_name = next_entry(&view, &position, &entry)) != NULL) {
+        if (entry.name_length == name_length
+                && memcmp(entry_name, name, name_length) == 0
+                && entry_data(&view, &entry) != NULL) {
+            found = entry;
+            data = entry_data(&view, &entry);
+        }
+    }
+
+    return_value = 0;
+
+    if (data == NULL) {
+        errno = ENOENT;
+        return_value = HIERONYMUS_ERROR(err_pack, "pack_extract");
+    } else if (simd_crc32c(0, data, found.length) != found.checksum) {
+        errno = EIO;
+        return_value = HIERONYMUS_ERROR(err_pack, "pack_extract");
+    } else {
+        fd = strcmp(dest, "-") == 0 ? STDOUT_FILENO
+            : open(dest, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+        if (fd < 0 || write_all(fd, data, found.length) < 0) {
+            return_value = HIERONYMUS_ERROR(err_pack, "pack_extract");
+        }
+
+        if (fd >= 0 && fd != STDOUT_FILENO) {
+            close(fd);
+        }
+    }
+
+    close_view(&view);
+
+    return return_value;
+}
+
+/**
+ * Print the names of the packed versions of a '.version' directory, one per
+ * line, in the order they were packed.
+ */
+int pack_list(const char *version_directory, FILE *stream)
+{
+    pack_view view;
+    pack_entry entry;
+    const char *name = NULL;
+    size_t position = sizeof(pack_header);
+    int result = 0;
+
+    if ((result = open_view(version_directory, &view)) <= 0) {
+        return result < 0 ? HIERONYMUS_ERROR(err_pack, "pack_list") : 0;
+    }
+
+    while ((name = next_entry(&view, &position, &entry)) != NULL) {
+        fprintf(stream, "%.*s\n", (int) entry.name_length, name);
+    }
+
+    close_view(&view);
+
+    return 0;
+}
+
+static int add_live(pack_live_set *set, const char *name, size_t name_length,
+        const unsigned char *data, uint64_t length, char *path)
+{
+    pack_live *live = NULL;
+
+    if (name_length >= MAX_PACK_NAME) {
+        return 0;
+    }
+
+    if (set->num_entries == set->capacity) {
+        set->capacity = set->capacity == 0 ? 256 : set->capacity * 2;
+        live = (pack_live *) realloc(set->entries,
+                set->capacity * sizeof(pack_live));
+
+        if (live == NULL) {
+            return -1;
+        }
+
+        set->entries = live;
+    }
+
+    live = &set->entries[set->num_entries];
+    memcpy(live->name, name, name_length);
+    live->name[name_length] = '\0';
+    live->data = data;
+    live->length = length;
+    live->checksum = simd_crc32c(0, data, length);
+    live->sequence = set->num_entries++;
+    live->path = path;
+
+    return 1;
+}
+
+static int compare_live(const void *a, const void *b)
+{
+    const pack_live *left = (const pack_live *) a;
+    const pack_live *right = (const pack_live *) b;
+    int order = strcmp(left->name, right->name);
+
+    if (order != 0) {
+        return order;
+    }
+
+    return left->sequence < right->sequence ? -1 : 1;
+}
+
+static int is_snapshot(const char *name)
+{
+    return name[0] >= '0' && name[0] <= '9';
+}
+
+/**
+ * Return whether the snapshot directory of an entry still exists, entries of
+ * removed snapshots are dropped by a repack.
+ */
+static int snapshot_exists(const char *version_directory, const char *name,
+        size_t name_length)
+{
+    const char *separator = memchr(name, '/', name_length);
+    char path[PATH_MAX];
+    struct stat snapshot_stat;
+
+    if (separator == NULL) {
+        return 0;
+    }
+
+    snprintf(path, PATH_MAX, "%s/%.*s", version_directory,
+            (int) (separator - name), name);
+
+    return stat(path, &snapshot_stat) == 0 && S_ISDIR(snapshot_stat.st_mode);
+}
+
+/**
+ * Read the small stored versions in one snapshot directory into the set.
+ */
+static int absorb_snapshot(const char *version_directory, const char *id,
+        pack_live_set *set)
+{
+    char directory[PATH_MAX];
+    char path[PATH_MAX];
+    char name[MAX_PACK_NAME];
+    struct dirent *entry = NULL;
+    struct stat file_stat;
+    unsigned char *data = NULL;
+    int return_value = 0;
+    int fd = -1;
+    DIR *snapshot = NULL;
+
+    snprintf(directory, PATH_MAX, "%s/%s", version_directory, id);
+
+    if ((snapshot = opendir(directory)) == NULL) {
+        return -1;
+    }
+
+    while (return_value >= 0 && (entry = readdir(snapshot)) != NULL) {
+        if (!codec_sealable(entry->d_name)) {
+            continue;
+        }
+
+        if (snprintf(path, PATH_MAX, "%s/%s", directory, entry->d_name)
+                >= PATH_MAX || lstat(path, &file_stat) < 0 
+                || !S_ISREG(file_stat.st_mode)
+                || (unsigned long long) file_stat.st_size > packs.threshold
+                || snprintf(name, MAX_PACK_NAME, "%s/%s", id, entry->d_name)
+                >= MAX_PACK_NAME) {
+            continue;
+        }
+
+        if ((fd = open(path, O_RDONLY)) < 0) {
+            return_value = -1;
+            break;
+        }
+
+        data = (unsigned char *) checked_malloc(file_stat.st_size + 1);
+
+        if (read_all(fd, data, file_stat.st_size) < 0) {
+            free(data);
+            return_value = -1;
+        } else {
+            char *loose = (char *) checked_malloc(strlen(path) + 1);
+
+            strcpy(loose, path);
+
+            if ((return_value = add_live(set, name, strlen(name), data,
+                            file_stat.st_size, loose)) <= 0) {
+                free(data);
+                free(loose);
+            }
+        }
+
+        close(fd);
+    }
+
+    closedir(snapshot);
+
+    return return_value < 0 ? -1 : 0;
+}
+
+/**
+ * Read the small stored versions left as files in every snapshot directory
+ * but the latest (whose copies are the base of new patches) into the set.
+ */
+static int absorb_loose(const char *version_directory, pack_live_set *set)
+{
+    struct dirent *entry = NULL;
+    unsigned long long latest = 0;
+    int return_value = 0;
+    DIR *versions = opendir(version_directory);
+
+    if (versions == NULL) {
+        return -1;
+    }
+
+    while ((entry = readdir(versions)) != NULL) {
+        if (is_snapshot(entry->d_name)
+                && strtoull(entry->d_name, NULL, 10) > latest) {
+            latest = strtoull(entry->d_name, NULL, 10);
+        }
+    }
+
+    rewinddir(versions);
+
+    while (return_value == 0 && (entry = readdir(versions)) != NULL) {
+        if (is_snapshot(entry->d_name)
+                && strtoull(entry->d_name, NULL, 10) != latest) {
+            return_value = absorb_snapshot(version_directory, entry->d_name,
+                    set);
+        }
+    }
+
+    closedir(versions);
+
+    return return_value;
+}
+
+/**
+ * Write the last entry of every name in a sorted set to a new pack and index.
+ * The new pack is returned locked, so appenders wait until both are renamed
+ * into place.
+ */
+static int write_repack(const char *pack_file, const char *index_file,
+        pack_live_set *set, int *pack_fd, pack_statistics *statistics)
+{
+    FILE *pack = NULL;
+    FILE *index = NULL;
+    pack_header header;
+    pack_record record;
+    pack_entry entry;
+    pack_live *live = NULL;
+    uint64_t offset = sizeof(pack_header);
+    size_t name_length = 0;
+    size_t i = 0;
+    int return_value = 0;
+
+    if ((*pack_fd = open(pack_file, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0
+            || flock(*pack_fd, LOCK_EX) < 0
+            || (pack = fdopen(dup(*pack_fd), "w")) == NULL
+            || (index = fopen(index_file, "w")) == NULL) {
+        return_value = -1;
+        goto out;
+    }
+
+    header.generation = next_version_id();
+    memcpy(header.magic, PACK_MAGIC, sizeof(header.magic));
+    fwrite(&header, sizeof(header), 1, pack);
+    memcpy(header.magic, PACK_INDEX_MAGIC, sizeof(header.magic));
+    fwrite(&header, sizeof(header), 1, index);
+
+    for (i = 0; i < set->num_entries; i++) {
+        live = &set->entries[i];
+
+        if (i + 1 < set->num_entries
+                && strcmp(live->name, set->entries[i + 1].name) == 0) {
+            statistics->dropped++;
+            continue;
+        }
+
+        name_length = strlen(live->name);
+
+        memset(&record, 0, sizeof(record));
+        memcpy(record.magic, PACK_RECORD_MAGIC, sizeof(record.magic));
+        record.checksum = live->checksum;
+        record.length = live->length;
+        record.name_length = name_length;
+
+        entry.offset = offset + sizeof(record) + name_length;
+        entry.length = live->length;
+        entry.checksum = live->checksum;
+        entry.name_length = name_length;
+        entry.reserved = 0;
+
+        fwrite(&record, sizeof(record), 1, pack);
+        fwrite(live->name, name_length, 1, pack);
+        fwrite(live->data, live->length, 1, pack);
+        fwrite(&entry, sizeof(entry), 1, index);
+        fwrite(live->name, name_length, 1, index);
+
+        offset += sizeof(record) + name_length + live->length;
+        statistics->entries++;
+        statistics->absorbed += live->path != NULL;
+    }
+
+    statistics->bytes = offset;
+
+    if (fflush(pack) != 0 || fflush(index) != 0 || fsync(fileno(pack)) < 0
+            || fsync(fileno(index)) < 0) {
+        return_value = -1;
+    }
+
+out:
+    if (pack != NULL && fclose(pack) != 0) {
+        return_value = -1;
+    }
+
+    if (index != NULL && fclose(index) != 0) {
+        return_value = -1;
+    }
+
+    return return_value;
+}
+
+/**
+ * Rewrite the pack of a '.version' directory with only its live entries,
+ * sorted by name, and absorb the small stored versions of all but the latest
+ * snapshot. Entries that fail their checksum or belong to a removed snapshot
+ * are dropped, as are all but the last entry of a name.
+ */
+int pack_repack(const char *version_directory, pack_statistics *statistics)
+{
+    char pack_file[PATH_MAX];
+    char index_file[PATH_MAX];
+    char temporary_pack[PATH_MAX];
+    char temporary_index[PATH_MAX];
+    pack_live_set set = { NULL, 0, 0 };
+    pack_header header;
+    pack_record record;
+    struct stat pack_stat;
+    unsigned char *old = NULL;
+    const char *name = NULL;
+    const unsigned char *data = NULL;
+    size_t position = sizeof(pack_header);
+    size_t i = 0;
+    int pack_fd = -1;
+    int new_pack_fd = -1;
+    int result = 0;
+    int return_value = 0;
+
+    memset(statistics, 0, sizeof(pack_statistics));
+
+    pack_path(version_directory, PACK_NAME, pack_file);
+    pack_path(version_directory, PACK_INDEX_NAME, index_file);
+    pack_path(version_directory, PACK_NAME PACK_TEMPORARY_SUFFIX,
+            temporary_pack);
+    pack_path(version_directory, PACK_INDEX_NAME PACK_TEMPORARY_SUFFIX,
+            temporary_index);
+
+    if ((pack_fd = lock_pack(version_directory, &header)) < 0
+            || fstat(pack_fd, &pack_stat) < 0) {
+        return_value = HIERONYMUS_ERROR(err_pack, "pack_repack");
+        goto out;
+    }
+
+    statistics->bytes_before = pack_stat.st_size;
+    old = (unsigned char *) mmap(NULL, pack_stat.st_size, PROT_READ,
+            MAP_SHARED, pack_fd, 0);
+
+    if (old == MAP_FAILED) {
+        old = NULL;
+        return_value = HIERONYMUS_ERROR(err_pack, "pack_repack");
+        goto out;
+    }
+
+    /*
+     * The records of the pack are read rather than the index, a torn or lost
+     * index is repaired this way.
+     */
+    while ((name = next_record(old, pack_stat.st_size, &position, &record))
+            != NULL) {
+        data = old + position - record.length;
+
+        if (simd_crc32c(0, data, record.length) != record.checksum
+                || !snapshot_exists(version_directory, name,
+                    record.name_length)) {
+            statistics->dropped++;
+        } else if ((result = add_live(&set, name, record.name_length, data,
+                        record.length, NULL)) < 0) {
+            return_value = HIERONYMUS_ERROR(err_malloc, "pack_repack");
+            goto out;
+        } else if (result == 0) {
+            statistics->dropped++;
+        }
+    }
+
+    if (absorb_loose(version_directory, &set) < 0) {
+        return_value = HIERONYMUS_ERROR(err_pack, "pack_repack");
+        goto out;
+    }
+
+    qsort(set.entries, set.num_entries, sizeof(pack_live), compare_live);
+
+    if (write_repack(temporary_pack, temporary_index, &set, &new_pack_fd,
+                statistics) < 0 || rename(temporary_pack, pack_file) < 0
+            || rename(temporary_index, index_file) < 0) {
+        unlink(temporary_pack);
+        unlink(temporary_index);
+        return_value = HIERONYMUS_ERROR(err_pack, "pack_repack");
+        goto out;
+    }
+
+    for (i = 0; i < set.num_entries; i++) {
+        if (set.entries[i].path != NULL && unlink(set.entries[i].path) < 0) {
+            return_value = HIERONYMUS_ERROR(err_pack, "pack_repack");
+        }
+    }
+
+out:
+    for (i = 0; i < set.num_entries; i++) {
+        if (set.entries[i].path != NULL) {
+            free((void *) set.entries[i].data);
+            free(set.entries[i].path);
+        }
+    }
+
+    free(set.entries);
+
+    if (old != NULL) {
+        munmap(old, pack_stat.st_size);
+    }
+
+    if (new_pack_fd >= 0) {
+        close(new_pack_fd);
+    }
+
+    if (pack_fd >= 0) {
+        close(pack_fd);
+    }
+
+    return return_value;
+}
@@ -0,0 +1,279 @@
+/******************************************************************************
+ *
+ * file   : path.c
+ *
+ * author : Tim van Deurzen
+ * date   : 18/10/2026
+ *
+ * Building paths without fixed-size buffers.
+ *
+ * Paths are allocated from an arena per thread instead of from PATH_MAX
+ * buffers on the stack. Allocation only bumps a pointer. A FUSE handler resets
+ * the arena of its thread when it starts, other functions take a mark and
+ * release everything allocated after it when they are done.
+ *
+ * Parts of paths (the parent directory, the name) are handled as slices: a
+ * pointer and a length into an existing string, so taking a path apart copies
+ * nothing and measures nothing twice. A path is put together from slices with
+ * a single allocation and one memcpy per slice. The length of the root
+ * directory is computed once, resolving a path in the mount point to a path in
+ * the root directory takes two memcpy calls.
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "path.h"
+#include "util.h"
+
+/*
+ * A block of the arena. Blocks are chained to the previous block, so releasing
+ * to a mark frees the blocks allocated after it.
+ */
+typedef struct PATH_ARENA_BLOCK {
+    struct PATH_ARENA_BLOCK *previous;
+    size_t size;
+    size_t used;
+    char data[];
+} path_arena_block;
+
+static __thread path_arena_block *arena = NULL;
+
+/*
+ * The arena of a thread is freed when the thread exits (FUSE starts and stops
+ * worker threads as the load changes).
+ */
+static pthread_key_t arena_key;
+static pthread_once_t arena_key_once = PTHREAD_ONCE_INIT;
+
+static struct {
+    const char *root;
+    size_t root_length;
+} path_root = {
+    .root = "",
+    .root_length = 0
+};
+
+/**
+ * Set the root directory paths are resolved against.
+ */
+void path_init(const char *root)
+{
+    path_root.root = root;
+    path_root.root_length = strlen(root);
+}
+
+/**
+ * Free all blocks of the arena of the exiting thread.
+ */
+static void free_arena(void *data)
+{
+    path_arena_block *previous = NULL;
+
+    (void) data;
+
+    while (arena != NULL) {
+        previous = arena->previous;
+        free(arena);
+        arena = previous;
+    }
+}
+
+static void create_arena_key(void)
+{
+    pthread_key_create(&arena_key, free_arena);
+}
+
+static void add_block(size_t size)
+{
+    path_arena_block *block = NULL;
+
+    if (arena == NULL) {
+        pthread_once(&arena_key_once, create_arena_key);
+        pthread_setspecific(arena_key, (void *) 1);
+    }
+
+    if (size < PATH_ARENA_BLOCK_SIZE) {
+        size = PATH_ARENA_BLOCK_SIZE;
+    }
+
+    block = (path_arena_block *) checked_malloc(sizeof(path_arena_block)
+            + size);
+    block->previous = arena;
+    block->size = size;
+    block->used = 0;
+
+    arena = block;
+}
+
+/**
+ * Allocate size bytes from the arena of this thread.
+ */
+char *path_alloc(size_t size)
+{
+    char *memory = NULL;
+
+    if (arena == NULL || arena->used + size > arena->size) {
+        add_block(size);
+    }
+
+    memory = arena->data + arena->used;
+    arena->used += size;
+
+    return memory;
+}
+
+/**
+ * Return the current position in the arena of this thread.
+ */
+path_mark path_get_mark(void)
+{
+    path_mark mark;
+
+    if (arena == NULL) {
+        add_block(0);
+    }
+
+    mark.block = arena;
+    mark.used = arena->used;
+
+    return mark;
+}
+
+/**
+ * Release everything allocated from the arena of this thread after mark was
+ * taken.
+ */
+void path_release(path_mark mark)
+{
+    path_arena_block *previous = NULL;
+
+    while (arena != NULL && arena != mark.block) {
+        previous = arena->previous;
+        free(arena);
+        arena = previous;
+    }
+
+    if (arena != NULL) {
+        arena->used = mark.used;
+    }
+}
+
+/**
+ * Release everything allocated from the arena of this thread. Called by a FUSE
+ * handler before it allocates its first path.
+ */
+void path_reset(void)
+{
+    path_arena_block *previous = NULL;
+
+    if (arena == NULL) {
+        return;
+    }
+
+    while (arena->previous != NULL) {
+        previous = arena->previous;
+        free(arena);
+        arena = previous;
+    }
+
+    arena->used = 0;
+}
+
+/**
+ * Return the path in the root directory of a path in the mount point.
+ *
+ * The root of the file system and the mount point are two separate locations
+ * in the file system. However, all paths FUSE passes are relative to the mount
+ * point, this function translates each path to the root directory.
+ */
+char *path_resolve(const char *path)
+{
+    size_t length = strlen(path) + 1;
+    char *root_path = path_alloc(path_root.root_length + length);
+
+    memcpy(root_path, path_root.root, path_root.root_length);
+    memcpy(root_path + path_root.root_length, path, length);
+
+    return root_path;
+}
+
+/**
+ * Concatenate slices into a new null-terminated path. The list of slices ends
+ * with PATH_END.
+ */
+char *path_build(path_slice first, ...)
+{
+    va_list slices;
+    path_slice slice;
+    size_t length = 0;
+    char *path = NULL;
+    char *end = NULL;
+
+    va_start(slices, first);
+
+    for (slice = first; slice.data != NULL;
+            slice = va_arg(slices, path_slice)) {
+        length += slice.length;
+    }
+
+    va_end(slices);
+
+    path = path_alloc(length + 1);
+    end = path;
+
+    va_start(slices, first);
+
+    for (slice = first; slice.data != NULL;
+            slice = va_arg(slices, path_slice)) {
+        memcpy(end, slice.data, slice.length);
+        end += slice.length;
+    }
+
+    va_end(slices);
+
+    *end = '\0';
+
+    return path;
+}
+
+/**
+ * Return the parent directory of a path ('/' for a path directly below the
+ * root), like parent_directory without copying.
+ */
+path_slice path_parent(path_slice path)
+{
+    path_slice parent = path;
+
+    while (parent.length > 0 && path.data[parent.length - 1] != '/') {
+        parent.length--;
+    }
+
+    if (parent.length > 1) {
+        parent.length--;
+    }
+
+    return parent;
+}
+
+/**
+ * Return the last component of a path, like bottom_directory without copying.
+ */
+path_slice path_name(path_slice path)
+{
+    path_slice name = path;
+    size_t start = path.length;
+
+    while (start > 0 && path.data[start - 1] != '/') {
+        start--;
+    }
+
+    name.data = path.data + start;
+    name.length = path.length - start;
+
+    return name;
+}
@@ -0,0 +1,707 @@
+/******************************************************************************
+ *
+ * file   : policy.c
+ *
+ * author : Tim van Deurzen
+ * date   : 18/10/2026
+ *
+ * The versioning policy of a mount: which files are versioned, and how.
+ *
+ * The policy is read from the file given with --policy=<file> at mount time,
+ * one rule per line:
+ *
+ *     # build output is not versioned
+ *     exclude *.o
+ *     exclude /build/
+ *     include *.log max_versions=4 codec=zstd:19 coalesce=5000
+ *
+ * The first rule whose pattern matches the path of a file (in the mount point)
+ * applies to it, a file that no rule matches is versioned as configured. A
+ * pattern without a '/' matches the name of a file in any directory, other
+ * patterns match the path from the mount point on. '*' and '?' do not match a
+ * '/', '**' does, and '**' followed by '/' also matches no directory at all.
+ * '[...]' is a character class, '\' escapes the next character. A pattern
+ * that matches a directory matches everything in it, one ending with '/' only
+ * matches directories.
+ *
+ * An excluded file is not versioned when it is written, it is still kept when
+ * it is removed or replaced. 'max_versions' is the number of versions per
+ * snapshot (see max_num_versions in config.c), 'codec' the codec of its stored
+ * versions (taking precedence over --codec) and 'coalesce' the minimum number
+ * of milliseconds between versions created through one open file. Writes in
+ * between are versioned once the file has not been written for that long.
+ *
+ * All patterns are compiled into a single deterministic automaton at mount
+ * time, by the subset construction over the positions in the patterns. Bytes
+ * no pattern tells apart share a column of the transition table. Matching a
+ * path is a walk of the automaton, one table lookup per byte, independent of
+ * the number of rules. Open files keep the rule that applies to them (see
+ * handle.c), so a write does not match at all.
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include "policy.h"
+#include "fuse_main.h"
+#include "error.h"
+#include "util.h"
+
+#define BYTE_SET_SIZE 32
+#define IN_SET(set, byte) (((set)[(byte) >> 3] >> ((byte) & 7)) & 1)
+#define ADD_TO_SET(set, byte) ((set)[(byte) >> 3] |= 1 << ((byte) & 7))
+
+/*
+ * A position in a pattern. A byte in 'advance' moves on to the next position,
+ * a byte in 'stay' keeps the position and an optional position may be
+ * skipped. The position after the last token of a pattern is final.
+ */
+typedef struct POLICY_POSITION {
+    unsigned char advance[BYTE_SET_SIZE];
+    unsigned char stay[BYTE_SET_SIZE];
+    int optional;
+    int final;
+    int rule;
+} policy_position;
+
+/*
+ * The automaton under construction: the set of positions of each state and a
+ * hash table to find a state by its set.
+ */
+typedef struct POLICY_BUILDER {
+    policy_position *positions;
+    int num_positions;
+    size_t words;
+    uint64_t *sets;
+    int capacity;
+    int *table;
+} policy_builder;
+
+static struct {
+    policy_rule rules[POLICY_MAX_RULES];
+    int num_rules;
+    unsigned char classes[256];
+    int num_classes;
+    int num_states;
+    int start;
+    int *next;
+    int *accept;
+    int *accept_directory;
+    int enabled;
+} policy = {
+    .num_rules = 0,
+    .enabled = 0
+};
+
+/**
+ * Add the bytes of the character class starting after the '[' at pattern to
+ * set, return the position after its ']' or NULL if it is not closed.
+ */
+static const char *parse_class(const char *pattern, unsigned char *set)
+{
+    unsigned char members[BYTE_SET_SIZE];
+    const char *character = pattern;
+    int negated = 0;
+    int first = 0;
+    int last = 0;
+    int i = 0;
+
+    memset(members, 0, sizeof(members));
+
+    if (*character == '!' || *character == '^') {
+        negated = 1;
+        character++;
+    }
+
+    do {
+        if (*character == '\0') {
+            return NULL;
+        }
+
+        if (*character == '\\' && character[1] != '\0') {
+            character++;
+        }
+
+        first = (unsigned char) *character++;
+        last = first;
+
+        if (character[0] == '-' && character[1] != ']'
+                && character[1] != '\0') {
+            character++;
+
+            if (*character == '\\' && character[1] != '\0') {
+                character++;
+            }
+
+            last = (unsigned char) *character++;
+        }
+
+        for (i = first; i <= last; i++) {
+            ADD_TO_SET(members, i);
+        }
+    } while (*character != ']');
+
+    for (i = 0; i < 256; i++) {
+        if (IN_SET(members, i) != negated && i != '/') {
+            ADD_TO_SET(set, i);
+        }
+    }
+
+    return character + 1;
+}
+
+/**
+ * Compile a pattern into positions, the last one final. Returns the number of
+ * positions.
+ */
+static int compile_pattern(const char *pattern, int rule,
+        policy_position *positions)
+{
+    policy_position *position = positions;
+    const char *end = NULL;
+    int i = 0;
+
+    while (*pattern != '\0') {
+        memset(position, 0, sizeof(policy_position));
+        position->rule = rule;
+
+        if (pattern[0] == '*' && pattern[1] == '*') {
+            pattern += strspn(pattern, "*");
+            memset(position->stay, 0xff, BYTE_SET_SIZE);
+            position->optional = 1;
+
+            if (*pattern == '/') {
+                ADD_TO_SET(position->advance, '/');
+                pattern++;
+            }
+        } else if (*pattern == '*') {
+            pattern++;
+            memset(position->stay, 0xff, BYTE_SET_SIZE);
+            position->stay['/' >> 3] &= ~(1 << ('/' & 7));
+            position->optional = 1;
+        } else if (*pattern == '?') {
+            pattern++;
+
+            for (i = 0; i < 256; i++) {
+                if (i != '/') {
+                    ADD_TO_SET(position->advance, i);
+                }
+            }
+        } else if (*pattern == '['
+                && (end = parse_class(pattern + 1, position->advance))
+                != NULL) {
+            pattern = end;
+        } else {
+            if (*pattern == '\\' && pattern[1] != '\0') {
+                pattern++;
+            }
+
+            ADD_TO_SET(position->advance, (unsigned char) *pattern);
+            pattern++;
+        }
+
+        position++;
+    }
+
+    memset(position, 0, sizeof(policy_position));
+    position->rule = rule;
+    position->final = 1;
+
+    return position - positions + 1;
+}
+
+/**
+ * Parse a line of the policy file into a rule. Returns 1 for a rule, 0 for a
+ * blank line or comment and -1 if the line is not understood.
+ */
+static int parse_rule(char *line, policy_rule *rule)
+{
+    char *term = line + strspn(line, " \t\r\n");
+    char *end = NULL;
+    size_t length = 0;
+    long number = 0;
+
+    if (*term == '\0' || *term == '#') {
+        return 0;
+    }
+
+    memset(rule, 0, sizeof(policy_rule));
+    length = strcspn(term, " \t");
+
+    if (length == 7 && strncmp(term, "include", 7) == 0) {
+        rule->versioned = 1;
+    } else if (length != 7 || strncmp(term, "exclude", 7) != 0) {
+        return -1;
+    }
+
+    term += length;
+    term += strspn(term, " \t");
+
+    /*
+     * The pattern ends at the first blank that is not escaped.
+     */
+    for (length = 0; term[length] != '\0' && term[length] != ' '
+            && term[length] != '\t' && term[length] != '\r'
+            && term[length] != '\n'; length++) {
+        if (term[length] == '\\' && term[length + 1] != '\0') {
+            length++;
+        }
+    }
+
+    if (length == 0 || length >= POLICY_MAX_PATTERN) {
+        return -1;
+    }
+
+    memcpy(rule->pattern, term, length);
+    rule->pattern[length] = '\0';
+    term += length;
+
+    if (length > 1 && rule->pattern[length - 1] == '/') {
+        rule->pattern[length - 1] = '\0';
+        rule->directory_only = 1;
+    }
+
+    while (*(term += strspn(term, " \t\r\n")) != '\0') {
+        length = strcspn(term, " \t\r\n");
+
+        if (term[length] != '\0') {
+            term[length++] = '\0';
+        }
+
+        if (strncmp(term, "max_versions=", 13) == 0) {
+            number = strtol(term + 13, &end, 10);
+
+            if (end == term + 13 || *end != '\0' || number < 1) {
+                return -1;
+            }
+
+            rule->max_versions = number;
+        } else if (strncmp(term, "coalesce=", 9) == 0) {
+            number = strtol(term + 9, &end, 10);
+
+            if (end == term + 9 || *end != '\0' || number < 0) {
+                return -1;
+            }
+
+            rule->coalesce = number;
+        } else if (strncmp(term, "codec=", 6) == 0) {
+            if (codec_parse(term + 6, &rule->codec) < 0) {
+                return -1;
+            }
+
+            rule->has_codec = 1;
+        } else {
+            return -1;
+        }
+
+        term += length;
+    }
+
+    return 1;
+}
+
+/**
+ * Split the bytes of each class in two: those in set and those not in it.
+ */
+static void refine_classes(const unsigned char *set)
+{
+    int renumber[256][2];
+    int num_classes = 0;
+    int byte = 0;
+    int inside = 0;
+
+    memset(renumber, 0xff, sizeof(renumber));
+
+    for (byte = 0; byte < 256; byte++) {
+        inside = IN_SET(set, byte);
+
+        if (renumber[policy.classes[byte]][inside] < 0) {
+            renumber[policy.classes[byte]][inside] = num_classes++;
+        }
+
+        policy.classes[byte] = renumber[policy.classes[byte]][inside];
+    }
+
+    policy.num_classes = num_classes;
+}
+
+/**
+ * Add a position and the positions it may skip to to a set.
+ */
+static void add_position(policy_builder *builder, uint64_t *set, int position)
+{
+    while (!(set[position / 64] & (1ULL << (position % 64)))) {
+        set[position / 64] |= 1ULL << (position % 64);
+
+        if (builder->positions[position].final
+                || !builder->positions[position].optional) {
+            break;
+        }
+
+        position++;
+    }
+}
+
+static unsigned long hash_set(const policy_builder *builder,
+        const uint64_t *set)
+{
+    unsigned long hash = 14695981039346656037UL;
+    size_t i = 0;
+
+    for (i = 0; i < builder->words; i++) {
+        hash = (hash ^ set[i]) * 1099511628211UL;
+    }
+
+    return hash;
+}
+
+/**
+ * Double the room for states.
+ */
+static int grow_automaton(policy_builder *builder)
+{
+    int capacity = 2 * builder->capacity;
+    uint64_t *sets = NULL;
+    int *next = NULL;
+    int *accept = NULL;
+    int *accept_directory = NULL;
+
+    if ((sets = (uint64_t *) realloc(builder->sets,
+                    capacity * builder->words * sizeof(uint64_t))) != NULL) {
+        builder->sets = sets;
+    }
+
+    if ((next = (int *) realloc(policy.next,
+                    capacity * policy.num_classes * sizeof(int))) != NULL) {
+        policy.next = next;
+    }
+
+    if ((accept = (int *) realloc(policy.accept,
+                    capacity * sizeof(int))) != NULL) {
+        policy.accept = accept;
+    }
+
+    if ((accept_directory = (int *) realloc(policy.accept_directory,
+                    capacity * sizeof(int))) != NULL) {
+        policy.accept_directory = accept_directory;
+    }
+
+    if (sets == NULL || next == NULL || accept == NULL
+            || accept_directory == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    builder->capacity = capacity;
+
+    return 0;
+}
+
+/**
+ * Return the state with the given set of positions, adding it if it is new.
+ * Returns -1 (with errno set) if the automaton has too many states.
+ */
+static int find_state(policy_builder *builder, const uint64_t *set)
+{
+    size_t bytes = builder->words * sizeof(uint64_t);
+    size_t slot = hash_set(builder, set) % (2 * POLICY_MAX_STATES);
+    int state = 0;
+
+    while ((state = builder->table[slot]) >= 0) {
+        if (memcmp(builder->sets + state * builder->words, set, bytes) == 0) {
+            return state;
+        }
+
+        slot = (slot + 1) % (2 * POLICY_MAX_STATES);
+    }
+
+    if (policy.num_states == POLICY_MAX_STATES) {
+        errno = E2BIG;
+        return -1;
+    }
+
+    if (policy.num_states == builder->capacity
+            && grow_automaton(builder) < 0) {
+        return -1;
+    }
+
+    state = policy.num_states++;
+    memcpy(builder->sets + state * builder->words, set, bytes);
+    builder->table[slot] = state;
+
+    return state;
+}
+
+/**
+ * Build the automaton of the positions by the subset construction. State 0
+ * is the empty set, from which nothing matches. Returns -1 (with errno set)
+ * if the automaton grows too large.
+ */
+static int build_automaton(policy_builder *builder)
+{
+    uint64_t *set = NULL;
+    int *members = NULL;
+    int num_members = 0;
+    const policy_position *position = NULL;
+    int representative[256];
+    int state = 0;
+    int class = 0;
+    int target = 0;
+    int byte = 0;
+    int i = 0;
+
+    for (byte = 255; byte >= 0; byte--) {
+        representative[policy.classes[byte]] = byte;
+    }
+
+    builder->words = (builder->num_positions + 63) / 64;
+    builder->capacity = 64;
+    builder->sets = (uint64_t *) checked_malloc(builder->capacity
+            * builder->words * sizeof(uint64_t));
+    policy.next = (int *) checked_malloc(builder->capacity
+            * policy.num_classes * sizeof(int));
+    policy.accept = (int *) checked_malloc(builder->capacity * sizeof(int));
+    policy.accept_directory = (int *) checked_malloc(builder->capacity
+            * sizeof(int));
+    builder->table = (int *) checked_malloc(2 * POLICY_MAX_STATES
+            * sizeof(int));
+    memset(builder->table, 0xff, 2 * POLICY_MAX_STATES * sizeof(int));
+    set = (uint64_t *) checked_malloc(builder->words * sizeof(uint64_t));
+    members = (int *) checked_malloc(builder->num_positions * sizeof(int));
+
+    memset(set, 0, builder->words * sizeof(uint64_t));
+    find_state(builder, set);
+
+    for (i = 0; i < builder->num_positions; i++) {
+        if (i == 0 || builder->positions[i - 1].final) {
+            add_position(builder, set, i);
+        }
+    }
+
+    policy.start = find_state(builder, set);
+
+    for (state = 0; state < policy.num_states; state++) {
+        policy.accept[state] = policy.num_rules;
+        policy.accept_directory[state] = policy.num_rules;
+        num_members = 0;
+
+        for (i = 0; i < builder->num_positions; i++) {
+            if (builder->sets[state * builder->words + i / 64]
+                    & (1ULL << (i % 64))) {
+                members[num_members++] = i;
+            }
+        }
+
+        for (i = 0; i < num_members; i++) {
+            position = &builder->positions[members[i]];
+
+            if (!position->final) {
+                continue;
+            }
+
+            if (position->rule < policy.accept_directory[state]) {
+                policy.accept_directory[state] = position->rule;
+            }
+
+            if (!policy.rules[position->rule].directory_only
+                    && position->rule < policy.accept[state]) {
+                policy.accept[state] = position->rule;
+            }
+        }
+
+        for (class = 0; class < policy.num_classes; class++) {
+            byte = representative[class];
+            memset(set, 0, builder->words * sizeof(uint64_t));
+
+            for (i = 0; i < num_members; i++) {
+                position = &builder->positions[members[i]];
+
+                if (position->final) {
+                    continue;
+                }
+
+                if (IN_SET(position->advance, byte)) {
+                    add_position(builder, set, members[i] + 1);
+                }
+
+                if (IN_SET(position->stay, byte)) {
+                    add_position(builder, set, members[i]);
+                }
+            }
+
+            if ((target = find_state(builder, set)) < 0) {
+                free(members);
+                free(set);
+                return -1;
+            }
+
+            policy.next[state * policy.num_classes + class] = target;
+        }
+    }
+
+    free(members);
+    free(set);
+
+    return 0;
+}
+
+/**
+ * Read the policy file and compile its rules. Nothing is versioned
+ * differently if it cannot be read or a rule is not understood.
+ */
+int policy_load(const char *file)
+{
+    policy_builder builder;
+    char line[POLICY_MAX_LINE];
+    char pattern[POLICY_MAX_PATTERN + 4];
+    FILE *input = NULL;
+    int return_value = 0;
+    int i = 0;
+
+    if ((input = fopen(file, "r")) == NULL) {
+        return HIERONYMUS_ERROR(err_policy, "policy_load");
+    }
+
+    policy_destroy();
+
+    while (return_value == 0 && fgets(line, sizeof(line), input) != NULL) {
+        if (policy.num_rules == POLICY_MAX_RULES) {
+            errno = ENOSPC;
+            return_value = -1;
+        } else if ((return_value = parse_rule(line,
+                        &policy.rules[policy.num_rules])) > 0) {
+            policy.num_rules++;
+            return_value = 0;
+        } else if (return_value < 0) {
+            errno = EINVAL;
+        }
+    }
+
+    fclose(input);
+
+    if (return_value < 0) {
+        policy.num_rules = 0;
+        return HIERONYMUS_ERROR(err_policy, "policy_load");
+    }
+
+    if (policy.num_rules == 0) {
+        return 0;
+    }
+
+    memset(&builder, 0, sizeof(policy_builder));
+    builder.positions = (policy_position *) checked_malloc(policy.num_rules
+            * (sizeof(pattern) + 1) * sizeof(policy_position));
+    memset(policy.classes, 0, sizeof(policy.classes));
+    policy.num_classes = 1;
+
+    /*
+     * A pattern without a '/' matches a name in any directory, the others
+     * match from the mount point on.
+     */
+    for (i = 0; i < policy.num_rules; i++) {
+        snprintf(pattern, sizeof(pattern), "%s%s",
+                strchr(policy.rules[i].pattern, '/') == NULL ? "**/"
+                : policy.rules[i].pattern[0] == '/' ? "" : "/",
+                policy.rules[i].pattern);
+        builder.num_positions += compile_pattern(pattern, i,
+                builder.positions + builder.num_positions);
+    }
+
+    for (i = 0; i < builder.num_positions; i++) {
+        refine_classes(builder.positions[i].advance);
+        refine_classes(builder.positions[i].stay);
+    }
+
+    if (build_automaton(&builder) < 0) {
+        return_value = HIERONYMUS_ERROR(err_policy, "policy_load");
+        policy_destroy();
+    } else {
+        policy.enabled = 1;
+    }
+
+    free(builder.positions);
+    free(builder.sets);
+    free(builder.table);
+
+    for (i = 0; return_value == 0 && i < policy.num_rules; i++) {
+        if (policy.rules[i].has_codec
+                && policy.rules[i].codec.codec != codec_none) {
+            codec_enable();
+        }
+    }
+
+    return return_value;
+}
+
+int policy_enabled(void)
+{
+    return policy.enabled;
+}
+
+/**
+ * Return the rule that applies to a path in the mount point, NULL if no rule
+ * matches it (or there is no policy).
+ */
+const policy_rule *policy_match(const char *path)
+{
+    const unsigned char *character = (const unsigned char *) path;
+    int state = policy.start;
+    int best = policy.num_rules;
+
+    if (!policy.enabled) {
+        return NULL;
+    }
+
+    for (; *character != '\0' && state != 0; character++) {
+        if (*character == '/' && policy.accept_directory[state] < best) {
+            best = policy.accept_directory[state];
+        }
+
+        state = policy.next[state * policy.num_classes
+            + policy.classes[*character]];
+    }
+
+    if (policy.accept[state] < best) {
+        best = policy.accept[state];
+    }
+
+    return best < policy.num_rules ? &policy.rules[best] : NULL;
+}
+
+/**
+ * Return the rule that applies to a path in the root directory.
+ */
+const policy_rule *policy_match_root(const char *root_path)
+{
+    size_t length = 0;
+
+    if (!policy.enabled) {
+        return NULL;
+    }
+
+    length = strlen(ADMIN->root_directory);
+
+    if (strncmp(root_path, ADMIN->root_directory, length) != 0) {
+        return NULL;
+    }
+
+    return policy_match(root_path + length);
+}
+
+void policy_destroy(void)
+{
+    policy.enabled = 0;
+    policy.num_rules = 0;
+    policy.num_states = 0;
+
+    free(policy.next);
+    free(policy.accept);
+    free(policy.accept_directory);
+    policy.next = NULL;
+    policy.accept = NULL;
+    policy.accept_directory = NULL;
+}
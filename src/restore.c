@@ -0,0 +1,601 @@
+/******************************************************************************
+ *
+ * file   : restore.c
+ *
+ * author : Tim van Deurzen
+ * date   : 18/10/2026
+ *
+ * Reconstruction of old versions ('h_vtool restore' and 'restore-blocks', used
+ * by h_admin.py --restore).
+ *
+ * A whole-file version is its snapshot copy with one patch applied. Both are
+ * made readable (unpacked from the pack of their '.version' directory and
+ * decompressed when needed) and read ahead into the page cache by tasks of the
+ * shared pool at the same time, the patch is applied once both are there.
+ *
+ * A block-level version is the live file with the undo-block stores of every
+ * epoch since then applied, newest first. The live file is copied and the
+ * first RESTORE_WINDOW stores are loaded into memory in parallel, the others
+ * are read ahead. Every store that has been applied makes room for the next one
+ * in the window, so the stores are read while earlier ones are applied.
+ *
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "restore.h"
+#include "block_versioning.h"
+#include "thread_pool.h"
+#include "delta.h"
+#include "codec.h"
+#include "pack.h"
+#include "error.h"
+#include "util.h"
+
+/**
+ * Parse the name of a restore method, returns -1 for an unknown name.
+ */
+int restore_parse_method(const char *name)
+{
+    if (strcmp(name, "native") == 0) {
+        return restore_native;
+    }
+
+    if (strcmp(name, "xdelta") == 0) {
+        return restore_xdelta;
+    }
+
+    if (strcmp(name, "diff") == 0) {
+        return restore_diff;
+    }
+
+    return -1;
+}
+
+/**
+ * Read a file into the page cache, in chunks so the reads are queued one after
+ * another. A file system without readahead gets the hint instead.
+ */
+static void read_ahead(int fd)
+{
+    struct stat stat_buffer;
+    off_t offset = 0;
+
+    if (fstat(fd, &stat_buffer) < 0) {
+        return;
+    }
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    for (offset = 0; offset < stat_buffer.st_size;
+            offset += RESTORE_READAHEAD_CHUNK) {
+        if (readahead(fd, offset, RESTORE_READAHEAD_CHUNK) < 0) {
+            posix_fadvise(fd, offset, 0, POSIX_FADV_WILLNEED);
+            break;
+        }
+    }
+}
+
+static void read_ahead_path(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+
+    if (fd >= 0) {
+        read_ahead(fd);
+        close(fd);
+    }
+}
+
+/**
+ * Make a temporary file next to the output of a reconstruction, so it is on
+ * the same file system.
+ */
+static int make_temporary(const char *output, char *path)
+{
+    int length = snprintf(path, PATH_MAX, "%s.XXXXXX", output);
+    int fd = -1;
+
+    if (length < 0 || length >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        path[0] = '\0';
+        return HIERONYMUS_ERROR(err_restore, "make_temporary");
+    }
+
+    if ((fd = mkstemp(path)) < 0) {
+        path[0] = '\0';
+        return HIERONYMUS_ERROR(err_restore, "make_temporary");
+    }
+
+    close(fd);
+
+    return 0;
+}
+
+/**
+ * Unpack a stored version that is not in its snapshot directory: version
+ * ``<version directory>/<snapshot>/<name>'' is the pack entry
+ * ``<snapshot>/<name>'' of the version directory.
+ */
+static int unpack(const char *path, const char *dest)
+{
+    char directory[PATH_MAX];
+    char *name = NULL;
+    char *slash = NULL;
+
+    snprintf(directory, PATH_MAX, "%s", path);
+
+    if ((slash = strrchr(directory, '/')) == NULL) {
+        errno = ENOENT;
+        return HIERONYMUS_ERROR(err_restore, "unpack");
+    }
+
+    *slash = '\0';
+    name = strrchr(directory, '/');
+    *slash = '/';
+
+    if (name == NULL) {
+        return pack_extract(".", directory, dest);
+    }
+
+    *name = '\0';
+
+    return pack_extract(directory, name + 1, dest);
+}
+
+/**
+ * Make an input readable and read it ahead (a pool task).
+ */
+static void prepare_input(void *argument)
+{
+    restore_input *input = (restore_input *) argument;
+    char unpacked[PATH_MAX];
+    const char *source = input->path;
+    int compressed = 0;
+
+    unpacked[0] = '\0';
+
+    if (access(input->path, F_OK) < 0 && errno == ENOENT) {
+        if (make_temporary(input->output, unpacked) < 0
+                || unpack(input->path, unpacked) < 0) {
+            goto failed;
+        }
+
+        source = unpacked;
+    }
+
+    if ((compressed = codec_is_compressed(source)) < 0) {
+        HIERONYMUS_ERROR(err_restore, "prepare_input");
+        goto failed;
+    }
+
+    if (compressed) {
+        if (make_temporary(input->output, input->readable) < 0) {
+            goto failed;
+        }
+
+        input->temporary = 1;
+
+        if (codec_decompress_file(source, input->readable) < 0) {
+            goto failed;
+        }
+
+        if (unpacked[0] != '\0') {
+            unlink(unpacked);
+        }
+    } else {
+        snprintf(input->readable, PATH_MAX, "%s", source);
+        input->temporary = unpacked[0] != '\0';
+    }
+
+    read_ahead_path(input->readable);
+
+    return;
+
+failed:
+    if (unpacked[0] != '\0') {
+        unlink(unpacked);
+    }
+
+    input->failed = 1;
+}
+
+static void start_input(thread_pool *pool, restore_input *input,
+        const char *path, const char *output)
+{
+    memset(input, 0, sizeof(*input));
+    snprintf(input->path, PATH_MAX, "%s", path);
+    input->output = output;
+
+    pool_group_init(&input->group);
+    thread_pool_submit(pool, &input->group, prepare_input, input);
+}
+
+static void finish_input(thread_pool *pool, restore_input *input)
+{
+    pool_group_wait(pool, &input->group);
+    pool_group_destroy(&input->group);
+}
+
+/**
+ * Run an external tool (found in PATH) with the given arguments and wait for
+ * it. The arguments are passed as they are, without a shell, so file names
+ * may contain any character. Returns 0 if the tool exited with status 0.
+ */
+static int run_tool(char *const arguments[])
+{
+    extern char **environ;
+    pid_t pid = 0;
+    int status = 0;
+    int error = 0;
+
+    if ((error = posix_spawnp(&pid, arguments[0], NULL, NULL, arguments, 
+                    environ)) != 0) {
+        errno = error;
+        return -1;
+    }
+
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        errno = EIO;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Restore the version made of a snapshot copy and a patch to output, applying
+ * the patch with the given method.
+ */
+int restore_version(const char *base, const char *patch, const char *output,
+        int method)
+{
+    thread_pool *pool = thread_pool_shared();
+    restore_input *inputs = NULL;
+    int return_value = 0;
+    int i = 0;
+
+    if ((inputs = (restore_input *) malloc(2 * sizeof(*inputs))) == NULL) {
+        HIERONYMUS_ERROR(err_malloc, "restore_version");
+        abort();
+    }
+
+    start_input(pool, &inputs[0], base, output);
+    start_input(pool, &inputs[1], patch, output);
+
+    finish_input(pool, &inputs[0]);
+    finish_input(pool, &inputs[1]);
+
+    if (inputs[0].failed || inputs[1].failed) {
+        errno = EIO;
+        return_value = HIERONYMUS_ERROR(err_restore, "restore_version");
+        goto out;
+    }
+
+    if (method == restore_native) {
+        return_value = delta_decode(inputs[0].readable, inputs[1].readable,
+                output);
+        goto out;
+    }
+
+    if (method == restore_xdelta) {
+        char *const arguments[] = { "xdelta3", "-f", "-d", "-s", 
+            inputs[0].readable, inputs[1].readable, (char *) output, NULL };
+
+        return_value = run_tool(arguments);
+    } else {
+        char *const arguments[] = { "patch", "-s", "-o", (char *) output, 
+            inputs[0].readable, inputs[1].readable, NULL };
+
+        return_value = run_tool(arguments);
+    }
+
+    if (return_value < 0) {
+        return_value = HIERONYMUS_ERROR(err_restore, "restore_version");
+    }
+
+out:
+    for (i = 0; i < 2; i++) {
+        if (inputs[i].temporary) {
+            unlink(inputs[i].readable);
+        }
+    }
+
+    free(inputs);
+
+    return return_value;
+}
+
+/**
+ * Copy the path of a file of an epoch (its prefix and a suffix) to path.
+ */
+static int epoch_path(const restore_epoch *epoch, const char *suffix,
+        char *path)
+{
+    int length = snprintf(path, PATH_MAX, "%s%s", epoch->prefix, suffix);
+
+    if (length < 0 || length >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Load the bitmap header and the undo-block store of an epoch (a pool task). A
+ * file without a bitmap in an epoch was not written in it.
+ */
+static void load_epoch(void *argument)
+{
+    restore_epoch *epoch = (restore_epoch *) argument;
+    char path[PATH_MAX];
+    block_map_header header;
+    struct stat stat_buffer;
+    ssize_t length = 0;
+    size_t done = 0;
+    int fd = -1;
+
+    if (epoch_path(epoch, BLOCK_MAP_SUFFIX, path) < 0) {
+        epoch->failed = 1;
+        return;
+    }
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        epoch->failed = errno != ENOENT;
+        return;
+    }
+
+    length = read(fd, &header, sizeof(header));
+    close(fd);
+
+    if (length != sizeof(header) || header.block_size == 0
+            || memcmp(header.magic, BLOCK_MAP_MAGIC, sizeof(header.magic))
+            != 0) {
+        epoch->failed = 1;
+        return;
+    }
+
+    epoch->has_map = 1;
+    epoch->block_size = header.block_size;
+    epoch->original_size = header.original_size;
+
+    if (epoch_path(epoch, BLOCK_STORE_SUFFIX, path) < 0) {
+        epoch->failed = 1;
+        return;
+    }
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        epoch->failed = errno != ENOENT;
+        return;
+    }
+
+    if (fstat(fd, &stat_buffer) < 0) {
+        epoch->failed = 1;
+        close(fd);
+        return;
+    }
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    if (stat_buffer.st_size > 0
+            && (epoch->blocks = malloc(stat_buffer.st_size)) == NULL) {
+        epoch->failed = 1;
+        close(fd);
+        return;
+    }
+
+    while (done < (size_t) stat_buffer.st_size) {
+        length = pread(fd, epoch->blocks + done, stat_buffer.st_size - done,
+                done);
+
+        if (length <= 0) {
+            break;
+        }
+
+        done += length;
+    }
+
+    epoch->length = done;
+    close(fd);
+}
+
+/**
+ * Read ahead the undo-block store of an epoch that is not in the window yet
+ * (a pool task).
+ */
+static void prefetch_epoch(void *argument)
+{
+    restore_epoch *epoch = (restore_epoch *) argument;
+    char path[PATH_MAX];
+
+    if (epoch_path(epoch, BLOCK_STORE_SUFFIX, path) == 0) {
+        read_ahead_path(path);
+    }
+}
+
+typedef struct RESTORE_COPY {
+    const char *source;
+    const char *dest;
+    int failed;
+} restore_copy;
+
+static void copy_live(void *argument)
+{
+    restore_copy *job = (restore_copy *) argument;
+
+    job->failed = copy(job->source, job->dest) < 0;
+}
+
+/**
+ * Write the blocks of an epoch to the output. After a crash a block can be
+ * saved twice in an epoch, only its first record holds the contents from the
+ * start of the epoch. 'applied' has a bit per block, it is grown as needed and
+ * left cleared.
+ */
+static int apply_epoch(int fd, restore_epoch *epoch, unsigned char **applied,
+        unsigned long long *num_bits)
+{
+    const block_record *record = NULL;
+    unsigned long long needed = 0;
+    unsigned long long block = 0;
+    size_t position = 0;
+    int return_value = 0;
+
+    while (position + sizeof(block_record) <= epoch->length) {
+        record = (const block_record *) (epoch->blocks + position);
+        position += sizeof(block_record);
+
+        if (record->length > epoch->length - position) {
+            break;
+        }
+
+        block = record->block;
+
+        if (block >= *num_bits) {
+            needed = (block + 1) * 2;
+
+            if ((*applied = realloc(*applied, (needed + 7) / 8)) == NULL) {
+                HIERONYMUS_ERROR(err_malloc, "apply_epoch");
+                abort();
+            }
+
+            memset(*applied + (*num_bits + 7) / 8, 0,
+                    (needed + 7) / 8 - (*num_bits + 7) / 8);
+            *num_bits = needed;
+        }
+
+        if (((*applied)[block / 8] & (1 << (block % 8))) == 0) {
+            (*applied)[block / 8] |= 1 << (block % 8);
+
+            if (pwrite(fd, epoch->blocks + position, record->length,
+                        block * epoch->block_size) != (ssize_t) record->length) {
+                return_value = HIERONYMUS_ERROR(err_restore, "apply_epoch");
+                break;
+            }
+        }
+
+        position += record->length;
+    }
+
+    if (*applied != NULL) {
+        memset(*applied, 0, (*num_bits + 7) / 8);
+    }
+
+    return return_value;
+}
+
+/**
+ * Restore a file to output from the undo-block stores of the epochs with the
+ * given path prefixes (``<version directory>/<epoch>/<name>''), newest first.
+ * The oldest epoch the file was written in determines its size.
+ */
+int restore_blocks(const char *file, const char *output, char **prefixes,
+        int num_epochs)
+{
+    thread_pool *pool = thread_pool_shared();
+    restore_epoch *epochs = NULL;
+    restore_copy live;
+    pool_group copy_group;
+    pool_group prefetch_group;
+    unsigned char *applied = NULL;
+    unsigned long long num_bits = 0;
+    unsigned long long size = 0;
+    int sized = 0;
+    int loaded = 0;
+    int fd = -1;
+    int return_value = 0;
+    int i = 0;
+
+    if (num_epochs > 0 && (epochs = calloc(num_epochs, sizeof(*epochs)))
+            == NULL) {
+        HIERONYMUS_ERROR(err_malloc, "restore_blocks");
+        abort();
+    }
+
+    live.source = file;
+    live.dest = output;
+    live.failed = 0;
+
+    pool_group_init(&copy_group);
+    pool_group_init(&prefetch_group);
+    thread_pool_submit(pool, &copy_group, copy_live, &live);
+
+    for (i = 0; i < num_epochs; i++) {
+        snprintf(epochs[i].prefix, PATH_MAX, "%s", prefixes[i]);
+        pool_group_init(&epochs[i].group);
+
+        if (i < RESTORE_WINDOW) {
+            thread_pool_submit(pool, &epochs[i].group, load_epoch, &epochs[i]);
+            loaded++;
+        } else {
+            thread_pool_submit(pool, &prefetch_group, prefetch_epoch,
+                    &epochs[i]);
+        }
+    }
+
+    pool_group_wait(pool, &copy_group);
+    pool_group_destroy(&copy_group);
+
+    if (live.failed || (fd = open(output, O_RDWR)) < 0) {
+        return_value = HIERONYMUS_ERROR(err_restore, "restore_blocks");
+    }
+
+    for (i = 0; i < num_epochs; i++) {
+        pool_group_wait(pool, &epochs[i].group);
+
+        if (loaded < num_epochs) {
+            thread_pool_submit(pool, &epochs[loaded].group, load_epoch,
+                    &epochs[loaded]);
+            loaded++;
+        }
+
+        if (return_value == 0 && epochs[i].failed) {
+            errno = EIO;
+            return_value = HIERONYMUS_ERROR(err_restore, "restore_blocks");
+        }
+
+        if (return_value == 0 && epochs[i].has_map) {
+            return_value = apply_epoch(fd, &epochs[i], &applied, &num_bits);
+            size = epochs[i].original_size;
+            sized = 1;
+        }
+
+        free(epochs[i].blocks);
+        epochs[i].blocks = NULL;
+        pool_group_destroy(&epochs[i].group);
+    }
+
+    pool_group_wait(pool, &prefetch_group);
+    pool_group_destroy(&prefetch_group);
+
+    if (return_value == 0 && sized && ftruncate(fd, size) < 0) {
+        return_value = HIERONYMUS_ERROR(err_restore, "restore_blocks");
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    free(applied);
+    free(epochs);
+
+    return return_value;
+}
@@ -0,0 +1,394 @@
+/******************************************************************************
+ *
+ * file   : scheduler.c
+ *
+ * author : Tim van Deurzen
+ * date   : 18/10/2026
+ *
+ * Scheduler of deferred work: coalesced versions, flushing the log.
+ *
+ * Timers are kept in a hierarchical timing wheel. Level 0 has a slot per tick
+ * for the next SCHEDULER_SLOTS ticks, a slot of level n holds the timers that
+ * expire in a span of SCHEDULER_SLOTS^n ticks further ahead. A timer goes
+ * straight into its slot and is unlinked from it when it is cancelled or armed
+ * again, both in constant time, no matter how many timers there are. Every
+ * time level n has made a full round, the next slot of level n + 1 is
+ * cascaded: its timers are spread over the lower levels.
+ *
+ * One thread advances the wheel a tick at a time and hands the timers of the
+ * slot it reaches to a small pool of workers. It sleeps while no timer is
+ * pending. The scheduler is started in h_init and stopped in h_destroy; timers
+ * that are still pending then are dropped, timers being run are waited for.
+ * Without the scheduler arming a timer fails, its user falls back to doing
+ * the work another way.
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "scheduler.h"
+#include "thread_pool.h"
+#include "error.h"
+
+#define SLOT_MASK (SCHEDULER_SLOTS - 1)
+#define MAX_DELAY ((1ULL << (SCHEDULER_LEVELS * SCHEDULER_LEVEL_BITS)) - 1)
+
+static struct {
+    scheduler_timer *slots[SCHEDULER_LEVELS][SCHEDULER_SLOTS];
+    unsigned long long now;
+    unsigned long long num_pending;
+    struct timespec start;
+    thread_pool *workers;
+    pool_group fired;
+    pthread_t ticker;
+    int running;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t finished;
+} scheduler = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .finished = PTHREAD_COND_INITIALIZER
+};
+
+/*
+ * The timer whose function the current thread runs, if any.
+ */
+static __thread scheduler_timer *current_timer = NULL;
+
+/**
+ * Return the tick the monotonic clock is at.
+ */
+static unsigned long long clock_ticks(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return ((now.tv_sec - scheduler.start.tv_sec) * 1000ULL
+        + (now.tv_nsec - scheduler.start.tv_nsec) / 1000000LL)
+        / SCHEDULER_TICK;
+}
+
+/**
+ * Put a timer in the slot for its expiry, called with the lock held. A timer
+ * that is already due expires on the next tick.
+ */
+static void insert_locked(scheduler_timer *timer)
+{
+    scheduler_timer **slot = NULL;
+    unsigned long long delta = 0;
+    int level = 0;
+
+    if (timer->expires < scheduler.now) {
+        timer->expires = scheduler.now;
+    }
+
+    if (timer->expires - scheduler.now > MAX_DELAY) {
+        timer->expires = scheduler.now + MAX_DELAY;
+    }
+
+    delta = timer->expires - scheduler.now;
+
+    while (level < SCHEDULER_LEVELS - 1
+            && delta >> ((level + 1) * SCHEDULER_LEVEL_BITS) != 0) {
+        level++;
+    }
+
+    slot = &scheduler.slots[level][(timer->expires
+            >> (level * SCHEDULER_LEVEL_BITS)) & SLOT_MASK];
+
+    timer->next = *slot;
+
+    if (*slot != NULL) {
+        (*slot)->link = &timer->next;
+    }
+
+    *slot = timer;
+    timer->link = slot;
+    timer->pending = 1;
+    scheduler.num_pending++;
+}
+
+static void unlink_locked(scheduler_timer *timer)
+{
+    *timer->link = timer->next;
+
+    if (timer->next != NULL) {
+        timer->next->link = timer->link;
+    }
+
+    timer->next = NULL;
+    timer->link = NULL;
+    timer->pending = 0;
+    scheduler.num_pending--;
+}
+
+/**
+ * Spread the timers of a slot over the lower levels.
+ */
+static void cascade_locked(int level, int index)
+{
+    scheduler_timer *timer = scheduler.slots[level][index];
+    scheduler_timer *next = NULL;
+
+    scheduler.slots[level][index] = NULL;
+
+    for (; timer != NULL; timer = next) {
+        next = timer->next;
+        scheduler.num_pending--;
+        insert_locked(timer);
+    }
+}
+
+/**
+ * Run the function of an expired timer (a task of the workers).
+ */
+static void run_timer(void *argument)
+{
+    scheduler_timer *timer = (scheduler_timer *) argument;
+
+    current_timer = timer;
+    timer->function(timer->argument);
+    current_timer = NULL;
+
+    pthread_mutex_lock(&scheduler.lock);
+    timer->running--;
+    pthread_cond_broadcast(&scheduler.finished);
+    pthread_mutex_unlock(&scheduler.lock);
+}
+
+/**
+ * Advance the wheel by one tick and hand the timers that expire on it to the
+ * workers, called with the lock held.
+ */
+static void tick_locked(void)
+{
+    unsigned long long tick = scheduler.now;
+    scheduler_timer *timer = NULL;
+    scheduler_timer *next = NULL;
+    int index = tick & SLOT_MASK;
+    int level = 1;
+    int slot = 0;
+
+    if (index == 0) {
+        for (level = 1; level < SCHEDULER_LEVELS; level++) {
+            slot = (tick >> (level * SCHEDULER_LEVEL_BITS)) & SLOT_MASK;
+            cascade_locked(level, slot);
+
+            if (slot != 0) {
+                break;
+            }
+        }
+    }
+
+    timer = scheduler.slots[0][index];
+    scheduler.slots[0][index] = NULL;
+    scheduler.now = tick + 1;
+
+    for (; timer != NULL; timer = next) {
+        next = timer->next;
+        timer->next = NULL;
+        timer->link = NULL;
+        timer->pending = 0;
+        timer->running++;
+        scheduler.num_pending--;
+
+        thread_pool_submit(scheduler.workers, &scheduler.fired, run_timer,
+                timer);
+    }
+}
+
+static void *ticker(void *argument)
+{
+    struct timespec deadline;
+    unsigned long long milliseconds = 0;
+
+    (void) argument;
+
+    pthread_mutex_lock(&scheduler.lock);
+
+    while (scheduler.running) {
+        if (scheduler.num_pending == 0) {
+            pthread_cond_wait(&scheduler.wake, &scheduler.lock);
+            continue;
+        }
+
+        if (clock_ticks() < scheduler.now) {
+            milliseconds = scheduler.now * SCHEDULER_TICK;
+            deadline.tv_sec = scheduler.start.tv_sec + milliseconds / 1000;
+            deadline.tv_nsec = scheduler.start.tv_nsec
+                + (milliseconds % 1000) * 1000000L;
+
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+
+            pthread_cond_timedwait(&scheduler.wake, &scheduler.lock,
+                    &deadline);
+            continue;
+        }
+
+        tick_locked();
+    }
+
+    pthread_mutex_unlock(&scheduler.lock);
+
+    return NULL;
+}
+
+/**
+ * Start the scheduler with the given number of workers.
+ */
+int scheduler_start(int num_workers)
+{
+    pthread_condattr_t attributes;
+
+    pthread_mutex_lock(&scheduler.lock);
+
+    if (scheduler.running) {
+        pthread_mutex_unlock(&scheduler.lock);
+        return 0;
+    }
+
+    memset(scheduler.slots, 0, sizeof(scheduler.slots));
+    clock_gettime(CLOCK_MONOTONIC, &scheduler.start);
+    scheduler.now = 0;
+    scheduler.num_pending = 0;
+
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&scheduler.wake, &attributes);
+    pthread_condattr_destroy(&attributes);
+
+    scheduler.workers = thread_pool_create(num_workers);
+    pool_group_init(&scheduler.fired);
+    scheduler.running = 1;
+
+    if (pthread_create(&scheduler.ticker, NULL, ticker, NULL) != 0) {
+        scheduler.running = 0;
+        pool_group_destroy(&scheduler.fired);
+        thread_pool_destroy(scheduler.workers);
+        pthread_cond_destroy(&scheduler.wake);
+        pthread_mutex_unlock(&scheduler.lock);
+
+        return HIERONYMUS_ERROR(err_scheduler, "scheduler_start");
+    }
+
+    pthread_mutex_unlock(&scheduler.lock);
+
+    return 0;
+}
+
+/**
+ * Stop the scheduler: drop the pending timers and wait for the ones that are
+ * being run.
+ */
+void scheduler_stop(void)
+{
+    int level = 0;
+    int index = 0;
+
+    pthread_mutex_lock(&scheduler.lock);
+
+    if (!scheduler.running) {
+        pthread_mutex_unlock(&scheduler.lock);
+        return;
+    }
+
+    scheduler.running = 0;
+
+    for (level = 0; level < SCHEDULER_LEVELS; level++) {
+        for (index = 0; index < SCHEDULER_SLOTS; index++) {
+            while (scheduler.slots[level][index] != NULL) {
+                unlink_locked(scheduler.slots[level][index]);
+            }
+        }
+    }
+
+    pthread_cond_signal(&scheduler.wake);
+    pthread_mutex_unlock(&scheduler.lock);
+
+    pthread_join(scheduler.ticker, NULL);
+
+    pool_group_wait(scheduler.workers, &scheduler.fired);
+    pool_group_destroy(&scheduler.fired);
+    thread_pool_destroy(scheduler.workers);
+    pthread_cond_destroy(&scheduler.wake);
+}
+
+void scheduler_timer_init(scheduler_timer *timer, scheduler_function function,
+        void *argument)
+{
+    memset(timer, 0, sizeof(*timer));
+    timer->function = function;
+    timer->argument = argument;
+}
+
+/**
+ * Let a timer expire the given number of milliseconds from now, instead of
+ * when it would have if it is pending. Fails if the scheduler is not running.
+ */
+int scheduler_arm(scheduler_timer *timer, unsigned long milliseconds)
+{
+    unsigned long long now = 0;
+
+    pthread_mutex_lock(&scheduler.lock);
+
+    if (!scheduler.running) {
+        pthread_mutex_unlock(&scheduler.lock);
+        return -1;
+    }
+
+    if (timer->pending) {
+        unlink_locked(timer);
+    }
+
+    /*
+     * The wheel stands still while it is empty, it is moved on to the clock
+     * before it is used again.
+     */
+    if (scheduler.num_pending == 0 && (now = clock_ticks()) > scheduler.now) {
+        scheduler.now = now;
+    }
+
+    timer->expires = scheduler.now
+        + (milliseconds + SCHEDULER_TICK - 1) / SCHEDULER_TICK;
+    insert_locked(timer);
+
+    if (scheduler.num_pending == 1) {
+        pthread_cond_signal(&scheduler.wake);
+    }
+
+    pthread_mutex_unlock(&scheduler.lock);
+
+    return 0;
+}
+
+/**
+ * Cancel a timer, returns whether it was pending. If its function is being
+ * run (other than by the calling function itself), this waits until it is
+ * done, so the structure of the timer can be freed afterwards.
+ */
+int scheduler_cancel(scheduler_timer *timer)
+{
+    int pending = 0;
+
+    pthread_mutex_lock(&scheduler.lock);
+
+    if ((pending = timer->pending)) {
+        unlink_locked(timer);
+    }
+
+    while (timer->running > (current_timer == timer)) {
+        pthread_cond_wait(&scheduler.finished, &scheduler.lock);
+    }
+
+    pthread_mutex_unlock(&scheduler.lock);
+
+    return pending;
+}
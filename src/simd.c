@@ -0,0 +1,725 @@
+/******************************************************************************
+ *
+ * file   : simd.c
+ *
+ * author : Tim van Deurzen
+ * date   : 18/10/2026
+ *
+ * Vectorised kernels for change detection.
+ *
+ * Three kernels are provided, each in a scalar version and in versions for
+ * SSE4.2, AVX2 and AVX-512 (where the instruction set helps):
+ *
+ *  - simd_mismatch: offset of the first differing byte of two ranges, with an
+ *    early exit at the first vector that differs.
+ *  - simd_crc32c: CRC32C (Castagnoli) checksum, with the SSE4.2 crc32
+ *    instruction (the scalar version uses slicing-by-8 tables).
+ *  - simd_gear_boundary: first content-defined chunk boundary according to a
+ *    gear rolling hash. The hash of a position only depends on the 64 bytes up
+ *    to it, so the vector versions hash 4 (AVX2) or 8 (AVX-512) parts of the
+ *    buffer at once, each lane warmed up on the 64 bytes before its part.
+ *
+ * The best supported level is selected on first use. The vector versions are
+ * compiled with target attributes, so this file needs no special flags and the
+ * binary still runs on processors without these extensions.
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "simd.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define SIMD_X86
+#include <immintrin.h>
+#endif
+
+#define CRC32C_POLYNOMIAL 0x82f63b78
+
+typedef struct SIMD_KERNELS {
+    size_t (*mismatch)(const void *, const void *, size_t);
+    uint32_t (*crc32c)(uint32_t, const void *, size_t);
+    size_t (*gear_boundary)(const void *, size_t, uint64_t);
+} simd_kernels;
+
+static const char *level_names[num_simd_levels] = {
+    "scalar", "sse4.2", "avx2", "avx512"
+};
+
+static simd_kernels kernels[num_simd_levels];
+static int supported[num_simd_levels];
+
+static struct {
+    int level;
+    simd_kernels active;
+} simd;
+
+static pthread_once_t simd_once = PTHREAD_ONCE_INIT;
+
+static uint32_t crc_table[8][256];
+static uint64_t gear_table[256];
+
+/**
+ * Index of the first differing byte of two words, given their exclusive or.
+ */
+static inline size_t first_difference(uint64_t difference)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return __builtin_ctzll(difference) / 8;
+#else
+    return __builtin_clzll(difference) / 8;
+#endif
+}
+
+static size_t mismatch_scalar(const void *a, const void *b, size_t length)
+{
+    const unsigned char *x = (const unsigned char *) a;
+    const unsigned char *y = (const unsigned char *) b;
+    uint64_t u = 0;
+    uint64_t v = 0;
+    size_t i = 0;
+
+    for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+        memcpy(&u, x + i, sizeof(uint64_t));
+        memcpy(&v, y + i, sizeof(uint64_t));
+
+        if (u != v) {
+            return i + first_difference(u ^ v);
+        }
+    }
+
+    for (; i < length; i++) {
+        if (x[i] != y[i]) {
+            return i;
+        }
+    }
+
+    return length;
+}
+
+static uint32_t crc32c_scalar(uint32_t crc, const void *data, size_t length)
+{
+    const unsigned char *bytes = (const unsigned char *) data;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint64_t word = 0;
+#endif
+
+    crc = ~crc;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (; length >= sizeof(uint64_t); length -= sizeof(uint64_t)) {
+        memcpy(&word, bytes, sizeof(uint64_t));
+        word ^= crc;
+        bytes += sizeof(uint64_t);
+
+        crc = crc_table[7][word & 0xff] ^ crc_table[6][(word >> 8) & 0xff]
+            ^ crc_table[5][(word >> 16) & 0xff]
+            ^ crc_table[4][(word >> 24) & 0xff]
+            ^ crc_table[3][(word >> 32) & 0xff]
+            ^ crc_table[2][(word >> 40) & 0xff]
+            ^ crc_table[1][(word >> 48) & 0xff]
+            ^ crc_table[0][word >> 56];
+    }
+#endif
+
+    for (; length > 0; length--) {
+        crc = crc_table[0][(crc ^ *bytes++) & 0xff] ^ (crc >> 8);
+    }
+
+    return ~crc;
+}
+
+/**
+ * Continue a gear hash 'hash' from 'start', return the position after the
+ * first boundary or length if there is none.
+ */
+static size_t gear_continue(const unsigned char *data, size_t start,
+        size_t length, uint64_t hash, uint64_t mask)
+{
+    size_t i = 0;
+
+    for (i = start; i < length; i++) {
+        hash = (hash << 1) + gear_table[data[i]];
+
+        if ((hash & mask) == 0) {
+            return i + 1;
+        }
+    }
+
+    return length;
+}
+
+static size_t gear_scalar(const void *data, size_t length, uint64_t mask)
+{
+    return gear_continue((const unsigned char *) data, 0, length, 0, mask);
+}
+
+#ifdef SIMD_X86
+
+/**
+ * Gear hash of the position before 'start' (start >= SIMD_GEAR_WINDOW), as
+ * if hashing had started at the beginning of the buffer.
+ */
+static uint64_t gear_warm_up(const unsigned char *data, size_t start)
+{
+    uint64_t hash = 0;
+    size_t i = 0;
+
+    for (i = start - SIMD_GEAR_WINDOW; i < start; i++) {
+        hash = (hash << 1) + gear_table[data[i]];
+    }
+
+    return hash;
+}
+
+/**
+ * Store the boundary at 'position' (in the part of the first lane) for every
+ * lane in hits.
+ */
+static inline void record_boundaries(size_t *boundaries, unsigned int hits,
+        size_t position)
+{
+    int lane = 0;
+
+    for (; hits != 0; hits &= hits - 1) {
+        lane = __builtin_ctz(hits);
+        boundaries[lane] = position + lane * SIMD_GEAR_PART;
+    }
+}
+
+__attribute__((target("sse4.2")))
+static size_t mismatch_sse42(const void *a, const void *b, size_t length)
+{
+    const unsigned char *x = (const unsigned char *) a;
+    const unsigned char *y = (const unsigned char *) b;
+    unsigned int equal = 0;
+    size_t i = 0;
+
+    for (; i + 16 <= length; i += 16) {
+        equal = _mm_movemask_epi8(_mm_cmpeq_epi8(
+                    _mm_loadu_si128((const __m128i *) (x + i)),
+                    _mm_loadu_si128((const __m128i *) (y + i))));
+
+        if (equal != 0xffff) {
+            return i + __builtin_ctz(~equal);
+        }
+    }
+
+    return i + mismatch_scalar(x + i, y + i, length - i);
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const void *data, size_t length)
+{
+    const unsigned char *bytes = (const unsigned char *) data;
+    uint64_t state = ~crc;
+    uint64_t word = 0;
+
+    for (; length >= sizeof(uint64_t); length -= sizeof(uint64_t)) {
+        memcpy(&word, bytes, sizeof(uint64_t));
+        state = _mm_crc32_u64(state, word);
+        bytes += sizeof(uint64_t);
+    }
+
+    for (; length > 0; length--) {
+        state = _mm_crc32_u8(state, *bytes++);
+    }
+
+    return ~(uint32_t) state;
+}
+
+__attribute__((target("avx2")))
+static size_t mismatch_avx2(const void *a, const void *b, size_t length)
+{
+    const unsigned char *x = (const unsigned char *) a;
+    const unsigned char *y = (const unsigned char *) b;
+    __m256i low;
+    __m256i high;
+    unsigned int equal = 0;
+    size_t i = 0;
+
+    for (; i + 64 <= length; i += 64) {
+        low = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (x + i)),
+                _mm256_loadu_si256((const __m256i *) (y + i)));
+        high = _mm256_cmpeq_epi8(
+                _mm256_loadu_si256((const __m256i *) (x + i + 32)),
+                _mm256_loadu_si256((const __m256i *) (y + i + 32)));
+
+        if ((unsigned int) _mm256_movemask_epi8(_mm256_and_si256(low, high))
+                != 0xffffffff) {
+            equal = _mm256_movemask_epi8(low);
+
+            if (equal != 0xffffffff) {
+                return i + __builtin_ctz(~equal);
+            }
+
+            return i + 32 + __builtin_ctz(~_mm256_movemask_epi8(high));
+        }
+    }
+
+    for (; i + 32 <= length; i += 32) {
+        equal = _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+                    _mm256_loadu_si256((const __m256i *) (x + i)),
+                    _mm256_loadu_si256((const __m256i *) (y + i))));
+
+        if (equal != 0xffffffff) {
+            return i + __builtin_ctz(~equal);
+        }
+    }
+
+    return i + mismatch_scalar(x + i, y + i, length - i);
+}
+
+__attribute__((target("avx2")))
+static size_t gear_avx2(const void *data, size_t length, uint64_t mask)
+{
+    const unsigned char *bytes = (const unsigned char *) data;
+    const unsigned char *lanes = NULL;
+    size_t boundary = 0;
+    size_t position = SIMD_GEAR_WINDOW;
+    __m256i hash;
+    __m256i masks = _mm256_set1_epi64x(mask);
+    __m256i zero = _mm256_setzero_si256();
+    size_t boundaries[8];
+    unsigned int found = 0;
+    unsigned int hits = 0;
+    size_t i = 0;
+
+    boundary = gear_continue(bytes, 0, length < SIMD_GEAR_WINDOW ?
+            length : SIMD_GEAR_WINDOW, 0, mask);
+
+    if (boundary < SIMD_GEAR_WINDOW) {
+        return boundary;
+    }
+
+    for (; position + 4 * SIMD_GEAR_PART <= length;
+            position += 4 * SIMD_GEAR_PART) {
+        lanes = bytes + position - SIMD_GEAR_WINDOW;
+        hash = zero;
+
+        for (i = 0; i < SIMD_GEAR_WINDOW; i++) {
+            hash = _mm256_add_epi64(_mm256_slli_epi64(hash, 1),
+                    _mm256_setr_epi64x(gear_table[lanes[i]],
+                        gear_table[lanes[SIMD_GEAR_PART + i]],
+                        gear_table[lanes[2 * SIMD_GEAR_PART + i]],
+                        gear_table[lanes[3 * SIMD_GEAR_PART + i]]));
+        }
+
+        for (; i < SIMD_GEAR_WINDOW + SIMD_GEAR_PART; i++) {
+            hash = _mm256_add_epi64(_mm256_slli_epi64(hash, 1),
+                    _mm256_setr_epi64x(gear_table[lanes[i]],
+                        gear_table[lanes[SIMD_GEAR_PART + i]],
+                        gear_table[lanes[2 * SIMD_GEAR_PART + i]],
+                        gear_table[lanes[3 * SIMD_GEAR_PART + i]]));
+            hits = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(
+                            _mm256_and_si256(hash, masks), zero))) & ~found;
+
+            if (hits != 0) {
+                record_boundaries(boundaries, hits, position
+                        + i - SIMD_GEAR_WINDOW + 1);
+                found |= hits;
+
+                /*
+                 * A boundary in the first lane comes before any other.
+                 */
+                if (found & 1) {
+                    break;
+                }
+            }
+        }
+
+        if (found != 0) {
+            return boundaries[__builtin_ctz(found)];
+        }
+    }
+
+    return gear_continue(bytes, position, length,
+            gear_warm_up(bytes, position), mask);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static size_t mismatch_avx512(const void *a, const void *b, size_t length)
+{
+    const unsigned char *x = (const unsigned char *) a;
+    const unsigned char *y = (const unsigned char *) b;
+    __mmask64 different = 0;
+    __mmask64 tail = 0;
+    size_t i = 0;
+
+    for (; i + 64 <= length; i += 64) {
+        different = _mm512_cmpneq_epi8_mask(_mm512_loadu_si512(x + i),
+                _mm512_loadu_si512(y + i));
+
+        if (different != 0) {
+            return i + __builtin_ctzll(different);
+        }
+    }
+
+    if (i == length) {
+        return length;
+    }
+
+    /*
+     * Masked loads do not touch the bytes past the end.
+     */
+    tail = (1ULL << (length - i)) - 1;
+    different = _mm512_cmpneq_epi8_mask(_mm512_maskz_loadu_epi8(tail, x + i),
+            _mm512_maskz_loadu_epi8(tail, y + i));
+
+    return different != 0 ? i + __builtin_ctzll(different) : length;
+}
+
+__attribute__((target("avx512f")))
+static size_t gear_avx512(const void *data, size_t length, uint64_t mask)
+{
+    const unsigned char *bytes = (const unsigned char *) data;
+    const unsigned char *lanes = NULL;
+    size_t boundary = 0;
+    size_t position = SIMD_GEAR_WINDOW;
+    __m512i hash;
+    __m512i masks = _mm512_set1_epi64(mask);
+    size_t boundaries[8];
+    unsigned int found = 0;
+    unsigned int hits = 0;
+    size_t i = 0;
+
+    boundary = gear_continue(bytes, 0, length < SIMD_GEAR_WINDOW ?
+            length : SIMD_GEAR_WINDOW, 0, mask);
+
+    if (boundary < SIMD_GEAR_WINDOW) {
+        return boundary;
+    }
+
+    for (; position + 8 * SIMD_GEAR_PART <= length;
+            position += 8 * SIMD_GEAR_PART) {
+        lanes = bytes + position - SIMD_GEAR_WINDOW;
+        hash = _mm512_setzero_si512();
+
+        for (i = 0; i < SIMD_GEAR_WINDOW + SIMD_GEAR_PART; i++) {
+            hash = _mm512_add_epi64(_mm512_slli_epi64(hash, 1),
+                    _mm512_setr_epi64(gear_table[lanes[i]],
+                        gear_table[lanes[SIMD_GEAR_PART + i]],
+                        gear_table[lanes[2 * SIMD_GEAR_PART + i]],
+                        gear_table[lanes[3 * SIMD_GEAR_PART + i]],
+                        gear_table[lanes[4 * SIMD_GEAR_PART + i]],
+                        gear_table[lanes[5 * SIMD_GEAR_PART + i]],
+                        gear_table[lanes[6 * SIMD_GEAR_PART + i]],
+                        gear_table[lanes[7 * SIMD_GEAR_PART + i]]));
+
+            if (i < SIMD_GEAR_WINDOW) {
+                continue;
+            }
+
+            hits = _mm512_testn_epi64_mask(hash, masks) & ~found;
+
+            if (hits != 0) {
+                record_boundaries(boundaries, hits, position
+                        + i - SIMD_GEAR_WINDOW + 1);
+                found |= hits;
+
+                if (found & 1) {
+                    break;
+                }
+            }
+        }
+
+        if (found != 0) {
+            return boundaries[__builtin_ctz(found)];
+        }
+    }
+
+    return gear_continue(bytes, position, length,
+            gear_warm_up(bytes, position), mask);
+}
+
+#endif
+
+/**
+ * Build the lookup tables, detect the instruction sets and select the best.
+ */
+static void simd_init(void)
+{
+    uint64_t seed = 0x9e3779b97f4a7c15ULL;
+    uint64_t mixed = 0;
+    uint32_t crc = 0;
+    int i = 0;
+    int k = 0;
+
+    for (i = 0; i < 256; i++) {
+        crc = i;
+
+        for (k = 0; k < 8; k++) {
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLYNOMIAL : crc >> 1;
+        }
+
+        crc_table[0][i] = crc;
+    }
+
+    for (i = 0; i < 256; i++) {
+        for (k = 1; k < 8; k++) {
+            crc_table[k][i] = (crc_table[k - 1][i] >> 8)
+                ^ crc_table[0][crc_table[k - 1][i] & 0xff];
+        }
+    }
+
+    /*
+     * The gear table only needs to be random and fixed (boundaries must not
+     * change between runs), splitmix64 of a constant seed.
+     */
+    for (i = 0; i < 256; i++) {
+        mixed = (seed += 0x9e3779b97f4a7c15ULL);
+        mixed = (mixed ^ (mixed >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        mixed = (mixed ^ (mixed >> 27)) * 0x94d049bb133111ebULL;
+        gear_table[i] = mixed ^ (mixed >> 31);
+    }
+
+    for (i = 0; i < num_simd_levels; i++) {
+        kernels[i].mismatch = mismatch_scalar;
+        kernels[i].crc32c = crc32c_scalar;
+        kernels[i].gear_boundary = gear_scalar;
+    }
+
+    supported[simd_scalar] = 1;
+
+#ifdef SIMD_X86
+    __builtin_cpu_init();
+
+    supported[simd_sse42] = __builtin_cpu_supports("sse4.2");
+    supported[simd_avx2] = supported[simd_sse42]
+        && __builtin_cpu_supports("avx2");
+    supported[simd_avx512] = supported[simd_avx2]
+        && __builtin_cpu_supports("avx512f")
+        && __builtin_cpu_supports("avx512bw");
+
+    for (i = simd_sse42; i < num_simd_levels; i++) {
+        kernels[i].mismatch = mismatch_sse42;
+        kernels[i].crc32c = crc32c_sse42;
+    }
+
+    for (i = simd_avx2; i < num_simd_levels; i++) {
+        kernels[i].mismatch = mismatch_avx2;
+        kernels[i].gear_boundary = gear_avx2;
+    }
+
+    kernels[simd_avx512].mismatch = mismatch_avx512;
+    kernels[simd_avx512].gear_boundary = gear_avx512;
+#endif
+
+    for (i = num_simd_levels - 1; !supported[i]; i--);
+
+    simd.level = i;
+    simd.active = kernels[i];
+}
+
+/**
+ * Return the offset of the first byte in which a and b differ, or length if
+ * they are equal.
+ */
+size_t simd_mismatch(const void *a, const void *b, size_t length)
+{
+    pthread_once(&simd_once, simd_init);
+
+    return simd.active.mismatch(a, b, length);
+}
+
+/**
+ * Extend the CRC32C checksum crc (0 to start) with length bytes of data.
+ */
+uint32_t simd_crc32c(uint32_t crc, const void *data, size_t length)
+{
+    pthread_once(&simd_once, simd_init);
+
+    return simd.active.crc32c(crc, data, length);
+}
+
+/**
+ * Return the length of the first content-defined chunk of data: the position
+ * after the first byte at which the gear hash has none of the bits of mask
+ * set, or length if there is no such byte.
+ */
+size_t simd_gear_boundary(const void *data, size_t length, uint64_t mask)
+{
+    pthread_once(&simd_once, simd_init);
+
+    return simd.active.gear_boundary(data, length, mask);
+}
+
+/**
+ * Return the selected level.
+ */
+int simd_level(void)
+{
+    pthread_once(&simd_once, simd_init);
+
+    return simd.level;
+}
+
+int simd_supported(int level)
+{
+    pthread_once(&simd_once, simd_init);
+
+    return level >= 0 && level < num_simd_levels && supported[level];
+}
+
+/**
+ * Select a level other than the best one (e.g. to compare against the scalar
+ * kernels). Not safe while other threads use the kernels.
+ */
+int simd_set_level(int level)
+{
+    if (!simd_supported(level)) {
+        return -1;
+    }
+
+    simd.level = level;
+    simd.active = kernels[level];
+
+    return 0;
+}
+
+const char *simd_level_name(int level)
+{
+    if (level < 0 || level >= num_simd_levels) {
+        return "unknown";
+    }
+
+    return level_names[level];
+}
+
+static uint64_t next_random(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+
+    return *state;
+}
+
+/**
+ * Check the kernels of one level against the scalar kernels, return the number
+ * of failures.
+ */
+static int test_level(int level, unsigned char *a, unsigned char *b,
+        size_t size)
+{
+    simd_kernels *test = &kernels[level];
+    uint64_t random = 0x2545f4914f6cdd1dULL;
+    size_t length = 0;
+    size_t offset = 0;
+    size_t split = 0;
+    size_t position = 0;
+    uint64_t mask = 0;
+    int bits = 0;
+    int failures = 0;
+
+    if (test->crc32c(0, "123456789", 9) != 0xe3069283) {
+        fprintf(stderr, "simd_self_test: %s crc32c check value\n",
+                level_names[level]);
+        failures++;
+    }
+
+    for (length = 0; length <= 300; length++) {
+        for (offset = 0; offset < 4; offset++) {
+            memcpy(b, a, size);
+
+            if (test->mismatch(a + offset, b + offset, length) != length) {
+                failures++;
+            }
+
+            if (test->crc32c(0, a + offset, length)
+                    != crc32c_scalar(0, a + offset, length)) {
+                failures++;
+            }
+
+            split = length / 3;
+
+            if (test->crc32c(test->crc32c(0, a + offset, split),
+                        a + offset + split, length - split)
+                    != crc32c_scalar(0, a + offset, length)) {
+                failures++;
+            }
+
+            for (position = 0; position < length; position++) {
+                b[offset + position] ^= 1 + (position & 0x7f);
+
+                if (test->mismatch(a + offset, b + offset, length)
+                        != position) {
+                    failures++;
+                }
+
+                b[offset + position] = a[offset + position];
+            }
+        }
+    }
+
+    for (bits = 2; bits <= 20; bits += 3) {
+        mask = SIMD_GEAR_MASK(bits);
+
+        for (length = 0; length < size; length += 1 + next_random(&random)
+                % 4096) {
+            if (test->gear_boundary(a, length, mask)
+                    != gear_scalar(a, length, mask)) {
+                failures++;
+            }
+        }
+    }
+
+    /*
+     * A mask that (almost) never matches exercises the tails.
+     */
+    if (test->gear_boundary(a, size - 3, ~0ULL)
+            != gear_scalar(a, size - 3, ~0ULL)) {
+        failures++;
+    }
+
+    if (failures > 0) {
+        fprintf(stderr, "simd_self_test: %s: %d failures\n",
+                level_names[level], failures);
+    }
+
+    return failures;
+}
+
+/**
+ * Check the kernels of every supported level against the scalar kernels.
+ * Return 0 if they all agree, -1 otherwise.
+ */
+int simd_self_test(void)
+{
+    uint64_t random = 0x853c49e6748fea9bULL;
+    size_t size = 256 * 1024;
+    unsigned char *a = NULL;
+    unsigned char *b = NULL;
+    size_t i = 0;
+    int failures = 0;
+    int level = 0;
+
+    pthread_once(&simd_once, simd_init);
+
+    a = (unsigned char *) malloc(size);
+    b = (unsigned char *) malloc(size);
+
+    if (a == NULL || b == NULL) {
+        free(a);
+        free(b);
+        return -1;
+    }
+
+    for (i = 0; i < size; i++) {
+        a[i] = next_random(&random) >> 56;
+    }
+
+    for (level = 0; level < num_simd_levels; level++) {
+        if (supported[level]) {
+            failures += test_level(level, a, b, size);
+        }
+    }
+
+    free(a);
+    free(b);
+
+    return failures == 0 ? 0 : -1;
+}
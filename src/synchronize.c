@@ -0,0 +1,457 @@
+/******************************************************************************
+ *
+ * file   : synchronize.c
+ *
+ * author : Tim van Deurzen
+ * date   : 18/10/2026
+ *
+ * Build the versioning baseline for an existing tree at mount-time.
+ *
+ * When a non-empty root directory is mounted, its directories have no
+ * '.version' directory and its files have no snapshot version, so their first
+ * change could not be undone. This walks the whole tree in parallel and gives
+ * every directory a '.version' directory and every regular file a snapshot
+ * version in the latest snapshot of its directory.
+ *
+ * The walk is spread over a number of worker threads. Every worker owns a deque
+ * of directories: it takes work from the back of its own deque (depth-first,
+ * keeping the working set small) and steals from the front of the deques of
+ * the other workers when it runs out. Directories are read with getdents64 and
+ * entries are only stat'ed (with fstatat) if the file system does not report
+ * their type.
+ *
+ * The walk can safely be interrupted: snapshot versions are copied to a
+ * temporary name and renamed into place, and files that already have one are
+ * skipped, so the next mount simply resumes. Once the whole tree is done a
+ * marker is left behind and later mounts skip the walk altogether.
+ *
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <limits.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "synchronize.h"
+#include "util.h"
+#include "error.h"
+
+/*
+ * Directory entry as returned by the getdents64 system call.
+ */
+struct linux_dirent64 {
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/*
+ * Deque of directories owned by a single worker.
+ */
+typedef struct SYNC_DEQUE {
+    pthread_mutex_t lock;
+    char **paths;
+    size_t head;
+    size_t tail;
+    size_t capacity;
+} sync_deque;
+
+/*
+ * State shared by all workers, the counters are only updated atomically.
+ */
+typedef struct SYNC_STATE {
+    int num_workers;
+    sync_deque deques[MAX_SYNC_THREADS];
+    volatile unsigned long pending;
+    volatile unsigned long directories;
+    volatile unsigned long files;
+    volatile unsigned long baselines;
+    volatile unsigned long errors;
+} sync_state;
+
+typedef struct SYNC_WORKER {
+    int id;
+    sync_state *state;
+    char *buffer;
+} sync_worker;
+
+/**
+ * Push a directory onto the back of a deque.
+ *
+ * The pending counter is raised before the directory becomes visible, so the
+ * walk cannot be considered finished while it is queued.
+ */
+static void deque_push(sync_state *state, sync_deque *deque, char *path)
+{
+    __sync_fetch_and_add(&state->pending, 1);
+
+    pthread_mutex_lock(&deque->lock);
+
+    if (deque->tail == deque->capacity) {
+        /*
+         * Move the live part to the front before growing the array.
+         */
+        if (deque->head > 0) {
+            memmove(deque->paths, deque->paths + deque->head, 
+                    (deque->tail - deque->head) * sizeof(char *));
+            deque->tail -= deque->head;
+            deque->head = 0;
+        }
+
+        if (deque->tail == deque->capacity) {
+            deque->capacity = (deque->capacity == 0) ? 64 : deque->capacity * 2;
+            deque->paths = (char **) realloc(deque->paths, 
+                    deque->capacity * sizeof(char *));
+
+            if (deque->paths == NULL) {
+                HIERONYMUS_ERROR(err_malloc, "deque_push");
+                abort();
+            }
+        }
+    }
+
+    deque->paths[deque->tail++] = path;
+
+    pthread_mutex_unlock(&deque->lock);
+}
+
+/**
+ * Take a directory from the back (owner) or the front (thief) of a deque.
+ */
+static char *deque_take(sync_deque *deque, int steal)
+{
+    char *path = NULL;
+
+    pthread_mutex_lock(&deque->lock);
+
+    if (deque->head < deque->tail) {
+        if (steal) {
+            path = deque->paths[deque->head++];
+        } else {
+            path = deque->paths[--deque->tail];
+        }
+
+        if (deque->head == deque->tail) {
+            deque->head = deque->tail = 0;
+        }
+    }
+
+    pthread_mutex_unlock(&deque->lock);
+
+    return path;
+}
+
+/**
+ * Create the snapshot version of a single file.
+ *
+ * The copy is made under a temporary name and renamed into place, so an
+ * interrupted walk never leaves a partial snapshot version behind. A file
+ * whose paths do not fit in PATH_MAX is reported and skipped.
+ */
+static int make_baseline(const char *directory, const char *snapshot_path, 
+        const char *name)
+{
+    char source[PATH_MAX];
+    char temporary[PATH_MAX];
+    char destination[PATH_MAX];
+
+    if (snprintf(source, PATH_MAX, "%s/%s", directory, name) >= PATH_MAX
+            || snprintf(temporary, PATH_MAX, "%s/.%s.sync", snapshot_path, 
+                name) >= PATH_MAX
+            || snprintf(destination, PATH_MAX, "%s/%s", snapshot_path, name)
+            >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return HIERONYMUS_ERROR(err_synchronize, "make_baseline");
+    }
+
+    if (copy(source, temporary) != 0) {
+        unlink(temporary);
+        return -1;
+    }
+
+    if (rename(temporary, destination) != 0) {
+        return HIERONYMUS_ERROR(err_rename, "make_baseline");
+    }
+
+    return 0;
+}
+
+/**
+ * Synchronize a single directory.
+ *
+ * Subdirectories are pushed onto the worker's own deque, regular files without
+ * a snapshot version in the latest snapshot get one.
+ */
+static void synchronize_directory(sync_worker *worker, char *path)
+{
+    sync_state *state = worker->state;
+    int directory_fd = -1;
+    int snapshot_fd = -1;
+    long length = 0;
+    long position = 0;
+    unsigned char type = 0;
+    struct linux_dirent64 *entry = NULL;
+    struct stat stat_buffer;
+    char version_path[PATH_MAX];
+    char snapshot_path[PATH_MAX];
+    char *subdirectory = NULL;
+
+    directory_fd = open(path, O_RDONLY | O_DIRECTORY);
+
+    if (directory_fd < 0) {
+        HIERONYMUS_ERROR(err_opendir, "synchronize_directory");
+        __sync_fetch_and_add(&state->errors, 1);
+        return;
+    }
+
+    /*
+     * Every directory needs a '.version' directory and a snapshot to hold the
+     * snapshot versions (find_latest_snapshot creates the first one).
+     */
+    if (mkdirat(directory_fd, ".version", S_IRWXU | S_IRWXG) != 0 
+            && errno != EEXIST) {
+        HIERONYMUS_ERROR(err_mkdir, "synchronize_directory");
+        __sync_fetch_and_add(&state->errors, 1);
+        close(directory_fd);
+        return;
+    }
+
+    if (snprintf(version_path, PATH_MAX, "%s/.version", path) >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        HIERONYMUS_ERROR(err_synchronize, "synchronize_directory");
+        __sync_fetch_and_add(&state->errors, 1);
+        close(directory_fd);
+        return;
+    }
+
+    if (find_latest_snapshot(version_path, snapshot_path) < 0 
+            || (snapshot_fd = open(snapshot_path, O_RDONLY | O_DIRECTORY))
+            < 0) {
+        HIERONYMUS_ERROR(err_snapshot, "synchronize_directory");
+        __sync_fetch_and_add(&state->errors, 1);
+        close(directory_fd);
+        return;
+    }
+
+    while ((length = syscall(SYS_getdents64, directory_fd, worker->buffer, 
+                    SYNC_BUFFER_SIZE)) > 0) {
+        for (position = 0; position < length; position += entry->d_reclen) {
+            entry = (struct linux_dirent64 *) (worker->buffer + position);
+
+            if (strcmp(entry->d_name, ".") == 0 
+                    || strcmp(entry->d_name, "..") == 0
+                    || strcmp(entry->d_name, ".version") == 0) {
+                continue;
+            }
+
+            type = entry->d_type;
+
+            if (type == DT_UNKNOWN) {
+                if (fstatat(directory_fd, entry->d_name, &stat_buffer, 
+                            AT_SYMLINK_NOFOLLOW) != 0) {
+                    continue;
+                }
+
+                type = S_ISDIR(stat_buffer.st_mode) ? DT_DIR 
+                    : S_ISREG(stat_buffer.st_mode) ? DT_REG : DT_UNKNOWN;
+            }
+
+            if (type == DT_DIR) {
+                subdirectory = (char *) checked_malloc(strlen(path) 
+                        + strlen(entry->d_name) + 2);
+                sprintf(subdirectory, "%s/%s", path, entry->d_name);
+
+                deque_push(state, &state->deques[worker->id], subdirectory);
+            } else if (type == DT_REG) {
+                __sync_fetch_and_add(&state->files, 1);
+
+                /*
+                 * Files that already have a snapshot version are skipped, this
+                 * is what makes an interrupted walk resumable.
+                 */
+                if (fstatat(snapshot_fd, entry->d_name, &stat_buffer, 
+                            AT_SYMLINK_NOFOLLOW) == 0) {
+                    continue;
+                }
+
+                if (make_baseline(path, snapshot_path, entry->d_name) == 0) {
+                    __sync_fetch_and_add(&state->baselines, 1);
+                } else {
+                    __sync_fetch_and_add(&state->errors, 1);
+                }
+            }
+        }
+    }
+
+    if (length < 0) {
+        HIERONYMUS_ERROR(err_readdir, "synchronize_directory");
+        __sync_fetch_and_add(&state->errors, 1);
+    }
+
+    __sync_fetch_and_add(&state->directories, 1);
+
+    close(snapshot_fd);
+    close(directory_fd);
+}
+
+/**
+ * Worker thread: process directories until the whole tree is done.
+ */
+static void *synchronize_worker(void *argument)
+{
+    sync_worker *worker = (sync_worker *) argument;
+    sync_state *state = worker->state;
+    char *path = NULL;
+    int victim = 0;
+    int i = 0;
+
+    worker->buffer = (char *) checked_malloc(SYNC_BUFFER_SIZE);
+
+    while (state->pending > 0) {
+        path = deque_take(&state->deques[worker->id], 0);
+
+        /*
+         * Out of work, try to steal from the other workers.
+         */
+        for (i = 1; path == NULL && i < state->num_workers; i++) {
+            victim = (worker->id + i) % state->num_workers;
+            path = deque_take(&state->deques[victim], 1);
+        }
+
+        if (path == NULL) {
+            sched_yield();
+            continue;
+        }
+
+        synchronize_directory(worker, path);
+        free(path);
+
+        __sync_fetch_and_sub(&state->pending, 1);
+    }
+
+    free(worker->buffer);
+
+    return NULL;
+}
+
+/**
+ * Synchronize the root directory with the versioning information.
+ *
+ * Walks the tree below root_directory with one worker per processor and
+ * reports the progress on stderr. Returns the number of entries that could
+ * not be synchronized, or -1 if the walk could not be started.
+ */
+int synchronize_roots(const char *root_directory)
+{
+    int return_value = 0;
+    int i = 0;
+    int num_workers = 0;
+    int started = 0;
+    char marker[PATH_MAX];
+    sync_state *state = NULL;
+    sync_worker workers[MAX_SYNC_THREADS];
+    pthread_t threads[MAX_SYNC_THREADS];
+    int marker_fd = -1;
+    time_t start = time(NULL);
+    time_t last_report = start;
+    unsigned long entries = 0;
+
+    snprintf(marker, PATH_MAX, "%s/%s", root_directory, SYNCHRONIZED_MARKER);
+
+    if (access(marker, F_OK) == 0) {
+        return 0;
+    }
+
+    num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (num_workers < 1) {
+        num_workers = 1;
+    } else if (num_workers > MAX_SYNC_THREADS) {
+        num_workers = MAX_SYNC_THREADS;
+    }
+
+    state = (sync_state *) checked_malloc(sizeof(sync_state));
+    memset(state, 0, sizeof(sync_state));
+    state->num_workers = num_workers;
+
+    for (i = 0; i < num_workers; i++) {
+        pthread_mutex_init(&state->deques[i].lock, NULL);
+    }
+
+    deque_push(state, &state->deques[0], strdup(root_directory));
+
+    for (i = 0; i < num_workers; i++) {
+        workers[i].id = i;
+        workers[i].state = state;
+
+        if (pthread_create(&threads[i], NULL, synchronize_worker, 
+                    &workers[i]) != 0) {
+            HIERONYMUS_ERROR(err_synchronize, "synchronize_roots");
+            break;
+        }
+
+        started++;
+    }
+
+    /*
+     * If no worker could be started, do the work on this thread.
+     */
+    if (started == 0) {
+        state->num_workers = 1;
+        synchronize_worker(&workers[0]);
+    }
+
+    while (state->pending > 0) {
+        usleep(10000);
+
+        if (time(NULL) - last_report < SYNC_PROGRESS_INTERVAL) {
+            continue;
+        }
+
+        last_report = time(NULL);
+        entries = state->directories + state->files;
+        fprintf(stderr, "synchronize: %lu directories, %lu files, "
+                "%lu new baselines (%lu entries/s)\n", state->directories, 
+                state->files, state->baselines, 
+                entries / (unsigned long) (time(NULL) - start + 1));
+    }
+
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    return_value = state->errors;
+
+    /*
+     * Only a complete walk is marked as such, otherwise the next mount
+     * resumes where this one left off.
+     */
+    if (return_value == 0) {
+        marker_fd = open(marker, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
+
+        if (marker_fd >= 0) {
+            close(marker_fd);
+        }
+    }
+
+    for (i = 0; i < num_workers; i++) {
+        pthread_mutex_destroy(&state->deques[i].lock);
+        free(state->deques[i].paths);
+    }
+
+    free(state);
+
+    return return_value;
+}
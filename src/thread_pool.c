@@ -0,0 +1,337 @@
+/******************************************************************************
+ *
+ * file   : thread_pool.c
+ *
+ * author : Tim van Deurzen
+ * date   : 18/10/2026
+ *
+ * A pool of worker threads for CPU-bound work (e.g. computing deltas).
+ *
+ * Tasks are submitted as part of a group and the submitter waits for the whole
+ * group. While waiting, the submitter runs queued tasks of its group itself, so
+ * waiting from within a task cannot deadlock and the submitting thread is not
+ * idle.
+ *
+ * A pool can be resized while it runs. Growing starts workers (or wakes
+ * parked ones), shrinking parks the workers past the new size once they are
+ * idle, so no thread is ever joined while tasks run.
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "thread_pool.h"
+#include "util.h"
+
+static thread_pool *shared_pool = NULL;
+static pthread_once_t shared_pool_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Remove the first task from the queue. Called with the pool lock held.
+ */
+static pool_task *dequeue_locked(thread_pool *pool)
+{
+    pool_task *task = pool->head;
+
+    if (task != NULL) {
+        pool->head = task->next;
+
+        if (pool->head == NULL) {
+            pool->tail = NULL;
+        }
+    }
+
+    return task;
+}
+
+/**
+ * Remove the first task of group from the queue. Called with the pool lock
+ * held.
+ */
+static pool_task *dequeue_group_locked(thread_pool *pool, pool_group *group)
+{
+    pool_task *previous = NULL;
+    pool_task *task = pool->head;
+
+    while (task != NULL && task->group != group) {
+        previous = task;
+        task = task->next;
+    }
+
+    if (task == NULL) {
+        return NULL;
+    }
+
+    if (previous != NULL) {
+        previous->next = task->next;
+    } else {
+        pool->head = task->next;
+    }
+
+    if (pool->tail == task) {
+        pool->tail = previous;
+    }
+
+    return task;
+}
+
+/**
+ * Run a task and signal its group if it was the last one.
+ */
+static void run_task(pool_task *task)
+{
+    pool_group *group = task->group;
+
+    task->function(task->argument);
+    free(task);
+
+    pthread_mutex_lock(&group->lock);
+
+    if (--group->pending == 0) {
+        pthread_cond_broadcast(&group->done);
+    }
+
+    pthread_mutex_unlock(&group->lock);
+}
+
+static void *worker(void *data)
+{
+    pool_worker *self = (pool_worker *) data;
+    thread_pool *pool = self->pool;
+    pool_task *task = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+
+    while (pool->running) {
+        /*
+         * A parked worker may have taken the wake-up meant for a task, it is
+         * passed on.
+         */
+        if (self->index >= pool->limit) {
+            if (pool->head != NULL) {
+                pthread_cond_signal(&pool->available);
+            }
+
+            pthread_cond_wait(&pool->parked, &pool->lock);
+            continue;
+        }
+
+        if ((task = dequeue_locked(pool)) == NULL) {
+            pthread_cond_wait(&pool->available, &pool->lock);
+            continue;
+        }
+
+        pthread_mutex_unlock(&pool->lock);
+        run_task(task);
+        pthread_mutex_lock(&pool->lock);
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+static int clamp_threads(int num_threads)
+{
+    if (num_threads < 1) {
+        return 1;
+    }
+
+    return num_threads > MAX_POOL_THREADS ? MAX_POOL_THREADS : num_threads;
+}
+
+/**
+ * Start workers until there are num_threads. Called with the pool lock held.
+ */
+static void start_workers_locked(thread_pool *pool, int num_threads)
+{
+    int i = 0;
+
+    for (i = pool->num_threads; i < num_threads; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+
+        if (pthread_create(&pool->threads[i], NULL, worker,
+                    &pool->workers[i]) != 0) {
+            break;
+        }
+
+        pool->num_threads++;
+    }
+}
+
+/**
+ * Start a pool with the given number of workers.
+ */
+thread_pool *thread_pool_create(int num_threads)
+{
+    thread_pool *pool = NULL;
+
+    pool = (thread_pool *) checked_malloc(sizeof(thread_pool));
+    pool->head = NULL;
+    pool->tail = NULL;
+    pool->running = 1;
+    pool->num_threads = 0;
+    pool->limit = clamp_threads(num_threads);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->available, NULL);
+    pthread_cond_init(&pool->parked, NULL);
+
+    pthread_mutex_lock(&pool->lock);
+    start_workers_locked(pool, pool->limit);
+    pthread_mutex_unlock(&pool->lock);
+
+    return pool;
+}
+
+/**
+ * Change the number of workers that run tasks. Returns the new number.
+ */
+int thread_pool_resize(thread_pool *pool, int num_threads)
+{
+    num_threads = clamp_threads(num_threads);
+
+    pthread_mutex_lock(&pool->lock);
+
+    start_workers_locked(pool, num_threads);
+    pool->limit = num_threads < pool->num_threads ? num_threads
+        : pool->num_threads;
+
+    /*
+     * Idle workers past the limit move on to park, parked ones within it
+     * return to the queue.
+     */
+    pthread_cond_broadcast(&pool->available);
+    pthread_cond_broadcast(&pool->parked);
+
+    num_threads = pool->limit;
+
+    pthread_mutex_unlock(&pool->lock);
+
+    return num_threads;
+}
+
+/**
+ * Stop all workers. Tasks still in the queue are not run.
+ */
+void thread_pool_destroy(thread_pool *pool)
+{
+    int i = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->running = 0;
+    pthread_cond_broadcast(&pool->available);
+    pthread_cond_broadcast(&pool->parked);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->num_threads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->available);
+    pthread_cond_destroy(&pool->parked);
+    free(pool);
+}
+
+static void create_shared_pool(void)
+{
+    shared_pool = thread_pool_create(sysconf(_SC_NPROCESSORS_ONLN));
+}
+
+/**
+ * Return the pool shared by all users, started on first use with one worker
+ * per processor.
+ */
+thread_pool *thread_pool_shared(void)
+{
+    pthread_once(&shared_pool_once, create_shared_pool);
+
+    return shared_pool;
+}
+
+void pool_group_init(pool_group *group)
+{
+    group->pending = 0;
+    pthread_mutex_init(&group->lock, NULL);
+    pthread_cond_init(&group->done, NULL);
+}
+
+void pool_group_destroy(pool_group *group)
+{
+    pthread_mutex_destroy(&group->lock);
+    pthread_cond_destroy(&group->done);
+}
+
+/**
+ * Queue function(argument) as part of group.
+ */
+void thread_pool_submit(thread_pool *pool, pool_group *group,
+        pool_function function, void *argument)
+{
+    pool_task *task = (pool_task *) checked_malloc(sizeof(pool_task));
+
+    task->function = function;
+    task->argument = argument;
+    task->group = group;
+    task->next = NULL;
+
+    pthread_mutex_lock(&group->lock);
+    group->pending++;
+    pthread_mutex_unlock(&group->lock);
+
+    pthread_mutex_lock(&pool->lock);
+
+    if (pool->tail != NULL) {
+        pool->tail->next = task;
+    } else {
+        pool->head = task;
+    }
+
+    pool->tail = task;
+
+    pthread_cond_signal(&pool->available);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * Wait until all tasks of group have run, running its queued tasks meanwhile
+ * (tasks of other groups, e.g. background work, are left to the workers).
+ */
+void pool_group_wait(thread_pool *pool, pool_group *group)
+{
+    pool_task *task = NULL;
+
+    for (;;) {
+        pthread_mutex_lock(&group->lock);
+
+        if (group->pending == 0) {
+            pthread_mutex_unlock(&group->lock);
+            break;
+        }
+
+        pthread_mutex_unlock(&group->lock);
+
+        pthread_mutex_lock(&pool->lock);
+        task = dequeue_group_locked(pool, group);
+        pthread_mutex_unlock(&pool->lock);
+
+        if (task != NULL) {
+            run_task(task);
+            continue;
+        }
+
+        /*
+         * Nothing left to help with, the remaining tasks are running.
+         */
+        pthread_mutex_lock(&group->lock);
+
+        while (group->pending > 0) {
+            pthread_cond_wait(&group->done, &group->lock);
+        }
+
+        pthread_mutex_unlock(&group->lock);
+    }
+}
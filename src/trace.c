@@ -0,0 +1,285 @@
+/******************************************************************************
+ *
+ * file   : trace.c
+ *
+ * author : Tim van Deurzen
+ * date   : 18/10/2026
+ *
+ * Capture a compact binary trace of every FUSE operation served.
+ *
+ * Where the log (HIERONYMUS_LOG) writes a line of text per operation, the trace
+ * records the operation, the path(s), its arguments, the result and its
+ * timing in a fixed-size binary record. Paths are interned: each distinct path
+ * is written once and referred to by identifier afterwards. Records are
+ * collected in a buffer and written in large blocks. A trace can be replayed
+ * against a fresh mount with utility/h_replay.
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "trace.h"
+#include "util.h"
+#include "error.h"
+
+/*
+ * Entry in the path table, mapping a path to its identifier.
+ */
+typedef struct TRACE_PATH {
+    char *path;
+    unsigned int hash;
+    unsigned int path_id;
+} trace_path_entry;
+
+static struct {
+    int fd;
+    char *buffer;
+    size_t used;
+    unsigned long long start;
+    trace_path_entry *paths;
+    size_t table_size;
+    size_t num_paths;
+    pthread_mutex_t lock;
+} trace = { 
+    .fd = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+#define X(a, b) b,
+static const char *operation_names[] = { TRACE_OPERATIONS };
+#undef X
+
+/**
+ * Return the current time in nanoseconds (monotonic).
+ */
+unsigned long long trace_clock(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (unsigned long long) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * Return the name of an operation.
+ */
+const char *trace_operation_name(int operation)
+{
+    if (operation < 0 || operation >= num_trace_operations) {
+        return "unknown";
+    }
+
+    return operation_names[operation];
+}
+
+/**
+ * Write the buffer to the trace file. Called with the trace lock held.
+ */
+static void flush_locked(void)
+{
+    if (trace.used > 0 && write(trace.fd, trace.buffer, trace.used) 
+            != (ssize_t) trace.used) {
+        HIERONYMUS_ERROR(err_trace, "flush_locked");
+    }
+
+    trace.used = 0;
+}
+
+/**
+ * Append data to the buffer. Called with the trace lock held.
+ */
+static void append_locked(const void *data, size_t length)
+{
+    if (trace.used + length > TRACE_BUFFER_SIZE) {
+        flush_locked();
+    }
+
+    memcpy(trace.buffer + trace.used, data, length);
+    trace.used += length;
+}
+
+static unsigned int path_hash(const char *path)
+{
+    unsigned int hash = 2166136261U;
+
+    while (*path) {
+        hash = (hash ^ (unsigned char) *path++) * 16777619U;
+    }
+
+    return hash;
+}
+
+/**
+ * Return the identifier of a path, defining it in the trace if it is new.
+ *
+ * Called with the trace lock held. The path table uses open addressing and is
+ * doubled when it is half full.
+ */
+static unsigned int intern_path_locked(const char *path)
+{
+    unsigned int hash = path_hash(path);
+    size_t i = 0;
+    size_t j = 0;
+    trace_path_entry *old_paths = NULL;
+    size_t old_size = 0;
+    trace_path_record record;
+
+    for (i = hash & (trace.table_size - 1); trace.paths[i].path != NULL; 
+            i = (i + 1) & (trace.table_size - 1)) {
+        if (trace.paths[i].hash == hash 
+                && strcmp(trace.paths[i].path, path) == 0) {
+            return trace.paths[i].path_id;
+        }
+    }
+
+    trace.paths[i].path = strdup(path);
+    trace.paths[i].hash = hash;
+    trace.paths[i].path_id = ++trace.num_paths;
+
+    record.kind = trace_path;
+    record.reserved = 0;
+    record.length = strlen(path);
+    record.path_id = trace.paths[i].path_id;
+
+    append_locked(&record, sizeof(record));
+    append_locked(path, record.length);
+
+    if (trace.num_paths * 2 > trace.table_size) {
+        old_paths = trace.paths;
+        old_size = trace.table_size;
+
+        trace.table_size *= 2;
+        trace.paths = (trace_path_entry *) checked_malloc(
+                trace.table_size * sizeof(trace_path_entry));
+        memset(trace.paths, 0, trace.table_size * sizeof(trace_path_entry));
+
+        for (j = 0; j < old_size; j++) {
+            if (old_paths[j].path == NULL) {
+                continue;
+            }
+
+            for (i = old_paths[j].hash & (trace.table_size - 1); 
+                    trace.paths[i].path != NULL; 
+                    i = (i + 1) & (trace.table_size - 1));
+
+            trace.paths[i] = old_paths[j];
+        }
+
+        free(old_paths);
+    }
+
+    return record.path_id;
+}
+
+/**
+ * Record a single operation.
+ *
+ * Does nothing unless a trace was opened with trace_open. The start time is
+ * taken with trace_clock before the operation was performed.
+ */
+void trace_operation(int operation, const char *path, const char *second_path, 
+        unsigned long long argument, unsigned long long size, int result, 
+        unsigned long long start, int process)
+{
+    unsigned long long duration = trace_clock() - start;
+    trace_record record;
+
+    if (trace.fd < 0) {
+        return;
+    }
+
+    memset(&record, 0, sizeof(record));
+    record.kind = trace_operation_record;
+    record.operation = operation;
+    record.process = process;
+    record.result = result;
+    record.duration = (duration > 0xffffffffULL) ? 0xffffffffU : duration;
+    record.argument = argument;
+    record.size = size;
+    record.start = start - trace.start;
+
+    pthread_mutex_lock(&trace.lock);
+
+    if (trace.fd < 0) {
+        pthread_mutex_unlock(&trace.lock);
+        return;
+    }
+
+    record.path_id = (path != NULL) ? intern_path_locked(path) : 0;
+    record.second_path_id = (second_path != NULL) 
+        ? intern_path_locked(second_path) : 0;
+
+    append_locked(&record, sizeof(record));
+
+    pthread_mutex_unlock(&trace.lock);
+}
+
+/**
+ * Start tracing to the given file.
+ */
+int trace_open(const char *path)
+{
+    trace_header header;
+    struct timespec now;
+
+    trace.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+
+    if (trace.fd < 0) {
+        return HIERONYMUS_ERROR(err_trace, "trace_open");
+    }
+
+    trace.buffer = (char *) checked_malloc(TRACE_BUFFER_SIZE);
+    trace.table_size = TRACE_TABLE_SIZE;
+    trace.paths = (trace_path_entry *) checked_malloc(
+            trace.table_size * sizeof(trace_path_entry));
+    memset(trace.paths, 0, trace.table_size * sizeof(trace_path_entry));
+
+    /*
+     * Operations are timed with the monotonic clock, the header holds the
+     * wall-clock time at which the trace started.
+     */
+    clock_gettime(CLOCK_REALTIME, &now);
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.start = (unsigned long long) now.tv_sec * 1000000000ULL 
+        + now.tv_nsec;
+    trace.start = trace_clock();
+
+    append_locked(&header, sizeof(header));
+
+    return 0;
+}
+
+/**
+ * Write the remaining records and close the trace.
+ */
+void trace_close(void)
+{
+    size_t i = 0;
+
+    if (trace.fd < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&trace.lock);
+
+    flush_locked();
+    close(trace.fd);
+    trace.fd = -1;
+
+    for (i = 0; i < trace.table_size; i++) {
+        free(trace.paths[i].path);
+    }
+
+    free(trace.paths);
+    free(trace.buffer);
+
+    pthread_mutex_unlock(&trace.lock);
+}
@@ -9,24 +9,34 @@
  *
  *****************************************************************************/
 
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <string.h>
 #include <stdlib.h>
-#include <fuse.h>
+#include <stdio.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <limits.h>
 #include <pwd.h>
 #include <dirent.h>
 #include <errno.h>
 #include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
 
 #include "util.h"
 #include "fuse_main.h"
 #include "error.h"
 #include "sha1.h"
 #include "print_color.h"
+#include "delta.h"
+#include "pack.h"
 
-#define MAX_TIME_STR 64
+/*
+ * Private data of the mount, see ADMIN in fuse_main.h.
+ */
+hieronymus_data *hieronymus_admin = NULL;
 
 /**
  * Create the versioning root directory and a mountpoint-specific subdirectory.
@@ -122,7 +132,9 @@ int create_versioning_root(char *versioning_root, char *mount_directory)
  */
 int make_snapshot_directory(const char *path, char *new_path)
 {
-    sprintf(new_path, "%s/%s", path, timestamp());
+    char version_id[MAX_VERSION_ID_LENGTH];
+
+    sprintf(new_path, "%s/%s", path, timestamp(version_id));
 
     return checked_mkdir(new_path);
 }
@@ -130,10 +142,14 @@ int make_snapshot_directory(const char *path, char *new_path)
 /**
  * Search the '.version' directory for the latest snapshot directory.
  *
- * This function finds the latest snapshot directory by comparing the timestamps
- * of each snapshot. If there is no snapshot yet, this function will create the
- * first. The function copies the path to the snapshot directory to its second
- * arugment.
+ * This function finds the latest snapshot directory by comparing the version
+ * identifiers of each snapshot. If there is no snapshot yet, this function will
+ * create the first. The function copies the path to the snapshot directory to
+ * its second arugment.
+ *
+ * The name of the latest snapshot is kept as found on disk, so snapshots
+ * created with the older second-resolution names are still resolved
+ * correctly.
  */
 int find_latest_snapshot(const char *path, char *new_path)
 {
@@ -141,8 +157,9 @@ int find_latest_snapshot(const char *path, char *new_path)
     DIR *dir_pointer;
     struct dirent *directory_entry;
 
-    int latest = 0;
-    int current = 0;
+    unsigned long long latest = 0;
+    unsigned long long current = 0;
+    char latest_name[MAX_SNAPSHOT_LENGTH] = "";
     
     dir_pointer = opendir(path);
 
@@ -165,19 +182,23 @@ int find_latest_snapshot(const char *path, char *new_path)
          * snapshot folders.
          */
         if (strncmp(directory_entry->d_name, ".", 1) != 0) {
-            current = atoi(directory_entry->d_name);
+            current = strtoull(directory_entry->d_name, NULL, 10);
 
-            HIERONYMUS_DEBUG("current: %d, latest: %d\n", current, latest);
+            HIERONYMUS_DEBUG("current: %llu, latest: %llu\n", current, latest);
             if (current > latest) {
                 latest = current;
+                strncpy(latest_name, directory_entry->d_name, 
+                        MAX_SNAPSHOT_LENGTH - 1);
             }
         }
     } while ((directory_entry = readdir(dir_pointer)) != NULL);
 
+    closedir(dir_pointer);
+
     if (latest == 0) {
         return_value = make_snapshot_directory(path, new_path);
     } else {
-        sprintf(new_path, "%s/%d", path, latest);
+        sprintf(new_path, "%s/%s", path, latest_name);
     }
 
     return return_value;
@@ -198,6 +219,9 @@ int find_snapshot_version (const char *path, const char *filename)
     struct dirent *directory_entry;
     int filename_length = strlen(filename);
     int number_of_versions = -1;
+#ifdef _PACKING
+    int packed = 0;
+#endif
 
     dir_pointer = opendir(path);
 
@@ -223,6 +247,17 @@ int find_snapshot_version (const char *path, const char *filename)
         }
     } while ((directory_entry = readdir(dir_pointer)) != NULL);
 
+    closedir(dir_pointer);
+
+#ifdef _PACKING
+    /*
+     * Small versions are moved from the directory into the pack.
+     */
+    if ((packed = pack_count(path, filename)) > 0) {
+        number_of_versions += packed;
+    }
+#endif
+
     return number_of_versions;
 }
 
@@ -329,7 +364,7 @@ void parent_directory(const char *path, char *dest)
     while(i > 0 && path[i--] != '/');
 
     strncpy(dest, path, i + 1);
-    dest[i + 2] = '\0';
+    dest[i + 1] = '\0';
 }
 
 /**
@@ -349,67 +384,159 @@ void bottom_directory(const char *path, char *dest)
 }
 
 /**
- * Return a formatted string containing the date and time.
+ * Generate a new version identifier.
+ *
+ * A version identifier is the number of nanoseconds since the epoch. Whenever
+ * the clock has not advanced since the previous call (or went backwards) the
+ * identifier is bumped by one, so every identifier handed out during a mount is
+ * strictly larger than the one before it. Two versions created within the same
+ * clock tick therefore still get distinct, correctly ordered names.
  */
-char *timestamp(void)
+unsigned long long next_version_id(void)
 {
-    char *timestamp;
+    static volatile unsigned long long last_id = 0;
+    unsigned long long previous = 0;
+    unsigned long long current = 0;
+    struct timespec now;
 
-    timestamp = (char *) checked_malloc(64 * sizeof(char));
+    clock_gettime(CLOCK_REALTIME, &now);
 
-    struct tm *time_struct;
-    time_t time_value;
+    do {
+        previous = last_id;
+        current = (unsigned long long) now.tv_sec * 1000000000ULL 
+            + now.tv_nsec;
+
+        if (current <= previous) {
+            current = previous + 1;
+        }
+    } while (!__sync_bool_compare_and_swap(&last_id, previous, current));
+
+    return current;
+}
+
+/**
+ * Format a version identifier.
+ *
+ * The identifier is written as a zero-padded decimal number of fixed width, so
+ * the lexical order of the names equals their numerical (and thus temporal)
+ * order. The buffer must hold at least MAX_VERSION_ID_LENGTH characters.
+ */
+char *format_version_id(unsigned long long id, char *buffer)
+{
+    int i = MAX_VERSION_ID_LENGTH - 1;
+
+    buffer[i] = '\0';
 
-    time_value = time(NULL);
-    time_struct = localtime(&time_value);
+    while (i > 0) {
+        buffer[--i] = '0' + (id % 10);
+        id /= 10;
+    }
 
-    strftime(timestamp, MAX_TIME_STR, "%s", time_struct);
+    return buffer;
+}
 
-    return timestamp;
+/**
+ * Write a new version identifier into buffer and return it.
+ *
+ * This replaces the old second-resolution timestamp; the buffer is provided by
+ * the caller (MAX_VERSION_ID_LENGTH characters) so nothing is allocated.
+ */
+char *timestamp(char *buffer)
+{
+    return format_version_id(next_version_id(), buffer);
 }
 
 /**
  * Copy a file from source to dest.
  *
- * This function uses 'system' to call the function 'cp'. If anything goes wrong
- * it is reported as an error.
+ * The copy is made in-process with copy_file_range, which lets the kernel (or
+ * the file system) copy the data without passing it through user space. If
+ * that is not supported for these files, a plain read / write loop is used.
+ * The destination gets the permission bits of the source. If anything goes
+ * wrong it is reported as an error.
  */
 int copy (const char *source, const char *dest)
 {
     int return_value = 0;
-    char command[MAX_COMMAND_LENGTH];
+    int source_fd = -1;
+    int dest_fd = -1;
+    ssize_t length = 0;
+    struct stat stat_buffer;
+    char buffer[COPY_BUFFER_SIZE];
 
-    sprintf(command, "cp %s %s", source, dest);
+    source_fd = open(source, O_RDONLY);
 
-    return_value = system(command);
+    if (source_fd < 0 || fstat(source_fd, &stat_buffer) < 0) {
+        return_value = HIERONYMUS_ERROR(err_open, "copy");
+        goto cleanup;
+    }
 
-    if (return_value < 0) {
-        return_value = HIERONYMUS_ERROR(err_system, "copy");
+    dest_fd = open(dest, O_WRONLY | O_CREAT | O_TRUNC, 
+            stat_buffer.st_mode & 07777);
+
+    if (dest_fd < 0) {
+        return_value = HIERONYMUS_ERROR(err_create, "copy");
+        goto cleanup;
+    }
+
+    while ((length = copy_file_range(source_fd, NULL, dest_fd, NULL, 
+                    stat_buffer.st_size + COPY_BUFFER_SIZE, 0)) > 0);
+
+    /*
+     * Not supported between these file systems, fall back to copying the data
+     * ourselves from where copy_file_range left off.
+     */
+    if (length < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL 
+                || errno == EOPNOTSUPP)) {
+        while ((length = read(source_fd, buffer, COPY_BUFFER_SIZE)) > 0) {
+            if (write(dest_fd, buffer, length) != length) {
+                length = -1;
+                break;
+            }
+        }
+    }
+
+    if (length < 0) {
+        return_value = HIERONYMUS_ERROR(err_write, "copy");
     }
 
     HIERONYMUS_NOTE("copy: creating snapshot version.\n");
 
+cleanup:
+    if (source_fd >= 0) {
+        close(source_fd);
+    }
+
+    if (dest_fd >= 0) {
+        close(dest_fd);
+    }
+
     return return_value;
 }
 
 /**
  * Calculate the diff between old_file and new_file.
  *
- * This function creates a patch file to go from old_file to new_file.
- * The patch can be generated by xdelta or gnudiff, which one is used can be
- * changed at compile-time (-D_XDELTA for xdelta).
+ * This function creates the patch file patch_file to go from old_file to
+ * new_file. The patch can be generated by xdelta or gnudiff, which one is used
+ * can be changed at compile-time (-D_XDELTA for xdelta). With -D_NATIVE_DELTA
+ * the patch is computed in-process by the parallel delta engine (delta.c),
+ * which is meant for very large files.
  */
-int diff (const char *old_file, const char *new_file)
+int diff (const char *old_file, const char *new_file, const char *patch_file)
 {
     int return_value = 0;
+#ifdef _NATIVE_DELTA
+    return_value = delta_encode(old_file, new_file, patch_file);
+#else
     char command[MAX_COMMAND_LENGTH];
 
 #ifdef _XDELTA
-    sprintf(command, "xdelta3 -e -s %s %s %s-%s.patch", 
-            old_file, new_file, old_file, timestamp());
+    snprintf(command, MAX_COMMAND_LENGTH, "xdelta3 -e -s %s %s %s", 
+            old_file, new_file, patch_file);
 #else
-    sprintf(command, "diff -u %s %s > %s-%s.patch", 
-            old_file, new_file, old_file, timestamp());
+    snprintf(command, MAX_COMMAND_LENGTH, "diff -u %s %s > %s", 
+            old_file, new_file, patch_file);
 #endif
 
     return_value = system(command);
@@ -417,6 +544,7 @@ int diff (const char *old_file, const char *new_file)
     if (return_value < 0) {
         return_value = HIERONYMUS_ERROR(err_system, "diff");
     }
+#endif
 
     HIERONYMUS_NOTE("diff: creating patch version.\n");
 
@@ -10,16 +10,75 @@
  *
  *****************************************************************************/
 
-#include <fuse.h>
+#define _GNU_SOURCE
+
+#include <stdio.h>
 #include <limits.h>
 #include <string.h>
 #include <stdlib.h>
 #include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #include "versioning.h"
 #include "util.h"
 #include "error.h"
 #include "fuse_main.h"
+#include "journal.h"
+#include "path.h"
+#include "codec.h"
+#include "pack.h"
+#include "vindex.h"
+#include "config.h"
+#include "policy.h"
+#include "dedup.h"
+#include "vstate.h"
+
+#ifdef _VERSION_INDEX
+/**
+ * Record a version in the version index of the mount.
+ *
+ * The path, which has to be in the root directory, is stored relative to it,
+ * with the size of the file and the size of the stored version (if any) at
+ * this moment. A file that is gone (removed) has the size of its stored
+ * version. An id of 0 means now.
+ */
+static void index_version(const char *path, int kind, unsigned long long id,
+        const char *stored_path)
+{
+    struct stat stat_buffer;
+    unsigned long long size = 0;
+    unsigned long long stored = 0;
+    size_t root_length = strlen(ADMIN->root_directory);
+    int exists = 0;
+
+    /*
+     * Only paths in the root directory have a key in the index.
+     */
+    if (strncmp(path, ADMIN->root_directory, root_length) != 0 
+            || (path[root_length] != '/' && path[root_length] != '\0')) {
+        return;
+    }
+
+    exists = lstat(path, &stat_buffer) == 0;
+
+    if (exists) {
+        size = stat_buffer.st_size;
+    }
+
+    if (stored_path != NULL && lstat(stored_path, &stat_buffer) == 0) {
+        stored = stat_buffer.st_size;
+
+        if (!exists) {
+            size = stored;
+        }
+    }
+
+    vindex_record(path + root_length, kind, id, size, stored);
+}
+#endif
 
 /**
  * Create a new directory and its '.version' directory.
@@ -30,51 +89,400 @@
  */
 int h_versioned_mkdir(const char *root_path) 
 {
-    char tmp[PATH_MAX];
+    path_mark mark = path_get_mark();
     int return_value;
 
     /*
      * We're creating a new directory so using checked_mkdir here would 
      * add some unnecessary overhead.
      */
-    sprintf(tmp, "%s/.version", root_path);
-
-    return_value = mkdir(tmp, S_IRWXU | S_IRWXG);
+    return_value = mkdir(path_build(PATH_SLICE(root_path), 
+                PATH_LITERAL("/.version"), PATH_END), S_IRWXU | S_IRWXG);
 
     if (return_value != 0) {
         return_value = HIERONYMUS_ERROR(err_mkdir, "h_versioned_mkdir");
     }
 
+    path_release(mark);
+
     return return_value;
 }
 
 /**
  * Remove a directory.
  *
- * When a directory is removed, it is in fact simply moved into its
- * parent-directory's '.version' folder. That way it can be restored if
- * necessary.
+ * When a directory (given by its path in the root directory) is removed, it is
+ * in fact simply moved into its parent-directory's '.version' folder. That way
+ * it can be restored if necessary. With journaling the move is logged as an
+ * intent first, so an interrupted move is completed at the next mount. Returns
+ * -errno if the move fails, without recording the error (h_rmdir does).
  */
 int h_versioned_rmdir(const char *path)
 {
     int return_value = 0;
+    path_mark mark = path_get_mark();
+    path_slice slice = PATH_SLICE(path);
+    char version_id[MAX_VERSION_ID_LENGTH];
+    char *stored_path = NULL;
 
-    char tmp1[PATH_MAX];
-    char tmp2[PATH_MAX];
-    parent_directory(path, tmp1);
-    bottom_directory(path, tmp2);
+    stored_path = path_build(path_parent(slice), 
+            PATH_LITERAL("/.version/__DIR__"), path_name(slice), 
+            PATH_LITERAL("__"), PATH_SLICE(timestamp(version_id)), PATH_END);
 
-    sprintf(tmp1, "%s/.version/__DIR__%s__%s", tmp1, tmp2, timestamp());
+#ifdef _JOURNALING
+    unsigned long long sequence = journal_intent(intent_rmdir, path, 
+            stored_path);
 
-    return_value = rename(path, tmp1);
+    if (journal_commit(sequence) < 0) {
+        HIERONYMUS_ERROR(err_journal, "h_versioned_rmdir");
+    }
+#endif
 
-    if (return_value != 0) {
-        return_value = HIERONYMUS_ERROR(err_rename, "h_versioned_rmdir");
+    if (rename(path, stored_path) != 0) {
+        return_value = -errno;
+    } else {
+        vstate_invalidate();
     }
 
+#ifdef _VERSION_INDEX
+    if (return_value == 0) {
+        index_version(path, vindex_rmdir, 0, NULL);
+    }
+#endif
+
+#ifdef _JOURNALING
+    journal_done(sequence);
+#endif
+
+    path_release(mark);
+
     return return_value;
 }
 
+/**
+ * Log an event in the index of a '.version' directory.
+ *
+ * Each event is a single line, appended with a single write:
+ *
+ *    ``<version id> <event> <name> [<argument>]''
+ *
+ * Paths given as argument are relative to the root directory. Called with a
+ * mark taken by the caller, the index path and the line are allocated from the
+ * path arena.
+ */
+static int log_version_event(path_slice directory, const char *event, 
+        path_slice name, const char *argument)
+{
+    int return_value = 0;
+    int index_fd = 0;
+    char version_id[MAX_VERSION_ID_LENGTH];
+    char *index_path = NULL;
+    char *line = NULL;
+    size_t length = 0;
+
+    index_path = path_build(directory, PATH_LITERAL("/.version/"), 
+            PATH_LITERAL(VERSION_INDEX), PATH_END);
+
+    line = path_build(PATH_SLICE(timestamp(version_id)), PATH_LITERAL(" "), 
+            PATH_SLICE(event), PATH_LITERAL(" "), name, 
+            (argument != NULL) ? PATH_LITERAL(" ") : PATH_LITERAL(""), 
+            (argument != NULL) ? PATH_SLICE(argument) : PATH_LITERAL(""), 
+            PATH_LITERAL("\n"), PATH_END);
+    length = strlen(line);
+
+    index_fd = open(index_path, O_WRONLY | O_APPEND | O_CREAT, 
+            S_IRUSR | S_IWUSR);
+
+    if (index_fd < 0) {
+        return HIERONYMUS_ERROR(err_index, "log_version_event");
+    }
+
+    if (write(index_fd, line, length) != (ssize_t) length) {
+        return_value = HIERONYMUS_ERROR(err_index, "log_version_event");
+    }
+
+    close(index_fd);
+
+    return return_value;
+}
+
+/**
+ * Determine where a removed file is kept.
+ *
+ * A removed file is kept as '.version/__FILE__<name>__<version id>' in its own
+ * directory (the same convention as used for directories). The name and the
+ * absolute path of the stored version are allocated from the path arena.
+ */
+static void stored_version_path(const char *path, char **stored_name, 
+        char **stored_path)
+{
+    path_slice slice = PATH_SLICE(path);
+    char version_id[MAX_VERSION_ID_LENGTH];
+
+    *stored_name = path_build(PATH_LITERAL("__FILE__"), path_name(slice), 
+            PATH_LITERAL("__"), PATH_SLICE(timestamp(version_id)), PATH_END);
+    *stored_path = path_build(path_parent(slice), PATH_LITERAL("/.version/"), 
+            PATH_SLICE(*stored_name), PATH_END);
+}
+
+/**
+ * Move a file into the '.version' directory, without copying any data.
+ *
+ * If link_only is set a hard link is created instead, leaving the file itself
+ * in place. Either way only metadata changes, so the cost does not depend on
+ * the size of the file. Returns -errno on failure, the caller records it.
+ */
+static int store_removed_file(const char *path, const char *stored_path, 
+        int link_only)
+{
+    int return_value = 0;
+
+    if (link_only) {
+        return_value = link(path, stored_path);
+    } else {
+        /*
+         * Version identifiers are unique, but never overwrite an existing
+         * version should the name exist anyway.
+         */
+        return_value = renameat2(AT_FDCWD, path, AT_FDCWD, stored_path, 
+                RENAME_NOREPLACE);
+
+        if (return_value != 0 && (errno == EINVAL || errno == ENOSYS)) {
+            return_value = rename(path, stored_path);
+        }
+    }
+
+    return return_value != 0 ? -errno : 0;
+}
+
+/**
+ * Create a file.
+ *
+ * The file is created (and opened) as usual, the creation is logged in the
+ * index of its directory. That way a new file can be told apart from an earlier
+ * file with the same name that was removed. Returns the file descriptor, or
+ * -errno without recording the error (h_create does).
+ */
+int h_versioned_create(const char *path, mode_t mode)
+{
+    int file_descriptor = 0;
+    path_mark mark;
+    path_slice slice = PATH_SLICE(path);
+
+    file_descriptor = creat(path, mode);
+
+    if (file_descriptor < 0) {
+        return -errno;
+    }
+
+    mark = path_get_mark();
+
+    log_version_event(path_parent(slice), "create", path_name(slice), NULL);
+
+#ifdef _VERSION_INDEX
+    index_version(path, vindex_create, 0, NULL);
+#endif
+
+    path_release(mark);
+
+    return file_descriptor;
+}
+
+/**
+ * Remove a file.
+ *
+ * When a file is removed, it is in fact moved into the '.version' directory of
+ * its directory, like a removed directory. This is a rename within the same
+ * file system, so removing a large file is as cheap as a normal unlink. The
+ * removal and the name of the stored version are logged in the index. Returns
+ * -errno without recording the error (h_unlink does).
+ */
+int h_versioned_unlink(const char *path)
+{
+    int return_value = 0;
+    path_mark mark = path_get_mark();
+    path_slice slice = PATH_SLICE(path);
+    char *stored_name = NULL;
+    char *stored_path = NULL;
+
+    stored_version_path(path, &stored_name, &stored_path);
+
+#ifdef _JOURNALING
+    unsigned long long sequence = journal_intent(intent_unlink, path, 
+            stored_path);
+
+    if (journal_commit(sequence) < 0) {
+        HIERONYMUS_ERROR(err_journal, "h_versioned_unlink");
+    }
+#endif
+
+    return_value = store_removed_file(path, stored_path, 0);
+
+    if (return_value == 0) {
+        log_version_event(path_parent(slice), "unlink", path_name(slice), 
+                stored_name);
+
+#ifdef _VERSION_INDEX
+        index_version(path, vindex_unlink, 0, stored_path);
+#endif
+    }
+
+#ifdef _JOURNALING
+    journal_done(sequence);
+#endif
+
+    path_release(mark);
+
+    return return_value;
+}
+
+/**
+ * Log a rename in the indexes of the old and the new directory.
+ *
+ * The old directory records where the file went, the new directory records
+ * where it came from, so the history of a file can be followed across renames
+ * in both directions without moving any of the existing versions.
+ */
+int h_versioned_rename_index(const char *path, const char *new_path)
+{
+    int return_value = 0;
+    size_t root_length = strlen(ADMIN->root_directory);
+    path_mark mark = path_get_mark();
+    path_slice slice = PATH_SLICE(path);
+    path_slice new_slice = PATH_SLICE(new_path);
+
+    return_value = log_version_event(path_parent(slice), "rename-from", 
+            path_name(slice), new_path + root_length);
+
+    if (log_version_event(path_parent(new_slice), "rename-to", 
+                path_name(new_slice), path + root_length) < 0) {
+        return_value = -1;
+    }
+
+#ifdef _VERSION_INDEX
+    index_version(path, vindex_rename_from, 0, NULL);
+    index_version(new_path, vindex_rename_to, 0, NULL);
+#endif
+
+    path_release(mark);
+
+    return return_value;
+}
+
+/**
+ * Log in the index of its directory that a file replaced by a rename is kept
+ * as stored_path (see h_versioned_rename).
+ */
+int h_versioned_replace_index(const char *path, const char *stored_path)
+{
+    int return_value = 0;
+    path_mark mark = path_get_mark();
+    path_slice slice = PATH_SLICE(path);
+
+    return_value = log_version_event(path_parent(slice), "unlink", 
+            path_name(slice), strrchr(stored_path, '/') + 1);
+
+    path_release(mark);
+
+    return return_value;
+}
+
+/**
+ * Rename a file or directory.
+ *
+ * If the rename replaces an existing file, that file is first hard linked into
+ * the '.version' directory of its directory, as if it was removed. The rename
+ * itself is then performed as usual. Once it succeeded the removal and the
+ * rename are logged in the indexes, so the history of the file follows it to
+ * its new name; if it fails the link is undone. No data is copied in either
+ * step. With journaling the link is logged as an intent of its own, so a link
+ * left behind by a crash is undone (or logged) at the next mount. Returns
+ * -errno if the rename fails, without recording the error (h_rename does).
+ */
+int h_versioned_rename(const char *path, const char *new_path)
+{
+    int return_value = 0;
+    struct stat stat_buffer;
+    path_mark mark = path_get_mark();
+    int directory = 0;
+    int replaced = 0;
+    char *stored_name = NULL;
+    char *stored_path = NULL;
+
+    if (lstat(new_path, &stat_buffer) == 0 && S_ISREG(stat_buffer.st_mode)) {
+        stored_version_path(new_path, &stored_name, &stored_path);
+    }
+
+#ifdef _JOURNALING
+    unsigned long long sequence = journal_intent(intent_rename, path, 
+            new_path);
+    unsigned long long replace_sequence = (stored_path != NULL) 
+        ? journal_intent(intent_replace, new_path, stored_path) : 0;
+
+    if (journal_commit(replace_sequence != 0 ? replace_sequence : sequence) 
+            < 0) {
+        HIERONYMUS_ERROR(err_journal, "h_versioned_rename");
+    }
+#endif
+
+    if (stored_path != NULL) {
+        if ((return_value = store_removed_file(new_path, stored_path, 1)) 
+                == 0) {
+            replaced = 1;
+        } else {
+            HIERONYMUS_RETURNED_ERROR(err_link, "h_versioned_rename",
+                    return_value, 0);
+            return_value = 0;
+        }
+    }
+
+    directory = lstat(path, &stat_buffer) == 0 && S_ISDIR(stat_buffer.st_mode);
+
+    if (rename(path, new_path) != 0) {
+        return_value = -errno;
+
+        if (replaced) {
+            unlink(stored_path);
+        }
+    } else {
+        if (replaced) {
+            h_versioned_replace_index(new_path, stored_path);
+        }
+
+        h_versioned_rename_index(path, new_path);
+    }
+
+    /*
+     * The '.version' directories below a renamed directory moved with it.
+     */
+    if (return_value == 0 && directory) {
+        vstate_invalidate();
+    }
+
+#ifdef _JOURNALING
+    journal_done(replace_sequence);
+    journal_done(sequence);
+#endif
+
+    path_release(mark);
+
+    return return_value;
+}
+
+/**
+ * Seal a snapshot directory that was replaced by a newer one: its copies no
+ * longer serve as the base of new patches. Called by vstate once no writer
+ * uses the snapshot any more.
+ */
+static void seal_snapshot(const char *snapshot_directory)
+{
+#if defined(_PACKING)
+    pack_seal_snapshot(snapshot_directory);
+#elif defined(_COMPRESSION)
+    codec_seal_snapshot(snapshot_directory);
+#endif
+}
+
 /**
  * Write a file to disk.
  *
@@ -84,55 +492,148 @@ int h_versioned_rmdir(const char *path)
  * version. For a snapshot version it copies the file to the latest snapshot
  * directory. For a patch version it creates a patch in the latest snapshot
  * directory.
+ *
+ * With -D_DEDUP no version is created if the contents of the file did not
+ * change since its latest version, and snapshot copies with the same contents
+ * share a blob (see dedup.c). The SHA-1 of the file is read from it, unless
+ * known_digest (if not NULL) returns it for the writer. Either is done once
+ * the file is locked, so the digest matches the version that is stored.
  */
-int h_versioned_write(const char *path)
+int h_versioned_write(const char *path, version_digest_function known_digest,
+        void *writer)
 {
     int return_value = 0;
     int num_versions = 0;
-    char snapshot_path[PATH_MAX];
-    char directory[PATH_MAX];
-    char filename[MAX_FILENAME];
+    path_mark mark = path_get_mark();
+    path_slice slice = PATH_SLICE(path);
+    path_slice filename = path_name(slice);
+    char *version_directory = NULL;
+    char *snapshot_directory = NULL;
+    char *snapshot_path = NULL;
+    char *stored_path = NULL;
+    char version_id[MAX_VERSION_ID_LENGTH];
+    unsigned long long id = 0;
+    const policy_rule *rule = policy_match_root(path);
+    int max_num_versions = config_get()->max_num_versions;
+    vstate_file *file = NULL;
+
+    if (rule != NULL && rule->max_versions > 0) {
+        max_num_versions = rule->max_versions;
+    }
+
+    /*
+     * Writers of the same file take turns from here on, see vstate.c.
+     */
+    file = vstate_lock_file(path);
+
+#ifdef _DEDUP
+    unsigned char digest[SHA1_LENGTH];
 
-    parent_directory(path, directory);
-    bottom_directory(path, filename);
-    strncat(directory, "/.version", 9);
+    if (known_digest == NULL || known_digest(writer, digest) == NULL) {
+        if ((return_value = dedup_digest_file(path, digest)) < 0) {
+            goto out;
+        }
+    }
+
+    if (dedup_unchanged(path, digest)) {
+        goto out;
+    }
+#endif
+
+    version_directory = path_build(path_parent(slice), 
+            PATH_LITERAL("/.version"), PATH_END);
+    snapshot_directory = path_alloc(PATH_MAX);
     
     /* Find latest snapshot (with this file), if it exists. 
      *
      * Find-function creates the first snapshot folder if necessary else it
      * returns the newest snapshot folder (possibly without this file).
      */
-    if (find_latest_snapshot(directory, snapshot_path) < 0) {
+    if (vstate_latest_snapshot(file, version_directory, snapshot_directory) 
+            < 0) {
         return_value = HIERONYMUS_ERROR(err_snapshot, "h_versioned_write");
+        goto out;
     }
 
-    sprintf(snapshot_path, "%s/%s", snapshot_path, filename);
-    strncpy(directory, snapshot_path, (strlen(snapshot_path) - strlen(filename)));
-    directory[(strlen(snapshot_path) - strlen(filename)) - 1] = '\0';
-
     /* 
      * Check if this file exists in the snapshot folder, if not, simply make a
      * copy of the file (i.e. snapshot version). Else call diff with the
      * snapshot version and the new version and store the patch.
+     *
+     * If we've exceeded the maximum number of versions per snapshot (of the
+     * configuration, or of the policy of the file), create a new snapshot
+     * directory with a new snapshot version. Of several writers that find
+     * the snapshot full, only the first makes a new one.
      */
-    if ((num_versions = find_snapshot_version(directory, filename)) < 0) {
+    num_versions = vstate_num_versions(file, snapshot_directory, 
+            filename.data);
+
+    if (num_versions > max_num_versions) {
+        if (vstate_next_snapshot(file, version_directory, snapshot_directory,
+                    snapshot_directory, seal_snapshot) == 0) {
+            num_versions = vstate_num_versions(file, snapshot_directory, 
+                    filename.data);
+        } else {
+            num_versions = -1;
+        }
+
+        HIERONYMUS_DEBUG("num_versions: %d, snapshot_dir: %s", 
+                num_versions, snapshot_directory);
+    }
+
+    snapshot_path = path_build(PATH_SLICE(snapshot_directory), 
+            PATH_LITERAL("/"), filename, PATH_END);
+    id = next_version_id();
+
+    if (num_versions < 0) {
+        stored_path = snapshot_path;
+#ifdef _DEDUP
+        return_value = dedup_store_copy(path, snapshot_path, digest);
+#else
         return_value = copy(path, snapshot_path);
+#endif
     } else {
-        /*
-         * If we've exceeded the maximum number of versions per snapshot, create
-         * a new snapshot.
-         */
-        if (num_versions > ADMIN->max_num_versions) {
-            parent_directory(path, directory);
-            strncat(directory, "/.version", 9);
-            make_snapshot_directory(directory, snapshot_path);
+        stored_path = path_build(PATH_SLICE(snapshot_path), PATH_LITERAL("-"),
+                PATH_SLICE(format_version_id(id, version_id)), 
+                PATH_LITERAL(".patch"), PATH_END);
+        return_value = diff(snapshot_path, path, stored_path);
+    }
+
+    if (return_value >= 0) {
+        vstate_add_version(file, snapshot_directory, num_versions);
+    }
 
-            HIERONYMUS_DEBUG("num_versions: %d, snapshot_dir: %s", 
-                    num_versions, snapshot_path);
-        } 
+#ifdef _DEDUP
+    if (return_value >= 0) {
+        dedup_remember(path, digest);
+    }
+#endif
 
-        return_value = diff(snapshot_path, path);
+#ifdef _VERSION_INDEX
+    if (return_value >= 0) {
+        index_version(path, num_versions < 0 ? vindex_snapshot : vindex_patch,
+                id, stored_path);
     }
+#endif
+
+    /*
+     * Once indexed, a patch is compressed and packed in the background (the
+     * snapshot copy is the base of the next patches, it waits until its
+     * snapshot is sealed).
+     */
+#if defined(_PACKING)
+    if (return_value >= 0 && num_versions >= 0) {
+        pack_store_async(stored_path);
+    }
+#elif defined(_COMPRESSION)
+    if (return_value >= 0 && num_versions >= 0) {
+        codec_compress_async(stored_path);
+    }
+#endif
+
+out:
+    vstate_unlock_file(file);
+    path_release(mark);
 
     return return_value;
 }
@@ -0,0 +1,1223 @@
+/******************************************************************************
+ *
+ * file   : vindex.c
+ *
+ * author : Tim van Deurzen
+ * date   : 18/10/2026
+ *
+ * The version index of a mount (compiled in with -D_VERSION_INDEX): for every
+ * file, the versions stored of it and the events logged for it, by version id.
+ *
+ * The index is never parsed at mount-time. Its base is a read-only file that
+ * is mapped as is: a header, the files sorted by the hash of their path (one
+ * cache line each), the versions of each file sorted by id (two per cache
+ * line) and the paths. A path is looked up with a binary search on its hash.
+ *
+ * New versions go into an in-memory delta, and are appended to a log so the
+ * delta survives a restart. Once the delta holds VINDEX_MERGE_THRESHOLD
+ * versions it is frozen, the log is rotated and the frozen delta is merged
+ * with the base into a new base in the background, in two streaming passes.
+ * Opening an index maps the base and replays at most two logs, so it takes
+ * the same time for any history.
+ *
+ * h_vtool and h_admin.py read the index without the daemon running.
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "vindex.h"
+#include "thread_pool.h"
+#include "simd.h"
+#include "error.h"
+#include "util.h"
+
+/*
+ * Either counts the sections of a new base or writes them, each section
+ * through a stream of its own.
+ */
+typedef struct VINDEX_WRITER {
+    int counting;
+    FILE *files;
+    FILE *versions;
+    FILE *strings;
+    uint64_t num_files;
+    uint64_t num_versions;
+    uint64_t strings_size;
+} vindex_writer;
+
+static const char *kind_names[num_vindex_kinds] = {
+    "unknown", "snapshot", "patch", "create", "unlink", "rename-from",
+    "rename-to", "rmdir"
+};
+
+/*
+ * The index of the mounted root directory.
+ */
+static vindex *mounted = NULL;
+
+const char *vindex_kind_name(int kind)
+{
+    if (kind <= 0 || kind >= num_vindex_kinds) {
+        return kind_names[0];
+    }
+
+    return kind_names[kind];
+}
+
+/**
+ * Hash a path (64-bit FNV-1a).
+ */
+uint64_t vindex_hash(const char *path)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    while (*path != '\0') {
+        hash = (hash ^ (unsigned char) *path++) * 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+static uint64_t align(uint64_t offset)
+{
+    return (offset + VINDEX_ALIGNMENT - 1) & ~((uint64_t) VINDEX_ALIGNMENT - 1);
+}
+
+static int write_all(int fd, const void *buffer, size_t length)
+{
+    const unsigned char *data = (const unsigned char *) buffer;
+    ssize_t written = 0;
+
+    while (length > 0) {
+        if ((written = write(fd, data, length)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return -1;
+        }
+
+        data += written;
+        length -= written;
+    }
+
+    return 0;
+}
+
+static void index_path(const vindex *index, const char *name, char *path)
+{
+    if (snprintf(path, PATH_MAX, "%s/%s", index->root, name) >= PATH_MAX) {
+        path[0] = '\0';
+    }
+}
+
+static const vindex_header *base_header(const vindex *index)
+{
+    return (const vindex_header *) index->base;
+}
+
+static const vindex_file *base_files(const vindex *index)
+{
+    return (const vindex_file *) (index->base
+            + base_header(index)->files_offset);
+}
+
+static const vindex_version *base_versions(const vindex *index)
+{
+    return (const vindex_version *) (index->base
+            + base_header(index)->versions_offset);
+}
+
+static const char *base_strings(const vindex *index)
+{
+    return (const char *) index->base + base_header(index)->strings_offset;
+}
+
+/**
+ * Check that the sections of a base lie within it.
+ */
+static int valid_base(const vindex_header *header, size_t size)
+{
+    if (memcmp(header->magic, VINDEX_MAGIC, sizeof(header->magic)) != 0) {
+        return 0;
+    }
+
+    return header->files_offset >= sizeof(vindex_header)
+        && header->num_files <= size / sizeof(vindex_file)
+        && header->num_versions <= size / sizeof(vindex_version)
+        && header->files_offset + header->num_files * sizeof(vindex_file)
+            <= header->versions_offset
+        && header->versions_offset + header->num_versions
+            * sizeof(vindex_version) <= header->strings_offset
+        && header->strings_offset <= size;
+}
+
+/**
+ * Map the base of an index. Without a base, *base is NULL.
+ */
+static int map_base(const vindex *index, const unsigned char **base,
+        size_t *size)
+{
+    char path[PATH_MAX];
+    struct stat base_stat;
+    void *mapping = NULL;
+    int fd = -1;
+
+    *base = NULL;
+    *size = 0;
+
+    index_path(index, VINDEX_NAME, path);
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    if (fstat(fd, &base_stat) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    if (base_stat.st_size < (off_t) sizeof(vindex_header)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    mapping = mmap(NULL, base_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (mapping == MAP_FAILED) {
+        return -1;
+    }
+
+    if (!valid_base((const vindex_header *) mapping, base_stat.st_size)) {
+        munmap(mapping, base_stat.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+
+    madvise(mapping, base_stat.st_size, MADV_RANDOM);
+
+    *base = (const unsigned char *) mapping;
+    *size = base_stat.st_size;
+
+    return 0;
+}
+
+static int delta_append(vindex_delta *delta, uint64_t sequence,
+        const char *path, size_t path_length, const vindex_version *version)
+{
+    vindex_delta_entry *entries = NULL;
+    vindex_delta_entry *entry = NULL;
+
+    if (delta->num_entries == delta->capacity) {
+        delta->capacity = delta->capacity == 0 ? 256 : delta->capacity * 2;
+        entries = (vindex_delta_entry *) realloc(delta->entries,
+                delta->capacity * sizeof(vindex_delta_entry));
+
+        if (entries == NULL) {
+            return -1;
+        }
+
+        delta->entries = entries;
+    }
+
+    entry = &delta->entries[delta->num_entries++];
+    entry->path = (char *) checked_malloc(path_length + 1);
+    memcpy(entry->path, path, path_length);
+    entry->path[path_length] = '\0';
+    entry->hash = vindex_hash(entry->path);
+    entry->sequence = sequence;
+    entry->version = *version;
+
+    return 0;
+}
+
+static void delta_free(vindex_delta *delta)
+{
+    size_t i = 0;
+
+    for (i = 0; i < delta->num_entries; i++) {
+        free(delta->entries[i].path);
+    }
+
+    free(delta->entries);
+    memset(delta, 0, sizeof(vindex_delta));
+}
+
+static uint32_t log_checksum(const vindex_log_record *record, const char *path)
+{
+    vindex_log_record blank = *record;
+
+    blank.checksum = 0;
+
+    return simd_crc32c(simd_crc32c(0, &blank, sizeof(blank)), path,
+            record->path_length);
+}
+
+/**
+ * Add the records of a log that are not in the base to the active delta. A
+ * torn record ends the log.
+ */
+static int replay(vindex *index, const char *name, uint64_t last_sequence)
+{
+    char path[PATH_MAX];
+    struct stat log_stat;
+    vindex_log_record record;
+    const unsigned char *log = NULL;
+    const char *record_path = NULL;
+    size_t position = 0;
+    int return_value = 0;
+    int fd = -1;
+
+    index_path(index, name, path);
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    if (fstat(fd, &log_stat) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    if (log_stat.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    log = (const unsigned char *) mmap(NULL, log_stat.st_size, PROT_READ,
+            MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (log == MAP_FAILED) {
+        return -1;
+    }
+
+    while (return_value == 0 && position + sizeof(record)
+            <= (size_t) log_stat.st_size) {
+        memcpy(&record, log + position, sizeof(record));
+        record_path = (const char *) log + position + sizeof(record);
+
+        if (record.magic != VINDEX_LOG_MAGIC || record.path_length >= PATH_MAX
+                || position + sizeof(record) + record.path_length
+                > (size_t) log_stat.st_size
+                || log_checksum(&record, record_path) != record.checksum) {
+            break;
+        }
+
+        if (record.sequence > last_sequence) {
+            return_value = delta_append(&index->active, record.sequence,
+                    record_path, record.path_length, &record.version);
+        }
+
+        if (record.sequence >= index->next_sequence) {
+            index->next_sequence = record.sequence + 1;
+        }
+
+        position += sizeof(record) + record.path_length;
+    }
+
+    munmap((void *) log, log_stat.st_size);
+
+    return return_value;
+}
+
+static int compare_key(uint64_t hash, const char *path, uint64_t other_hash,
+        const char *other_path)
+{
+    if (hash != other_hash) {
+        return hash < other_hash ? -1 : 1;
+    }
+
+    return strcmp(path, other_path);
+}
+
+static int compare_delta(const void *a, const void *b)
+{
+    const vindex_delta_entry *left = *(vindex_delta_entry * const *) a;
+    const vindex_delta_entry *right = *(vindex_delta_entry * const *) b;
+    int order = compare_key(left->hash, left->path, right->hash, right->path);
+
+    if (order != 0) {
+        return order;
+    }
+
+    if (left->version.id != right->version.id) {
+        return left->version.id < right->version.id ? -1 : 1;
+    }
+
+    return left->sequence < right->sequence ? -1 : 1;
+}
+
+static void emit_version(vindex_writer *writer, vindex_file *file,
+        const vindex_version *version)
+{
+    if (file->num_versions == 0) {
+        file->first_id = version->id;
+    }
+
+    file->last_id = version->id;
+    file->total_stored += version->stored;
+    file->num_versions++;
+
+    if (!writer->counting) {
+        fwrite(version, sizeof(vindex_version), 1, writer->versions);
+    }
+
+    writer->num_versions++;
+}
+
+static void emit_file(vindex_writer *writer, vindex_file *file,
+        const char *path)
+{
+    file->path_offset = writer->strings_size;
+    file->path_length = strlen(path);
+
+    if (!writer->counting) {
+        fwrite(file, sizeof(vindex_file), 1, writer->files);
+        fwrite(path, file->path_length + 1, 1, writer->strings);
+    }
+
+    writer->strings_size += file->path_length + 1;
+    writer->num_files++;
+}
+
+/**
+ * Merge the files of the base with the sorted entries of the frozen delta,
+ * merging the versions of files in both by id.
+ */
+static void merge_walk(const vindex *index, vindex_delta_entry **sorted,
+        size_t num_sorted, vindex_writer *writer)
+{
+    const vindex_file *files = NULL;
+    const vindex_version *versions = NULL;
+    const char *strings = NULL;
+    const vindex_file *base_file = NULL;
+    const vindex_delta_entry *entry = NULL;
+    const char *path = NULL;
+    uint64_t num_files = 0;
+    uint64_t limit = 0;
+    uint64_t k = 0;
+    size_t i = 0;
+    size_t j = 0;
+    size_t end = 0;
+    vindex_file file;
+    int order = 0;
+
+    if (index->base != NULL) {
+        files = base_files(index);
+        versions = base_versions(index);
+        strings = base_strings(index);
+        num_files = base_header(index)->num_files;
+    }
+
+    while (i < num_files || j < num_sorted) {
+        base_file = i < num_files ? &files[i] : NULL;
+        entry = j < num_sorted ? sorted[j] : NULL;
+
+        if (base_file == NULL) {
+            order = 1;
+        } else if (entry == NULL) {
+            order = -1;
+        } else {
+            order = compare_key(base_file->hash,
+                    strings + base_file->path_offset, entry->hash,
+                    entry->path);
+        }
+
+        memset(&file, 0, sizeof(file));
+        file.first_version = writer->num_versions;
+        file.hash = order <= 0 ? base_file->hash : entry->hash;
+        path = order <= 0 ? strings + base_file->path_offset : entry->path;
+
+        end = j;
+
+        while (order >= 0 && end < num_sorted && sorted[end]->hash
+                == entry->hash && strcmp(sorted[end]->path, entry->path) == 0) {
+            end++;
+        }
+
+        k = order <= 0 ? base_file->first_version : 0;
+        limit = order <= 0 ? k + base_file->num_versions : 0;
+
+        while (k < limit || j < end) {
+            if (j >= end || (k < limit
+                        && versions[k].id <= sorted[j]->version.id)) {
+                emit_version(writer, &file, &versions[k++]);
+            } else {
+                emit_version(writer, &file, &sorted[j++]->version);
+            }
+        }
+
+        if (order <= 0) {
+            i++;
+        }
+
+        emit_file(writer, &file, path);
+    }
+}
+
+static FILE *open_section(const char *path, uint64_t offset)
+{
+    FILE *stream = fopen(path, "r+");
+
+    if (stream != NULL && fseeko(stream, offset, SEEK_SET) != 0) {
+        fclose(stream);
+        return NULL;
+    }
+
+    return stream;
+}
+
+/**
+ * Write the base merged with the frozen delta to a temporary file and rename
+ * it into place.
+ */
+static int write_base(const vindex *index)
+{
+    char temporary[PATH_MAX];
+    char path[PATH_MAX];
+    vindex_delta_entry **sorted = NULL;
+    vindex_writer writer;
+    vindex_header header;
+    size_t num_sorted = index->frozen.num_entries;
+    size_t i = 0;
+    int return_value = 0;
+    int fd = -1;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, VINDEX_MAGIC, sizeof(header.magic));
+    header.generation = next_version_id();
+
+    if (index->base != NULL) {
+        header.last_sequence = base_header(index)->last_sequence;
+    }
+
+    sorted = (vindex_delta_entry **) checked_malloc(
+            (num_sorted + 1) * sizeof(vindex_delta_entry *));
+
+    for (i = 0; i < num_sorted; i++) {
+        sorted[i] = &index->frozen.entries[i];
+
+        if (sorted[i]->sequence > header.last_sequence) {
+            header.last_sequence = sorted[i]->sequence;
+        }
+    }
+
+    qsort(sorted, num_sorted, sizeof(vindex_delta_entry *), compare_delta);
+
+    memset(&writer, 0, sizeof(writer));
+    writer.counting = 1;
+    merge_walk(index, sorted, num_sorted, &writer);
+
+    header.num_files = writer.num_files;
+    header.num_versions = writer.num_versions;
+    header.files_offset = align(sizeof(vindex_header));
+    header.versions_offset = align(header.files_offset
+            + header.num_files * sizeof(vindex_file));
+    header.strings_offset = align(header.versions_offset
+            + header.num_versions * sizeof(vindex_version));
+
+    index_path(index, VINDEX_TEMPORARY_NAME, temporary);
+    index_path(index, VINDEX_NAME, path);
+
+    if ((fd = open(temporary, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0
+            || ftruncate(fd, header.strings_offset + writer.strings_size) < 0
+            || write_all(fd, &header, sizeof(header)) < 0) {
+        return_value = -1;
+        goto out;
+    }
+
+    memset(&writer, 0, sizeof(writer));
+    writer.files = open_section(temporary, header.files_offset);
+    writer.versions = open_section(temporary, header.versions_offset);
+    writer.strings = open_section(temporary, header.strings_offset);
+
+    if (writer.files == NULL || writer.versions == NULL
+            || writer.strings == NULL) {
+        return_value = -1;
+    } else {
+        merge_walk(index, sorted, num_sorted, &writer);
+    }
+
+    if (writer.files != NULL && fclose(writer.files) != 0) {
+        return_value = -1;
+    }
+
+    if (writer.versions != NULL && fclose(writer.versions) != 0) {
+        return_value = -1;
+    }
+
+    if (writer.strings != NULL && fclose(writer.strings) != 0) {
+        return_value = -1;
+    }
+
+    if (return_value == 0 && (fsync(fd) < 0 || rename(temporary, path) < 0)) {
+        return_value = -1;
+    }
+
+out:
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    if (return_value < 0) {
+        unlink(temporary);
+    }
+
+    free(sorted);
+
+    return return_value;
+}
+
+/**
+ * Freeze the active delta. The log is rotated, so it only holds what is added
+ * after. Called with the lock held for writing.
+ */
+static int freeze(vindex *index)
+{
+    char log[PATH_MAX];
+    char merging[PATH_MAX];
+
+    index_path(index, VINDEX_LOG_NAME, log);
+    index_path(index, VINDEX_MERGING_NAME, merging);
+
+    if (index->log_fd >= 0) {
+        if (rename(log, merging) < 0) {
+            return -1;
+        }
+
+        close(index->log_fd);
+        index->log_fd = open(log, O_WRONLY | O_APPEND | O_CREAT, 0600);
+
+        if (index->log_fd < 0) {
+            return -1;
+        }
+    }
+
+    index->frozen = index->active;
+    memset(&index->active, 0, sizeof(vindex_delta));
+    index->merging = 1;
+
+    return 0;
+}
+
+/**
+ * Merge the frozen delta into a new base and switch lookups over to it. If
+ * the merge fails the frozen delta stays (and no other merge starts), its log
+ * is merged at the next open.
+ */
+static int merge_frozen(vindex *index)
+{
+    char merging[PATH_MAX];
+    const unsigned char *base = NULL;
+    size_t base_size = 0;
+
+    if (write_base(index) < 0 || map_base(index, &base, &base_size) < 0) {
+        return HIERONYMUS_ERROR(err_index, "merge_frozen");
+    }
+
+    pthread_rwlock_wrlock(&index->lock);
+
+    if (index->base != NULL) {
+        munmap((void *) index->base, index->base_size);
+    }
+
+    index->base = base;
+    index->base_size = base_size;
+    delta_free(&index->frozen);
+    index->merging = 0;
+
+    pthread_rwlock_unlock(&index->lock);
+
+    index_path(index, VINDEX_MERGING_NAME, merging);
+    unlink(merging);
+
+    return 0;
+}
+
+static void merge_task(void *argument)
+{
+    merge_frozen((vindex *) argument);
+}
+
+/**
+ * Open the index of a root directory. An index opened for writing merges what
+ * an interrupted merge left behind first.
+ */
+vindex *vindex_open(const char *root, int writable)
+{
+    vindex *index = (vindex *) checked_malloc(sizeof(vindex));
+    char path[PATH_MAX];
+    uint64_t last_sequence = 0;
+    int recovering = 0;
+
+    memset(index, 0, sizeof(vindex));
+    snprintf(index->root, PATH_MAX, "%s", root);
+    index->writable = writable;
+    index->log_fd = -1;
+    index->lock_fd = -1;
+    pthread_rwlock_init(&index->lock, NULL);
+    pool_group_init(&index->merges);
+
+    if (writable) {
+        index_path(index, ".version", path);
+
+        if ((index->lock_fd = open(path, O_RDONLY | O_DIRECTORY)) < 0
+                || flock(index->lock_fd, LOCK_EX | LOCK_NB) < 0) {
+            goto fail;
+        }
+    }
+
+    if (map_base(index, &index->base, &index->base_size) < 0) {
+        goto fail;
+    }
+
+    if (index->base != NULL) {
+        last_sequence = base_header(index)->last_sequence;
+    }
+
+    index->next_sequence = last_sequence + 1;
+
+    index_path(index, VINDEX_MERGING_NAME, path);
+    recovering = access(path, F_OK) == 0;
+
+    if (replay(index, VINDEX_MERGING_NAME, last_sequence) < 0
+            || replay(index, VINDEX_LOG_NAME, last_sequence) < 0) {
+        goto fail;
+    }
+
+    if (!writable) {
+        return index;
+    }
+
+    index_path(index, VINDEX_LOG_NAME, path);
+
+    /*
+     * Both logs are in the active delta, after merging it nothing is left in
+     * either of them.
+     */
+    if (recovering && (freeze(index) < 0 || merge_frozen(index) < 0)) {
+        goto fail;
+    }
+
+    if ((index->log_fd = open(path, O_WRONLY | O_APPEND | O_CREAT
+                    | (recovering ? O_TRUNC : 0), 0600)) < 0) {
+        goto fail;
+    }
+
+    return index;
+
+fail:
+    HIERONYMUS_ERROR(err_index, "vindex_open");
+    vindex_close(index);
+
+    return NULL;
+}
+
+void vindex_close(vindex *index)
+{
+    if (index == NULL) {
+        return;
+    }
+
+    pool_group_wait(thread_pool_shared(), &index->merges);
+    pool_group_destroy(&index->merges);
+
+    if (index->log_fd >= 0) {
+        close(index->log_fd);
+    }
+
+    if (index->lock_fd >= 0) {
+        close(index->lock_fd);
+    }
+
+    if (index->base != NULL) {
+        munmap((void *) index->base, index->base_size);
+    }
+
+    delta_free(&index->active);
+    delta_free(&index->frozen);
+    pthread_rwlock_destroy(&index->lock);
+    free(index);
+}
+
+/**
+ * Add a version of the file at path (relative to the root directory). Once the
+ * delta is large enough it is merged in the background.
+ */
+int vindex_add(vindex *index, const char *path, const vindex_version *version)
+{
+    size_t path_length = strlen(path);
+    size_t size = sizeof(vindex_log_record) + path_length;
+    vindex_log_record record;
+    unsigned char *buffer = NULL;
+    int start_merge = 0;
+    int return_value = 0;
+
+    if (!index->writable || path_length >= PATH_MAX) {
+        errno = index->writable ? ENAMETOOLONG : EROFS;
+        return HIERONYMUS_ERROR(err_index, "vindex_add");
+    }
+
+    memset(&record, 0, sizeof(record));
+    record.magic = VINDEX_LOG_MAGIC;
+    record.path_length = path_length;
+    record.version = *version;
+
+    buffer = (unsigned char *) checked_malloc(size);
+    memcpy(buffer + sizeof(record), path, path_length);
+
+    pthread_rwlock_wrlock(&index->lock);
+
+    record.sequence = index->next_sequence++;
+    record.checksum = log_checksum(&record, path);
+    memcpy(buffer, &record, sizeof(record));
+
+    if (write_all(index->log_fd, buffer, size) < 0
+            || delta_append(&index->active, record.sequence, path,
+                path_length, version) < 0) {
+        return_value = HIERONYMUS_ERROR(err_index, "vindex_add");
+    }
+
+    if (index->active.num_entries >= VINDEX_MERGE_THRESHOLD
+            && !index->merging) {
+        if (freeze(index) < 0) {
+            HIERONYMUS_ERROR(err_index, "vindex_add");
+        } else {
+            start_merge = 1;
+        }
+    }
+
+    pthread_rwlock_unlock(&index->lock);
+
+    if (start_merge) {
+        thread_pool_submit(thread_pool_shared(), &index->merges, merge_task,
+                index);
+    }
+
+    free(buffer);
+
+    return return_value;
+}
+
+/**
+ * Merge the whole delta into the base now.
+ */
+int vindex_merge(vindex *index)
+{
+    if (!index->writable) {
+        errno = EROFS;
+        return HIERONYMUS_ERROR(err_index, "vindex_merge");
+    }
+
+    pool_group_wait(thread_pool_shared(), &index->merges);
+
+    pthread_rwlock_wrlock(&index->lock);
+
+    if (index->merging || index->active.num_entries == 0) {
+        pthread_rwlock_unlock(&index->lock);
+
+        return index->merging ? HIERONYMUS_ERROR(err_index, "vindex_merge")
+            : 0;
+    }
+
+    if (freeze(index) < 0) {
+        pthread_rwlock_unlock(&index->lock);
+
+        return HIERONYMUS_ERROR(err_index, "vindex_merge");
+    }
+
+    pthread_rwlock_unlock(&index->lock);
+
+    return merge_frozen(index);
+}
+
+/**
+ * Find the file record of a path in the base.
+ */
+static const vindex_file *base_find(const vindex *index, const char *path,
+        uint64_t hash)
+{
+    const vindex_header *header = base_header(index);
+    const vindex_file *files = base_files(index);
+    const char *strings = base_strings(index);
+    uint64_t strings_size = index->base_size - header->strings_offset;
+    uint64_t low = 0;
+    uint64_t high = header->num_files;
+    uint64_t middle = 0;
+
+    while (low < high) {
+        middle = low + (high - low) / 2;
+
+        if (files[middle].hash < hash) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    for (; low < header->num_files && files[low].hash == hash; low++) {
+        if (files[low].path_offset < strings_size
+                && strcmp(strings + files[low].path_offset, path) == 0) {
+            return &files[low];
+        }
+    }
+
+    return NULL;
+}
+
+static int found_append(vindex_version **found, size_t *num_found,
+        size_t *capacity, const vindex_version *version)
+{
+    vindex_version *grown = NULL;
+
+    if (*num_found == *capacity) {
+        *capacity = *capacity == 0 ? 64 : *capacity * 2;
+        grown = (vindex_version *) realloc(*found,
+                *capacity * sizeof(vindex_version));
+
+        if (grown == NULL) {
+            return -1;
+        }
+
+        *found = grown;
+    }
+
+    (*found)[(*num_found)++] = *version;
+
+    return 0;
+}
+
+static int compare_versions(const void *a, const void *b)
+{
+    const vindex_version *left = (const vindex_version *) a;
+    const vindex_version *right = (const vindex_version *) b;
+
+    if (left->id != right->id) {
+        return left->id < right->id ? -1 : 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Copy at most max_versions versions of the file at path (relative to the
+ * root directory), oldest first. Returns the number of versions there are.
+ */
+int vindex_lookup(vindex *index, const char *path, vindex_version *versions,
+        int max_versions)
+{
+    vindex_delta *deltas[2] = { &index->frozen, &index->active };
+    const vindex_version *base_list = NULL;
+    const vindex_file *file = NULL;
+    vindex_version *found = NULL;
+    uint64_t hash = vindex_hash(path);
+    size_t num_found = 0;
+    size_t capacity = 0;
+    size_t num_base = 0;
+    size_t i = 0;
+    int d = 0;
+    int return_value = 0;
+
+    pthread_rwlock_rdlock(&index->lock);
+
+    if (index->base != NULL && (file = base_find(index, path, hash)) != NULL
+            && file->first_version + file->num_versions
+            <= base_header(index)->num_versions) {
+        base_list = base_versions(index) + file->first_version;
+        num_base = file->num_versions;
+    }
+
+    for (i = 0; i < num_base && return_value == 0; i++) {
+        return_value = found_append(&found, &num_found, &capacity,
+                &base_list[i]);
+    }
+
+    for (d = 0; d < 2; d++) {
+        for (i = 0; i < deltas[d]->num_entries && return_value == 0; i++) {
+            if (deltas[d]->entries[i].hash == hash
+                    && strcmp(deltas[d]->entries[i].path, path) == 0) {
+                return_value = found_append(&found, &num_found, &capacity,
+                        &deltas[d]->entries[i].version);
+            }
+        }
+    }
+
+    pthread_rwlock_unlock(&index->lock);
+
+    if (return_value < 0) {
+        free(found);
+
+        return HIERONYMUS_ERROR(err_malloc, "vindex_lookup");
+    }
+
+    if (num_found > num_base) {
+        qsort(found, num_found, sizeof(vindex_version), compare_versions);
+    }
+
+    if (max_versions > 0 && num_found > 0) {
+        memcpy(versions, found, (num_found < (size_t) max_versions ? num_found
+                    : (size_t) max_versions) * sizeof(vindex_version));
+    }
+
+    free(found);
+
+    return num_found;
+}
+
+/*
+ * A version of a file in a subtree, see vindex_walk.
+ */
+typedef struct VINDEX_MATCH {
+    const char *path;
+    vindex_version version;
+} vindex_match;
+
+static int compare_matches(const void *a, const void *b)
+{
+    const vindex_match *left = (const vindex_match *) a;
+    const vindex_match *right = (const vindex_match *) b;
+    int order = strcmp(left->path, right->path);
+
+    if (order != 0) {
+        return order;
+    }
+
+    return compare_versions(&left->version, &right->version);
+}
+
+static int match_append(vindex_match **matches, size_t *num_matches,
+        size_t *capacity, const char *path, const vindex_version *version)
+{
+    vindex_match *grown = NULL;
+
+    if (*num_matches == *capacity) {
+        *capacity = *capacity == 0 ? 256 : *capacity * 2;
+        grown = (vindex_match *) realloc(*matches,
+                *capacity * sizeof(vindex_match));
+
+        if (grown == NULL) {
+            return -1;
+        }
+
+        *matches = grown;
+    }
+
+    (*matches)[*num_matches].path = path;
+    (*matches)[(*num_matches)++].version = *version;
+
+    return 0;
+}
+
+/**
+ * Check whether path is the directory (or file) prefix of length length, or
+ * lies below it. An empty prefix is the root directory.
+ */
+static int in_subtree(const char *path, const char *prefix, size_t length)
+{
+    return length == 0 || (strncmp(path, prefix, length) == 0
+            && (path[length] == '\0' || path[length] == '/'));
+}
+
+/**
+ * Call function for every file in the subtree at path (relative to the root
+ * directory) with its versions, oldest first. The files come in the order of
+ * their paths. The index is locked for reading meanwhile, so function may not
+ * add to it. Stops at the first non-zero value function returns, which is
+ * returned.
+ */
+static int walk_subtree(vindex *index, const char *path,
+        vindex_walk_function function, void *argument)
+{
+    vindex_delta *deltas[2] = { &index->frozen, &index->active };
+    const vindex_header *header = NULL;
+    const vindex_file *files = NULL;
+    const vindex_version *versions = NULL;
+    const char *strings = NULL;
+    vindex_match *matches = NULL;
+    vindex_version *group = NULL;
+    size_t length = strlen(path);
+    size_t num_matches = 0;
+    size_t capacity = 0;
+    size_t first = 0;
+    size_t i = 0;
+    uint64_t f = 0;
+    uint64_t v = 0;
+    int d = 0;
+    int return_value = 0;
+
+    while (length > 0 && path[length - 1] == '/') {
+        length--;
+    }
+
+    pthread_rwlock_rdlock(&index->lock);
+
+    if (index->base != NULL) {
+        header = base_header(index);
+        files = base_files(index);
+        versions = base_versions(index);
+        strings = base_strings(index);
+
+        for (f = 0; f < header->num_files && return_value == 0; f++) {
+            if (files[f].path_offset >= index->base_size
+                    - header->strings_offset
+                    || files[f].first_version + files[f].num_versions
+                    > header->num_versions
+                    || !in_subtree(strings + files[f].path_offset, path,
+                        length)) {
+                continue;
+            }
+
+            for (v = 0; v < files[f].num_versions && return_value == 0; v++) {
+                return_value = match_append(&matches, &num_matches, &capacity,
+                        strings + files[f].path_offset,
+                        &versions[files[f].first_version + v]);
+            }
+        }
+    }
+
+    for (d = 0; d < 2; d++) {
+        for (i = 0; i < deltas[d]->num_entries && return_value == 0; i++) {
+            if (in_subtree(deltas[d]->entries[i].path, path, length)) {
+                return_value = match_append(&matches, &num_matches, &capacity,
+                        deltas[d]->entries[i].path,
+                        &deltas[d]->entries[i].version);
+            }
+        }
+    }
+
+    if (return_value == 0 && num_matches > 0) {
+        qsort(matches, num_matches, sizeof(vindex_match), compare_matches);
+        group = (vindex_version *) malloc(num_matches * sizeof(vindex_version));
+        return_value = group == NULL ? -1 : 0;
+    }
+
+    if (return_value < 0) {
+        pthread_rwlock_unlock(&index->lock);
+        free(matches);
+
+        return HIERONYMUS_ERROR(err_malloc, "vindex_walk");
+    }
+
+    for (i = 0; i <= num_matches && return_value == 0; i++) {
+        if (i > first && (i == num_matches
+                    || strcmp(matches[i].path, matches[first].path) != 0)) {
+            return_value = function(matches[first].path, group,
+                    i - first, argument);
+            first = i;
+        }
+
+        if (i < num_matches) {
+            group[i - first] = matches[i].version;
+        }
+    }
+
+    pthread_rwlock_unlock(&index->lock);
+
+    free(group);
+    free(matches);
+
+    return return_value;
+}
+
+/**
+ * Call function with the versions of the file at path (relative to the root
+ * directory), or with those of every file below path if subtree is set. See
+ * walk_subtree.
+ */
+int vindex_walk(vindex *index, const char *path, int subtree,
+        vindex_walk_function function, void *argument)
+{
+    vindex_version *versions = NULL;
+    int num_versions = 0;
+    int found = 0;
+    int return_value = 0;
+
+    if (subtree) {
+        return walk_subtree(index, path, function, argument);
+    }
+
+    /*
+     * A single file is found with its hash, the versions are copied so the
+     * index is not locked while function runs.
+     */
+    if ((num_versions = vindex_lookup(index, path, NULL, 0)) <= 0) {
+        return num_versions;
+    }
+
+    versions = (vindex_version *) checked_malloc(num_versions
+            * sizeof(vindex_version));
+    found = vindex_lookup(index, path, versions, num_versions);
+
+    /*
+     * Versions added in between are left out.
+     */
+    if (found > 0) {
+        return_value = function(path, versions, found < num_versions ? found
+                : num_versions, argument);
+    }
+
+    free(versions);
+
+    return return_value;
+}
+
+/**
+ * Open the index of the mounted root directory for writing.
+ */
+int vindex_mount(const char *root)
+{
+    if ((mounted = vindex_open(root, 1)) == NULL) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * The index of the mount, NULL if there is none.
+ */
+vindex *vindex_mounted(void)
+{
+    return mounted;
+}
+
+void vindex_unmount(void)
+{
+    vindex_close(mounted);
+    mounted = NULL;
+}
+
+/**
+ * Record a version in the index of the mount, if there is one. The path is
+ * relative to the root directory, an id of 0 means now.
+ */
+void vindex_record(const char *path, int kind, unsigned long long id,
+        unsigned long long size, unsigned long long stored)
+{
+    vindex_version version;
+
+    if (mounted == NULL) {
+        return;
+    }
+
+    version.id = id != 0 ? id : next_version_id();
+    version.size = size;
+    version.stored = stored;
+    version.kind = kind;
+    version.reserved = 0;
+
+    vindex_add(mounted, path, &version);
+}
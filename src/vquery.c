@@ -0,0 +1,610 @@
+/******************************************************************************
+ *
+ * file   : vquery.c
+ *
+ * author : Tim van Deurzen
+ * date   : 18/10/2026
+ *
+ * Queries on the version index (compiled in with -D_VERSION_INDEX): the
+ * versions of a file or of a subtree, in a range of time, with statistics on
+ * their sizes and how much was stored for them, one page at a time.
+ *
+ * A query is text, 'key=value' terms separated by blanks or newlines. A value
+ * with blanks is put in double quotes, in which '\"' and '\\' stand for '"'
+ * and '\'.
+ *
+ *     path=<path>       the file or directory, relative to the root directory
+ *     subtree=0|1       all files below path instead of path itself
+ *     from=<time>       only versions at or after this time
+ *     to=<time>         only versions at or before this time
+ *     kinds=<k>,...     only versions of these kinds (see vindex_kind_name)
+ *     offset=<n>        skip the first n versions
+ *     limit=<n>         list at most n versions, 0 lists all
+ *     format=json|text
+ *
+ * Times are seconds since the epoch, version ids, 'YYYY-MM-DD' or
+ * 'YYYY-MM-DDTHH:MM:SS' (local time). Versions are listed by path, then by
+ * id. Version ids are creation times in nanoseconds, so a range of time is a
+ * range of ids, found with a binary search in the versions of each file.
+ *
+ * The same queries are answered by h_vtool and by the control file
+ * '/.hieronymus/versions' of a mount.
+ *
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+
+#include "vquery.h"
+#include "vindex.h"
+#include "error.h"
+#include "util.h"
+
+/*
+ * State of a query while the index is walked, matched counts the versions
+ * that matched so far.
+ */
+typedef struct VQUERY_WALK {
+    const vquery *query;
+    vquery_result *result;
+    unsigned long long matched;
+} vquery_walk;
+
+void vquery_init(vquery *query)
+{
+    memset(query, 0, sizeof(vquery));
+    snprintf(query->path, PATH_MAX, "/");
+    query->limit = VQUERY_DEFAULT_LIMIT;
+    query->format = vquery_json;
+}
+
+static int parse_number(const char *text, unsigned long long *number)
+{
+    char *end = NULL;
+
+    if (!isdigit((unsigned char) *text)) {
+        return -1;
+    }
+
+    errno = 0;
+    *number = strtoull(text, &end, 10);
+
+    return errno != 0 || *end != '\0' ? -1 : 0;
+}
+
+/**
+ * Parse a time into a version id. An upper bound is the last id of the second
+ * (or day) given.
+ */
+int vquery_parse_time(const char *text, int upper, unsigned long long *id)
+{
+    static const char *formats[] = {
+        "%Y-%m-%dT%H:%M:%S", "%Y-%m-%d %H:%M:%S", "%Y-%m-%d"
+    };
+    unsigned long long seconds = 0;
+    unsigned long long span = 1;
+    struct tm broken_down;
+    const char *end = NULL;
+    time_t local = 0;
+    size_t i = 0;
+
+    if (parse_number(text, &seconds) == 0) {
+        if (strlen(text) > VQUERY_MAX_SECONDS_DIGITS) {
+            *id = seconds;
+
+            return 0;
+        }
+    } else {
+        for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+            memset(&broken_down, 0, sizeof(broken_down));
+            end = strptime(text, formats[i], &broken_down);
+
+            if (end != NULL && *end == '\0') {
+                break;
+            }
+        }
+
+        if (i == sizeof(formats) / sizeof(formats[0])) {
+            errno = EINVAL;
+
+            return -1;
+        }
+
+        broken_down.tm_isdst = -1;
+
+        if ((local = mktime(&broken_down)) < 0) {
+            errno = EINVAL;
+
+            return -1;
+        }
+
+        seconds = local;
+        span = i == 2 ? 24 * 60 * 60 : 1;
+    }
+
+    *id = seconds * 1000000000ULL + (upper ? span * 1000000000ULL - 1 : 0);
+
+    return 0;
+}
+
+static int parse_kinds(const char *text, unsigned int *kinds)
+{
+    const char *name = text;
+    size_t length = 0;
+    int kind = 0;
+
+    *kinds = 0;
+
+    while (*name != '\0') {
+        length = strcspn(name, ",");
+
+        for (kind = 1; kind < num_vindex_kinds; kind++) {
+            if (strlen(vindex_kind_name(kind)) == length
+                    && strncmp(vindex_kind_name(kind), name, length) == 0) {
+                break;
+            }
+        }
+
+        if (kind == num_vindex_kinds) {
+            return -1;
+        }
+
+        *kinds |= 1U << kind;
+        name += length + (name[length] == ',');
+    }
+
+    return 0;
+}
+
+static int parse_term(vquery *query, const char *key, size_t key_length,
+        const char *value)
+{
+    unsigned long long number = 0;
+
+#define KEY(name) (key_length == strlen(name) \
+        && strncmp(key, name, key_length) == 0)
+
+    if (KEY("path")) {
+        if (snprintf(query->path, PATH_MAX, "%s%s", value[0] == '/' ? "" : "/",
+                    value) >= PATH_MAX) {
+            return -1;
+        }
+    } else if (KEY("subtree")) {
+        if (parse_number(value, &number) < 0) {
+            return -1;
+        }
+
+        query->subtree = number != 0;
+    } else if (KEY("from")) {
+        return vquery_parse_time(value, 0, &query->from);
+    } else if (KEY("to")) {
+        return vquery_parse_time(value, 1, &query->to);
+    } else if (KEY("kinds")) {
+        return parse_kinds(value, &query->kinds);
+    } else if (KEY("offset")) {
+        return parse_number(value, &query->offset);
+    } else if (KEY("limit")) {
+        return parse_number(value, &query->limit);
+    } else if (KEY("format")) {
+        if (strcmp(value, "json") == 0) {
+            query->format = vquery_json;
+        } else if (strcmp(value, "text") == 0) {
+            query->format = vquery_text;
+        } else {
+            return -1;
+        }
+    } else {
+        return -1;
+    }
+
+#undef KEY
+
+    return 0;
+}
+
+/**
+ * Copy the value of a term into value, returns the length of the value in the
+ * query or -1 if it is too long or an opening quote is not closed.
+ */
+static int parse_value(const char *text, char *value)
+{
+    size_t length = 0;
+    size_t i = 0;
+
+    if (text[0] != '"') {
+        length = strcspn(text, " \t\r\n");
+
+        if (length >= PATH_MAX) {
+            return -1;
+        }
+
+        memcpy(value, text, length);
+        value[length] = '\0';
+
+        return length;
+    }
+
+    for (i = 1; text[i] != '"'; i++) {
+        if (text[i] == '\\' && (text[i + 1] == '"' || text[i + 1] == '\\')) {
+            i++;
+        }
+
+        if (text[i] == '\0' || length + 1 >= PATH_MAX) {
+            return -1;
+        }
+
+        value[length++] = text[i];
+    }
+
+    value[length] = '\0';
+
+    return i + 1;
+}
+
+/**
+ * Parse the terms of a query into query, on top of what it holds. Fails (with
+ * EINVAL) on the first term that is not understood.
+ */
+int vquery_parse(vquery *query, const char *text)
+{
+    char value[PATH_MAX];
+    const char *term = text;
+    const char *equals = NULL;
+    int length = 0;
+
+    while (*term != '\0') {
+        term += strspn(term, " \t\r\n");
+
+        if (*term == '\0') {
+            break;
+        }
+
+        if ((equals = strchr(term, '=')) == NULL
+                || (size_t) (equals - term) > strcspn(term, " \t\r\n")
+                || (length = parse_value(equals + 1, value)) < 0
+                || parse_term(query, term, equals - term, value) < 0) {
+            errno = EINVAL;
+
+            return -1;
+        }
+
+        term = equals + 1 + length;
+    }
+
+    return 0;
+}
+
+static void account(vquery_statistics *statistics,
+        const vindex_version *version, long long delta)
+{
+    if (statistics->versions == 0 || version->id < statistics->first_id) {
+        statistics->first_id = version->id;
+    }
+
+    if (version->id > statistics->last_id) {
+        statistics->last_id = version->id;
+    }
+
+    if (statistics->versions == 0 || version->size < statistics->min_size) {
+        statistics->min_size = version->size;
+    }
+
+    if (version->size > statistics->max_size) {
+        statistics->max_size = version->size;
+    }
+
+    statistics->versions++;
+    statistics->total_size += version->size;
+    statistics->growth += delta;
+
+    if (version->kind == vindex_snapshot) {
+        statistics->snapshots++;
+        statistics->snapshot_bytes += version->stored;
+    } else if (version->kind == vindex_patch) {
+        statistics->patches++;
+        statistics->patch_bytes += version->stored;
+        statistics->patched_bytes += version->size;
+    } else {
+        statistics->events++;
+    }
+}
+
+static int entry_append(vquery_result *result, const char *path,
+        const vindex_version *version, long long delta)
+{
+    vquery_entry *grown = NULL;
+    vquery_entry *entry = NULL;
+
+    if (result->num_entries == result->capacity) {
+        result->capacity = result->capacity == 0 ? 64 : result->capacity * 2;
+        grown = (vquery_entry *) realloc(result->entries,
+                result->capacity * sizeof(vquery_entry));
+
+        if (grown == NULL) {
+            return -1;
+        }
+
+        result->entries = grown;
+    }
+
+    entry = &result->entries[result->num_entries];
+
+    if ((entry->path = strdup(path)) == NULL) {
+        return -1;
+    }
+
+    entry->version = *version;
+    entry->delta = delta;
+    result->num_entries++;
+
+    return 0;
+}
+
+/**
+ * Account for and list the versions of a file that match the query. The
+ * versions are sorted by id, the first one in range is found with a binary
+ * search.
+ */
+static int collect(const char *path, const vindex_version *versions,
+        int num_versions, void *argument)
+{
+    vquery_walk *walk = (vquery_walk *) argument;
+    const vquery *query = walk->query;
+    int low = 0;
+    int high = num_versions;
+    int middle = 0;
+    int found = 0;
+    long long delta = 0;
+
+    while (low < high) {
+        middle = low + (high - low) / 2;
+
+        if (versions[middle].id < query->from) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    for (; low < num_versions && (query->to == 0
+                || versions[low].id <= query->to); low++) {
+        if (query->kinds != 0
+                && (query->kinds & (1U << versions[low].kind)) == 0) {
+            continue;
+        }
+
+        delta = (long long) versions[low].size
+            - (low > 0 ? (long long) versions[low - 1].size : 0);
+        account(&walk->result->statistics, &versions[low], delta);
+        found = 1;
+
+        if (walk->matched >= query->offset && (query->limit == 0
+                    || walk->matched - query->offset < query->limit)
+                && entry_append(walk->result, path, &versions[low],
+                    delta) < 0) {
+            return -1;
+        }
+
+        walk->matched++;
+    }
+
+    walk->result->statistics.files += found;
+
+    return 0;
+}
+
+/**
+ * The root directory is always a subtree.
+ */
+static int subtree(const vquery *query)
+{
+    return query->subtree || strcmp(query->path, "/") == 0;
+}
+
+/**
+ * Answer a query. The result holds the listed versions and the statistics of
+ * all versions matched, free it with vquery_free.
+ */
+int vquery_run(vindex *index, const vquery *query, vquery_result *result)
+{
+    vquery_walk walk;
+    struct timespec start;
+    struct timespec end;
+    int return_value = 0;
+
+    memset(result, 0, sizeof(vquery_result));
+    walk.query = query;
+    walk.result = result;
+    walk.matched = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    return_value = vindex_walk(index, query->path, subtree(query), collect,
+            &walk);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    result->seconds = (end.tv_sec - start.tv_sec)
+        + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    if (return_value < 0) {
+        vquery_free(result);
+
+        return HIERONYMUS_ERROR(err_malloc, "vquery_run");
+    }
+
+    return 0;
+}
+
+void vquery_free(vquery_result *result)
+{
+    size_t i = 0;
+
+    for (i = 0; i < result->num_entries; i++) {
+        free(result->entries[i].path);
+    }
+
+    free(result->entries);
+    memset(result, 0, sizeof(vquery_result));
+}
+
+/**
+ * Format the time of a version id, e.g. '2026-10-18T12:00:00.000000001'.
+ */
+static char *format_time(unsigned long long id, char *buffer, size_t size)
+{
+    time_t seconds = id / 1000000000ULL;
+    struct tm broken_down;
+    size_t length = 0;
+
+    if (localtime_r(&seconds, &broken_down) == NULL) {
+        snprintf(buffer, size, "-");
+        return buffer;
+    }
+
+    length = strftime(buffer, size, "%Y-%m-%dT%H:%M:%S", &broken_down);
+    snprintf(buffer + length, size - length, ".%09llu", id % 1000000000ULL);
+
+    return buffer;
+}
+
+static void print_string(const char *string, FILE *output)
+{
+    fputc('"', output);
+
+    for (; *string != '\0'; string++) {
+        if (*string == '"' || *string == '\\') {
+            fprintf(output, "\\%c", *string);
+        } else if ((unsigned char) *string < 0x20) {
+            fprintf(output, "\\u%04x", (unsigned char) *string);
+        } else {
+            fputc(*string, output);
+        }
+    }
+
+    fputc('"', output);
+}
+
+static double ratio(unsigned long long part, unsigned long long whole)
+{
+    return whole == 0 ? 0.0 : (double) part / whole;
+}
+
+static void print_json(const vquery *query, const vquery_result *result,
+        FILE *output)
+{
+    const vquery_statistics *statistics = &result->statistics;
+    char time_buffer[64];
+    size_t i = 0;
+
+    fprintf(output, "{\n    \"path\": ");
+    print_string(query->path, output);
+    fprintf(output, ",\n    \"subtree\": %s,\n", subtree(query) ? "true"
+            : "false");
+    fprintf(output, "    \"from\": \"%020llu\",\n", query->from);
+    fprintf(output, "    \"to\": \"%020llu\",\n", query->to);
+    fprintf(output, "    \"offset\": %llu,\n", query->offset);
+    fprintf(output, "    \"limit\": %llu,\n", query->limit);
+    fprintf(output, "    \"total\": %llu,\n", statistics->versions);
+
+    if (query->offset + result->num_entries < statistics->versions) {
+        fprintf(output, "    \"next_offset\": %llu,\n",
+                (unsigned long long) (query->offset + result->num_entries));
+    } else {
+        fprintf(output, "    \"next_offset\": null,\n");
+    }
+
+    fprintf(output, "    \"milliseconds\": %.3f,\n", result->seconds * 1e3);
+    fprintf(output, "    \"statistics\": {\n");
+    fprintf(output, "        \"files\": %llu,\n", statistics->files);
+    fprintf(output, "        \"snapshots\": %llu,\n", statistics->snapshots);
+    fprintf(output, "        \"patches\": %llu,\n", statistics->patches);
+    fprintf(output, "        \"events\": %llu,\n", statistics->events);
+    fprintf(output, "        \"first_id\": \"%020llu\",\n",
+            statistics->first_id);
+    fprintf(output, "        \"last_id\": \"%020llu\",\n", statistics->last_id);
+    fprintf(output, "        \"min_size\": %llu,\n", statistics->min_size);
+    fprintf(output, "        \"max_size\": %llu,\n", statistics->max_size);
+    fprintf(output, "        \"mean_size\": %.1f,\n",
+            ratio(statistics->total_size, statistics->versions));
+    fprintf(output, "        \"growth\": %lld,\n", statistics->growth);
+    fprintf(output, "        \"snapshot_bytes\": %llu,\n",
+            statistics->snapshot_bytes);
+    fprintf(output, "        \"patch_bytes\": %llu,\n",
+            statistics->patch_bytes);
+    fprintf(output, "        \"delta_ratio\": %.4f\n",
+            ratio(statistics->patch_bytes, statistics->patched_bytes));
+    fprintf(output, "    },\n    \"versions\": [\n");
+
+    for (i = 0; i < result->num_entries; i++) {
+        fprintf(output, "        { \"path\": ");
+        print_string(result->entries[i].path, output);
+        fprintf(output, ", \"id\": \"%020llu\", \"time\": \"%s\", "
+                "\"kind\": \"%s\", \"size\": %llu, \"stored\": %llu, "
+                "\"delta\": %lld }%s\n",
+                (unsigned long long) result->entries[i].version.id,
+                format_time(result->entries[i].version.id, time_buffer,
+                    sizeof(time_buffer)),
+                vindex_kind_name(result->entries[i].version.kind),
+                (unsigned long long) result->entries[i].version.size,
+                (unsigned long long) result->entries[i].version.stored,
+                result->entries[i].delta,
+                i + 1 < result->num_entries ? "," : "");
+    }
+
+    fprintf(output, "    ]\n}\n");
+}
+
+static void print_text(const vquery *query, const vquery_result *result,
+        FILE *output)
+{
+    const vquery_statistics *statistics = &result->statistics;
+    char time_buffer[64];
+    size_t i = 0;
+
+    for (i = 0; i < result->num_entries; i++) {
+        fprintf(output, "%020llu  %s  %-11s %12llu %12llu %+12lld  %s\n",
+                (unsigned long long) result->entries[i].version.id,
+                format_time(result->entries[i].version.id, time_buffer,
+                    sizeof(time_buffer)),
+                vindex_kind_name(result->entries[i].version.kind),
+                (unsigned long long) result->entries[i].version.size,
+                (unsigned long long) result->entries[i].version.stored,
+                result->entries[i].delta, result->entries[i].path);
+    }
+
+    fprintf(output, "# %llu-%llu of %llu versions of %llu files "
+            "(%.3f ms)\n", result->num_entries > 0 ? query->offset + 1 : 0,
+            (unsigned long long) (query->offset + result->num_entries),
+            statistics->versions, statistics->files, result->seconds * 1e3);
+    fprintf(output, "# %llu snapshots (%llu bytes), %llu patches "
+            "(%llu bytes, delta ratio %.4f), %llu events\n",
+            statistics->snapshots, statistics->snapshot_bytes,
+            statistics->patches, statistics->patch_bytes,
+            ratio(statistics->patch_bytes, statistics->patched_bytes),
+            statistics->events);
+    fprintf(output, "# size %llu-%llu (mean %.1f), growth %+lld bytes\n",
+            statistics->min_size, statistics->max_size,
+            ratio(statistics->total_size, statistics->versions),
+            statistics->growth);
+}
+
+/**
+ * Print the result of a query in the format it asks for.
+ */
+int vquery_print(const vquery *query, const vquery_result *result,
+        FILE *output)
+{
+    if (query->format == vquery_text) {
+        print_text(query, result, output);
+    } else {
+        print_json(query, result, output);
+    }
+
+    return ferror(output) ? -1 : 0;
+}
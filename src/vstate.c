@@ -0,0 +1,533 @@
+/******************************************************************************
+ *
+ * file   : vstate.c
+ *
+ * author : Tim van Deurzen
+ * date   : 18/10/2026
+ *
+ * In-memory state of the versioning of a mount, shared by the threads that
+ * write files.
+ *
+ * Creating a version used to find the latest snapshot directory and the number
+ * of versions of the file in it by reading directories, with nothing to keep
+ * two writers apart: two writers of one file could both make its snapshot
+ * copy, or patch against a copy that was still being made, and two writers in
+ * one directory could both start a new snapshot.
+ *
+ * Instead, a writer locks the entry of its file for the whole version, so
+ * writers of one file take turns and writers of different files do not wait
+ * for each other. The latest snapshot of each '.version' directory is kept in
+ * a second table. It is only read from disk the first time, and replaced under
+ * the lock of the directory, so one snapshot is started when it is full no
+ * matter how many writers find that out. The number of versions of a file in
+ * the latest snapshot is counted along with the versions that are made.
+ *
+ * A snapshot that is replaced is sealed (its copies compressed or packed, see
+ * versioning.c), which changes or removes the files writers of other files
+ * may still be reading: they found it to be the latest snapshot just before.
+ * So the writers that use each snapshot are counted, and a replaced snapshot
+ * is only sealed once the last of them unlocks its file.
+ *
+ * Both tables are hash tables with striped locks, the stripes are only held to
+ * find or insert an entry. Renaming or removing a directory can move versions
+ * out from under the cached state, it invalidates all of it (vstate_invalidate)
+ * by advancing a generation; an entry of an older generation is read from disk
+ * again when it is used.
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "vstate.h"
+#include "config.h"
+#include "util.h"
+#include "error.h"
+
+static struct {
+    vstate_directory *directories[VSTATE_BUCKETS];
+    vstate_file *files[VSTATE_BUCKETS];
+    pthread_mutex_t locks[VSTATE_STRIPES];
+    volatile unsigned long generation;
+    unsigned long num_files;
+} vstate;
+
+static pthread_once_t vstate_once = PTHREAD_ONCE_INIT;
+
+static void init_vstate(void)
+{
+    int i = 0;
+
+    for (i = 0; i < VSTATE_STRIPES; i++) {
+        pthread_mutex_init(&vstate.locks[i], NULL);
+    }
+
+    vstate.generation = 1;
+}
+
+/**
+ * Hash a path (32-bit FNV-1a).
+ */
+static unsigned int vstate_hash(const char *path)
+{
+    unsigned int hash = 2166136261U;
+
+    while (*path != '\0') {
+        hash = (hash ^ (unsigned char) *path++) * 16777619U;
+    }
+
+    return hash;
+}
+
+static pthread_mutex_t *vstate_lock(unsigned int hash)
+{
+    return &vstate.locks[hash & (VSTATE_STRIPES - 1)];
+}
+
+static char *copy_path(const char *path)
+{
+    char *copy = (char *) checked_malloc(strlen(path) + 1);
+
+    strcpy(copy, path);
+
+    return copy;
+}
+
+/**
+ * Return the name of a snapshot directory (its last component).
+ */
+static const char *snapshot_name(const char *snapshot_directory)
+{
+    const char *slash = strrchr(snapshot_directory, '/');
+
+    return slash == NULL ? snapshot_directory : slash + 1;
+}
+
+/**
+ * Find the entry of a '.version' directory, adding it if there is none.
+ * Directory entries stay until the state is destroyed.
+ */
+static vstate_directory *find_directory(const char *path)
+{
+    unsigned int hash = vstate_hash(path);
+    vstate_directory **bucket = &vstate.directories[hash % VSTATE_BUCKETS];
+    vstate_directory *directory = NULL;
+
+    pthread_once(&vstate_once, init_vstate);
+    pthread_mutex_lock(vstate_lock(hash));
+
+    for (directory = *bucket; directory != NULL; directory = directory->next) {
+        if (directory->hash == hash && strcmp(directory->path, path) == 0) {
+            break;
+        }
+    }
+
+    if (directory == NULL) {
+        directory = (vstate_directory *) checked_malloc(sizeof(*directory));
+        directory->path = copy_path(path);
+        directory->hash = hash;
+        directory->generation = 0;
+        directory->latest[0] = '\0';
+        directory->snapshots = NULL;
+        pthread_mutex_init(&directory->lock, NULL);
+        directory->next = *bucket;
+        *bucket = directory;
+    }
+
+    pthread_mutex_unlock(vstate_lock(hash));
+
+    return directory;
+}
+
+/**
+ * Make sure the latest snapshot of a directory is known, called with the lock
+ * of the directory held. The first snapshot is made if there is none.
+ */
+static int refresh_directory_locked(vstate_directory *directory)
+{
+    char snapshot_directory[PATH_MAX];
+    unsigned long generation = vstate.generation;
+
+    if (directory->generation == generation && directory->latest[0] != '\0') {
+        return 0;
+    }
+
+    if (find_latest_snapshot(directory->path, snapshot_directory) < 0) {
+        directory->latest[0] = '\0';
+        return -1;
+    }
+
+    strncpy(directory->latest, snapshot_name(snapshot_directory),
+            MAX_SNAPSHOT_LENGTH - 1);
+    directory->latest[MAX_SNAPSHOT_LENGTH - 1] = '\0';
+    directory->generation = generation;
+
+    return 0;
+}
+
+/**
+ * Let the writer of a locked file use a snapshot of a directory, called with
+ * the lock of the directory held.
+ */
+static void use_snapshot_locked(vstate_directory *directory,
+        vstate_file *file, const char *name)
+{
+    vstate_snapshot *snapshot = directory->snapshots;
+
+    while (snapshot != NULL && strcmp(snapshot->name, name) != 0) {
+        snapshot = snapshot->next;
+    }
+
+    if (snapshot == NULL) {
+        snapshot = (vstate_snapshot *) checked_malloc(sizeof(*snapshot));
+        strncpy(snapshot->name, name, MAX_SNAPSHOT_LENGTH - 1);
+        snapshot->name[MAX_SNAPSHOT_LENGTH - 1] = '\0';
+        snapshot->users = 0;
+        snapshot->seal = NULL;
+        snapshot->next = directory->snapshots;
+        directory->snapshots = snapshot;
+    }
+
+    snapshot->users++;
+    file->directory = directory;
+    file->used = snapshot;
+}
+
+/**
+ * The writer of a locked file is done with its snapshot, called with the lock
+ * of its directory held. If it was the last writer to use a replaced snapshot,
+ * the snapshot is sealed now.
+ */
+static void leave_snapshot_locked(vstate_file *file)
+{
+    vstate_directory *directory = file->directory;
+    vstate_snapshot *snapshot = file->used;
+    vstate_snapshot **link = NULL;
+    char path[PATH_MAX];
+
+    file->directory = NULL;
+    file->used = NULL;
+
+    if (--snapshot->users > 0) {
+        return;
+    }
+
+    if (snapshot->seal != NULL) {
+        snprintf(path, PATH_MAX, "%s/%s", directory->path, snapshot->name);
+        snapshot->seal(path);
+    }
+
+    for (link = &directory->snapshots; *link != snapshot;
+            link = &(*link)->next);
+
+    *link = snapshot->next;
+    free(snapshot);
+}
+
+/**
+ * Let the writer of a locked file use the latest snapshot of its directory
+ * instead of the one it used, called with the lock of the directory held.
+ */
+static void switch_snapshot_locked(vstate_directory *directory,
+        vstate_file *file)
+{
+    if (file->used != NULL) {
+        leave_snapshot_locked(file);
+    }
+
+    if (directory->latest[0] != '\0') {
+        use_snapshot_locked(directory, file, directory->latest);
+    }
+}
+
+/**
+ * Take the entry of a file in the root directory and lock it, waiting for any
+ * other writer of the file.
+ */
+vstate_file *vstate_lock_file(const char *path)
+{
+    unsigned int hash = vstate_hash(path);
+    vstate_file **bucket = &vstate.files[hash % VSTATE_BUCKETS];
+    vstate_file *file = NULL;
+
+    pthread_once(&vstate_once, init_vstate);
+    pthread_mutex_lock(vstate_lock(hash));
+
+    for (file = *bucket; file != NULL; file = file->next) {
+        if (file->hash == hash && strcmp(file->path, path) == 0) {
+            break;
+        }
+    }
+
+    if (file == NULL) {
+        file = (vstate_file *) checked_malloc(sizeof(*file));
+        file->path = copy_path(path);
+        file->hash = hash;
+        file->references = 0;
+        file->generation = 0;
+        file->snapshot = 0;
+        file->num_versions = -1;
+        file->directory = NULL;
+        file->used = NULL;
+        pthread_mutex_init(&file->lock, NULL);
+        file->next = *bucket;
+        *bucket = file;
+        __sync_fetch_and_add(&vstate.num_files, 1);
+    }
+
+    file->references++;
+
+    pthread_mutex_unlock(vstate_lock(hash));
+
+    pthread_mutex_lock(&file->lock);
+    file->locked_generation = vstate.generation;
+
+    return file;
+}
+
+/**
+ * Unlock the entry of a file. It is dropped if nobody else is waiting for it
+ * and there are too many files in the table.
+ */
+void vstate_unlock_file(vstate_file *file)
+{
+    vstate_directory *directory = file->directory;
+    vstate_file **link = NULL;
+    int drop = 0;
+
+    if (directory != NULL) {
+        pthread_mutex_lock(&directory->lock);
+        leave_snapshot_locked(file);
+        pthread_mutex_unlock(&directory->lock);
+    }
+
+    pthread_mutex_unlock(&file->lock);
+    pthread_mutex_lock(vstate_lock(file->hash));
+
+    if (--file->references == 0 && vstate.num_files 
+            > config_get()->vstate_max_files) {
+        for (link = &vstate.files[file->hash % VSTATE_BUCKETS]; *link != file;
+                link = &(*link)->next);
+
+        *link = file->next;
+        __sync_fetch_and_sub(&vstate.num_files, 1);
+        drop = 1;
+    }
+
+    pthread_mutex_unlock(vstate_lock(file->hash));
+
+    if (drop) {
+        pthread_mutex_destroy(&file->lock);
+        free(file->path);
+        free(file);
+    }
+}
+
+/**
+ * Copy the path of the latest snapshot directory of a '.version' directory to
+ * snapshot_directory, like find_latest_snapshot (which it calls only the first
+ * time). The writer of the locked file uses it until it unlocks the file.
+ */
+int vstate_latest_snapshot(vstate_file *file, const char *version_directory,
+        char *snapshot_directory)
+{
+    vstate_directory *directory = find_directory(version_directory);
+    int return_value = 0;
+
+    pthread_mutex_lock(&directory->lock);
+
+    if ((return_value = refresh_directory_locked(directory)) == 0) {
+        sprintf(snapshot_directory, "%s/%s", version_directory,
+                directory->latest);
+        use_snapshot_locked(directory, file, directory->latest);
+    }
+
+    pthread_mutex_unlock(&directory->lock);
+
+    return return_value;
+}
+
+/**
+ * Copy the path of the latest snapshot directory of a '.version' directory to
+ * snapshot_directory, like vstate_latest_snapshot but without a file that uses
+ * it (block-level versioning does not seal snapshots).
+ */
+int vstate_current_snapshot(const char *version_directory,
+        char *snapshot_directory)
+{
+    vstate_directory *directory = find_directory(version_directory);
+    int return_value = 0;
+
+    pthread_mutex_lock(&directory->lock);
+
+    if ((return_value = refresh_directory_locked(directory)) == 0) {
+        sprintf(snapshot_directory, "%s/%s", version_directory,
+                directory->latest);
+    }
+
+    pthread_mutex_unlock(&directory->lock);
+
+    return return_value;
+}
+
+/**
+ * Start a new snapshot in a '.version' directory if 'current' is still its
+ * latest snapshot. The path of the latest snapshot is copied to
+ * snapshot_directory, returns 1 if it was made by this call.
+ */
+int vstate_close_snapshot(const char *version_directory, const char *current,
+        char *snapshot_directory)
+{
+    vstate_directory *directory = find_directory(version_directory);
+    int return_value = 0;
+
+    pthread_mutex_lock(&directory->lock);
+
+    if (refresh_directory_locked(directory) == 0
+            && strcmp(directory->latest, snapshot_name(current)) != 0) {
+        sprintf(snapshot_directory, "%s/%s", version_directory,
+                directory->latest);
+    } else if (make_snapshot_directory(version_directory, 
+                snapshot_directory) < 0) {
+        return_value = HIERONYMUS_ERROR(err_snapshot, 
+                "vstate_close_snapshot");
+        directory->latest[0] = '\0';
+    } else {
+        strncpy(directory->latest, snapshot_name(snapshot_directory),
+                MAX_SNAPSHOT_LENGTH - 1);
+        directory->latest[MAX_SNAPSHOT_LENGTH - 1] = '\0';
+        directory->generation = vstate.generation;
+        return_value = 1;
+    }
+
+    pthread_mutex_unlock(&directory->lock);
+
+    return return_value;
+}
+
+/**
+ * Start a new snapshot in a '.version' directory because 'current' (the
+ * snapshot the writer of the locked file uses) is full. If another writer
+ * already did, its snapshot is used. Otherwise a new snapshot is made, and
+ * 'current' is sealed (if seal is not NULL) once no writer uses it any more.
+ * The path of the snapshot to use is copied to snapshot_directory (which may
+ * be 'current'), returns 1 if it was made by this call.
+ */
+int vstate_next_snapshot(vstate_file *file, const char *version_directory,
+        const char *current, char *snapshot_directory,
+        vstate_seal_function seal)
+{
+    vstate_directory *directory = find_directory(version_directory);
+    int return_value = 0;
+
+    pthread_mutex_lock(&directory->lock);
+
+    if (refresh_directory_locked(directory) == 0
+            && strcmp(directory->latest, snapshot_name(current)) != 0) {
+        sprintf(snapshot_directory, "%s/%s", version_directory,
+                directory->latest);
+        switch_snapshot_locked(directory, file);
+        pthread_mutex_unlock(&directory->lock);
+
+        return 0;
+    }
+
+    if (file->used != NULL
+            && strcmp(file->used->name, snapshot_name(current)) == 0) {
+        file->used->seal = seal;
+    } else if (seal != NULL) {
+        seal(current);
+    }
+
+    if (make_snapshot_directory(version_directory, snapshot_directory) < 0) {
+        return_value = HIERONYMUS_ERROR(err_snapshot, "vstate_next_snapshot");
+        directory->latest[0] = '\0';
+    } else {
+        strncpy(directory->latest, snapshot_name(snapshot_directory),
+                MAX_SNAPSHOT_LENGTH - 1);
+        directory->latest[MAX_SNAPSHOT_LENGTH - 1] = '\0';
+        directory->generation = vstate.generation;
+        return_value = 1;
+    }
+
+    switch_snapshot_locked(directory, file);
+    pthread_mutex_unlock(&directory->lock);
+
+    return return_value;
+}
+
+/**
+ * Return the number of versions of a locked file in a snapshot directory, see
+ * find_snapshot_version (which it calls if the number is not known).
+ */
+int vstate_num_versions(vstate_file *file, const char *snapshot_directory,
+        const char *filename)
+{
+    unsigned long long snapshot = strtoull(snapshot_name(snapshot_directory),
+            NULL, 10);
+
+    if (file->generation != file->locked_generation
+            || file->snapshot != snapshot) {
+        file->num_versions = find_snapshot_version(snapshot_directory,
+                filename);
+        file->snapshot = snapshot;
+        file->generation = file->locked_generation;
+    }
+
+    return file->num_versions;
+}
+
+/**
+ * Record that a locked file, which had num_versions versions in a snapshot
+ * directory, got another one there.
+ */
+void vstate_add_version(vstate_file *file, const char *snapshot_directory,
+        int num_versions)
+{
+    file->snapshot = strtoull(snapshot_name(snapshot_directory), NULL, 10);
+    file->num_versions = num_versions + 1;
+    file->generation = file->locked_generation;
+}
+
+/**
+ * Forget all cached state, versions may have moved.
+ */
+void vstate_invalidate(void)
+{
+    __sync_fetch_and_add(&vstate.generation, 1);
+}
+
+void vstate_destroy(void)
+{
+    vstate_directory *directory = NULL;
+    vstate_snapshot *snapshot = NULL;
+    vstate_file *file = NULL;
+    int i = 0;
+
+    for (i = 0; i < VSTATE_BUCKETS; i++) {
+        while ((directory = vstate.directories[i]) != NULL) {
+            vstate.directories[i] = directory->next;
+
+            while ((snapshot = directory->snapshots) != NULL) {
+                directory->snapshots = snapshot->next;
+                free(snapshot);
+            }
+
+            pthread_mutex_destroy(&directory->lock);
+            free(directory->path);
+            free(directory);
+        }
+
+        while ((file = vstate.files[i]) != NULL) {
+            vstate.files[i] = file->next;
+            pthread_mutex_destroy(&file->lock);
+            free(file->path);
+            free(file);
+        }
+    }
+
+    vstate.num_files = 0;
+}
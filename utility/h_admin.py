@@ -11,6 +11,7 @@ import os
 import sys
 import time
 import re
+import subprocess
 from datetime import datetime
 from operator import itemgetter
 from optparse import OptionParser
@@ -28,6 +29,49 @@ parser.add_option(
         default=False
         )
 
+parser.add_option(
+        "--from", 
+        help="With --list, only versions from this date in dd-mm-YYYY[ hh.mm.ss] format.", 
+        dest="list_from", 
+        default=None
+        )
+
+parser.add_option(
+        "--to", 
+        help="With --list, only versions up to this date in dd-mm-YYYY[ hh.mm.ss] format.", 
+        dest="list_to", 
+        default=None
+        )
+
+parser.add_option(
+        "--kinds", 
+        help="With --list, only versions of these kinds (e.g. snapshot,patch).", 
+        dest="kinds", 
+        default=None
+        )
+
+parser.add_option(
+        "--offset", 
+        help="With --list, skip this many versions.", 
+        dest="offset", 
+        default="0"
+        )
+
+parser.add_option(
+        "--limit", 
+        help="With --list, list at most this many versions (0 lists all).", 
+        dest="limit", 
+        default="100"
+        )
+
+parser.add_option(
+        "--json", 
+        help="With --list, print the listing as JSON.", 
+        dest="json", 
+        action="store_true",
+        default=False
+        )
+
 parser.add_option(
         "-r", 
         "--restore", 
@@ -61,9 +105,87 @@ parser.add_option(
         default=False
         )
 
+parser.add_option(
+        "--native", 
+        help="Use h_vtool for restoring files. NOTE: only use this if hieronymus was compiled with -D_NATIVE_DELTA!", 
+        dest="native", 
+        action="store_true",
+        default=False
+        )
+
+parser.add_option(
+        "--blocks", 
+        help="Restore from block-level versions. NOTE: only use this if hieronymus was compiled with -D_BLOCK_VERSIONING!", 
+        dest="blocks", 
+        action="store_true",
+        default=False
+        )
+
 ### Functions ###
 
-def restore(path, date, time, using_xdelta = False):
+# The version index of a root directory (-D_VERSION_INDEX) is kept in its
+# '.version' directory, see include/vindex.h.
+VERSION_INDEX = [".version/.vindex", ".version/.vindex.log"]
+
+def find_root(path):
+    """
+    Return the root directory a path is in: the closest directory above it
+    with a version index.
+    """
+    directory = os.path.abspath(path)
+
+    if not os.path.isdir(directory):
+        directory = os.path.dirname(directory)
+
+    while True:
+        for name in VERSION_INDEX:
+            if os.path.exists("%s/%s" % (directory, name)):
+                return directory
+
+        if directory == "/":
+            return None
+
+        directory = os.path.dirname(directory)
+
+
+def list_versions(path, options):
+    """
+    List the versions of a file, or of all files below a directory, with
+    h_vtool (see src/vquery.c for the query terms).
+    """
+    root = find_root(path)
+
+    if root is None:
+        print "No version index found for %s" % path
+        return 1
+
+    relative = os.path.relpath(os.path.abspath(path), root)
+
+    if relative == ".":
+        relative = ""
+
+    # Query values with blanks are quoted.
+    quoted = relative.replace("\\", "\\\\").replace('"', '\\"')
+
+    terms = ['path="/%s"' % quoted,
+             "subtree=%d" % os.path.isdir(path),
+             "offset=%s" % options.offset,
+             "limit=%s" % options.limit,
+             "format=%s" % ("json" if options.json else "text")]
+
+    if options.list_from is not None:
+        terms.append("from=%d" % parselistdate(options.list_from))
+
+    if options.list_to is not None:
+        terms.append("to=%d" % parselistdate(options.list_to))
+
+    if options.kinds is not None:
+        terms.append("kinds=%s" % options.kinds)
+
+    return subprocess.call(["h_vtool", "list", root] + terms)
+
+
+def restore(path, date, time, using_xdelta = False, using_native = False):
     filename = extract_filename(path)
     directory = extract_directory(path)
     timestamp = parsedate(date, time)
@@ -78,18 +200,77 @@ def restore(path, date, time, using_xdelta = False):
     if os.path.exists(path) and os.path.exists(version_path):
         snapshot = find_closest_snapshot(timestamp, version_path)
         patch = find_closest_patch(timestamp, snapshot)
-    
-        if using_xdelta:
-            command = "xdelta3 -f -d -s %s/%s %s %s" % (snapshot, filename,
-                    patch, path)
+
+        if using_native:
+            method = "native"
+        elif using_xdelta:
+            method = "xdelta"
         else:
-            command = "patch -o %s %s/%s %s" % (path, snapshot, filename, patch)
+            method = "diff"
+
+        # h_vtool unpacks and decompresses the snapshot copy and the patch
+        # (with -D_PACKING and -D_COMPRESSION) and reads them ahead in
+        # parallel, see src/restore.c.
+        subprocess.call(["h_vtool", "restore", method,
+            "%s/%s" % (snapshot, filename), patch, path])
+
+
+# Small versions are moved into the pack of their '.version' directory with
+# -D_PACKING, see include/pack.h. Entries are named '<snapshot>/<version>'.
+PACK_INDEX = ".pack.idx"
+
+def packed_versions(snapshot):
+    """
+    Return the names of the packed versions of a snapshot directory.
+    """
+    version_path = os.path.dirname(snapshot)
+    prefix = "%s/" % os.path.basename(snapshot)
+
+    if not os.path.exists("%s/%s" % (version_path, PACK_INDEX)):
+        return []
+
+    names = os.popen("h_vtool packed %s" % version_path).read().split("\n")
+
+    return [x[len(prefix):] for x in names if x.startswith(prefix)]
+
+
+def restore_blocks(path, date, time):
+    filename = extract_filename(path)
+    directory = extract_directory(path)
+    timestamp = parsedate(date, time)
+
+    print "Restoring %s to epoch closest to %s at %s" % (path, date, time)
+
+    if len(directory) <= 1:
+        version_path = ".version"
+    else:
+        version_path = "%s/.version" % directory
+
+    if not (os.path.exists(path) and os.path.exists(version_path)):
+        return
+
+    snapshot = find_closest_snapshot(timestamp, version_path)
+    epochs = sorted([x for x in os.listdir(version_path) if x.isdigit()],
+                    key=long, reverse=True)
+    epochs = epochs[:epochs.index(extract_filename(snapshot)) + 1]
+
+    # h_vtool undoes the newest epoch first, the oldest epoch determines the
+    # final contents (and size) of the file. The undo-block stores are read
+    # ahead while earlier ones are applied, see src/restore.c.
+    prefixes = ["%s/%s/%s" % (version_path, epoch, filename)
+                for epoch in epochs]
+    restored = "%s.restore" % path
 
-        os.system(command)
+    if subprocess.call(["h_vtool", "restore-blocks", path, restored]
+            + prefixes) == 0:
+        os.rename(restored, path)
+    elif os.path.exists(restored):
+        os.remove(restored)
 
 
 def find_closest_snapshot(timestamp, path):
-    minlist = [(abs(int(x) - timestamp), x) for x in os.listdir(path)]
+    minlist = [(abs(version_seconds(x) - timestamp), x) 
+               for x in os.listdir(path) if x.isdigit()]
     minlist = sorted(minlist, key=itemgetter(0))
 
     (_, snapshot) = minlist[0]
@@ -99,7 +280,7 @@ def find_closest_snapshot(timestamp, path):
 
 def find_closest_patch(timestamp, path):
     minlist = [(abs(get_patch_timestamp(x) - timestamp), x) 
-               for x in os.listdir(path)]
+               for x in os.listdir(path) + packed_versions(path)]
     minlist = sorted(minlist, key=itemgetter(0))
 
     (_, patch) = minlist[0]
@@ -111,11 +292,22 @@ def get_patch_timestamp(path):
     m = re.search('[a-zA-Z0-9\_-]-([0-9]{10,}).patch', path)
 
     if m is not None:
-        timestamp = m.group(1)
+        timestamp = version_seconds(m.group(1))
     else:
         timestamp = 0
 
-    return long(timestamp)
+    return timestamp
+
+
+# Version identifiers are nanoseconds since the epoch, older versions were
+# named with a timestamp in seconds. Both are converted to seconds here.
+def version_seconds(version_id):
+    value = long(version_id)
+
+    if len(version_id.lstrip('0')) > 10:
+        value = value / 1000000000
+
+    return value
 
 
 def parsedate(dateval, timeval):
@@ -128,6 +320,15 @@ def parsedate(dateval, timeval):
     return long(time.mktime(d.timetuple()))
 
 
+def parselistdate(value):
+    parts = value.split()
+
+    if len(parts) == 1:
+        parts.append("00.00.00")
+
+    return parsedate(parts[0], parts[1])
+
+
 def extract_filename(path):
     parts = path.split('/')
 
@@ -153,8 +354,7 @@ if len(args) == 0:
     sys.exit(0)
 
 if options.listing == True:
-    print "Unimplemented!"
-    sys.exit(0)
+    sys.exit(list_versions(args[0], options))
 
 if options.restore == True:
     if len(options.date) < MIN_DATE_LEN and len(options.time) < MIN_TIME_LEN:
@@ -162,5 +362,9 @@ if options.restore == True:
         parser.print_help()
         sys.exit(0)
 
-    restore(args[0], options.date, options.time, options.xdelta)
+    if options.blocks:
+        restore_blocks(args[0], options.date, options.time)
+    else:
+        restore(args[0], options.date, options.time, options.xdelta,
+                options.native)
 
@@ -0,0 +1,389 @@
+/******************************************************************************
+ *
+ * file   : h_bench.c
+ *
+ * author : Tim van Deurzen
+ * date   : 18/10/2026
+ *
+ * Workload generator for benchmarking a mounted Hieronymus file system.
+ *
+ * Runs one of a set of standard workloads in a directory (normally inside the
+ * mount point) and prints the results as a single line of JSON: the number of
+ * operations, operations per second and latency percentiles. Used by
+ * utility/run_benchmarks.sh (make bench).
+ *
+ *     ``h_bench <workload> <directory> [-n count] [-s size] [-c command]''
+ *
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define IO_CHUNK 131072
+#define RANDOM_IO_SIZE 4096
+#define SMALL_FILE_SIZE 4096
+
+/*
+ * Latencies of all operations of a run, in nanoseconds.
+ */
+typedef struct BENCH_RESULTS {
+    unsigned long long *latencies;
+    size_t count;
+    size_t capacity;
+    unsigned long long bytes;
+    unsigned long errors;
+} bench_results;
+
+typedef struct BENCH_OPTIONS {
+    const char *directory;
+    const char *command;
+    unsigned long count;
+    unsigned long long size;
+} bench_options;
+
+static char io_buffer[IO_CHUNK];
+
+static unsigned long long now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (unsigned long long) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * Record the latency of a single operation started at 'start'.
+ */
+static void record(bench_results *results, unsigned long long start, int ok)
+{
+    if (results->count == results->capacity) {
+        results->capacity = (results->capacity == 0) ? 4096 
+            : results->capacity * 2;
+        results->latencies = realloc(results->latencies, 
+                results->capacity * sizeof(unsigned long long));
+
+        if (results->latencies == NULL) {
+            perror("record");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    results->latencies[results->count++] = now_ns() - start;
+
+    if (!ok) {
+        results->errors++;
+    }
+}
+
+/*
+ * Time a single expression as one operation.
+ */
+#define TIMED(results, expression) \
+    do { \
+        unsigned long long start__ = now_ns(); \
+        int ok__ = ((expression) >= 0); \
+        record(results, start__, ok__); \
+    } while (0)
+
+/**
+ * Metadata storm: create, stat, rename, chmod and remove files.
+ */
+static void workload_metadata(bench_options *options, bench_results *results)
+{
+    unsigned long i = 0;
+    int fd = 0;
+    struct stat stat_buffer;
+    char path[PATH_MAX];
+    char new_path[PATH_MAX];
+
+    for (i = 0; i < options->count; i++) {
+        snprintf(path, PATH_MAX, "%s/meta_%lu", options->directory, i);
+        snprintf(new_path, PATH_MAX, "%s/meta_%lu.renamed", 
+                options->directory, i);
+
+        TIMED(results, fd = open(path, O_WRONLY | O_CREAT, 0644));
+        close(fd);
+        TIMED(results, stat(path, &stat_buffer));
+        /* Negative lookup, expected to fail with ENOENT. */
+        TIMED(results, stat(new_path, &stat_buffer) + 1);
+        TIMED(results, rename(path, new_path));
+        TIMED(results, chmod(new_path, 0600));
+        TIMED(results, unlink(new_path));
+    }
+}
+
+/**
+ * Small-file create: create, write and close many small files.
+ */
+static void workload_smallfile(bench_options *options, bench_results *results)
+{
+    unsigned long i = 0;
+    int fd = 0;
+    unsigned long long start = 0;
+    size_t size = (options->size > 0 && options->size < IO_CHUNK) 
+        ? options->size : SMALL_FILE_SIZE;
+    char path[PATH_MAX];
+
+    for (i = 0; i < options->count; i++) {
+        snprintf(path, PATH_MAX, "%s/small_%lu", options->directory, i);
+
+        start = now_ns();
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+        if (fd >= 0 && write(fd, io_buffer, size) == (ssize_t) size) {
+            results->bytes += size;
+            record(results, start, close(fd) == 0);
+        } else {
+            if (fd >= 0) {
+                close(fd);
+            }
+
+            record(results, start, 0);
+        }
+    }
+}
+
+/**
+ * Sequential large I/O: write a large file in chunks, then read it back.
+ */
+static void workload_sequential(bench_options *options, 
+        bench_results *results)
+{
+    int fd = 0;
+    unsigned long long offset = 0;
+    char path[PATH_MAX];
+
+    snprintf(path, PATH_MAX, "%s/sequential", options->directory);
+
+    if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+        perror("workload_sequential");
+        exit(EXIT_FAILURE);
+    }
+
+    for (offset = 0; offset < options->size; offset += IO_CHUNK) {
+        TIMED(results, pwrite(fd, io_buffer, IO_CHUNK, offset));
+        results->bytes += IO_CHUNK;
+    }
+
+    for (offset = 0; offset < options->size; offset += IO_CHUNK) {
+        TIMED(results, pread(fd, io_buffer, IO_CHUNK, offset));
+        results->bytes += IO_CHUNK;
+    }
+
+    close(fd);
+}
+
+/**
+ * Random large I/O: small writes and reads at random offsets in a large file.
+ */
+static void workload_random(bench_options *options, bench_results *results)
+{
+    int fd = 0;
+    unsigned long i = 0;
+    unsigned long long blocks = options->size / RANDOM_IO_SIZE;
+    unsigned long long offset = 0;
+    char path[PATH_MAX];
+
+    snprintf(path, PATH_MAX, "%s/random", options->directory);
+
+    if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0 
+            || ftruncate(fd, options->size) < 0) {
+        perror("workload_random");
+        exit(EXIT_FAILURE);
+    }
+
+    /*
+     * A fixed seed keeps the access pattern identical between runs.
+     */
+    srandom(42);
+
+    for (i = 0; i < options->count; i++) {
+        offset = ((unsigned long long) random() % blocks) * RANDOM_IO_SIZE;
+
+        if (i % 2 == 0) {
+            TIMED(results, pwrite(fd, io_buffer, RANDOM_IO_SIZE, offset));
+        } else {
+            TIMED(results, pread(fd, io_buffer, RANDOM_IO_SIZE, offset));
+        }
+
+        results->bytes += RANDOM_IO_SIZE;
+    }
+
+    close(fd);
+}
+
+/**
+ * Many-version appends: append a line to a single file, reopening it every
+ * time, so every append creates a new version.
+ */
+static void workload_append(bench_options *options, bench_results *results)
+{
+    int fd = 0;
+    int length = 0;
+    unsigned long i = 0;
+    unsigned long long start = 0;
+    char path[PATH_MAX];
+    char line[64];
+
+    snprintf(path, PATH_MAX, "%s/append", options->directory);
+
+    for (i = 0; i < options->count; i++) {
+        length = snprintf(line, sizeof(line), "Version %lu\n", i);
+
+        start = now_ns();
+        fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+
+        if (fd >= 0 && write(fd, line, length) == length) {
+            results->bytes += length;
+            record(results, start, close(fd) == 0);
+        } else {
+            if (fd >= 0) {
+                close(fd);
+            }
+
+            record(results, start, 0);
+        }
+    }
+}
+
+/**
+ * Restore: run the given restore command a number of times.
+ */
+static void workload_restore(bench_options *options, bench_results *results)
+{
+    unsigned long i = 0;
+
+    if (options->command == NULL) {
+        fprintf(stderr, "restore: no restore command given (-c)\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < options->count; i++) {
+        TIMED(results, system(options->command) == 0 ? 0 : -1);
+    }
+}
+
+static int compare_latency(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *) a;
+    unsigned long long y = *(const unsigned long long *) b;
+
+    return (x > y) - (x < y);
+}
+
+static double percentile(bench_results *results, double fraction)
+{
+    size_t index = 0;
+
+    if (results->count == 0) {
+        return 0;
+    }
+
+    index = (size_t) (fraction * (results->count - 1));
+
+    return results->latencies[index] / 1000.0;
+}
+
+/**
+ * Print the results of a run as a single line of JSON.
+ */
+static void report(const char *workload, bench_results *results, 
+        unsigned long long elapsed)
+{
+    double seconds = elapsed / 1e9;
+
+    qsort(results->latencies, results->count, sizeof(unsigned long long), 
+            compare_latency);
+
+    printf("{\"workload\": \"%s\", \"ops\": %lu, \"errors\": %lu, "
+            "\"seconds\": %.6f, \"ops_per_sec\": %.1f, \"bytes\": %llu, "
+            "\"latency_us\": {\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, "
+            "\"p999\": %.1f, \"max\": %.1f}}\n", 
+            workload, (unsigned long) results->count, results->errors, 
+            seconds, (seconds > 0) ? results->count / seconds : 0, 
+            results->bytes, percentile(results, 0.5), 
+            percentile(results, 0.9), percentile(results, 0.99), 
+            percentile(results, 0.999), percentile(results, 1.0));
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: h_bench <workload> <directory> [-n count] "
+            "[-s size] [-c command]\n\n"
+            "Workloads: metadata, smallfile, sequential, random, append, "
+            "restore\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    int option = 0;
+    const char *workload = NULL;
+    unsigned long long start = 0;
+    bench_options options = { NULL, NULL, 1000, 64 * 1024 * 1024 };
+    bench_results results;
+
+    while ((option = getopt(argc, argv, "n:s:c:")) != -1) {
+        switch (option) {
+        case 'n':
+            options.count = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            options.size = strtoull(optarg, NULL, 10);
+            break;
+        case 'c':
+            options.command = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (argc - optind != 2) {
+        usage();
+    }
+
+    workload = argv[optind];
+    options.directory = argv[optind + 1];
+
+    memset(&results, 0, sizeof(results));
+    memset(io_buffer, 'h', sizeof(io_buffer));
+
+    if (options.size < IO_CHUNK) {
+        options.size = IO_CHUNK;
+    }
+
+    start = now_ns();
+
+    if (strcmp(workload, "metadata") == 0) {
+        workload_metadata(&options, &results);
+    } else if (strcmp(workload, "smallfile") == 0) {
+        workload_smallfile(&options, &results);
+    } else if (strcmp(workload, "sequential") == 0) {
+        workload_sequential(&options, &results);
+    } else if (strcmp(workload, "random") == 0) {
+        workload_random(&options, &results);
+    } else if (strcmp(workload, "append") == 0) {
+        workload_append(&options, &results);
+    } else if (strcmp(workload, "restore") == 0) {
+        workload_restore(&options, &results);
+    } else {
+        usage();
+    }
+
+    report(workload, &results, now_ns() - start);
+
+    free(results.latencies);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,468 @@
+/******************************************************************************
+ *
+ * file   : h_microbench.c
+ *
+ * author : Tim van Deurzen
+ * date   : 18/10/2026
+ *
+ * In-process micro-benchmarks for the versioning primitives.
+ *
+ * Links against libhieronymus.a and calls the versioning and utility functions
+ * directly on a temporary directory, without FUSE or a kernel mount, so the hot
+ * paths can be measured (and profiled with perf) in isolation. Every primitive
+ * prints one line of JSON.
+ *
+ *     ``h_microbench [-s file size] [-v versions] [-f fan-out] [-i iterations]
+ *                    [-d directory] [primitive ...]''
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+
+#include "fuse_main.h"
+#include "versioning.h"
+#include "util.h"
+#include "simd.h"
+
+typedef struct MICROBENCH_OPTIONS {
+    unsigned long long file_size;
+    unsigned long versions;
+    unsigned long fan_out;
+    unsigned long iterations;
+    char directory[PATH_MAX];
+} microbench_options;
+
+typedef struct MICROBENCH_TIMINGS {
+    unsigned long long *samples;
+    unsigned long count;
+} microbench_timings;
+
+static unsigned long long now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (unsigned long long) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static int compare_samples(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *) a;
+    unsigned long long y = *(const unsigned long long *) b;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ * Print the timings of a primitive as a single line of JSON.
+ */
+static void report(const char *primitive, microbench_options *options, 
+        microbench_timings *timings)
+{
+    unsigned long long total = 0;
+    unsigned long i = 0;
+
+    for (i = 0; i < timings->count; i++) {
+        total += timings->samples[i];
+    }
+
+    qsort(timings->samples, timings->count, sizeof(unsigned long long), 
+            compare_samples);
+
+    printf("{\"primitive\": \"%s\", \"file_size\": %llu, \"versions\": %lu, "
+            "\"fan_out\": %lu, \"iterations\": %lu, \"mean_ns\": %llu, "
+            "\"p50_ns\": %llu, \"p99_ns\": %llu, \"max_ns\": %llu}\n", 
+            primitive, options->file_size, options->versions, 
+            options->fan_out, timings->count, 
+            timings->count ? total / timings->count : 0, 
+            timings->count ? timings->samples[timings->count / 2] : 0,
+            timings->count ? timings->samples[(timings->count * 99) / 100] : 0,
+            timings->count ? timings->samples[timings->count - 1] : 0);
+}
+
+/*
+ * Time a statement, storing the sample in the timings.
+ */
+#define SAMPLE(timings, statement) \
+    do { \
+        unsigned long long start__ = now_ns(); \
+        statement; \
+        (timings)->samples[(timings)->count++] = now_ns() - start__; \
+    } while (0)
+
+/**
+ * Format a path of at most PATH_MAX bytes, exits if it does not fit.
+ */
+static void make_path(char *path, const char *format, ...)
+{
+    va_list arguments;
+    int length = 0;
+
+    va_start(arguments, format);
+    length = vsnprintf(path, PATH_MAX, format, arguments);
+    va_end(arguments);
+
+    if (length < 0 || length >= PATH_MAX) {
+        fprintf(stderr, "h_microbench: path too long\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Write a file of the given size, the contents depend on 'seed' so successive
+ * versions differ.
+ */
+static void write_file(const char *path, unsigned long long size, 
+        unsigned long seed)
+{
+    FILE *file = fopen(path, "w");
+    unsigned long long i = 0;
+
+    if (file == NULL) {
+        perror("write_file");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < size; i++) {
+        fputc('a' + ((i / 64 + seed) % 26), file);
+    }
+
+    fclose(file);
+}
+
+/**
+ * Create the test tree: a directory with 'fan_out' files and a '.version'
+ * directory holding 'versions' snapshots, each with a snapshot version of
+ * every file.
+ */
+static void setup_tree(microbench_options *options, char *directory, 
+        char *version_directory, char *snapshot_path)
+{
+    unsigned long i = 0;
+    unsigned long j = 0;
+    char path[PATH_MAX];
+
+    make_path(directory, "%s/tree", options->directory);
+    make_path(version_directory, "%s/.version", directory);
+
+    checked_mkdir(directory);
+    checked_mkdir(version_directory);
+
+    for (i = 0; i < options->fan_out; i++) {
+        make_path(path, "%s/file_%lu", directory, i);
+        write_file(path, options->file_size, i);
+    }
+
+    for (j = 0; j < options->versions; j++) {
+        make_snapshot_directory(version_directory, snapshot_path);
+
+        for (i = 0; i < options->fan_out; i++) {
+            make_path(path, "%s/file_%lu", snapshot_path, i);
+            write_file(path, 0, 0);
+        }
+    }
+}
+
+static void bench_sha1_str(microbench_options *options, 
+        microbench_timings *timings)
+{
+    unsigned long i = 0;
+    char path[PATH_MAX];
+    char output[2 * SHA1_LENGTH + 1];
+
+    for (i = 0; i < options->iterations; i++) {
+        make_path(path, "%s/tree/file_%lu", options->directory, i);
+        output[0] = '\0';
+
+        SAMPLE(timings, sha1_str(path, output));
+    }
+}
+
+static void bench_find_latest_snapshot(microbench_options *options, 
+        microbench_timings *timings, const char *version_directory)
+{
+    unsigned long i = 0;
+    char snapshot_path[PATH_MAX];
+
+    for (i = 0; i < options->iterations; i++) {
+        SAMPLE(timings, find_latest_snapshot(version_directory, snapshot_path));
+    }
+}
+
+static void bench_find_snapshot_version(microbench_options *options, 
+        microbench_timings *timings, const char *snapshot_path)
+{
+    unsigned long i = 0;
+    char filename[MAX_FILENAME];
+
+    for (i = 0; i < options->iterations; i++) {
+        snprintf(filename, MAX_FILENAME, "file_%lu", i % options->fan_out);
+
+        SAMPLE(timings, find_snapshot_version(snapshot_path, filename));
+    }
+}
+
+static void bench_copy(microbench_options *options, 
+        microbench_timings *timings, const char *directory)
+{
+    unsigned long i = 0;
+    char source[PATH_MAX];
+    char dest[PATH_MAX];
+
+    make_path(source, "%s/file_0", directory);
+    make_path(dest, "%s/copy_target", options->directory);
+
+    for (i = 0; i < options->iterations; i++) {
+        SAMPLE(timings, copy(source, dest));
+    }
+
+    unlink(dest);
+}
+
+static void bench_diff(microbench_options *options, 
+        microbench_timings *timings, const char *directory)
+{
+    unsigned long i = 0;
+    char old_file[PATH_MAX];
+    char new_file[PATH_MAX];
+    char patch_file[PATH_MAX];
+
+    make_path(old_file, "%s/diff_old", options->directory);
+    make_path(new_file, "%s/file_0", directory);
+    make_path(patch_file, "%s/diff_patch", options->directory);
+
+    write_file(old_file, options->file_size, 1);
+
+    for (i = 0; i < options->iterations; i++) {
+        SAMPLE(timings, diff(old_file, new_file, patch_file));
+    }
+
+    unlink(patch_file);
+}
+
+static void bench_versioned_write(microbench_options *options, 
+        microbench_timings *timings, const char *directory)
+{
+    unsigned long i = 0;
+    char path[PATH_MAX];
+
+    make_path(path, "%s/file_0", directory);
+
+    for (i = 0; i < options->iterations; i++) {
+        write_file(path, options->file_size, i);
+
+        SAMPLE(timings, h_versioned_write(path, NULL, NULL));
+    }
+}
+
+/*
+ * Kernels of simd.c, timed on a buffer of file size bytes at every supported
+ * instruction set level (reported as "<kernel>/<level>").
+ */
+enum simd_benchmarks {
+    bench_mismatch,
+    bench_crc32c,
+    bench_gear_boundary
+};
+
+/**
+ * Split a buffer in content-defined chunks (8 KiB on average).
+ */
+static unsigned long chunk_buffer(const unsigned char *buffer, size_t size)
+{
+    unsigned long chunks = 0;
+    size_t position = 0;
+
+    for (; position < size; chunks++) {
+        position += simd_gear_boundary(buffer + position, size - position, 
+                SIMD_GEAR_MASK(13));
+    }
+
+    return chunks;
+}
+
+static void bench_simd(microbench_options *options,
+        microbench_timings *timings, int kernel)
+{
+    static const char *names[] = { "mismatch", "crc32c", "gear_boundary" };
+    unsigned char *a = (unsigned char *) checked_malloc(options->file_size);
+    unsigned char *b = (unsigned char *) checked_malloc(options->file_size);
+    char primitive[64];
+    unsigned long long i = 0;
+    int best = simd_level();
+    int level = 0;
+
+    for (i = 0; i < options->file_size; i++) {
+        a[i] = b[i] = (i * 2654435761ULL) >> 13;
+    }
+
+    for (level = 0; level < num_simd_levels; level++) {
+        if (simd_set_level(level) < 0) {
+            continue;
+        }
+
+        timings->count = 0;
+
+        for (i = 0; i < options->iterations; i++) {
+            switch (kernel) {
+            case bench_mismatch:
+                SAMPLE(timings, simd_mismatch(a, b, options->file_size));
+                break;
+            case bench_crc32c:
+                SAMPLE(timings, simd_crc32c(0, a, options->file_size));
+                break;
+            case bench_gear_boundary:
+                SAMPLE(timings, chunk_buffer(a, options->file_size));
+                break;
+            }
+        }
+
+        snprintf(primitive, sizeof(primitive), "%s/%s", names[kernel],
+                simd_level_name(level));
+        report(primitive, options, timings);
+    }
+
+    simd_set_level(best);
+
+    free(a);
+    free(b);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: h_microbench [-s file size] [-v versions] "
+            "[-f fan-out] [-i iterations] [-d directory] [primitive ...]\n\n"
+            "Primitives: sha1_str, find_latest_snapshot, "
+            "find_snapshot_version, copy, diff, h_versioned_write, "
+            "simd_self_test, mismatch, crc32c, gear_boundary\n");
+    exit(EXIT_FAILURE);
+}
+
+static int selected(int argc, char *argv[], const char *primitive)
+{
+    int i = optind;
+
+    if (optind == argc) {
+        return 1;
+    }
+
+    for (; i < argc; i++) {
+        if (strcmp(argv[i], primitive) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int option = 0;
+    char command[PATH_MAX + sizeof("rm -rf ")];
+    char directory[PATH_MAX];
+    char version_directory[PATH_MAX];
+    char snapshot_path[PATH_MAX];
+    hieronymus_data administration;
+    microbench_options options = { 65536, 16, 64, 1000, "" };
+    microbench_timings timings;
+
+    while ((option = getopt(argc, argv, "s:v:f:i:d:")) != -1) {
+        switch (option) {
+        case 's':
+            options.file_size = strtoull(optarg, NULL, 10);
+            break;
+        case 'v':
+            options.versions = strtoul(optarg, NULL, 10);
+            break;
+        case 'f':
+            options.fan_out = strtoul(optarg, NULL, 10);
+            break;
+        case 'i':
+            options.iterations = strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            make_path(options.directory, "%s/h_microbench.XXXXXX", optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (options.fan_out == 0 || options.versions == 0 
+            || options.iterations == 0) {
+        usage();
+    }
+
+    if (options.directory[0] == '\0') {
+        make_path(options.directory, "/tmp/h_microbench.XXXXXX");
+    }
+
+    if (mkdtemp(options.directory) == NULL) {
+        perror("mkdtemp");
+        return EXIT_FAILURE;
+    }
+
+    /*
+     * The versioning code finds its settings through ADMIN, normally set up by
+     * main in fuse_main.c.
+     */
+    memset(&administration, 0, sizeof(administration));
+    administration.root_directory = options.directory;
+    administration.log_file = stderr;
+    hieronymus_admin = &administration;
+
+    setup_tree(&options, directory, version_directory, snapshot_path);
+
+    timings.samples = (unsigned long long *) checked_malloc(
+            options.iterations * sizeof(unsigned long long));
+
+#define RUN(name, call) \
+    if (selected(argc, argv, name)) { \
+        timings.count = 0; \
+        call; \
+        report(name, &options, &timings); \
+    }
+
+    RUN("sha1_str", bench_sha1_str(&options, &timings));
+    RUN("find_latest_snapshot", 
+            bench_find_latest_snapshot(&options, &timings, version_directory));
+    RUN("find_snapshot_version", 
+            bench_find_snapshot_version(&options, &timings, snapshot_path));
+    RUN("copy", bench_copy(&options, &timings, directory));
+    RUN("diff", bench_diff(&options, &timings, directory));
+    RUN("h_versioned_write", 
+            bench_versioned_write(&options, &timings, directory));
+
+#undef RUN
+
+    if (selected(argc, argv, "simd_self_test")) {
+        printf("{\"primitive\": \"simd_self_test\", \"level\": \"%s\", "
+                "\"passed\": %s}\n", simd_level_name(simd_level()),
+                simd_self_test() == 0 ? "true" : "false");
+    }
+
+    if (selected(argc, argv, "mismatch")) {
+        bench_simd(&options, &timings, bench_mismatch);
+    }
+
+    if (selected(argc, argv, "crc32c")) {
+        bench_simd(&options, &timings, bench_crc32c);
+    }
+
+    if (selected(argc, argv, "gear_boundary")) {
+        bench_simd(&options, &timings, bench_gear_boundary);
+    }
+
+    free(timings.samples);
+
+    snprintf(command, sizeof(command), "rm -rf %s", options.directory);
+    
+    return system(command) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,538 @@
+/******************************************************************************
+ *
+ * file   : h_replay.c
+ *
+ * author : Tim van Deurzen
+ * date   : 18/10/2026
+ *
+ * Replay a binary trace (recorded by mounting with --trace=<file>) against a
+ * mounted file system.
+ *
+ * Every process in the trace is replayed by its own thread, in the order its
+ * operations were recorded. By default operations are issued as fast as
+ * possible; with -t the recorded start times are honoured, so the think-time
+ * between operations is preserved. Written data is not part of the trace, a
+ * fixed pattern of the recorded size is written instead. Extended attribute
+ * operations are skipped. A summary is printed as JSON.
+ *
+ *     ``h_replay [-t] [-p] trace mount point''
+ *
+ * With -p the trace is printed instead of replayed.
+ *
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <utime.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/mman.h>
+
+#include "trace.h"
+
+typedef struct REPLAY_WORKER {
+    pthread_t thread;
+    unsigned int process;
+    trace_record **records;
+    unsigned long count;
+    unsigned long capacity;
+    int *fds;
+    char *pattern;
+    size_t pattern_size;
+    unsigned long operations;
+    unsigned long mismatches;
+    unsigned long skipped;
+    unsigned long long busy;
+} replay_worker;
+
+static struct {
+    const char *mount_point;
+    int timed;
+    char **paths;
+    unsigned int num_paths;
+    unsigned long long replay_start;
+} replay;
+
+static unsigned long long now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (unsigned long long) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void *replay_malloc(size_t size)
+{
+    void *memory = malloc(size);
+
+    if (memory == NULL) {
+        perror("h_replay");
+        exit(EXIT_FAILURE);
+    }
+
+    return memory;
+}
+
+static const char *path_name(unsigned int path_id)
+{
+    if (path_id == 0 || path_id > replay.num_paths
+            || replay.paths[path_id] == NULL) {
+        return "";
+    }
+
+    return replay.paths[path_id];
+}
+
+/**
+ * Prefix a traced path with the mount point.
+ */
+static char *mounted_path(unsigned int path_id, char *dest)
+{
+    snprintf(dest, PATH_MAX, "%s%s", replay.mount_point, path_name(path_id));
+
+    return dest;
+}
+
+/**
+ * Return the descriptor opened for path_id by this worker, or open one for the
+ * duration of a single operation (*temporary is set).
+ */
+static int worker_fd(replay_worker *worker, unsigned int path_id, int flags,
+        int *temporary)
+{
+    char path[PATH_MAX];
+
+    *temporary = 0;
+
+    if (worker->fds[path_id] >= 0) {
+        return worker->fds[path_id];
+    }
+
+    *temporary = 1;
+
+    return open(mounted_path(path_id, path), flags);
+}
+
+static void worker_close(replay_worker *worker, unsigned int path_id)
+{
+    if (worker->fds[path_id] >= 0) {
+        close(worker->fds[path_id]);
+        worker->fds[path_id] = -1;
+    }
+}
+
+/**
+ * Perform a single operation, returns 0 or -errno (or a byte count for read,
+ * write and readlink) like the file system did, or INT_MIN if skipped.
+ */
+static int replay_operation(replay_worker *worker, trace_record *record)
+{
+    char path[PATH_MAX];
+    char second_path[PATH_MAX];
+    char buffer[PATH_MAX];
+    struct stat stats;
+    struct statvfs fs_stats;
+    struct timespec times[2];
+    char *data = NULL;
+    DIR *directory = NULL;
+    int fd = -1;
+    int temporary = 0;
+    int result = 0;
+
+    mounted_path(record->path_id, path);
+
+    switch (record->operation) {
+        case op_getattr:
+            result = lstat(path, &stats);
+            break;
+        case op_fgetattr:
+            fd = worker_fd(worker, record->path_id, O_RDONLY, &temporary);
+            result = (fd < 0) ? -1 : fstat(fd, &stats);
+            break;
+        case op_readlink:
+            result = readlink(path, buffer, sizeof(buffer));
+            result = (result < 0) ? result : 0;
+            break;
+        case op_mknod:
+            result = mknod(path, record->argument, record->size);
+            break;
+        case op_mkdir:
+            result = mkdir(path, record->argument);
+            break;
+        case op_unlink:
+            result = unlink(path);
+            break;
+        case op_rmdir:
+            result = rmdir(path);
+            break;
+        case op_symlink:
+            /* The second path is the target of the link, not a mounted path. */
+            result = symlink(path_name(record->second_path_id), path);
+            break;
+        case op_rename:
+            result = rename(path,
+                    mounted_path(record->second_path_id, second_path));
+            break;
+        case op_link:
+            result = link(path,
+                    mounted_path(record->second_path_id, second_path));
+            break;
+        case op_chmod:
+            result = chmod(path, record->argument);
+            break;
+        case op_chown:
+            result = lchown(path, record->argument, record->size);
+            break;
+        case op_truncate:
+            result = truncate(path, record->argument);
+            break;
+        case op_ftruncate:
+            fd = worker_fd(worker, record->path_id, O_WRONLY, &temporary);
+            result = (fd < 0) ? -1 : ftruncate(fd, record->argument);
+            break;
+        case op_utime:
+        case op_utimens:
+            times[0].tv_nsec = UTIME_NOW;
+            times[1].tv_nsec = UTIME_NOW;
+            result = utimensat(AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW);
+            break;
+        case op_open:
+            worker_close(worker, record->path_id);
+            fd = open(path, record->argument);
+            result = (fd < 0) ? -1 : 0;
+            worker->fds[record->path_id] = fd;
+            fd = -1;
+            break;
+        case op_create:
+            worker_close(worker, record->path_id);
+            fd = open(path, O_CREAT | O_RDWR, record->argument);
+            result = (fd < 0) ? -1 : 0;
+            worker->fds[record->path_id] = fd;
+            fd = -1;
+            break;
+        case op_read:
+            data = (char *) replay_malloc(record->size + 1);
+            fd = worker_fd(worker, record->path_id, O_RDONLY, &temporary);
+            result = (fd < 0) ? -1
+                : pread(fd, data, record->size, record->argument);
+            free(data);
+            break;
+        case op_write:
+            if (record->size > worker->pattern_size) {
+                free(worker->pattern);
+                worker->pattern_size = record->size;
+                worker->pattern = (char *) replay_malloc(worker->pattern_size);
+                memset(worker->pattern, 'h', worker->pattern_size);
+            }
+
+            fd = worker_fd(worker, record->path_id, O_WRONLY, &temporary);
+            result = (fd < 0) ? -1
+                : pwrite(fd, worker->pattern, record->size, record->argument);
+            break;
+        case op_flush:
+            result = 0;
+            break;
+        case op_fsync:
+            fd = worker_fd(worker, record->path_id, O_RDONLY, &temporary);
+            result = (fd < 0) ? -1
+                : (record->argument ? fdatasync(fd) : fsync(fd));
+            break;
+        case op_release:
+            worker_close(worker, record->path_id);
+            result = 0;
+            break;
+        case op_statfs:
+            result = statvfs(path, &fs_stats);
+            break;
+        case op_readdir:
+            directory = opendir(path);
+
+            if (directory == NULL) {
+                result = -1;
+                break;
+            }
+
+            while (readdir(directory) != NULL);
+
+            closedir(directory);
+            break;
+        case op_access:
+            result = access(path, record->argument);
+            break;
+        case op_opendir:
+        case op_releasedir:
+        case op_fsyncdir:
+            /* Directory streams are opened and closed around readdir. */
+            result = 0;
+            break;
+        default:
+            /* Extended attributes are skipped. */
+            return INT_MIN;
+    }
+
+    if (result < 0) {
+        result = -errno;
+    }
+
+    if (temporary && fd >= 0) {
+        close(fd);
+    }
+
+    return result;
+}
+
+/**
+ * Compare the replayed result to the recorded one. Byte counts of read and
+ * write only need to agree on success or failure.
+ */
+static int results_match(trace_record *record, int result)
+{
+    if (record->operation == op_read || record->operation == op_write
+            || record->operation == op_readlink) {
+        return (record->result < 0) == (result < 0);
+    }
+
+    return (record->result < 0 ? record->result : 0) == result;
+}
+
+static void *replay_worker_thread(void *data)
+{
+    replay_worker *worker = (replay_worker *) data;
+    struct timespec delay;
+    unsigned long long start = 0;
+    unsigned long long now = 0;
+    unsigned long i = 0;
+    int result = 0;
+
+    for (i = 0; i < worker->count; i++) {
+        if (replay.timed) {
+            now = now_ns() - replay.replay_start;
+
+            if (worker->records[i]->start > now) {
+                delay.tv_sec = (worker->records[i]->start - now) / 1000000000ULL;
+                delay.tv_nsec = (worker->records[i]->start - now) % 1000000000ULL;
+                nanosleep(&delay, NULL);
+            }
+        }
+
+        start = now_ns();
+        result = replay_operation(worker, worker->records[i]);
+        worker->busy += now_ns() - start;
+
+        if (result == INT_MIN) {
+            worker->skipped++;
+            continue;
+        }
+
+        worker->operations++;
+
+        if (!results_match(worker->records[i], result)) {
+            worker->mismatches++;
+        }
+    }
+
+    for (i = 0; i <= replay.num_paths; i++) {
+        worker_close(worker, i);
+    }
+
+    return NULL;
+}
+
+static replay_worker *find_worker(replay_worker **workers,
+        unsigned long *num_workers, unsigned int process)
+{
+    unsigned long i = 0;
+
+    for (i = 0; i < *num_workers; i++) {
+        if ((*workers)[i].process == process) {
+            return &(*workers)[i];
+        }
+    }
+
+    *workers = (replay_worker *) realloc(*workers,
+            (*num_workers + 1) * sizeof(replay_worker));
+
+    if (*workers == NULL) {
+        perror("h_replay");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&(*workers)[*num_workers], 0, sizeof(replay_worker));
+    (*workers)[*num_workers].process = process;
+
+    return &(*workers)[(*num_workers)++];
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: h_replay [-t] [-p] trace mount point\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    replay_worker *workers = NULL;
+    replay_worker *worker = NULL;
+    trace_path_record *path_record = NULL;
+    trace_record *record = NULL;
+    struct stat stats;
+    char *trace = NULL;
+    size_t offset = 0;
+    unsigned long num_workers = 0;
+    unsigned long num_records = 0;
+    unsigned long operations = 0;
+    unsigned long mismatches = 0;
+    unsigned long skipped = 0;
+    unsigned long long recorded = 0;
+    unsigned long long elapsed = 0;
+    unsigned long i = 0;
+    int print = 0;
+    int option = 0;
+    int fd = -1;
+
+    while ((option = getopt(argc, argv, "tp")) != -1) {
+        switch (option) {
+            case 't': replay.timed = 1; break;
+            case 'p': print = 1; break;
+            default: usage();
+        }
+    }
+
+    if (optind >= argc || (!print && optind + 1 >= argc)) {
+        usage();
+    }
+
+    replay.mount_point = print ? "" : argv[optind + 1];
+
+    /*
+     * Map the trace and index its paths and records.
+     */
+    fd = open(argv[optind], O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &stats) < 0
+            || (size_t) stats.st_size < sizeof(trace_header)) {
+        fprintf(stderr, "h_replay: could not read trace %s\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    trace = (char *) mmap(NULL, stats.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (trace == MAP_FAILED || memcmp(trace, TRACE_MAGIC, 8) != 0) {
+        fprintf(stderr, "h_replay: %s is not a trace\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    for (offset = sizeof(trace_header); offset + sizeof(trace_path_record)
+            <= (size_t) stats.st_size;) {
+        if (trace[offset] == trace_path) {
+            path_record = (trace_path_record *) (trace + offset);
+            offset += sizeof(trace_path_record);
+
+            if (offset + path_record->length > (size_t) stats.st_size) {
+                break;
+            }
+
+            if (path_record->path_id > replay.num_paths) {
+                replay.paths = (char **) realloc(replay.paths,
+                        (path_record->path_id + 1) * sizeof(char *));
+                memset(replay.paths + replay.num_paths + 1, 0,
+                        (path_record->path_id - replay.num_paths)
+                        * sizeof(char *));
+                replay.num_paths = path_record->path_id;
+            }
+
+            replay.paths[path_record->path_id] = strndup(trace + offset,
+                    path_record->length);
+            offset += path_record->length;
+        } else if (trace[offset] == trace_operation_record
+                && offset + sizeof(trace_record) <= (size_t) stats.st_size) {
+            record = (trace_record *) (trace + offset);
+            offset += sizeof(trace_record);
+            num_records++;
+
+            if (record->start + record->duration > recorded) {
+                recorded = record->start + record->duration;
+            }
+
+            if (print) {
+                printf("%llu.%09llu %u %s %s%s%s = %d (%u ns)\n",
+                        record->start / 1000000000ULL,
+                        record->start % 1000000000ULL, record->process,
+                        trace_operation_name(record->operation),
+                        path_name(record->path_id),
+                        record->second_path_id ? " " : "",
+                        path_name(record->second_path_id),
+                        record->result, record->duration);
+                continue;
+            }
+
+            worker = find_worker(&workers, &num_workers, record->process);
+
+            if (worker->count == worker->capacity) {
+                worker->capacity = worker->capacity ? worker->capacity * 2 : 64;
+                worker->records = (trace_record **) realloc(worker->records,
+                        worker->capacity * sizeof(trace_record *));
+
+                if (worker->records == NULL) {
+                    perror("h_replay");
+                    return EXIT_FAILURE;
+                }
+            }
+
+            worker->records[worker->count++] = record;
+        } else {
+            /* Truncated trace, e.g. the file system was not unmounted. */
+            break;
+        }
+    }
+
+    if (print) {
+        return EXIT_SUCCESS;
+    }
+
+    /*
+     * Replay every process in its own thread.
+     */
+    replay.replay_start = now_ns();
+
+    for (i = 0; i < num_workers; i++) {
+        workers[i].fds = (int *) replay_malloc((replay.num_paths + 1)
+                * sizeof(int));
+        memset(workers[i].fds, -1, (replay.num_paths + 1) * sizeof(int));
+        pthread_create(&workers[i].thread, NULL, replay_worker_thread,
+                &workers[i]);
+    }
+
+    for (i = 0; i < num_workers; i++) {
+        pthread_join(workers[i].thread, NULL);
+        operations += workers[i].operations;
+        mismatches += workers[i].mismatches;
+        skipped += workers[i].skipped;
+    }
+
+    elapsed = now_ns() - replay.replay_start;
+
+    printf("{\"records\": %lu, \"paths\": %u, \"processes\": %lu, "
+            "\"operations\": %lu, \"skipped\": %lu, \"mismatches\": %lu, "
+            "\"timed\": %s, \"recorded_s\": %.3f, \"replayed_s\": %.3f, "
+            "\"ops_per_s\": %.1f}\n",
+            num_records, replay.num_paths, num_workers, operations, skipped,
+            mismatches, replay.timed ? "true" : "false", recorded / 1e9,
+            elapsed / 1e9, elapsed ? operations / (elapsed / 1e9) : 0.0);
+
+    munmap(trace, stats.st_size);
+    close(fd);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,372 @@
+/******************************************************************************
+ *
+ * file   : h_vtool.c
+ *
+ * author : Tim van Deurzen
+ * date   : 18/10/2026
+ *
+ * Create, apply and inspect patches of the native delta engine (the patches
+ * written when compiled with -D_NATIVE_DELTA), compress or decompress stored
+ * versions (with -D_COMPRESSION), list, unpack or repack the packs of
+ * '.version' directories (with -D_PACKING), look up or merge the version
+ * index of a root directory and query it (with -D_VERSION_INDEX), remove the
+ * blobs of a root directory no version links to (with -D_DEDUP) and restore
+ * old versions.
+ *
+ *     ``h_vtool encode old new patch''
+ *     ``h_vtool decode old patch new''
+ *     ``h_vtool info patch''
+ *     ``h_vtool compress codec[:level] file''
+ *     ``h_vtool decompress file output|- [dictionary directory]''
+ *     ``h_vtool packed version-directory''
+ *     ``h_vtool unpack version-directory snapshot/name output|-''
+ *     ``h_vtool repack version-directory [threshold]''
+ *     ``h_vtool versions root-directory path''
+ *     ``h_vtool merge root-directory''
+ *     ``h_vtool list root-directory [key=value ...]''
+ *     ``h_vtool prune-blobs root-directory''
+ *     ``h_vtool restore native|xdelta|diff snapshot/name patch output''
+ *     ``h_vtool restore-blocks file output epoch/name ...''
+ *
+ * Encoding, decoding and compressing use one thread per processor. h_admin.py
+ * restores native patches with 'decode', reads compressed versions with
+ * 'decompress', which streams and accepts uncompressed files as well, and
+ * finds packed versions with 'packed' and 'unpack' and lists versions with
+ * 'list', which takes the terms of a query (see vquery.c). It restores versions
+with 'restore' and 'restore-blocks', which read all stored versions involved
+ahead in parallel (see restore.c); the epochs are given newest first.
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "delta.h"
+#include "codec.h"
+#include "pack.h"
+#include "vindex.h"
+#include "vquery.h"
+#include "dedup.h"
+#include "restore.h"
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: h_vtool encode old new patch\n"
+                    "       h_vtool decode old patch new\n"
+                    "       h_vtool info patch\n"
+                    "       h_vtool compress codec[:level] file\n"
+                    "       h_vtool decompress file output|- "
+                    "[dictionary directory]\n"
+                    "       h_vtool packed version-directory\n"
+                    "       h_vtool unpack version-directory snapshot/name "
+                    "output|-\n"
+                    "       h_vtool repack version-directory [threshold]\n"
+                    "       h_vtool versions root-directory path\n"
+                    "       h_vtool merge root-directory\n"
+                    "       h_vtool list root-directory [key=value ...]\n"
+                    "       h_vtool prune-blobs root-directory\n"
+                    "       h_vtool restore native|xdelta|diff snapshot/name "
+                    "patch output\n"
+                    "       h_vtool restore-blocks file output epoch/name "
+                    "...\n");
+    exit(EXIT_FAILURE);
+}
+
+static double elapsed(struct timespec *start)
+{
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return (end.tv_sec - start->tv_sec)
+        + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * Print the header of a patch and how its segments are stored.
+ */
+static int info(const char *patch_file)
+{
+    FILE *patch = fopen(patch_file, "rb");
+    delta_header header;
+    delta_segment segment;
+    unsigned long counts[3] = { 0, 0, 0 };
+    unsigned long long payload = 0;
+    uint32_t i = 0;
+
+    if (patch == NULL) {
+        perror(patch_file);
+        return EXIT_FAILURE;
+    }
+
+    if (fread(&header, sizeof(header), 1, patch) != 1
+            || memcmp(header.magic, DELTA_MAGIC, sizeof(header.magic)) != 0) {
+        fprintf(stderr, "%s: not a native delta patch\n", patch_file);
+        fclose(patch);
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < header.num_segments; i++) {
+        if (fread(&segment, sizeof(segment), 1, patch) != 1
+                || segment.type > segment_delta) {
+            fprintf(stderr, "%s: corrupt segment table\n", patch_file);
+            fclose(patch);
+            return EXIT_FAILURE;
+        }
+
+        counts[segment.type]++;
+        payload += segment.length;
+    }
+
+    fclose(patch);
+
+    printf("{\n");
+    printf("    \"old_size\": %llu,\n", (unsigned long long) header.old_size);
+    printf("    \"new_size\": %llu,\n", (unsigned long long) header.new_size);
+    printf("    \"segment_size\": %u,\n", header.segment_size);
+    printf("    \"segments\": %u,\n", header.num_segments);
+    printf("    \"same\": %lu,\n", counts[segment_same]);
+    printf("    \"literal\": %lu,\n", counts[segment_literal]);
+    printf("    \"delta\": %lu,\n", counts[segment_delta]);
+    printf("    \"payload_bytes\": %llu\n", payload);
+    printf("}\n");
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Repack a '.version' directory and print what it did.
+ */
+static int repack(const char *version_directory)
+{
+    pack_statistics statistics;
+
+    if (pack_repack(version_directory, &statistics) < 0) {
+        return EXIT_FAILURE;
+    }
+
+    printf("{\n");
+    printf("    \"entries\": %llu,\n", statistics.entries);
+    printf("    \"absorbed\": %llu,\n", statistics.absorbed);
+    printf("    \"dropped\": %llu,\n", statistics.dropped);
+    printf("    \"bytes_before\": %llu,\n", statistics.bytes_before);
+    printf("    \"bytes\": %llu\n", statistics.bytes);
+    printf("}\n");
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Print the versions of a file in the version index of a root directory, the
+ * path is relative to the root directory.
+ */
+static int versions(const char *root, const char *path)
+{
+    vindex *index = vindex_open(root, 0);
+    vindex_version *list = NULL;
+    int num_versions = 0;
+    int i = 0;
+
+    if (index == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    num_versions = vindex_lookup(index, path, NULL, 0);
+
+    if (num_versions > 0) {
+        list = (vindex_version *) malloc(num_versions * sizeof(*list));
+        num_versions = vindex_lookup(index, path, list, num_versions);
+    }
+
+    printf("[\n");
+
+    for (i = 0; list != NULL && i < num_versions; i++) {
+        printf("    { \"id\": \"%020llu\", \"kind\": \"%s\", \"size\": %llu, "
+                "\"stored\": %llu }%s\n", (unsigned long long) list[i].id,
+                vindex_kind_name(list[i].kind),
+                (unsigned long long) list[i].size,
+                (unsigned long long) list[i].stored,
+                i + 1 < num_versions ? "," : "");
+    }
+
+    printf("]\n");
+
+    free(list);
+    vindex_close(index);
+
+    return num_versions < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * Merge the delta of the version index of a root directory into its base.
+ * Fails while the root directory is mounted.
+ */
+static int merge(const char *root)
+{
+    vindex *index = vindex_open(root, 1);
+    int return_value = 0;
+
+    if (index == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    return_value = vindex_merge(index);
+    vindex_close(index);
+
+    return return_value < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * Answer a query on the version index of a root directory, the arguments are
+ * its terms (one per line, so paths may hold blanks).
+ */
+static int list(const char *root, int num_terms, char **terms)
+{
+    vindex *index = NULL;
+    vquery query;
+    vquery_result result;
+    int i = 0;
+
+    vquery_init(&query);
+
+    for (i = 0; i < num_terms; i++) {
+        if (vquery_parse(&query, terms[i]) < 0) {
+            fprintf(stderr, "%s: not a query term\n", terms[i]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if ((index = vindex_open(root, 0)) == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    if (vquery_run(index, &query, &result) < 0) {
+        vindex_close(index);
+        return EXIT_FAILURE;
+    }
+
+    vquery_print(&query, &result, stdout);
+    vquery_free(&result);
+    vindex_close(index);
+
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv)
+{
+    struct timespec start;
+    codec_choice choice;
+    int return_value = 0;
+
+    if (argc == 3 && strcmp(argv[1], "info") == 0) {
+        return info(argv[2]);
+    }
+
+    if (argc == 3 && strcmp(argv[1], "packed") == 0) {
+        return pack_list(argv[2], stdout) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    if (argc == 5 && strcmp(argv[1], "unpack") == 0) {
+        return pack_extract(argv[2], argv[3], argv[4]) < 0 ? EXIT_FAILURE
+            : EXIT_SUCCESS;
+    }
+
+    if (argc == 4 && strcmp(argv[1], "versions") == 0) {
+        return versions(argv[2], argv[3]);
+    }
+
+    if (argc == 3 && strcmp(argv[1], "merge") == 0) {
+        return merge(argv[2]);
+    }
+
+    if (argc >= 3 && strcmp(argv[1], "list") == 0) {
+        return list(argv[2], argc - 3, argv + 3);
+    }
+
+    if (argc == 3 && strcmp(argv[1], "prune-blobs") == 0) {
+        if ((return_value = dedup_prune(argv[2])) < 0) {
+            return EXIT_FAILURE;
+        }
+
+        printf("%d blobs removed\n", return_value);
+
+        return EXIT_SUCCESS;
+    }
+
+    if (argc >= 3 && argc <= 4 && strcmp(argv[1], "repack") == 0) {
+        pack_configure(argc == 4 ? strtoull(argv[3], NULL, 10) : 0);
+
+        return repack(argv[2]);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (argc == 6 && strcmp(argv[1], "restore") == 0) {
+        if ((return_value = restore_parse_method(argv[2])) < 0) {
+            usage();
+        }
+
+        if (restore_version(argv[3], argv[4], argv[5], return_value) < 0) {
+            return EXIT_FAILURE;
+        }
+
+        fprintf(stderr, "%s: %.3f s\n", argv[1], elapsed(&start));
+
+        return EXIT_SUCCESS;
+    }
+
+    if (argc >= 4 && strcmp(argv[1], "restore-blocks") == 0) {
+        if (restore_blocks(argv[2], argv[3], argv + 4, argc - 4) < 0) {
+            return EXIT_FAILURE;
+        }
+
+        fprintf(stderr, "%s: %.3f s\n", argv[1], elapsed(&start));
+
+        return EXIT_SUCCESS;
+    }
+
+    if (argc >= 4 && argc <= 5 && strcmp(argv[1], "decompress") == 0) {
+        if (codec_configure("", argc == 5 ? argv[4] : "") < 0
+                || codec_decompress_file(argv[2], argv[3]) < 0) {
+            return EXIT_FAILURE;
+        }
+
+        codec_print_statistics(stderr);
+
+        return EXIT_SUCCESS;
+    }
+
+    if (argc == 4 && strcmp(argv[1], "compress") == 0) {
+        if (codec_parse(argv[2], &choice) < 0
+                || codec_compress_file(argv[3], &choice) < 0) {
+            return EXIT_FAILURE;
+        }
+
+        codec_print_statistics(stderr);
+
+        return EXIT_SUCCESS;
+    }
+
+    if (argc != 5) {
+        usage();
+    }
+
+    if (strcmp(argv[1], "encode") == 0) {
+        return_value = delta_encode(argv[2], argv[3], argv[4]);
+    } else if (strcmp(argv[1], "decode") == 0) {
+        return_value = delta_decode(argv[2], argv[3], argv[4]);
+    } else {
+        usage();
+    }
+
+    if (return_value != 0) {
+        return EXIT_FAILURE;
+    }
+
+    fprintf(stderr, "%s: %.3f s\n", argv[1], elapsed(&start));
+
+    return EXIT_SUCCESS;
+}
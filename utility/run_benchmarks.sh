@@ -0,0 +1,116 @@
+#!/bin/bash
+
+#
+# file   : run_benchmarks.sh
+#
+# author : Tim van Deurzen
+# date   : 18/10/2026
+#
+# Benchmark a Hieronymus mount with a set of standard workloads (make bench,
+# which builds hieronymus-bench with versioning for it).
+#
+# The versioning root and the mount point are placed on tmpfs, so the results
+# measure Hieronymus itself and not the backing disk. Every workload runs on a
+# fresh mount and prints one line of JSON, extended with the number of bytes
+# (and files) stored in the versioning information afterwards.
+#
+# Environment:
+#   HIERONYMUS    binary built with -D_VERSIONING           (default: ./hieronymus)
+#   BENCH_COUNT   number of operations per workload         (default: 2000)
+#   BENCH_SIZE    file size for the large-file workloads    (default: 64 MiB)
+#   BENCH_OUTPUT  file the results are appended to          (default: stdout)
+#   PYTHON        interpreter for h_admin.py (restore)      (default: python2)
+#
+
+HIERONYMUS=${HIERONYMUS:-./hieronymus}
+H_BENCH=${H_BENCH:-./h_bench}
+H_ADMIN=$(cd "$(dirname "$0")" && pwd)/h_admin.py
+COUNT=${BENCH_COUNT:-2000}
+SIZE=${BENCH_SIZE:-67108864}
+OUTPUT=${BENCH_OUTPUT:-/dev/stdout}
+PYTHON=${PYTHON:-python2}
+
+WORKLOADS="metadata smallfile sequential random append restore"
+
+# Use a private tmpfs if we are allowed to mount one, /dev/shm otherwise.
+BASE=$(mktemp -d /tmp/hieronymus-bench.XXXXXX)
+
+if [ "$(id -u)" -eq 0 ] && mount -t tmpfs -o size=4g tmpfs "$BASE" 2> /dev/null
+then
+    TMPFS_MOUNTED=1
+else
+    rmdir "$BASE"
+    BASE=$(mktemp -d /dev/shm/hieronymus-bench.XXXXXX)
+fi
+
+cleanup() {
+    fusermount -u "$BASE/mnt" 2> /dev/null
+    [ -n "$TMPFS_MOUNTED" ] && umount "$BASE"
+    rm -rf "$BASE"
+}
+
+trap cleanup EXIT
+
+mount_hieronymus() {
+    rm -rf "$BASE/root" "$BASE/mnt"
+    mkdir -p "$BASE/root" "$BASE/mnt"
+
+    "$HIERONYMUS" --versioning_root="$BASE/root" "$BASE/mnt" > /dev/null 2>&1
+
+    for i in $(seq 1 50); do
+        mountpoint -q "$BASE/mnt" && return 0
+        sleep 0.1
+    done
+
+    echo "run_benchmarks: could not mount $BASE/mnt" >&2
+    exit 1
+}
+
+unmount_hieronymus() {
+    fusermount -u "$BASE/mnt"
+}
+
+# Bytes and files stored in all '.version' directories below the root.
+version_usage() {
+    find "$BASE/root" -path '*/.version/*' -type f -printf '%s\n' \
+        | awk '{ bytes += $1; files++ } END { printf "%d %d", bytes, files }'
+}
+
+# The results are meaningless without versioning (nothing is stored), a new
+# directory only gets a '.version' directory in a build with -D_VERSIONING.
+mount_hieronymus
+mkdir "$BASE/mnt/probe"
+
+if [ ! -d "$BASE/root/probe/.version" ]; then
+    echo "run_benchmarks: $HIERONYMUS was built without -D_VERSIONING" >&2
+    unmount_hieronymus
+    exit 1
+fi
+
+unmount_hieronymus
+
+for workload in $WORKLOADS; do
+    mount_hieronymus
+
+    ARGS="-n $COUNT -s $SIZE"
+
+    if [ "$workload" = "restore" ]; then
+        if ! command -v "$PYTHON" > /dev/null; then
+            echo "run_benchmarks: $PYTHON not found, skipping restore" >&2
+            unmount_hieronymus
+            continue
+        fi
+
+        # Build a history to restore from first.
+        "$H_BENCH" append "$BASE/mnt" -n 100 > /dev/null
+        ARGS="-n 20 -c \"$PYTHON $H_ADMIN -r -d $(date +%d-%m-%Y) \
+            -t $(date +%H.%M.%S) $BASE/mnt/append > /dev/null\""
+    fi
+
+    RESULT=$(eval "$H_BENCH" "$workload" "$BASE/mnt" $ARGS)
+    read VERSION_BYTES VERSION_FILES <<< "$(version_usage)"
+
+    unmount_hieronymus
+
+    echo "${RESULT%\}}, \"version_bytes\": $VERSION_BYTES, \"version_files\": $VERSION_FILES}" >> "$OUTPUT"
+done
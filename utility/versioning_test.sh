@@ -1,8 +1,8 @@
 #!/bin/bash
 
-`touch file_01`
+touch file_01
 
-for i in {1..$1}
+for i in $(seq 1 $1)
 do
-    `echo "Version $i" >> file_01`
+    echo "Version $i" >> file_01
 done